@@ -53,6 +53,13 @@ typedef struct Mr
   int   mode;
 
   char *output_png;
+
+  char      *doc_source; /* what doc was parsed from */
+  MrgXmlDoc *doc;
+  int        doc_version; /* changed with doc, for the cached rendering */
+
+  FILE      *stream;     /* a large file doc is being parsed from */
+  char      *stream_uri;
 } Mr;
 
 void
@@ -116,6 +123,88 @@ static const char *magic_mime (const char *data, int length)
   return "text/plain";
 }
 
+#define STREAM_THRESHOLD  (1024 * 1024) /* larger local files are streamed */
+#define STREAM_CHUNK      (256 * 1024)  /* read per frame while streaming */
+
+static void stream_stop (Mr *mr)
+{
+  if (mr->stream)
+    fclose (mr->stream);
+  mr->stream = NULL;
+}
+
+/* large local xml and html files are not read in full before showing
+ * them; they are parsed a chunk per frame, and laid out incrementally.
+ * Returns 1 if the document of uri is, or is being, streamed.
+ */
+static int stream_document (Mr *mr)
+{
+  struct stat st;
+  char  sniff[256];
+  const char *mime_type;
+  int   length;
+  FILE *file;
+
+  if (mr->stream_uri && !strcmp (mr->stream_uri, mr->uri))
+    return 1;
+
+  if (strncmp (mr->uri, "file://", 7) ||
+      stat (mr->uri + 7, &st) != 0 ||
+      st.st_size < STREAM_THRESHOLD)
+    return 0;
+  file = fopen (mr->uri + 7, "rb");
+  if (!file)
+    return 0;
+  length = fread (sniff, 1, sizeof (sniff), file);
+  mime_type = magic_mime (sniff, length);
+  if (strcmp (mime_type, "text/html") &&
+      strcmp (mime_type, "text/xml") &&
+      strcmp (mime_type, "text/svg"))
+  {
+    fclose (file);
+    return 0;
+  }
+  rewind (file);
+
+  stream_stop (mr);
+  free (mr->stream_uri);
+  mrg_xml_doc_free (mr->doc);
+  free (mr->doc_source);
+  mr->doc_source = NULL;
+
+  mr->stream = file;
+  mr->stream_uri = strdup (mr->uri);
+  mr->doc = mrg_xml_doc_new_stream ();
+  mrg_xml_doc_set_incremental (mr->doc, 1);
+  return 1;
+}
+
+static void stream_chunk (Mr *mr)
+{
+  char *chunk;
+  int   length;
+
+  if (!mr->stream)
+    return;
+
+  chunk = malloc (STREAM_CHUNK);
+  do {
+    length = fread (chunk, 1, STREAM_CHUNK, mr->stream);
+    mrg_xml_doc_feed (mr->doc, chunk, length);
+  } while (mr->output_png && length == STREAM_CHUNK); /* no later frames */
+  free (chunk);
+
+  if (length < STREAM_CHUNK)
+  {
+    stream_stop (mr);
+    mrg_xml_doc_finish (mr->doc);
+  }
+  else
+  {
+    mrg_queue_draw (mr->mrg, NULL);
+  }
+}
+
 static void render_ui (Mrg *mrg, void *data)
 {
   Mr *mr = data;
@@ -131,7 +220,14 @@ static void render_ui (Mrg *mrg, void *data)
   cairo_save (mrg_cr (mrg));
   cairo_translate (mrg_cr (mrg), scroll[0], scroll[1]);
 #endif
-  mrg_get_contents (mrg, NULL, mr->uri, &contents, &length);
+  if (stream_document (mr))
+  {
+    stream_chunk (mr);
+    mrg_stylesheet_clear (mrg);
+    mrg_xml_render_doc (mrg, mr->uri, href_cb, mr, NULL, NULL, mr->doc);
+  }
+  else
+    mrg_get_contents (mrg, NULL, mr->uri, &contents, &length);
 
   if (contents)
   {
@@ -145,8 +241,24 @@ static void render_ui (Mrg *mrg, void *data)
              !strcmp (mime_type, "text/xml") ||
              !strcmp (mime_type, "text/svg"))
     {
+      /* only parse again when the document has changed */
+      if (!mr->doc_source || strcmp (mr->doc_source, contents))
+      {
+        stream_stop (mr);
+        free (mr->stream_uri);
+        mr->stream_uri = NULL;
+        mrg_xml_doc_free (mr->doc);
+        free (mr->doc_source);
+        mr->doc = mrg_xml_doc_new (contents);
+        mr->doc_source = contents;
+        mr->doc_version++;
+        contents = NULL;
+      }
       mrg_stylesheet_clear (mrg);
-      mrg_xml_render (mrg, mr->uri, href_cb, mr, NULL, NULL, contents);
+      /* while scrolling, the recording of the document is replayed */
+      if (mrg_start_cached (mrg, "div", mr->doc, mr->doc_version))
+        mrg_xml_render_doc (mrg, mr->uri, href_cb, mr, NULL, NULL, mr->doc);
+      mrg_end (mrg);
     }
     else
     {
@@ -190,6 +302,8 @@ int browser_main (int argc, char **argv)
   else
   //mrg = mrg_new (320, 480, NULL);
     mrg = mrg_new (-1, -1, NULL);
+  if (!mrg)
+    return -1;
 
   {
     char *tmp = realpath (argv[1]?argv[1]:argv[0], NULL);
@@ -224,6 +338,10 @@ int browser_main (int argc, char **argv)
   mrg_destroy (mrg);
 
   free (mr->uri);
+  stream_stop (mr);
+  free (mr->stream_uri);
+  mrg_xml_doc_free (mr->doc);
+  free (mr->doc_source);
   free (mr);
   return 0;
 }
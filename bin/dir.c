@@ -63,6 +63,9 @@ struct _State
   char     *cached_path;
   State    *sub_state; /* cached */
   MrgHost  *host;
+
+  char      *doc_source; /* what doc was parsed from */
+  MrgXmlDoc *doc;
 };
 
 State *edit_state_new (const char *path);
@@ -394,8 +397,17 @@ static void ui_xhtml (Mrg *mrg, void *data)
 
   if (contents)
   {
-    mrg_xml_render (mrg, tmp->str, NULL, NULL, NULL, NULL, contents);
-    free (contents);
+    /* only parse again when the file has changed */
+    if (!state->doc_source || strcmp (state->doc_source, contents))
+    {
+      mrg_xml_doc_free (state->doc);
+      free (state->doc_source);
+      state->doc = mrg_xml_doc_new (contents);
+      state->doc_source = contents;
+    }
+    else
+      free (contents);
+    mrg_xml_render_doc (mrg, tmp->str, NULL, NULL, NULL, NULL, state->doc);
   }
   mrg_string_free (tmp, 1);
 
@@ -611,6 +623,8 @@ int dir_main (int argc, char **argv)
   //mrg = mrg_new (1024, 768, NULL);
   //  else
     mrg = mrg_new (-1, -1, NULL);
+  if (!mrg)
+    return -1;
    //*mrg = mrg_new (1024, 768, NULL);
   //Mrg *mrg = mrg_new (800, 600, NULL);
 
@@ -621,11 +635,15 @@ int dir_main (int argc, char **argv)
     state->host = mrg_host_new (mrg, "/tmp/foo");
   }
 
+  mrg_set_image_decode_async (mrg, 1);
+  mrg_set_image_disk_cache_mb (mrg, 256);
   mrg_set_ui (mrg, gui, state);
   mrg_main (mrg);
 
   mrg_host_destroy (state->host);
   free (state->path);
+  mrg_xml_doc_free (state->doc);
+  free (state->doc_source);
   free (state);
 
   return 0;
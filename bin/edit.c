@@ -367,6 +367,11 @@ int edit_main (int argc, char **argv)
   }
   //mrg = mrg_new (480, 640, NULL);
   mrg = mrg_new (-1, -1, NULL);
+  if (!mrg)
+  {
+    edit_state_destroy (state);
+    return -1;
+  }
   mrg_set_ui (mrg, state->ui, state);
   mrg_main (mrg);
   edit_state_destroy (state);
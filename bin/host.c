@@ -273,6 +273,8 @@ int host_main (int argc, char **argv)
     mrg = mrg_new (640, 480, NULL);
   else
     mrg = mrg_new (-1, -1, NULL);
+  if (!mrg)
+    return -1;
   host = mrg_host_new (mrg, "/tmp/mrg");
 
   mrg_set_ui (mrg, render_ui, host);
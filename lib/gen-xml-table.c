@@ -0,0 +1,287 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2002, 2003, 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* build time generator for mrg-xml-table.inc, the rules for the tokenizer
+ * states are expanded into a dense table indexed by state and byte, so
+ * that the tokenizer does a single lookup per byte and has no tables to
+ * set up at runtime. Written to stdout.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "mrg-xml.h"
+#include "mrg-xml-states.h"
+
+static char *c_ws = " \n\r\t";
+
+typedef struct
+{
+  int       state;
+  char     *chars;
+  unsigned char r_start;
+  unsigned char r_end;
+  int       next_state;
+  int       charhandling;
+  int       return_type;        /* if set return current buf, with type set to the type */
+}
+state_entry;
+
+#define max_entries 20
+
+static state_entry state_table[s_count][max_entries];
+
+static void
+a (int state,
+   char *chars,
+   unsigned char r_start,
+   unsigned char r_end, int charhandling, int next_state)
+{
+  int       no = 0;
+
+  while (state_table[state][no].state != s_null)
+    no++;
+  state_table[state][no].state = state;
+  state_table[state][no].r_start = r_start;
+  state_table[state][no].chars = chars;
+  state_table[state][no].r_end = r_end;
+  state_table[state][no].charhandling = charhandling;
+  state_table[state][no].next_state = next_state;
+}
+
+static void
+r (int state, int return_type, int next_state)
+{
+  state_table[state][0].state = state;
+  state_table[state][0].return_type = return_type;
+  state_table[state][0].next_state = next_state;
+}
+
+/* *INDENT-OFF* */
+
+static void
+init_statetable (void) {
+    a(s_start,        "<",    0,0,            c_eat,            s_tag);
+    a(s_start,        c_ws,    0,0,            c_eat+c_store,    s_whitespace);
+    a(s_start,        "&",    0,0,            c_eat,            s_entitystart);
+    a(s_start,        NULL,    0,255,            c_eat+c_store,    s_word);
+
+    a(s_tag,        c_ws,    0,0,            c_eat,            s_tag);
+    a(s_tag,        "/",    0,0,            c_eat,            s_tagclose);
+    a(s_tag,        "!",    0,0,            c_eat,            s_tagexcl);
+    a(s_tag,        "?",    0,0,            c_eat,            s_prolog);
+    a(s_tag,        NULL,    0,255,            c_eat+c_store,    s_tagnamestart);
+
+    a(s_tagclose,    NULL,    0,255,            c_eat+c_store,    s_tagclosenamestart);
+    a(s_tagclosenamestart,    ">",    0,0,    c_eat,            s_tagclosedone);
+    a(s_tagclosenamestart,    NULL,    0,255,    c_eat+c_store,    s_tagclosename);
+    a(s_tagclosename,    ">",    0,0,        c_eat,            s_tagclosedone);
+    a(s_tagclosename,    NULL,    0,255,        c_eat+c_store,    s_tagclosename);
+    r(s_tagclosedone,    t_closetag,                            s_start);
+
+    a(s_whitespace,        c_ws,    0,0,        c_eat+c_store,    s_whitespace);
+    a(s_whitespace,        NULL,    0,255,        c_nil,            s_whitespacedone);
+    r(s_whitespacedone,    t_whitespace,                        s_start);
+
+    a(s_entitystart,";",    0,0,            c_eat,            s_entitydone);
+    a(s_entitystart,NULL,    0,255,            c_eat+c_store,    s_entity);
+    a(s_entity,        ";",    0,0,            c_eat,            s_entitydone);
+    a(s_entity,NULL,        0,255,            c_eat+c_store,    s_entity);
+    r(s_entitydone,    t_entity,                                s_start);
+
+    a(s_word,        c_ws,    0,0,            c_nil,            s_worddone);
+    a(s_word,        "<&",    0,0,            c_nil,            s_worddone);
+    a(s_word,        NULL,    0,255,            c_eat+c_store,    s_word);
+    r(s_worddone,    t_word,                                    s_start);
+
+    a(s_tagnamestart,c_ws,    0,0,            c_nil,            s_tagnamedone);
+    a(s_tagnamestart,    "/>",    0,0,        c_nil,            s_tagnamedone);
+    a(s_tagnamestart,NULL,    0,255,            c_eat+c_store,    s_tagname);
+    a(s_tagname,    c_ws,    0,0,            c_nil,            s_tagnamedone);
+    a(s_tagname,    "/>",    0,0,            c_nil,            s_tagnamedone);
+    a(s_tagname,    NULL,    0,255,            c_eat+c_store,    s_tagname);
+    r(s_tagnamedone,    t_tag,                                s_intag);
+
+    a(s_intag,        c_ws,    0,0,            c_eat,            s_intag);
+    a(s_intag,        ">",    0,0,            c_eat,            s_tagend);
+    a(s_intag,        "/",    0,0,            c_eat,            s_empty);
+    a(s_intag,        NULL,    0,255,            c_eat+c_store,    s_attstart);
+
+    a(s_attstart,    c_ws,    0,0,            c_eat,            s_attdone);
+    a(s_attstart,    "=/>",    0,0,            c_nil,            s_attdone);
+    a(s_attstart,    NULL,    0,255,            c_eat+c_store,    s_attname);
+    a(s_attname,    "=/>",    0,0,            c_nil,            s_attdone);
+    a(s_attname,    c_ws,    0,0,            c_eat,            s_attdone);
+    a(s_attname,    NULL,    0,255,            c_eat+c_store,    s_attname);
+    r(s_attdone,    t_att,                                    s_att);
+    a(s_att,        c_ws,    0,0,            c_eat,            s_att);
+    a(s_att,        "=",    0,0,            c_eat,            s_atteq);
+    a(s_att,        NULL,    0,255,            c_eat,            s_intag);
+    a(s_atteq,        "'",    0,0,            c_eat,            s_eqapos);
+    a(s_atteq,        "\"",    0,0,            c_eat,            s_eqquot);
+    a(s_atteq,        c_ws,    0,0,            c_eat,            s_atteq);
+    a(s_atteq,        NULL,    0,255,            c_nil,            s_eqval);
+
+    a(s_eqapos,        "'",    0,0,            c_eat,            s_eqaposvaldone);
+    a(s_eqapos,        NULL,    0,255,            c_eat+c_store,    s_eqaposval);
+    a(s_eqaposval,        "'",    0,0,        c_eat,            s_eqaposvaldone);
+    a(s_eqaposval,        NULL,    0,255,        c_eat+c_store,    s_eqaposval);
+    r(s_eqaposvaldone,    t_val,                                    s_intag);
+
+    a(s_eqquot,        "\"",    0,0,            c_eat,            s_eqquotvaldone);
+    a(s_eqquot,        NULL,    0,255,            c_eat+c_store,    s_eqquotval);
+    a(s_eqquotval,        "\"",    0,0,        c_eat,            s_eqquotvaldone);
+    a(s_eqquotval,        NULL,    0,255,        c_eat+c_store,    s_eqquotval);
+    r(s_eqquotvaldone,    t_val,                                    s_intag);
+
+    a(s_eqval,        c_ws,    0,0,            c_nil,            s_eqvaldone);
+    a(s_eqval,        "/>",    0,0,            c_nil,            s_eqvaldone);
+    a(s_eqval,        NULL,    0,255,            c_eat+c_store,    s_eqval);
+
+    r(s_eqvaldone,    t_val,                                    s_intag);
+
+    r(s_tagend,        t_endtag,                s_start);
+
+    r(s_empty,              t_endtag,                               s_inempty);
+    a(s_inempty,        ">",0,0,                c_eat,            s_emptyend);
+    a(s_inempty,        NULL,0,255,                c_eat,            s_inempty);
+    r(s_emptyend,    t_closeemptytag,                        s_start);
+
+    a(s_prolog,        "?",0,0,                c_eat,            s_prologq);
+    a(s_prolog,        NULL,0,255,                c_eat+c_store,    s_prolog);
+
+    a(s_prologq,    ">",0,0,                c_eat,            s_prologdone);
+    a(s_prologq,    NULL,0,255,                c_eat+c_store,    s_prolog);
+    r(s_prologdone,    t_prolog,                s_start);
+
+    a(s_tagexcl,    "-",0,0,                c_eat,            s_commentdash1);
+    a(s_tagexcl,    "D",0,0,                c_nil,            s_dtd);
+    a(s_tagexcl,    NULL,0,255,                c_eat,            s_start);
+
+    a(s_commentdash1,    "-",0,0,                c_eat,            s_commentdash2);
+    a(s_commentdash1,    NULL,0,255,                c_eat,            s_error);
+
+    a(s_commentdash2,    "-",0,0,                c_eat,            s_commentenddash1);
+    a(s_commentdash2,    NULL,0,255,                c_eat+c_store,    s_incomment);
+
+    a(s_incomment   ,    "-",0,0,                c_eat,            s_commentenddash1);
+    a(s_incomment   ,    NULL,0,255,                c_eat+c_store,    s_incomment);
+
+    a(s_commentenddash1,    "-",0,0,            c_eat,            s_commentenddash2);
+    a(s_commentenddash1,    NULL,0,255,            c_eat+c_store,    s_incomment);
+
+    a(s_commentenddash2,    ">",0,0,            c_eat,            s_commentdone);
+    a(s_commentenddash2,    NULL,0,255,            c_eat+c_store,    s_incomment);
+
+    r(s_commentdone,    t_comment,                s_start);
+
+    /* a malformed comment start is reported, rather than getting stuck */
+    r(s_error,          t_error,                  s_start);
+}
+
+/* *INDENT-ON* */
+
+/* the transition taken by state for byte c, bytes without a matching
+ * rule are skipped
+ */
+static int
+transition (int state, int c)
+{
+  state_entry *s = &state_table[state][0];
+
+  while (s->state)
+    {
+      if ((s->chars && c && strchr (s->chars, c))
+          || ((s->r_start + s->r_end)
+              && (c >= s->r_start && c <= s->r_end)))
+        return (s->next_state << 2) | s->charhandling;
+      s++;
+    }
+  return (s_start << 2) | c_eat;
+}
+
+/* for states that store runs of bytes while staying in the same state, the
+ * single byte ending the run, which lets the tokenizer find it with memchr,
+ * XML_RUN_TABLE if the run ends on several byte values.
+ */
+static int
+run_stop (int state)
+{
+  int self = (state << 2) | c_eat | c_store;
+  int stop = XML_RUN_NONE;
+  int c;
+
+  if (state_table[state][0].return_type != t_none)
+    return XML_RUN_NONE;
+  for (c = 0; c < 256; c++)
+    if (transition (state, c) == self)
+      break;
+  if (c == 256)
+    return XML_RUN_NONE;
+  for (c = 0; c < 256; c++)
+    if (transition (state, c) != self)
+      {
+        if (stop != XML_RUN_NONE)
+          return XML_RUN_TABLE;
+        stop = c;
+      }
+  return stop;
+}
+
+int
+main (int argc, char **argv)
+{
+  int state, c;
+
+  if (s_count > 64)
+    {
+      fprintf (stderr, "gen-xml-table: too many states for the encoding\n");
+      return 1;
+    }
+  init_statetable ();
+
+  printf ("/* generated by gen-xml-table.c, do not edit */\n\n");
+
+  printf ("static const unsigned char xml_transitions[%i][256] = {\n", s_count);
+  for (state = 0; state < s_count; state++)
+    {
+      printf ("  {");
+      for (c = 0; c < 256; c++)
+        printf ("%s%i,", c % 32 ? "" : "\n   ", transition (state, c));
+      printf ("\n  },\n");
+    }
+  printf ("};\n\n");
+
+  printf ("static const unsigned char xml_return_type[%i] = {", s_count);
+  for (state = 0; state < s_count; state++)
+    printf ("%s%i,", state % 16 ? "" : "\n  ", state_table[state][0].return_type);
+  printf ("\n};\n\n");
+
+  printf ("static const unsigned char xml_return_state[%i] = {", s_count);
+  for (state = 0; state < s_count; state++)
+    printf ("%s%i,", state % 16 ? "" : "\n  ",
+            state_table[state][0].return_type ?
+            state_table[state][0].next_state : state);
+  printf ("\n};\n\n");
+
+  printf ("static const short xml_run_stop[%i] = {", s_count);
+  for (state = 0; state < s_count; state++)
+    printf ("%s%i,", state % 16 ? "" : "\n  ", run_stop (state));
+  printf ("\n};\n");
+
+  return 0;
+}
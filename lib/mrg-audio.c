@@ -1,25 +1,44 @@
-#include <string.h>
+#include <time.h>
 #include "mrg-internal.h"
+#include "mrg-pcm.h"
 #include "mmm.h"
 
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <alsa/asoundlib.h>
 #include <alloca.h>
 
 #define DESIRED_PERIOD_SIZE 1000
+#define PCM_RING_FRAMES     65536  /* over a second at 48kHz */
+#define PCM_CHUNK_FRAMES    256    /* converted at a time when queuing */
 
 static float    host_freq     = 48000;
 static MrgPCM   host_format   = MRG_s16S;
 static float    client_freq   = 48000;
 static MrgPCM   client_format = MRG_s16S;
-static int      pcm_queued    = 0;
-static int      pcm_cur_left  = 0;
-static MrgList *pcm_list;
 
-/* todo: only start audio thread on first write - enabling dynamic choice
- * of sample-rate? or is it better to keep to opening 48000 as a standard
- * and do better internal resampling for others?
+/* frames queued by mrg_pcm_queue for the playback thread, already in the
+ * stereo s16 of host_format
  */
+static MrgPcmRing pcm_ring;
+static int        pcm_started = 0;  /* 1 when playing, -1 when that failed */
+static pthread_mutex_t pcm_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t   pcm_xruns = 0;    /* device underruns, not in pcm_ring */
+static FILE      *pcm_sink_file = NULL;
+
+/* the armed eventfds of _mrg_pcm_period_open, written each time the
+ * playback thread took a period from pcm_ring
+ */
+static MrgList        *pcm_period_fds = NULL;
+static pthread_mutex_t pcm_period_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* of frames queued at another rate than host_freq, made by the thread
+ * queuing
+ */
+static MrgResampler  *pcm_resampler = NULL;
+static int            pcm_resample  = MRG_RESAMPLE_SINC;
+static pthread_once_t pcm_resample_once = PTHREAD_ONCE_INIT;
 
 static snd_pcm_t *alsa_open (char *dev, int rate, int channels)
 {
@@ -68,103 +87,103 @@ static snd_pcm_t *alsa_open (char *dev, int rate, int channels)
    return h;
 }
 
+static void pcm_period_tick (void)
+{
+  uint64_t one = 1;
+  MrgList *l;
+
+  pthread_mutex_lock (&pcm_period_mutex);
+  for (l = pcm_period_fds; l; l = l->next)
+    if (write ((int)(intptr_t)l->data, &one, sizeof (one)) < 0)
+      continue; /* full, the reader is behind */
+  pthread_mutex_unlock (&pcm_period_mutex);
+}
+
 static  snd_pcm_t *h = NULL;
+
+/* recovers from err, counting underruns but not timeouts or suspends */
+static void alsa_recover (int err)
+{
+  if (err == -EPIPE)
+  {
+    if (getenv("LYD_FATAL_UNDERRUNS"))
+      {
+        printf ("dying XXxx need to add API for this debug\n");
+        exit(0);
+      }
+    __atomic_add_fetch (&pcm_xruns, 1, __ATOMIC_RELAXED);
+  }
+  snd_pcm_recover (h, err, 0);
+}
+
 static void *alsa_audio_start(Mrg *mrg)
 {
-//  Lyd *lyd = aux;
+  int16_t data[DESIRED_PERIOD_SIZE * 2];
   int c;
 
-  /* The audio handler is implemented as a mixer that adds data on top
-   * of 0s, XXX: it should be ensured that minimal work is there is
-   * no data available.
+  /* the ring gives silence when nothing is queued, keeping the device
+   * running
    */
   for (;;)
   {
-    int client_channels = mmm_pcm_channels (client_format);
-    int is_float = 0;
-    int16_t data[81920*8]={0,};
-
-    if (client_format == MRG_f32 ||
-        client_format == MRG_f32S)
-      is_float = 1;
-
     c = snd_pcm_wait(h, 1000);
 
     if (c >= 0)
        c = snd_pcm_avail_update(h);
 
-    if (c > 1000) c = 1000; // should use max mmm buffer sizes
+    if (c < 0)
+    {
+      alsa_recover (c);
+      continue;
+    }
 
-    if (c == -EPIPE)
-      snd_pcm_prepare(h);
+    if (c > DESIRED_PERIOD_SIZE) c = DESIRED_PERIOD_SIZE;
 
     if (c > 0)
     {
-      int i;
-      for (i = 0; i < c && pcm_cur_left; i ++)
-      {
-        if (pcm_cur_left)
-        {
-          uint32_t *packet_sizep = (pcm_list->data);
-          uint32_t packet_size = *packet_sizep;
-          uint16_t left = 0, right = 0;
-
-          if (is_float)
-          {
-            float *packet = (pcm_list->data);
-            packet += 4;
-            packet += (packet_size - pcm_cur_left) * client_channels;
-            left = right = packet[0] * (1<<15);
-            if (client_channels > 1)
-              right = packet[0] * (1<<15);
-          }
-          else // s16
-          {
-            uint16_t *packet = (pcm_list->data);
-            packet += 8;
-            packet += (packet_size - pcm_cur_left) * client_channels;
-
-            left = right = packet[0];
-            if (client_channels > 1)
-              right = packet[1];
-          }
-          data[i * 2 + 0] = left;
-          data[i * 2 + 1] = right;
-
-          pcm_cur_left--;
-          pcm_queued --;
-          if (pcm_cur_left == 0)
-          {
-            void *old = pcm_list->data;
-            mrg_list_remove (&pcm_list, pcm_list->data);
-            free (old);
-            pcm_cur_left = 0;
-            if (pcm_list)
-            {
-              uint32_t *packet_sizep = (pcm_list->data);
-              uint32_t packet_size = *packet_sizep;
-              pcm_cur_left = packet_size;
-            }
-          }
-        }
-      }
+      _mrg_pcm_ring_read (&pcm_ring, data, c);
+      pcm_period_tick ();
+      c = snd_pcm_writei(h, data, c);
+      if (c < 0)
+        alsa_recover (c);
+    }
+  }
+  return NULL;
+}
 
-    c = snd_pcm_writei(h, data, c);
-    if (c < 0)
-      c = snd_pcm_recover (h, c, 0);
-     }else{
-      if (getenv("LYD_FATAL_UNDERRUNS"))
-        {
-          printf ("dying XXxx need to add API for this debug\n");
-          //printf ("%i", lyd->active);
-          exit(0);
-        }
-      fprintf (stderr, "mrg alsa underun\n");
-      //exit(0);
+/* plays to a file of raw frames, or nowhere, at the pace of a device;
+ * for running without audio hardware
+ */
+static void *paced_audio_start (Mrg *mrg)
+{
+  int16_t data[DESIRED_PERIOD_SIZE * 2];
+  long period_ns = DESIRED_PERIOD_SIZE * 1000000000LL / host_freq;
+  struct timespec next;
+
+  clock_gettime (CLOCK_MONOTONIC, &next);
+  for (;;)
+  {
+    _mrg_pcm_ring_read (&pcm_ring, data, DESIRED_PERIOD_SIZE);
+    pcm_period_tick ();
+    if (pcm_sink_file)
+    {
+      fwrite (data, sizeof (int16_t) * 2, DESIRED_PERIOD_SIZE, pcm_sink_file);
+      fflush (pcm_sink_file);
+    }
+    next.tv_nsec += period_ns;
+    while (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec ++;
     }
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
   }
+  return NULL;
 }
 
+/* playback goes to the default ALSA device, or as set by MRG_PCM_SINK, to
+ * "null" or the path of a file of raw stereo s16 frames
+ */
 int mrg_pcm_init (Mrg *mrg)
 {
   if (!strcmp (mrg->backend->name, "mmm") ||
@@ -174,64 +193,254 @@ int mrg_pcm_init (Mrg *mrg)
   }
   else
   {
-     pthread_t tid;
-     h = alsa_open("default", host_freq, mmm_pcm_channels (host_format));
-  if (!h) {
-    fprintf(stderr, "mrg unable to open ALSA device (%d channels, %f Hz), dying\n",
-            mmm_pcm_channels (host_format), host_freq);
-    return -1;
-  }
-  pthread_create(&tid, NULL, (void*)alsa_audio_start, mrg);
+    const char *sink = getenv ("MRG_PCM_SINK");
+    pthread_t tid;
+
+    if (_mrg_pcm_ring_init (&pcm_ring, PCM_RING_FRAMES))
+      return -1;
+
+    if (sink && strcmp (sink, "alsa"))
+    {
+      if (strcmp (sink, "null"))
+      {
+        pcm_sink_file = fopen (sink, "wb");
+        if (!pcm_sink_file)
+        {
+          fprintf (stderr, "mrg unable to open audio sink %s\n", sink);
+          return -1;
+        }
+      }
+      pthread_create (&tid, NULL, (void*)paced_audio_start, mrg);
+      return 0;
+    }
+
+    h = alsa_open("default", host_freq, mmm_pcm_channels (host_format));
+    if (!h) {
+      fprintf(stderr, "mrg unable to open ALSA device (%d channels, %f Hz), dying\n",
+              mmm_pcm_channels (host_format), host_freq);
+      return -1;
+    }
+    pthread_create(&tid, NULL, (void*)alsa_audio_start, mrg);
   }
   return 0;
 }
 
-int mrg_pcm_queue (Mrg *mrg, const int8_t *data, int frames)
+/* starts playback on the first call, returns 0 when playing */
+static int pcm_start (Mrg *mrg)
 {
-  static int inited = 0;
-  if (!strcmp (mrg->backend->name, "mmm") ||
-      !strcmp (mrg->backend->name, "mmm-client"))
+  if (__atomic_load_n (&pcm_started, __ATOMIC_ACQUIRE) == 0)
   {
-    return mmm_pcm_queue (mrg->backend_data, data, frames);
+    pthread_mutex_lock (&pcm_start_mutex);
+    if (pcm_started == 0)
+      __atomic_store_n (&pcm_started, mrg_pcm_init (mrg) ? -1 : 1,
+                        __ATOMIC_RELEASE);
+    pthread_mutex_unlock (&pcm_start_mutex);
   }
-  else
+  return pcm_started > 0 ? 0 : -1;
+}
+
+static int pcm_period_is_timer (Mrg *mrg)
+{
+  return !strcmp (mrg->backend->name, "mmm") ||
+         !strcmp (mrg->backend->name, "mmm-client");
+}
+
+/* a new fd for the caller to read, draining the count, that becomes
+ * readable each time the playback thread took a period while it is armed;
+ * mmm does not tell when the host took frames, there it is a timer at a
+ * quarter of a period. Returns -1 when it could not be made.
+ */
+int _mrg_pcm_period_open (Mrg *mrg)
+{
+  if (pcm_period_is_timer (mrg))
+    return timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  return eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+/* starts or stops the ticks of fd, which starts out disarmed */
+void _mrg_pcm_period_arm (Mrg *mrg, int fd, int armed)
+{
+  if (fd < 0)
+    return;
+  if (pcm_period_is_timer (mrg))
   {
-    if (!inited)
-    {
-      mrg_pcm_init (mrg);
-      inited = 1;
-    }
-    float factor = client_freq * 1.0 / host_freq;
-    int   scaled_frames = frames / factor;
-    int   bpf = mmm_pcm_bytes_per_frame (client_format);
+    long tick_ns = armed ?
+                   DESIRED_PERIOD_SIZE * 1000000000LL / host_freq / 4 : 0;
+    struct itimerspec tick = {{0, tick_ns}, {0, tick_ns}};
+    timerfd_settime (fd, 0, &tick, NULL);
+    return;
+  }
+  pthread_mutex_lock (&pcm_period_mutex);
+  if (pcm_period_fds)
+    mrg_list_remove (&pcm_period_fds, (void*)(intptr_t)fd);
+  if (armed)
+    mrg_list_prepend (&pcm_period_fds, (void*)(intptr_t)fd);
+  pthread_mutex_unlock (&pcm_period_mutex);
+}
 
-    uint8_t *packet = malloc (scaled_frames * mmm_pcm_bytes_per_frame (client_format) + 16);
-    *((uint32_t *)packet) = scaled_frames;
+void _mrg_pcm_period_close (Mrg *mrg, int fd)
+{
+  if (fd < 0)
+    return;
+  _mrg_pcm_period_arm (mrg, fd, 0);
+  close (fd);
+}
 
-    /* we do both allocations and resampling at the pcm queuing stage.. at it
-     * is not on the actual audio playout thread doesn't have to, this sounds
-     * better than the resampling currently done in mmm / compositor
-     */
-    if (factor > 0.999 && factor < 1.0001)
+static void read_resample_env (void)
+{
+  if (getenv ("MRG_PCM_RESAMPLE") &&
+      !strcmp (getenv ("MRG_PCM_RESAMPLE"), "linear"))
+    pcm_resample = MRG_RESAMPLE_LINEAR;
+}
+
+void mrg_pcm_set_resample (Mrg *mrg, MrgResample quality)
+{
+  pthread_once (&pcm_resample_once, read_resample_env);
+  pcm_resample = quality;
+}
+
+MrgResample mrg_pcm_get_resample (Mrg *mrg)
+{
+  pthread_once (&pcm_resample_once, read_resample_env);
+  return pcm_resample;
+}
+
+static inline int16_t float_to_s16 (float val)
+{
+  val *= 32767.0f;
+  if (val > 32767.0f)
+    return 32767;
+  if (val < -32768.0f)
+    return -32768;
+  return val;
+}
+
+/* converts count frames of the client format to stereo float */
+static void client_to_float (const int8_t *data, int count, float *out)
+{
+  int bpf = mmm_pcm_bytes_per_frame (client_format);
+  int right = mmm_pcm_channels (client_format) > 1;
+  int i;
+
+  if (client_format == MRG_f32 || client_format == MRG_f32S)
+    for (i = 0; i < count; i++)
     {
-       memcpy (packet + 16, data, frames * bpf);
+      const float *src = (const float*)(data + i * bpf);
+      out[i * 2 + 0] = src[0];
+      out[i * 2 + 1] = src[right];
     }
-    else
+  else
+    for (i = 0; i < count; i++)
     {
-      int i;
-      for (i = 0; i < scaled_frames; i++)
+      const int16_t *src = (const int16_t*)(data + i * bpf);
+      out[i * 2 + 0] = src[0] * (1.0f / 32767.0f);
+      out[i * 2 + 1] = src[right] * (1.0f / 32767.0f);
+    }
+}
+
+/* queues frames at host_freq, as converted, to the ring */
+static int queue_direct (const int8_t *data, int frames)
+{
+  int16_t chunk[PCM_CHUNK_FRAMES * 2];
+  int   bpf = mmm_pcm_bytes_per_frame (client_format);
+  int   right = mmm_pcm_channels (client_format) > 1;
+  int   is_float = client_format == MRG_f32 || client_format == MRG_f32S;
+  int   done = 0;
+
+  /* only what fits is taken, the rest is left for the caller to queue
+   * again */
+  if (frames > _mrg_pcm_ring_space (&pcm_ring))
+    frames = _mrg_pcm_ring_space (&pcm_ring);
+
+  while (done < frames)
+  {
+    int count = frames - done;
+    int i;
+
+    if (count > PCM_CHUNK_FRAMES)
+      count = PCM_CHUNK_FRAMES;
+    for (i = 0; i < count; i++)
+    {
+      const int8_t *src = data + (done + i) * bpf;
+      if (is_float)
+      {
+        chunk[i * 2 + 0] = float_to_s16 (((const float*)src)[0]);
+        chunk[i * 2 + 1] = float_to_s16 (((const float*)src)[right]);
+      }
+      else
       {
-        int source_frame = i * factor;
-        memcpy (packet + 16 + bpf * i, data + source_frame * bpf, bpf);
+        chunk[i * 2 + 0] = ((const int16_t*)src)[0];
+        chunk[i * 2 + 1] = ((const int16_t*)src)[right];
       }
     }
-    if (pcm_list == NULL)     // otherwise it is another frame at front
-      pcm_cur_left = scaled_frames;  // and current cur_left is valid
+    _mrg_pcm_ring_write (&pcm_ring, chunk, count);
+    done += count;
+  }
+  return frames;
+}
+
+/* queues frames at client_freq resampled to host_freq, for as long as the
+ * resampled frames fit
+ */
+static int queue_resampled (const int8_t *data, int frames)
+{
+  int   bpf = mmm_pcm_bytes_per_frame (client_format);
+  float in[PCM_CHUNK_FRAMES * 2];
+  float out[PCM_CHUNK_FRAMES * 2];
+  int16_t chunk[PCM_CHUNK_FRAMES * 2];
+  int   done = 0;
 
-    mrg_list_append (&pcm_list, packet);
-    pcm_queued += scaled_frames;
+  if (pcm_resampler && _mrg_resampler_quality (pcm_resampler) != pcm_resample)
+  {
+    _mrg_resampler_free (pcm_resampler);
+    pcm_resampler = NULL;
+  }
+  if (!pcm_resampler)
+    pcm_resampler = _mrg_resampler_new (pcm_resample);
+  _mrg_resampler_set_rates (pcm_resampler, client_freq, host_freq);
 
-    return frames;
+  while (done < frames)
+  {
+    int space = _mrg_pcm_ring_space (&pcm_ring);
+    int count = frames - done;
+    int consumed, produced, i;
+
+    if (count > PCM_CHUNK_FRAMES)
+      count = PCM_CHUNK_FRAMES;
+    if (space > PCM_CHUNK_FRAMES)
+      space = PCM_CHUNK_FRAMES;
+    client_to_float (data + done * bpf, count, in);
+    produced = _mrg_resampler_process (pcm_resampler, in, count, &consumed,
+                                       out, space);
+    for (i = 0; i < produced * 2; i++)
+      chunk[i] = float_to_s16 (out[i]);
+    _mrg_pcm_ring_write (&pcm_ring, chunk, produced);
+    done += consumed;
+    if (!consumed && !produced)
+      break;
+  }
+  return done;
+}
+
+int mrg_pcm_queue (Mrg *mrg, const int8_t *data, int frames)
+{
+  if (!strcmp (mrg->backend->name, "mmm") ||
+      !strcmp (mrg->backend->name, "mmm-client"))
+  {
+    return mmm_pcm_queue (mrg->backend_data, data, frames);
+  }
+  else
+  {
+    if (pcm_start (mrg))
+      return frames; /* dropped, there is no playback */
+
+    /* converting and resampling is done when queuing, so the playback
+     * thread only copies frames out of the ring
+     */
+    pthread_once (&pcm_resample_once, read_resample_env);
+    if (client_freq == host_freq)
+      return queue_direct (data, frames);
+    return queue_resampled (data, frames);
   }
   return 0;
 }
@@ -243,7 +452,7 @@ static int mrg_pcm_get_queued_frames (Mrg *mrg)
   {
     return mmm_pcm_get_queued_frames (mrg->backend_data);
   }
-  return pcm_queued;
+  return _mrg_pcm_ring_queued (&pcm_ring);
 }
 
 int mrg_pcm_get_queued (Mrg *mrg)
@@ -251,6 +460,17 @@ int mrg_pcm_get_queued (Mrg *mrg)
   return mrg_pcm_get_queued_frames (mrg);
 }
 
+int mrg_pcm_get_underruns (Mrg *mrg)
+{
+  if (!strcmp (mrg->backend->name, "mmm") ||
+      !strcmp (mrg->backend->name, "mmm-client"))
+  {
+    return 0;
+  }
+  return _mrg_pcm_ring_underruns (&pcm_ring) +
+         __atomic_load_n (&pcm_xruns, __ATOMIC_RELAXED);
+}
+
 float mrg_pcm_get_queued_length (Mrg *mrg)
 {
   return 1.0 * mrg_pcm_get_queued_frames (mrg) / host_freq;
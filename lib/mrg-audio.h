@@ -12,13 +12,29 @@ typedef enum {
   MRG_s16S
 } MrgPCM;
 
+typedef enum {
+  MRG_RESAMPLE_LINEAR,
+  MRG_RESAMPLE_SINC
+} MrgResample;
+
 void   mrg_pcm_set_format        (Mrg *mrg, MrgPCM format);
 MrgPCM mrg_pcm_get_format        (Mrg *mrg);
 int    mrg_pcm_get_sample_rate   (Mrg *mrg);
 void   mrg_pcm_set_sample_rate   (Mrg *mrg, int sample_rate);
 int    mrg_pcm_get_frame_chunk   (Mrg *mrg);
 int    mrg_pcm_get_queued        (Mrg *mrg);
+/* times playback ran out of queued frames, which includes the end of every
+ * stream, or the device underran; not counted with the mmm backends
+ */
+int    mrg_pcm_get_underruns     (Mrg *mrg);
 float  mrg_pcm_get_queued_length (Mrg *mrg);
 int    mrg_pcm_queue             (Mrg *mrg, const int8_t *data, int frames);
 
+/* the quality of resampling, for queuing at another rate than the audio
+ * device's and for the mixing of mmm clients by MrgHost; a windowed sinc
+ * by default, or as set by MRG_PCM_RESAMPLE=linear
+ */
+void        mrg_pcm_set_resample (Mrg *mrg, MrgResample quality);
+MrgResample mrg_pcm_get_resample (Mrg *mrg);
+
 #endif
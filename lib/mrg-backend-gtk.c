@@ -31,6 +31,8 @@ typedef struct MrgGtk {
 
   GHashTable       *ht;
   GdkEventSequence *fingers[MRG_MAX_DEVICES];
+
+  cairo_t          *measure_cr; /* for layout outside of draw events */
 } MrgGtk;
 
 static void mrg_gtk_flush (Mrg *mrg)
@@ -64,18 +66,19 @@ static void mrg_gtk_main (Mrg *mrg,
 
 static cairo_t *mrg_gtk_cr (Mrg *mrg)
 {
-  static cairo_t *static_cr = NULL;
+  MrgGtk *mrg_gtk = mrg->backend_data;
   cairo_surface_t *surface;
 
   if (mrg->cr)
     return mrg->cr;
-  if (static_cr)
-    return static_cr;
+  if (mrg_gtk->measure_cr)
+    return mrg_gtk->measure_cr;
 
   surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
                                         1,1);
-  static_cr = cairo_create (surface);
-  return static_cr;
+  mrg_gtk->measure_cr = cairo_create (surface);
+  cairo_surface_destroy (surface);
+  return mrg_gtk->measure_cr;
 }
 
 static gboolean button_press_event (GtkWidget *widget, GdkEvent *event, gpointer userdata)
@@ -349,6 +352,8 @@ static void mrg_gtk_destroy (Mrg *mrg)
   MrgGtk *mrg_gtk = mrg->backend_data;
 
   g_hash_table_destroy (mrg_gtk->ht);
+  if (mrg_gtk->measure_cr)
+    cairo_destroy (mrg_gtk->measure_cr);
 
   if (mrg->backend_data)
   {
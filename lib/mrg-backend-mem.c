@@ -55,6 +55,11 @@ static void mrg_mem_main (Mrg *mrg,
                           void (*ui_update)(Mrg *mrg, void *user_data),
                           void *user_data)
 {
+  if (getenv ("MRG_REPLAY"))
+  {
+    mrg_replay (mrg, getenv ("MRG_REPLAY"), getenv ("MRG_REPLAY_FAST") != NULL);
+    return;
+  }
   fprintf (stderr, "error: main of mem backend invoked\n");
   return;
 }
@@ -90,14 +95,32 @@ MrgBackend mrg_backend_mem = {
 static Mrg *_mrg_mem_new (int width, int height)
 {
   Mrg *mrg;
-  MrgMem *backend = calloc (sizeof (MrgMem), 1);
+  MrgMem *backend;
 
+  if (width == -1 && height == -1)
+  {
+    /* no screen to be sized after, a replay is sized like its recording */
+    if (!getenv ("MRG_REPLAY") ||
+        _mrg_replay_size (getenv ("MRG_REPLAY"), &width, &height))
+    {
+      width = 640;
+      height = 480;
+    }
+  }
+  if (width <= 0 || height <= 0)
+  {
+    fprintf (stderr, "mrg mem backend needs a size, got %ix%i\n",
+             width, height);
+    return NULL;
+  }
+  backend = calloc (sizeof (MrgMem), 1);
   mrg = calloc (sizeof (Mrg), 1);
   backend->allocated = width * height * 4;
   backend->pixels = calloc (backend->allocated, 1);
   mrg->backend = &mrg_backend_mem;
   mrg->backend_data = backend;
   _mrg_init (mrg, width, height);
+  _mrg_raster_init (mrg);
 
   return mrg;
 }
@@ -256,6 +256,7 @@ static Mrg *_mrg_mmm_new (int width, int height)
   mrg->backend_data = mmm;
 
   _mrg_init (mrg, width, height);
+  _mrg_raster_init (mrg);
   mrg_set_size (mrg, width, height);
   mrg->do_clip = 1;
 
@@ -29,6 +29,7 @@ static int mrg_black_on_white;
 typedef struct MrgNct {
   Nchanterm     *term;
   unsigned char *nct_pixels;
+  int            was_down;
 } MrgNct;
 
 static char *qblocks[]={
@@ -338,8 +339,6 @@ static void mrg_nct_flush (Mrg *mrg)
 #include <stdio.h>
 #include <math.h>
 
-static int was_down = 0;
-
 static int mrg_nct_consume_events (Mrg *mrg)
 {
   MrgNct *backend = mrg->backend_data;
@@ -355,7 +354,7 @@ static int mrg_nct_consume_events (Mrg *mrg)
       if (!strcmp (event, "mouse-press"))
       {
         mrg_pointer_press (mrg, x, y, 0, 0);
-        was_down = 1;
+        backend->was_down = 1;
       } else if (!strcmp (event, "mouse-release"))
       {
         mrg_pointer_release (mrg, x, y, 0, 0);
@@ -363,10 +362,10 @@ static int mrg_nct_consume_events (Mrg *mrg)
       {
         nct_set_cursor_pos (backend->term, ix, iy);
         nct_flush (backend->term);
-        if (was_down)
+        if (backend->was_down)
         {
           mrg_pointer_release (mrg, x, y, 0, 0);
-          was_down = 0;
+          backend->was_down = 0;
         }
         mrg_pointer_motion (mrg, x, y, 0, 0);
       } else if (!strcmp (event, "mouse-drag"))
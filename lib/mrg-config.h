@@ -37,4 +37,8 @@
 #define MRG_LOG       1 // set to 0 to not compile any of the log messages
 #endif
 
+#ifndef MRG_PROFILE
+#define MRG_PROFILE   1 // set to 0 to not compile in the frame phase profiling
+#endif
+
 #endif
@@ -0,0 +1,340 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* on disk cache of downscaled images, in $XDG_CACHE_HOME/mrg or
+ * ~/.cache/mrg, keyed on the path, modification time and size of the file
+ * decoded and the size downscaled to. An entry is a small header followed
+ * by the pixels as laid out by cairo, and is loaded by mapping the file
+ * and wrapping the pixels in an image surface, without copying.
+ *
+ * Entries are written to a temporary file that is renamed into place, so
+ * that processes sharing the cache only see complete entries. Loading an
+ * entry updates its modification time, and the least recently used entries
+ * are removed when the entries take up more than the budget.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include "mrg-internal.h"
+#include "mrg-hash.h"
+
+#define MRG_DISK_CACHE_MAGIC      0x5447524d /* MRGT */
+#define MRG_DISK_CACHE_VERSION    1
+#define MRG_DISK_CACHE_HEADER     64  /* offset of the pixels */
+#define MRG_DISK_CACHE_TRIM_EVERY 64  /* stores between checks of the size */
+#define MRG_DISK_CACHE_STALE_TMP  600 /* seconds until a temp file is left
+                                         over from an interrupted store */
+
+typedef struct MrgDiskCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  int32_t  format;
+  int32_t  width;
+  int32_t  height;
+  int32_t  stride;
+} MrgDiskCacheHeader;
+
+typedef struct MrgDiskCacheMapping {
+  void   *addr;
+  size_t  length;
+} MrgDiskCacheMapping;
+
+typedef struct MrgDiskCacheEntry {
+  char   *name;
+  time_t  mtime;
+  long    size;
+} MrgDiskCacheEntry;
+
+struct _MrgDiskCache {
+  char *dir;
+  long  max_bytes;
+  int   stores;     /* since the size was last checked */
+};
+
+static const cairo_user_data_key_t mapping_key;
+
+static int mkdir_p (const char *path)
+{
+  char *dup = strdup (path);
+  char *p;
+  int ret;
+
+  for (p = dup + 1; *p; p++)
+    if (*p == '/')
+    {
+      *p = 0;
+      mkdir (dup, 0700);
+      *p = '/';
+    }
+  ret = mkdir (dup, 0700);
+  free (dup);
+  return ret == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static int compare_entry_mtime (const void *a, const void *b)
+{
+  const MrgDiskCacheEntry *ea = a;
+  const MrgDiskCacheEntry *eb = b;
+  return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+/* removes the least recently used entries, while over the budget, and
+ * temp files of stores that never completed
+ */
+static void trim (MrgDiskCache *cache)
+{
+  MrgDiskCacheEntry *entries = NULL;
+  int    count = 0, allocated = 0;
+  long   total = 0;
+  char   path[4096];
+  DIR   *dir;
+  struct dirent *dirent;
+  time_t now;
+  int    i;
+
+  cache->stores = 0;
+  now = time (NULL);
+  dir = opendir (cache->dir);
+  if (!dir)
+    return;
+  while ((dirent = readdir (dir)))
+  {
+    struct stat st;
+    int len = strlen (dirent->d_name);
+    if (len > 4 && !strcmp (dirent->d_name + len - 4, ".tmp"))
+    {
+      snprintf (path, sizeof (path), "%s/%s", cache->dir, dirent->d_name);
+      if (stat (path, &st) == 0 &&
+          now - st.st_mtime > MRG_DISK_CACHE_STALE_TMP)
+        unlink (path);
+      continue;
+    }
+    if (len < 5 || strcmp (dirent->d_name + len - 5, ".argb"))
+      continue;
+    snprintf (path, sizeof (path), "%s/%s", cache->dir, dirent->d_name);
+    if (stat (path, &st))
+      continue;
+    if (count >= allocated)
+    {
+      allocated = allocated * 2 + 64;
+      entries = realloc (entries, sizeof (MrgDiskCacheEntry) * allocated);
+    }
+    entries[count].name = strdup (dirent->d_name);
+    entries[count].mtime = st.st_mtime;
+    entries[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+  closedir (dir);
+
+  if (total > cache->max_bytes)
+  {
+    qsort (entries, count, sizeof (MrgDiskCacheEntry), compare_entry_mtime);
+    for (i = 0; i < count && total > cache->max_bytes; i++)
+    {
+      snprintf (path, sizeof (path), "%s/%s", cache->dir, entries[i].name);
+      if (unlink (path) == 0)
+        total -= entries[i].size;
+    }
+  }
+  for (i = 0; i < count; i++)
+    free (entries[i].name);
+  free (entries);
+}
+
+MrgDiskCache *_mrg_disk_cache_new (long max_bytes)
+{
+  const char *base = getenv ("XDG_CACHE_HOME");
+  MrgDiskCache *cache;
+  char dir[4096];
+
+  if (base && base[0])
+    snprintf (dir, sizeof (dir), "%s/mrg", base);
+  else if (getenv ("HOME"))
+    snprintf (dir, sizeof (dir), "%s/.cache/mrg", getenv ("HOME"));
+  else
+    return NULL;
+  if (mkdir_p (dir))
+    return NULL;
+
+  cache = calloc (sizeof (MrgDiskCache), 1);
+  cache->dir = strdup (dir);
+  cache->max_bytes = max_bytes;
+  trim (cache);
+  return cache;
+}
+
+void _mrg_disk_cache_free (MrgDiskCache *cache)
+{
+  free (cache->dir);
+  free (cache);
+}
+
+static void entry_path (MrgDiskCache *cache, char *out, size_t out_length,
+                        const char *path, long long mtime, long size,
+                        int width, int height)
+{
+  uint64_t hash = MRG_FNV1A_INIT;
+
+  hash = _mrg_fnv1a (hash, path, strlen (path) + 1);
+  hash = _mrg_fnv1a (hash, &mtime, sizeof (mtime));
+  hash = _mrg_fnv1a (hash, &size, sizeof (size));
+  hash = _mrg_fnv1a (hash, &width, sizeof (width));
+  hash = _mrg_fnv1a (hash, &height, sizeof (height));
+  snprintf (out, out_length, "%s/%016llx.argb", cache->dir,
+            (unsigned long long)hash);
+}
+
+static void unmap_entry (void *data)
+{
+  MrgDiskCacheMapping *mapping = data;
+  munmap (mapping->addr, mapping->length);
+  free (mapping);
+}
+
+/* the entry for the file at path, with the given modification time (in
+ * nanoseconds) and size, downscaled to width x height; or NULL
+ */
+cairo_surface_t *_mrg_disk_cache_load (MrgDiskCache *cache,
+                                       const char   *path,
+                                       long long     mtime,
+                                       long          size,
+                                       int           width,
+                                       int           height)
+{
+  MrgDiskCacheHeader *header;
+  MrgDiskCacheMapping *mapping;
+  cairo_surface_t *surface;
+  char   entry[4096];
+  struct stat st;
+  void  *addr;
+  int    fd;
+
+  entry_path (cache, entry, sizeof (entry), path, mtime, size, width, height);
+  fd = open (entry, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) || st.st_size < MRG_DISK_CACHE_HEADER)
+  {
+    close (fd);
+    return NULL;
+  }
+  /* private and writable, a surface is not expected to be read only */
+  addr = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  header = addr;
+  if (header->magic != MRG_DISK_CACHE_MAGIC ||
+      header->version != MRG_DISK_CACHE_VERSION ||
+      (header->format != CAIRO_FORMAT_ARGB32 &&
+       header->format != CAIRO_FORMAT_RGB24) ||
+      header->width != width || header->height != height ||
+      header->stride != cairo_format_stride_for_width (header->format, width) ||
+      st.st_size != MRG_DISK_CACHE_HEADER + (long)header->stride * height)
+  {
+    munmap (addr, st.st_size);
+    return NULL;
+  }
+
+  surface = cairo_image_surface_create_for_data (
+      (unsigned char*)addr + MRG_DISK_CACHE_HEADER, header->format,
+      width, height, header->stride);
+  mapping = malloc (sizeof (MrgDiskCacheMapping));
+  mapping->addr = addr;
+  mapping->length = st.st_size;
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS ||
+      cairo_surface_set_user_data (surface, &mapping_key, mapping,
+                                   unmap_entry) != CAIRO_STATUS_SUCCESS)
+  {
+    cairo_surface_destroy (surface);
+    unmap_entry (mapping);
+    return NULL;
+  }
+
+  /* marks the entry as recently used */
+  utimensat (AT_FDCWD, entry, NULL, 0);
+  return surface;
+}
+
+static int write_all (int fd, const void *data, size_t length)
+{
+  const char *p = data;
+  while (length)
+  {
+    ssize_t written = write (fd, p, length);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += written;
+    length -= written;
+  }
+  return 0;
+}
+
+/* stores surface as the entry for the file at path, downscaled to the
+ * size of surface
+ */
+void _mrg_disk_cache_store (MrgDiskCache    *cache,
+                            const char      *path,
+                            long long        mtime,
+                            long             size,
+                            cairo_surface_t *surface)
+{
+  char header[MRG_DISK_CACHE_HEADER] = {0};
+  MrgDiskCacheHeader *h = (void*)header;
+  char entry[4096];
+  char temp[4200];
+  int  fd;
+  int  failed;
+
+  h->magic = MRG_DISK_CACHE_MAGIC;
+  h->version = MRG_DISK_CACHE_VERSION;
+  h->format = cairo_image_surface_get_format (surface);
+  h->width = cairo_image_surface_get_width (surface);
+  h->height = cairo_image_surface_get_height (surface);
+  h->stride = cairo_image_surface_get_stride (surface);
+  if (h->format != CAIRO_FORMAT_ARGB32 && h->format != CAIRO_FORMAT_RGB24)
+    return;
+
+  entry_path (cache, entry, sizeof (entry), path, mtime, size,
+              h->width, h->height);
+  snprintf (temp, sizeof (temp), "%s.%i.tmp", entry, (int)getpid ());
+  fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return;
+  cairo_surface_flush (surface);
+  failed = write_all (fd, header, sizeof (header)) ||
+           write_all (fd, cairo_image_surface_get_data (surface),
+                      (size_t)h->stride * h->height);
+  failed = close (fd) || failed;
+  if (failed || rename (temp, entry))
+    unlink (temp);
+
+  if (++cache->stores >= MRG_DISK_CACHE_TRIM_EVERY)
+    trim (cache);
+}
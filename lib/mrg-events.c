@@ -16,6 +16,7 @@
  */
 
 #include "mrg-internal.h"
+#include "mrg-hash.h"
 
 typedef struct _MrgGrab MrgGrab;
 
@@ -88,13 +89,118 @@ void _mrg_clear_text_closures (Mrg *mrg)
   }
   mrg->text_listen_count  = 0;
   mrg->text_listen_active = 0;
+
+  for (i = 0; i < mrg->deferred_count; i ++)
+    mrg->deferred[i].finalize (mrg->deferred[i].data1,
+                               mrg->deferred[i].data2,
+                               mrg->deferred[i].finalize_data);
+  mrg->deferred_count = 0;
+}
+
+/* listener data that items of a frame still on screen can point at is
+ * finalized with the text closures of the frame being built, rather than
+ * right away
+ */
+void _mrg_defer_finalize (Mrg *mrg,
+                          void (*finalize)(void *listen_data,
+                                           void *listen_data2,
+                                           void *finalize_data),
+                          void *data1, void *data2, void *finalize_data)
+{
+  MrgClosure *closure;
+
+  if (mrg->deferred_count + 1 > mrg->deferred_allocated)
+  {
+    mrg->deferred_allocated = mrg->deferred_allocated * 2 + 16;
+    mrg->deferred = realloc (mrg->deferred,
+                             sizeof (MrgClosure) * mrg->deferred_allocated);
+  }
+  closure = &mrg->deferred[mrg->deferred_count++];
+  closure->finalize = finalize;
+  closure->data1 = data1;
+  closure->data2 = data2;
+  closure->finalize_data = finalize_data;
+}
+
+static inline MrgItem **item_table_bucket (MrgItemTable *table, uint64_t hash)
+{
+  return &table->buckets[hash & (table->size - 1)];
+}
+
+static void item_table_insert (MrgItemTable *table, MrgItem *item)
+{
+  MrgItem **bucket;
+
+  if (table->count >= table->size)
+  {
+    MrgItem **old_buckets = table->buckets;
+    int       old_size = table->size;
+    int       i;
+
+    table->size = old_size ? old_size * 2 : 64;
+    table->buckets = calloc (sizeof (MrgItem*), table->size);
+    for (i = 0; i < old_size; i++)
+    {
+      MrgItem *iter = old_buckets[i];
+      while (iter)
+      {
+        MrgItem *next = iter->hash_next;
+        bucket = item_table_bucket (table, iter->path_hash);
+        iter->hash_next = *bucket;
+        *bucket = iter;
+        iter = next;
+      }
+    }
+    free (old_buckets);
+  }
+
+  bucket = item_table_bucket (table, item->path_hash);
+  item->hash_next = *bucket;
+  *bucket = item;
+  table->count++;
+}
+
+/* empties the table, keeping the bucket allocation for the next frame,
+ * when drop is set the table's reference on the items is released.
+ */
+static void item_table_clear (MrgItemTable *table, int drop)
+{
+  int i;
+  if (!table->count)
+    return;
+  for (i = 0; i < table->size; i++)
+  {
+    MrgItem *iter = table->buckets[i];
+    while (iter)
+    {
+      MrgItem *next = iter->hash_next;
+      iter->hash_next = NULL;
+      if (drop)
+        _mrg_item_unref (iter);
+      iter = next;
+    }
+    table->buckets[i] = NULL;
+  }
+  table->count = 0;
 }
 
 void mrg_clear (Mrg *mrg)
 {
+  MrgList *l;
   if (mrg->frozen)
     return;
+
+  /* items of the previous frame that did not get recycled are let go of,
+   * and the items of the frame just finished become the pool the
+   * listeners of the next frame are matched against.
+   */
+  item_table_clear (&mrg->item_pool, 1);
+  item_table_clear (&mrg->item_table, 0);
+  for (l = mrg->items; l; l = l->next)
+    item_table_insert (&mrg->item_pool, l->data);
   mrg_list_free (&mrg->items);
+  mrg->listen_count = 0;
+  _mrg_focus_clear (mrg);
   if (mrg->backend->mrg_clear)
     mrg->backend->mrg_clear (mrg);
 
@@ -102,6 +208,22 @@ void mrg_clear (Mrg *mrg)
   _mrg_clear_text_closures (mrg);
 }
 
+/* releases the items of the frame and the pool, with the tables */
+void _mrg_items_destroy (Mrg *mrg)
+{
+  MrgList *l;
+
+  item_table_clear (&mrg->item_pool, 1);
+  item_table_clear (&mrg->item_table, 0);
+  for (l = mrg->items; l; l = l->next)
+    _mrg_item_unref (l->data);
+  mrg_list_free (&mrg->items);
+  free (mrg->item_pool.buckets);
+  free (mrg->item_table.buckets);
+  memset (&mrg->item_pool, 0, sizeof (mrg->item_pool));
+  memset (&mrg->item_table, 0, sizeof (mrg->item_table));
+}
+
 static void restore_path (cairo_t *cr, cairo_path_t *path)
 {
   //int i;
@@ -110,49 +232,24 @@ static void restore_path (cairo_t *cr, cairo_path_t *path)
   cairo_append_path (cr, path);
 }
 
-/* using bigger primes would be a good idea, this falls apart due to rounding
- * when zoomed in close
+/* 64bit FNV-1a over the exact bit patterns of the path, equality of paths
+ * with matching hashes is still verified with path_equal.
  */
-static double path_hash (cairo_path_t *path)
+static uint64_t path_hash (cairo_path_t *path)
 {
-  int i;
-  double ret = 0;
+  int i, j;
+  uint64_t ret = MRG_FNV1A_INIT;
   cairo_path_data_t *data;
   if (!path)
-    return 0.99999;
+    return 0;
   for (i = 0; i <path->num_data; i += path->data[i].header.length)
   {
     data = &path->data[i];
-    switch (data->header.type) {
-      case CAIRO_PATH_MOVE_TO:
-        ret *= 17;
-        ret += data[1].point.x;
-        ret *= 113;
-        ret += data[1].point.y;
-        break;
-      case CAIRO_PATH_LINE_TO:
-        ret *= 121;
-        ret += data[1].point.x;
-        ret *= 1021;
-        ret += data[1].point.y;
-        break;
-      case CAIRO_PATH_CURVE_TO:
-        ret *= 3111;
-        ret += data[1].point.x;
-        ret *= 23;
-        ret += data[1].point.y;
-        ret *= 107;
-        ret += data[2].point.x;
-        ret *= 739;
-        ret += data[2].point.y;
-        ret *= 3;
-        ret += data[3].point.x;
-        ret *= 51;
-        ret += data[3].point.y;
-        break;
-      case CAIRO_PATH_CLOSE_PATH:
-        ret *= 51;
-        break;
+    ret = _mrg_fnv1a (ret, &data->header.type, sizeof (data->header.type));
+    for (j = 1; j < data->header.length; j++)
+    {
+      ret = _mrg_fnv1a (ret, &data[j].point.x, sizeof (double));
+      ret = _mrg_fnv1a (ret, &data[j].point.y, sizeof (double));
     }
   }
   return ret;
@@ -187,7 +284,7 @@ path_equal (cairo_path_t *path,
       case CAIRO_PATH_CURVE_TO: count = 3; break;
       default: count = 0; break;
     }
-    for (int j = 0; j < count; j ++)
+    for (int j = 1; j <= count; j ++)
       if (data[j].point.x != data2[j].point.x ||
           data[j].point.y != data2[j].point.y)
         return 0;
@@ -195,11 +292,25 @@ path_equal (cairo_path_t *path,
   return 1;
 }
 
+static int
+matrix_equal (cairo_matrix_t *matrix,
+              cairo_matrix_t *matrix2)
+{
+  return matrix->xx == matrix2->xx && matrix->yx == matrix2->yx &&
+         matrix->xy == matrix2->xy && matrix->yy == matrix2->yy &&
+         matrix->x0 == matrix2->x0 && matrix->y0 == matrix2->y0;
+}
+
 MrgList *_mrg_detect_list (Mrg *mrg, float x, float y, MrgType type)
 {
+  /* with the render pipeline, the frame built last might not be on
+   * screen yet
+   */
+  MrgList *items = mrg->render_pipeline ? mrg->shown_items : mrg->items;
   MrgList *a;
   MrgList *ret = NULL;
 
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_HIT_TEST);
   if (type == MRG_KEY_DOWN ||
       type == MRG_KEY_UP ||
       type == MRG_MESSAGE ||
@@ -207,19 +318,20 @@ MrgList *_mrg_detect_list (Mrg *mrg, float x, float y, MrgType type)
       type == (MRG_KEY_DOWN|MRG_KEY_UP) ||
       type == (MRG_KEY_DOWN|MRG_KEY_UP|MRG_MESSAGE))
   {
-    for (a = mrg->items; a; a = a->next)
+    for (a = items; a; a = a->next)
     {
       MrgItem *item = a->data;
       if (item->types & type)
       {
         mrg_list_prepend (&ret, item);
-        return ret;
+        break;
       }
     }
-    return NULL;
+    MRG_PROFILE_END (mrg, MRG_PHASE_HIT_TEST);
+    return ret;
   }
 
-  for (a = mrg->items; a; a = a->next)
+  for (a = items; a; a = a->next)
   {
     MrgItem *item= a->data;
   
@@ -249,6 +361,7 @@ MrgList *_mrg_detect_list (Mrg *mrg, float x, float y, MrgType type)
       }
     }
   }
+  MRG_PROFILE_END (mrg, MRG_PHASE_HIT_TEST);
   return ret;
 }
 
@@ -274,6 +387,18 @@ void _mrg_item_ref (MrgItem *mrgitem)
   mrgitem->ref_count++;
 }
 
+static void _mrg_item_finalize_cbs (MrgItem *mrgitem)
+{
+  int i;
+  for (i = 0; i < mrgitem->cb_count; i++)
+  {
+    if (mrgitem->cb[i].finalize)
+      mrgitem->cb[i].finalize (mrgitem->cb[i].data1, mrgitem->cb[i].data2,
+                               mrgitem->cb[i].finalize_data);
+  }
+  mrgitem->cb_count = 0;
+}
+
 void _mrg_item_unref (MrgItem *mrgitem)
 {
   if (mrgitem->ref_count <= 0)
@@ -284,15 +409,7 @@ void _mrg_item_unref (MrgItem *mrgitem)
   mrgitem->ref_count--;
   if (mrgitem->ref_count <=0)
   {
-    {
-      int i;
-      for (i = 0; i < mrgitem->cb_count; i++)
-      {
-        if (mrgitem->cb[i].finalize)
-          mrgitem->cb[i].finalize (mrgitem->cb[i].data1, mrgitem->cb[i].data2,
-                                   mrgitem->cb[i].finalize_data);
-      }
-    }
+    _mrg_item_finalize_cbs (mrgitem);
     if (mrgitem->path)
     {
       cairo_path_destroy (mrgitem->path);
@@ -301,6 +418,50 @@ void _mrg_item_unref (MrgItem *mrgitem)
   }
 }
 
+/* takes the item registered with the same identity, path and transform
+ * in the previous frame out of the pool, if there is one.
+ */
+static MrgItem *_mrg_item_recycle (Mrg            *mrg,
+                                   cairo_path_t   *path,
+                                   uint64_t        hash,
+                                   cairo_matrix_t *inv_matrix,
+                                   void           *id_ptr,
+                                   MrgCb           cb,
+                                   void           *data1,
+                                   void           *data2)
+{
+  MrgItemTable *pool = &mrg->item_pool;
+  MrgItem **link;
+
+  if (!pool->count)
+    return NULL;
+
+  for (link = item_table_bucket (pool, hash); *link; link = &(*link)->hash_next)
+  {
+    MrgItem *item = *link;
+    /* items of a frame kept on screen by the render pipeline stay as
+     * they are
+     */
+    if (mrg->render_pipeline && item->ref_count > 1)
+      continue;
+    if (item->path_hash == hash &&
+        item->id_ptr == id_ptr &&
+        (id_ptr ||
+         (item->id_cb == cb &&
+          item->id_data1 == data1 &&
+          item->id_data2 == data2)) &&
+        matrix_equal (&item->inv_matrix, inv_matrix) &&
+        path_equal (item->path, path))
+    {
+      *link = item->hash_next;
+      item->hash_next = NULL;
+      pool->count--;
+      return item;
+    }
+  }
+  return NULL;
+}
+
 void mrg_listen (Mrg     *mrg,
                  MrgType  types,
                  MrgCb    cb,
@@ -312,14 +473,14 @@ void mrg_listen (Mrg     *mrg,
   return mrg_listen_full (mrg, types, cb, data1, data2, NULL, NULL);
 }
 
-void mrg_listen_full (Mrg     *mrg,
-                      MrgType  types,
-                      MrgCb    cb,
-                      void    *data1,
-                      void    *data2,
-                      void   (*finalize)(void *listen_data, void *listen_data2,
-                                         void *finalize_data),
-                      void    *finalize_data)
+static void _mrg_listen_full (Mrg     *mrg,
+                              MrgType  types,
+                              MrgCb    cb,
+                              void    *data1,
+                              void    *data2,
+                              void   (*finalize)(void *listen_data, void *listen_data2,
+                                                 void *finalize_data),
+                              void    *finalize_data)
 {
   float x, y, width, height;
 
@@ -327,6 +488,10 @@ void mrg_listen_full (Mrg     *mrg,
   {
     MrgItem *item;
     cairo_t *cr = mrg_cr (mrg);
+    cairo_path_t *path;
+    cairo_matrix_t inv_matrix;
+    uint64_t hash;
+    void *id_ptr;
 
     /* generate bounding box of what to listen for - from current cairo path */
     if (types & MRG_KEY)
@@ -354,10 +519,11 @@ void mrg_listen_full (Mrg     *mrg,
 
       cairo_user_to_device (cr, &tx, &ty);
       cairo_user_to_device_distance (cr, &tw, &th);
-      if (ty > mrg->height * 2 ||
+      if (!mrg->retained_recording &&
+          (ty > mrg->height * 2 ||
           tx > mrg->width * 2 ||
           tx + tw < 0 ||
-          ty + th < 0)
+          ty + th < 0))
       {
         if (finalize)
           finalize (data1, data2, finalize_data);
@@ -365,11 +531,67 @@ void mrg_listen_full (Mrg     *mrg,
       }
     }
     
-    item = calloc (sizeof (MrgItem), 1);
-    item->x0 = x;
-    item->y0 = y;
-    item->x1 = x + width;
-    item->y1 = y + height;
+    path = cairo_copy_path (cr);
+    hash = path_hash (path);
+    cairo_get_matrix (cr, &inv_matrix);
+    cairo_matrix_invert (&inv_matrix);
+
+    /* store multiple callbacks for one entry when the paths
+     * are exact matches, reducing per event traversal checks at the
+     * cost of a little paint-hit (XXX: is this the right tradeoff,
+     * perhaps it is better to spend more time during event processing
+     * than during paint?)
+     */
+    if (mrg->item_table.count)
+    {
+      for (item = *item_table_bucket (&mrg->item_table, hash);
+           item; item = item->hash_next)
+      {
+        if (item->path_hash == hash &&
+            path_equal (path, item->path))
+        {
+          /* found an item, add the cb data  */
+          item->cb[item->cb_count].types = types;
+          item->cb[item->cb_count].cb = cb;
+          item->cb[item->cb_count].data1 = data1;
+          item->cb[item->cb_count].data2 = data2;
+          item->cb[item->cb_count].finalize = finalize;
+          item->cb[item->cb_count].finalize_data = finalize_data;
+          item->cb_count++;
+          item->types |= types;
+          cairo_path_destroy (path);
+          return;
+        }
+      }
+    }
+
+    id_ptr = mrg_style (mrg)->id_ptr;
+    item = _mrg_item_recycle (mrg, path, hash, &inv_matrix,
+                              id_ptr, cb, data1, data2);
+    if (item)
+    {
+      /* the geometry is the same as in the previous frame, keep the
+       * already copied path and only replace the callbacks
+       */
+      cairo_path_destroy (path);
+      _mrg_item_finalize_cbs (item);
+    }
+    else
+    {
+      item = calloc (sizeof (MrgItem), 1);
+      item->x0 = x;
+      item->y0 = y;
+      item->x1 = x + width;
+      item->y1 = y + height;
+      item->path = path;
+      item->path_hash = hash;
+      item->inv_matrix = inv_matrix;
+      item->id_ptr = id_ptr;
+      item->id_cb = cb;
+      item->id_data1 = data1;
+      item->id_data2 = data2;
+      item->ref_count = 1;
+    }
     item->cb[0].types = types;
     item->cb[0].cb = cb;
     item->cb[0].data1 = data1;
@@ -378,51 +600,39 @@ void mrg_listen_full (Mrg     *mrg,
     item->cb[0].finalize_data = finalize_data;
     item->cb_count = 1;
     item->types = types;
-    item->path = cairo_copy_path (cr);
-    item->path_hash = path_hash (item->path);
-    cairo_get_matrix (cr, &item->inv_matrix);
-    cairo_matrix_invert (&item->inv_matrix);
+    item->focus_no = -1;
 
-    if (mrg->items)
-    {
-      MrgList *l;
-      for (l = mrg->items; l; l = l->next)
-      {
-        MrgItem *item2 = l->data;
-
-        /* store multiple callbacks for one entry when the paths
-         * are exact matches, reducing per event traversal checks at the
-         * cost of a little paint-hit (XXX: is this the right tradeoff,
-         * perhaps it is better to spend more time during event processing
-         * than during paint?)
-         */
-        if (item->path_hash == item2->path_hash &&
-            path_equal (item->path, item2->path))
-        {
-          /* found an item, copy over cb data  */
-          item2->cb[item2->cb_count] = item->cb[0];
-          free (item);
-          item2->cb_count++;
-          item2->types |= types;
-          /* increment ref_count? */
-          return;
-        }
-      }
-    }
-    item->ref_count = 1;
-    mrg_list_prepend_full (&mrg->items, item, (void*)_mrg_item_unref, NULL);
+    _mrg_focus_add (mrg, item, cr);
+    item_table_insert (&mrg->item_table, item);
+    mrg_list_prepend (&mrg->items, item);
   }
 }
 
+void mrg_listen_full (Mrg     *mrg,
+                      MrgType  types,
+                      MrgCb    cb,
+                      void    *data1,
+                      void    *data2,
+                      void   (*finalize)(void *listen_data, void *listen_data2,
+                                         void *finalize_data),
+                      void    *finalize_data)
+{
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_LISTEN);
+  _mrg_listen_full (mrg, types, cb, data1, data2, finalize, finalize_data);
+  MRG_PROFILE_END (mrg, MRG_PHASE_LISTEN);
+  mrg->listen_count++;
+}
+
 static int
 _mrg_emit_cb_item (Mrg *mrg, MrgItem *item, MrgEvent *event, MrgType type, float x, float y)
 {
-  static MrgEvent s_event;
+  MrgEvent s_event;
   MrgEvent transformed_event;
   int i;
 
   if (!event)
   {
+    memset (&s_event, 0, sizeof (s_event));
     event = &s_event;
     event->type = type;
     event->x = x;
@@ -630,6 +840,8 @@ int mrg_pointer_drop (Mrg *mrg, float x, float y, int device_no, uint32_t time,
 int mrg_pointer_press (Mrg *mrg, float x, float y, int device_no, uint32_t time)
 {
   MrgList *hitlist = NULL;
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_PRESS, x, y, device_no, time, NULL);
   mrg->pointer_x[device_no] = x;
   mrg->pointer_y[device_no] = y;
   if (device_no <= 3)
@@ -735,6 +947,8 @@ void mrg_resized (Mrg *mrg, int width, int height, long time)
 
 int mrg_pointer_release (Mrg *mrg, float x, float y, int device_no, uint32_t time)
 {
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_RELEASE, x, y, device_no, time, NULL);
   if (time == 0)
     time = mrg_ms (mrg);
 
@@ -842,6 +1056,9 @@ int mrg_pointer_motion (Mrg *mrg, float x, float y, int device_no, uint32_t time
   MrgList *grablist = NULL, *g;
   MrgGrab *grab;
 
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_MOTION, x, y, device_no, time, NULL);
+
   if (device_no < 0) device_no = 0;
   if (device_no >= MRG_MAX_DEVICES) device_no = MRG_MAX_DEVICES-1;
   MrgEvent *event = &mrg->drag_event[device_no];
@@ -927,9 +1144,13 @@ int mrg_pointer_motion (Mrg *mrg, float x, float y, int device_no, uint32_t time
 
 void mrg_incoming_message (Mrg *mrg, const char *message, long time)
 {
-  MrgItem *item = _mrg_detect (mrg, 0, 0, MRG_MESSAGE);
+  MrgItem *item;
   MrgEvent event = {0, };
 
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_MESSAGE, 0, 0, 0, time, message);
+  item = _mrg_detect (mrg, 0, 0, MRG_MESSAGE);
+
   if (!time)
     time = mrg_ms (mrg);
 
@@ -962,6 +1183,8 @@ int mrg_scrolled (Mrg *mrg, float x, float y, MrgScrollDirection scroll_directio
   MrgList *l;
 
   int device_no = 0;
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_SCROLL, x, y, scroll_direction, time, NULL);
   mrg->pointer_x[device_no] = x;
   mrg->pointer_y[device_no] = y;
 
@@ -1000,9 +1223,13 @@ int mrg_scrolled (Mrg *mrg, float x, float y, MrgScrollDirection scroll_directio
 int mrg_key_press (Mrg *mrg, unsigned int keyval,
                    const char *string, uint32_t time)
 {
-  MrgItem *item = _mrg_detect (mrg, 0, 0, MRG_KEY_DOWN);
+  MrgItem *item;
   MrgEvent event = {0,};
 
+  if (mrg->record)
+    _mrg_record_event (mrg, MRG_KEY_DOWN, 0, 0, keyval, time, string);
+  item = _mrg_detect (mrg, 0, 0, MRG_KEY_DOWN);
+
   if (time == 0)
     time = mrg_ms (mrg);
 
@@ -1077,6 +1304,9 @@ void _mrg_debug_overlays (Mrg *mrg)
     }
   }
   cairo_restore (cr);
+
+  if (mrg->hud)
+    _mrg_hud_draw (mrg);
 }
 
 void mrg_event_stop_propagate (MrgEvent *event)
@@ -17,292 +17,343 @@
 
 #include "mrg-internal.h"
 
-/* NOTE: quite a bit of unneeded code can be eliminated in here */
+/* focusable items are those that react to pointer interaction and have
+ * a non-empty bounding box, key and message listeners are excluded.
+ */
+#define MRG_FOCUSABLE (MRG_POINTER | MRG_TAPS | MRG_DRAG)
+
+/* how much more weight distance across the direction of travel carries
+ * than distance along it, when picking the next item in a direction.
+ */
+#define MRG_FOCUS_CROSS_WEIGHT 5
 
-static void mrg_item_center (MrgItem *item, float *cx, float *cy)
+void _mrg_focus_add (Mrg *mrg, MrgItem *item, cairo_t *cr)
 {
-  double x = (item->x0 + item->x1)/2;
-  double y = (item->y0 * 0.2 + item->y1 * 0.8);
+  MrgFocusIndex *focus = &mrg->focus;
+  MrgFocusEntry *entry;
+  double x, y;
+
+  if (!(item->types & MRG_FOCUSABLE) ||
+       (item->types & MRG_KEY) ||
+       item->x1 <= item->x0 ||
+       item->y1 <= item->y0)
+    return;
 
-  cairo_matrix_t mat = item->inv_matrix;
-  cairo_matrix_invert (&mat);
-  cairo_matrix_transform_point (&mat, &x, &y);
+  if (focus->count + 1 > focus->allocated)
+  {
+    focus->allocated = focus->allocated * 2 + 64;
+    focus->entries = realloc (focus->entries,
+                              sizeof (MrgFocusEntry) * focus->allocated);
+  }
 
-  if (cx) *cx = x;
-  if (cy) *cy = y;
+  x = (item->x0 + item->x1)/2;
+  y = (item->y0 * 0.2 + item->y1 * 0.8);
+  cairo_user_to_device (cr, &x, &y);
+
+  entry = &focus->entries[focus->count];
+  entry->item = item;
+  entry->x = x;
+  entry->y = y;
+  item->focus_no = focus->count++;
+  focus->built = 0;
 }
 
-static MrgItem *item_find_next (Mrg *mrg, MrgItem *cursor, int x_delta, int y_delta)
+/* forget the items of the previous frame, the allocations are kept around
+ * for reuse by the next frame.
+ */
+void _mrg_focus_clear (Mrg *mrg)
 {
-  MrgList *a;
-  float cursor_x, cursor_y;
+  mrg->focus.count = 0;
+  mrg->focus.built = 0;
+}
 
-  MrgItem *best = NULL;
-  float   best_distance = 10000000000000000000000.0;
+void _mrg_focus_free (MrgFocusIndex *focus)
+{
+  free (focus->entries);
+  free (focus->cell_start);
+  free (focus->cell_entries);
+  memset (focus, 0, sizeof (MrgFocusIndex));
+}
 
-  mrg_item_center (cursor, &cursor_x, &cursor_y);
-  for (a = mrg->items; a; a = a->next)
-    {
-      MrgItem *item = a->data;
-      if (item != cursor)
-        {
-          float cx, cy;
-          float distance;
-          mrg_item_center (item, &cx, &cy);
-
-          if (x_delta)
-          distance = (cx-cursor_x)*(cx-cursor_x) * 5 + (cy-cursor_y)*(cy-cursor_y);
-          else
-          if (y_delta)
-          distance = (cx-cursor_x)*(cx-cursor_x) + 5  * (cy-cursor_y)*(cy-cursor_y);
-          else
-          distance = (cx-cursor_x)*(cx-cursor_x) + (cy-cursor_y)*(cy-cursor_y);
-
-          distance = sqrt (distance);
-
-          if (distance <= best_distance)
-          {
-            if ((x_delta > 0) && (cx <= cursor_x))
-            { }
-            else if ((x_delta < 0) && (cx >= cursor_x))
-            { }
-            else if ((y_delta > 0) && (cy <= cursor_y))
-            { }
-            else if ((y_delta < 0) && (cy >= cursor_y))
-            { }
-            else
-            {
-              best_distance = distance;
-              best = item;
-            }
-          }
-        }
-    }
-  return best;
+/* the index of the frame events are matched against, with the render
+ * pipeline that is the frame on screen rather than the one being built
+ */
+static MrgFocusIndex *focus_index (Mrg *mrg)
+{
+  if (mrg->render_pipeline)
+    return _mrg_raster_focus (mrg);
+  return &mrg->focus;
 }
 
-static void cmd_focus_up (MrgEvent *event, void *data, void *data2)
+static inline int focus_cell (MrgFocusIndex *focus, MrgFocusEntry *entry)
 {
-  Mrg *mrg = event->mrg;
-  float x = mrg_pointer_x (mrg);
-  float y = mrg_pointer_y (mrg);
-  MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-  MrgItem *next = NULL;
+  int col = (entry->x - focus->x0) / focus->cell_width;
+  int row = (entry->y - focus->y0) / focus->cell_height;
+  return row * focus->cols + col;
+}
 
-  if (current)
+static void focus_build_grid (MrgFocusIndex *focus)
+{
+  float x0, y0, x1, y1;
+  int   cells;
+  int   side;
+  int   i;
+
+  if (focus->built)
+    return;
+
+  x0 = x1 = focus->entries[0].x;
+  y0 = y1 = focus->entries[0].y;
+  for (i = 1; i < focus->count; i++)
   {
-    next = item_find_next (mrg, current, 0, -1);
+    MrgFocusEntry *entry = &focus->entries[i];
+    if (entry->x < x0) x0 = entry->x;
+    if (entry->x > x1) x1 = entry->x;
+    if (entry->y < y0) y0 = entry->y;
+    if (entry->y > y1) y1 = entry->y;
   }
-  else
+
+  /* aim for a couple of items per cell */
+  side = sqrtf (focus->count / 2.0f) + 1;
+  focus->cols = side;
+  focus->rows = side;
+  focus->x0 = x0;
+  focus->y0 = y0;
+  focus->cell_width  = (x1 - x0) / side + 1;
+  focus->cell_height = (y1 - y0) / side + 1;
+  cells = focus->cols * focus->rows;
+
+  if (cells + 1 > focus->cells_allocated)
   {
-#if 1
-    MrgList *a;
-    for (a = mrg->items; a; a = a->next)
-      {
-        MrgItem *item = a->data;
-        if (!(item->x0 == 0 && item->y0 == 0))
-          next = item;
-      }
-#endif
+    focus->cells_allocated = cells + 1;
+    focus->cell_start = realloc (focus->cell_start,
+                                 sizeof (int) * focus->cells_allocated);
   }
-
-  if (next)
+  if (focus->count > focus->cell_entries_allocated)
   {
-    float cx, cy;
-    mrg_item_center (next, &cx, &cy);
-    mrg_warp_pointer (mrg, cx, cy);
-    mrg_event_stop_propagate (event);
+    focus->cell_entries_allocated = focus->allocated;
+    focus->cell_entries = realloc (focus->cell_entries,
+                                   sizeof (int) * focus->cell_entries_allocated);
   }
-}
 
-static void cmd_focus_down (MrgEvent *event, void *data, void *data2)
+  /* counting sort of the entries into cells, afterwards the entries of
+   * cell c are cell_entries[cell_start[c]] .. cell_entries[cell_start[c+1]-1]
+   */
+  memset (focus->cell_start, 0, sizeof (int) * (cells + 1));
+  for (i = 0; i < focus->count; i++)
+    focus->cell_start[focus_cell (focus, &focus->entries[i]) + 1]++;
+  for (i = 0; i < cells; i++)
+    focus->cell_start[i+1] += focus->cell_start[i];
+  for (i = 0; i < focus->count; i++)
+    focus->cell_entries[focus->cell_start[focus_cell (focus, &focus->entries[i])]++] = i;
+  for (i = cells; i > 0; i--)
+    focus->cell_start[i] = focus->cell_start[i-1];
+  focus->cell_start[0] = 0;
+
+  focus->built = 1;
+}
+static inline void focus_consider_cell (MrgFocusIndex *focus,
+                                        int col, int row,
+                                        float ox, float oy,
+                                        int exclude,
+                                        int x_delta, int y_delta,
+                                        int *best, float *best_distance)
 {
-  Mrg *mrg = event->mrg;
-  float x = mrg_pointer_x (mrg);
-  float y = mrg_pointer_y (mrg);
-  MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-  MrgItem *next = NULL;
-
-  if (current)
+  float cx0, cy0;
+  int   i;
+
+  if (col < 0 || row < 0 || col >= focus->cols || row >= focus->rows)
+    return;
+
+  /* skip cells entirely behind the direction of travel */
+  cx0 = focus->x0 + col * focus->cell_width;
+  cy0 = focus->y0 + row * focus->cell_height;
+  if ((x_delta > 0 && cx0 + focus->cell_width  <= ox) ||
+      (x_delta < 0 && cx0 >= ox) ||
+      (y_delta > 0 && cy0 + focus->cell_height <= oy) ||
+      (y_delta < 0 && cy0 >= oy))
+    return;
+
+  for (i = focus->cell_start[row * focus->cols + col];
+       i < focus->cell_start[row * focus->cols + col + 1]; i++)
   {
-    next = item_find_next (mrg, current, 0, 1);
+    int no = focus->cell_entries[i];
+    MrgFocusEntry *entry = &focus->entries[no];
+    float dx = entry->x - ox;
+    float dy = entry->y - oy;
+    float distance;
+
+    if (no == exclude)
+      continue;
+
+    if ((x_delta > 0 && dx <= 0) ||
+        (x_delta < 0 && dx >= 0) ||
+        (y_delta > 0 && dy <= 0) ||
+        (y_delta < 0 && dy >= 0))
+      continue;
+
+    if (x_delta)
+      distance = dx * dx + MRG_FOCUS_CROSS_WEIGHT * dy * dy;
+    else
+      distance = MRG_FOCUS_CROSS_WEIGHT * dx * dx + dy * dy;
+
+    if (distance < *best_distance ||
+        (distance == *best_distance && no < *best))
+    {
+      *best_distance = distance;
+      *best = no;
+    }
   }
-  else
+}
+
+/* find the nearest focusable item in the given direction from ox,oy,
+ * visiting grid cells in rings of growing distance and stopping once no
+ * unvisited cell can hold anything closer than the best candidate.
+ */
+static int focus_find_next (MrgFocusIndex *focus, float ox, float oy,
+                            int exclude, int x_delta, int y_delta)
+{
+  float best_distance = INFINITY;
+  float min_cell;
+  int   best = -1;
+  int   col, row;
+  int   r, max_r;
+
+  if (!focus->count)
+    return -1;
+  focus_build_grid (focus);
+
+  col = (ox - focus->x0) / focus->cell_width;
+  row = (oy - focus->y0) / focus->cell_height;
+  if (ox < focus->x0) col = -1;
+  if (oy < focus->y0) row = -1;
+  if (col >= focus->cols) col = focus->cols;
+  if (row >= focus->rows) row = focus->rows;
+
+  min_cell = focus->cell_width < focus->cell_height ?
+             focus->cell_width : focus->cell_height;
+  max_r = (focus->cols > focus->rows ? focus->cols : focus->rows) + 1;
+
+  for (r = 0; r <= max_r; r++)
   {
-#if 1
-    MrgList *a;
-    for (a = mrg->items; a; a = a->next)
+    int i;
+
+    if (r == 0)
+    {
+      focus_consider_cell (focus, col, row, ox, oy, exclude,
+                           x_delta, y_delta, &best, &best_distance);
+    }
+    else
+    {
+      for (i = -r; i <= r; i++)
       {
-        MrgItem *item = a->data;
-        if (!(item->x0 == 0 && item->y0 == 0))
-          next = item;
+        focus_consider_cell (focus, col + i, row - r, ox, oy, exclude,
+                             x_delta, y_delta, &best, &best_distance);
+        focus_consider_cell (focus, col + i, row + r, ox, oy, exclude,
+                             x_delta, y_delta, &best, &best_distance);
       }
-#endif
-  }
+      for (i = -r + 1; i < r; i++)
+      {
+        focus_consider_cell (focus, col - r, row + i, ox, oy, exclude,
+                             x_delta, y_delta, &best, &best_distance);
+        focus_consider_cell (focus, col + r, row + i, ox, oy, exclude,
+                             x_delta, y_delta, &best, &best_distance);
+      }
+    }
 
-  if (next)
-  {
-    mrg_warp_pointer (mrg, (next->x0 + next->x1)/2, (next->y0 * 0.2 + next->y1 * 0.8) );
-    mrg_event_stop_propagate (event);
+    /* every cell of ring r+1 is at least r cells away */
+    if (best >= 0 && (r * min_cell) * (r * min_cell) > best_distance)
+      break;
   }
+  return best;
 }
 
+static void focus_warp (Mrg *mrg, MrgFocusIndex *focus, int no)
+{
+  MrgFocusEntry *entry = &focus->entries[no];
+  mrg_warp_pointer (mrg, entry->x, entry->y);
+}
 
-static void cmd_focus_left (MrgEvent *event, void *data, void *data2)
+static void focus_move (MrgEvent *event, int x_delta, int y_delta)
 {
   Mrg *mrg = event->mrg;
+  MrgFocusIndex *focus = focus_index (mrg);
   float x = mrg_pointer_x (mrg);
   float y = mrg_pointer_y (mrg);
   MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-  MrgItem *next = NULL;
+  int next;
 
-  if (current)
+  /* search from the center of the focused item, or from the pointer
+   * when it isn't over anything focusable
+   */
+  if (current && current->focus_no >= 0 && current->focus_no < focus->count)
   {
-    next = item_find_next (mrg, current, -1, 0);
+    MrgFocusEntry *entry = &focus->entries[current->focus_no];
+    next = focus_find_next (focus, entry->x, entry->y, current->focus_no,
+                            x_delta, y_delta);
   }
   else
   {
-#if 0
-    MrgList *a;
-    for (a = mrg->items; a; a = a->next)
-      {
-        MrgItem *item = a->data;
-        if (!(item->x0 == 0 && item->y0 == 0))
-          next = item;
-      }
-#endif
+    next = focus_find_next (focus, x, y, -1, x_delta, y_delta);
   }
 
-  if (next)
+  if (next >= 0)
   {
-    mrg_warp_pointer (mrg, (next->x0 + next->x1)/2, (next->y0 * 0.2 + next->y1 * 0.8) );
+    focus_warp (mrg, focus, next);
     mrg_event_stop_propagate (event);
   }
 }
 
+static void cmd_focus_up (MrgEvent *event, void *data, void *data2)
+{
+  focus_move (event, 0, -1);
+}
+
+static void cmd_focus_down (MrgEvent *event, void *data, void *data2)
+{
+  focus_move (event, 0, 1);
+}
+
+static void cmd_focus_left (MrgEvent *event, void *data, void *data2)
+{
+  focus_move (event, -1, 0);
+}
 
 static void cmd_focus_right (MrgEvent *event, void *data, void *data2)
+{
+  focus_move (event, 1, 0);
+}
+
+/* tab-order is the order listeners were registered in during the frame */
+static void focus_step (MrgEvent *event, int step)
 {
   Mrg *mrg = event->mrg;
+  MrgFocusIndex *focus = focus_index (mrg);
   float x = mrg_pointer_x (mrg);
   float y = mrg_pointer_y (mrg);
   MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-  MrgItem *next = NULL;
+  int next;
 
-  if (current)
-  {
-    next = item_find_next (mrg, current, 1, 0);
-  }
+  if (!focus->count)
+    return;
+
+  if (current && current->focus_no >= 0 && current->focus_no < focus->count)
+    next = (current->focus_no + step + focus->count) % focus->count;
   else
-  {
-#if 0
-    MrgList *a;
-    for (a = mrg->items; a; a = a->next)
-      {
-        MrgItem *item = a->data;
-        if (!(item->x0 == 0 && item->y0 == 0))
-          next = item;
-      }
-#endif
-  }
+    next = step > 0 ? 0 : focus->count - 1;
 
-  if (next)
-  {
-    mrg_warp_pointer (mrg, (next->x0 + next->x1)/2, (next->y0 * 0.2 + next->y1 * 0.8) );
-    mrg_event_stop_propagate (event);
-  }
+  focus_warp (mrg, focus, next);
+  mrg_event_stop_propagate (event);
 }
 
 static void cmd_focus_previous (MrgEvent *event, void *data, void *data2)
 {
-  Mrg *mrg = event->mrg;
-  float x = mrg_pointer_x (mrg);
-  float y = mrg_pointer_y (mrg);
-  MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-
-  if (current)
-  {
-    {
-      MrgList *a;
-      MrgItem *prev = NULL;
-      for (a = mrg->items; a; a = a->next)
-        {
-          MrgItem *item = a->data;
-          if (item == current)
-          {
-            if (prev)
-            {
-              mrg_warp_pointer (mrg, (prev->x0 + prev->x1)/2, (prev->y0 * 0.2 + prev->y1 * 0.8) );
-            }
-          }
-          prev = item;
-        }
-      }
-  }
-  else
-  {
-    {
-      MrgList *a;
-      MrgItem *found = NULL;
-      for (a = mrg->items; a; a = a->next)
-        {
-          MrgItem *item = a->data;
-          if (!(item->x0 == 0 && item->y0 == 0)){
-            found = item;
-          }
-        }
-      if (found)
-        mrg_warp_pointer (mrg, (found->x0 + found->x1)/2, (found->y0 * 0.2 + found->y1 * 0.8) );
-      }
-  }
+  focus_step (event, -1);
 }
 
 static void cmd_focus_next (MrgEvent *event, void *data, void *data2)
 {
-  Mrg *mrg = event->mrg;
-  float x = mrg_pointer_x (mrg);
-  float y = mrg_pointer_y (mrg);
-  MrgItem *current = _mrg_detect (mrg, x, y, MRG_ANY);
-
-  if (current)
-  {
-    {
-      MrgList *a;
-      int found = 0;
-      for (a = mrg->items; a; a = a->next)
-        {
-          MrgItem *item = a->data;
-          if (found)
-          {
-            mrg_warp_pointer (mrg, (item->x0 + item->x1)/2, (item->y0 * 0.2 + item->y1 * 0.8) );
-            return;
-          }
-          if (item == current)
-            found = 1;
-        }
-        mrg_warp_pointer (mrg, mrg_width(mrg)/2, mrg_height(mrg)-1);
-        return;
-      }
-  }
-  else
-  {
-    {
-      MrgList *a;
-      for (a = mrg->items; a; a = a->next)
-        {
-          MrgItem *item = a->data;
-          if (!(item->x0 == 0 && item->y0 == 0)){
-            mrg_warp_pointer (mrg, (item->x0 + item->x1)/2, (item->y0 * 0.2 + item->y1 * 0.8) );
-            return;
-          }
-        }
-      mrg_warp_pointer (mrg, 0, 0);
-      return;
-    }
-
-  }
-
-  return;
+  focus_step (event, 1);
 }
 
 static void cmd_select (MrgEvent *event, void *data, void *data2)
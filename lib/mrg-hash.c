@@ -0,0 +1,116 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MurmurHash3 was written by Austin Appleby and placed in the public
+ * domain, this follows MurmurHash3_x64_128 and gives the same hashes.
+ */
+
+#include <string.h>
+#include "mrg-hash.h"
+
+static inline uint64_t rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64 (uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+/* a little endian load, memcpy keeps unaligned loads well defined */
+static inline uint64_t load64 (const uint8_t *p)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t v;
+  memcpy (&v, p, 8);
+  return v;
+#else
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+#endif
+}
+
+void _mrg_hash128 (const void *data, size_t length, uint32_t seed,
+                   uint64_t hash[2])
+{
+  const uint64_t c1 = 0x87c37b91114253d5ull;
+  const uint64_t c2 = 0x4cf5ad432745937full;
+  const uint8_t *p = data;
+  const uint8_t *tail;
+  size_t blocks = length / 16;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  size_t i;
+
+  for (i = 0; i < blocks; i++, p += 16)
+  {
+    k1 = load64 (p);
+    k2 = load64 (p + 8);
+
+    k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64 (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64 (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  tail = p;
+  k1 = k2 = 0;
+  switch (length & 15)
+  {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)tail[9] << 8;   /* fall through */
+    case  9: k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+             /* fall through */
+    case  8: k1 ^= (uint64_t)tail[7] << 56;  /* fall through */
+    case  7: k1 ^= (uint64_t)tail[6] << 48;  /* fall through */
+    case  6: k1 ^= (uint64_t)tail[5] << 40;  /* fall through */
+    case  5: k1 ^= (uint64_t)tail[4] << 32;  /* fall through */
+    case  4: k1 ^= (uint64_t)tail[3] << 24;  /* fall through */
+    case  3: k1 ^= (uint64_t)tail[2] << 16;  /* fall through */
+    case  2: k1 ^= (uint64_t)tail[1] << 8;   /* fall through */
+    case  1: k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64 (h1);
+  h2 = fmix64 (h2);
+  h1 += h2;
+  h2 += h1;
+
+  hash[0] = h1;
+  hash[1] = h2;
+}
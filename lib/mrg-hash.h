@@ -0,0 +1,61 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MRG_HASH_H
+#define MRG_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* MurmurHash3, x64 128 bit variant, of length bytes of data; a fast hash
+ * for telling contents apart, not resisting deliberate collisions
+ */
+void _mrg_hash128 (const void *data, size_t length, uint32_t seed,
+                   uint64_t hash[2]);
+
+/* the initial value of a 64 bit FNV-1a hash */
+#define MRG_FNV1A_INIT 14695981039346656037ull
+
+/* continues a 64 bit FNV-1a hash over length bytes of data, for the short
+ * keys of in memory tables where MurmurHash3 does not pay off
+ */
+static inline uint64_t _mrg_fnv1a (uint64_t hash, const void *data,
+                                   size_t length)
+{
+  const unsigned char *p = data;
+  size_t i;
+  for (i = 0; i < length; i++)
+  {
+    hash ^= p[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/* FNV-1a of a nul terminated string, folded to 32 bits for bucket indices */
+static inline uint32_t _mrg_fnv1a_string (const char *str)
+{
+  uint64_t hash = MRG_FNV1A_INIT;
+  for (; *str; str++)
+  {
+    hash ^= (unsigned char)*str;
+    hash *= 1099511628211ull;
+  }
+  return hash ^ (hash >> 32);
+}
+
+#endif
@@ -47,6 +47,9 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #if MRG_SDL
 #include <SDL/SDL.h>
@@ -54,6 +57,7 @@
 #endif
 
 #include "mrg-internal.h" // XXX: eeek
+#include "mrg-pcm.h"
 
 struct _MrgClient
 {
@@ -78,6 +82,11 @@ struct _MrgClient
   int    premax_height;
 
   int    ref_count;
+
+  MrgResampler *resampler;  /* of its audio, used by the audio thread */
+  int           queued;     /* frames left queued after the last mix */
+  float         gain;       /* set from other threads than it */
+  int           mute;
 };
 
 const char *mrg_client_get_title (MrgClient *client)
@@ -89,6 +98,18 @@ const char *mrg_client_get_title (MrgClient *client)
 
 static pthread_mutex_t host_mutex;
 
+/* the clients the audio thread mixes; replaced rather than changed, while
+ * it might be reading them, holding a reference on each client
+ */
+typedef struct _MrgAudioClients MrgAudioClients;
+struct _MrgAudioClients
+{
+  MrgAudioClients *retired_next;
+  unsigned int     retired_epoch;
+  int              count;
+  MrgClient       *clients[];
+};
+
 struct _MrgHost
 {
   Mrg        *mrg;
@@ -96,6 +117,17 @@ struct _MrgHost
   MrgList    *clients;
   MrgClient  *focused;
 
+  MrgAudioClients *audio_clients; /* the current snapshot */
+  MrgAudioClients *audio_retired; /* freed once the audio thread is past */
+  int              audio_busy;    /* 1 while it mixes a snapshot */
+  unsigned int     audio_epoch;   /* snapshots it is done mixing */
+  int              audio_wake;    /* eventfd, written when clients change */
+  int              audio_period;  /* of _mrg_pcm_period_open */
+  int              audio_idle;    /* 1 while waiting for clients to queue */
+  int              audio_quit;
+  pthread_t        audio_tid;
+  int              idle_id;       /* of host_idle_check */
+
   int default_width;
   int default_height;
 };
@@ -119,6 +151,8 @@ static void mrg_client_unref (void *ignored, void *ignored2, MrgClient *client)
       mmm_destroy (client->mmm);
       client->mmm = NULL;
     }
+    if (client->resampler)
+      _mrg_resampler_free (client->resampler);
     unlink (tmp);
     free (client);
   }
@@ -339,6 +373,7 @@ static MrgClient *validate_client (MrgHost *host, const char *client_name)
     MrgClient *client = calloc (sizeof (MrgClient), 1);
 
     char tmp[512];
+    client->gain = 1.0f;
     sprintf (tmp, "%s/%s", host->fbdir, client_name);
     client->host = host;
     client->mmm = mmm_host_open (tmp);
@@ -382,6 +417,7 @@ void mrg_host_add_client_mrg (MrgHost *host,
                               float    y)
 {
   MrgClient *client = calloc (sizeof (MrgClient), 1);
+  client->gain = 1.0f;
   client->mmm = NULL;
   client->pid = -1;
   client->int_x = x;
@@ -394,6 +430,72 @@ void mrg_host_add_client_mrg (MrgHost *host,
   pthread_mutex_unlock (&host_mutex);
 }
 
+/* with host_mutex held; a snapshot retired while the audio thread was idle
+ * is not seen by it, one retired while busy is done with when it finished
+ * that iteration
+ */
+static void reclaim_audio_clients (MrgHost *host)
+{
+  MrgAudioClients **iter = &host->audio_retired;
+  int busy = __atomic_load_n (&host->audio_busy, __ATOMIC_SEQ_CST);
+  unsigned int epoch = __atomic_load_n (&host->audio_epoch, __ATOMIC_SEQ_CST);
+
+  while (*iter)
+  {
+    MrgAudioClients *snapshot = *iter;
+    if (!busy || snapshot->retired_epoch != epoch)
+    {
+      int i;
+      *iter = snapshot->retired_next;
+      for (i = 0; i < snapshot->count; i++)
+        mrg_client_unref (NULL, NULL, snapshot->clients[i]);
+      free (snapshot);
+    }
+    else
+      iter = &snapshot->retired_next;
+  }
+}
+
+static void wake_audio (MrgHost *host)
+{
+  uint64_t one = 1;
+  if (host->audio_wake >= 0 &&
+      write (host->audio_wake, &one, sizeof (one)) < 0 && errno != EAGAIN)
+    fprintf (stderr, "mrg host failed waking audio\n");
+}
+
+/* with host_mutex held, after host->clients changed */
+static void publish_audio_clients (MrgHost *host)
+{
+  MrgAudioClients *snapshot, *old;
+  MrgList *l;
+  int count = 0;
+
+  for (l = host->clients; l; l = l->next)
+    if (!((MrgClient*)l->data)->mrg)
+      count++;
+  snapshot = calloc (sizeof (MrgAudioClients) + count * sizeof (MrgClient*), 1);
+  for (l = host->clients; l; l = l->next)
+  {
+    MrgClient *client = l->data;
+    if (!client->mrg)
+    {
+      mrg_client_ref (client);
+      snapshot->clients[snapshot->count++] = client;
+    }
+  }
+
+  old = __atomic_exchange_n (&host->audio_clients, snapshot, __ATOMIC_SEQ_CST);
+  if (old)
+  {
+    old->retired_epoch = __atomic_load_n (&host->audio_epoch, __ATOMIC_SEQ_CST);
+    old->retired_next = host->audio_retired;
+    host->audio_retired = old;
+  }
+  wake_audio (host);
+  reclaim_audio_clients (host);
+}
+
 static int pid_is_alive (long pid)
 {
   if (pid == -1)
@@ -405,6 +507,7 @@ MrgClient *mrg_host_monitor_dir (MrgHost *host)
 {
   MrgClient *new_client = NULL;
   MrgList *l;
+  int changed = 0;
   pthread_mutex_lock (&host_mutex);
 again:
   for (l = host->clients; l; l = l->next)
@@ -416,6 +519,7 @@ again:
       mrg_client_unref (NULL, NULL, client);
       mrg_queue_draw (host->mrg, NULL);
       mrg_list_remove (&host->clients, client);
+      changed = 1;
       goto again;
     }
   }
@@ -430,10 +534,21 @@ again:
     while ((ent = readdir (dir)))
     {
     if (ent->d_name[0]!='.')
-      new_client = validate_client (host, ent->d_name);
+    {
+      MrgClient *client = validate_client (host, ent->d_name);
+      if (client)
+      {
+        new_client = client;
+        changed = 1;
+      }
+    }
     }
     closedir (dir);
   }
+  if (changed)
+    publish_audio_clients (host);
+  else
+    reclaim_audio_clients (host);
   pthread_mutex_unlock (&host_mutex);
   return new_client;
 }
@@ -443,110 +558,137 @@ MrgList *mrg_host_clients (MrgHost *host)
   return host->clients;
 }
 
-int mrg_host_audio_iteration (MrgHost *host)
+void mrg_client_set_gain (MrgClient *client, float gain)
 {
-   MrgList *l;
+  __atomic_store (&client->gain, &gain, __ATOMIC_RELAXED);
+}
+
+float mrg_client_get_gain (MrgClient *client)
+{
+  float gain;
+  __atomic_load (&client->gain, &gain, __ATOMIC_RELAXED);
+  return gain;
+}
+
+void mrg_client_set_mute (MrgClient *client, int mute)
+{
+  __atomic_store_n (&client->mute, mute, __ATOMIC_RELAXED);
+}
+
+int mrg_client_get_mute (MrgClient *client)
+{
+  return __atomic_load_n (&client->mute, __ATOMIC_RELAXED);
+}
+
+#define MRG_HOST_MIX_FRAMES 1000 /* at most, mrg_pcm_get_frame_chunk */
+
+/* the clients are mixed in stereo float, each added with its gain, and
+ * brought to s16 through a soft limiter once, rather than wrapping around
+ * when loud clients add up; called from the audio thread only, which reads
+ * the published snapshot of clients without taking host_mutex. pending is
+ * set to the number of clients with frames left afterwards, or 1 when the
+ * output had no room.
+ */
+static int audio_iteration (MrgHost *host, int *pending)
+{
+   MrgAudioClients *clients;
+   int c;
    int frames = mrg_pcm_get_frame_chunk (host->mrg);
-   int16_t *data[8192 * 8]={0,};
+   float mix[MRG_HOST_MIX_FRAMES * 2];
+   int16_t data[MRG_HOST_MIX_FRAMES * 2];
    int got_data = 0;
+   int quality = mrg_pcm_get_resample (host->mrg);
 
+   *pending = frames <= 0;
    if (frames <= 0)
      return 0;
+   if (frames > MRG_HOST_MIX_FRAMES)
+     frames = MRG_HOST_MIX_FRAMES;
+   memset (mix, 0, frames * 2 * sizeof (float));
 
-   for (int i = 0; i < frames * 2; i++)
-     data[i] = 0;
-
-   pthread_mutex_lock (&host_mutex);
-   for (l = host->clients; l; l = l->next)
+   __atomic_store_n (&host->audio_busy, 1, __ATOMIC_SEQ_CST);
+   clients = __atomic_load_n (&host->audio_clients, __ATOMIC_SEQ_CST);
+   for (c = 0; clients && c < clients->count; c++)
    {
-     MrgClient *client = l->data;
-     if (!client->mrg)
+     MrgClient *client = clients->clients[c];
+     MmmPCM client_format = mmm_pcm_get_format (client->mmm);
+     int cbpf = mmm_pcm_bytes_per_frame (client_format);
+     int right = mmm_pcm_channels (client_format) > 1;
+     int needed;
+     int queued;
+
+     if (client->resampler &&
+         _mrg_resampler_quality (client->resampler) != quality)
+     {
+       _mrg_resampler_free (client->resampler);
+       client->resampler = NULL;
+     }
+     if (!client->resampler)
+       client->resampler = _mrg_resampler_new (quality);
+     _mrg_resampler_set_rates (client->resampler,
+                               mmm_pcm_get_sample_rate (client->mmm),
+                               mrg_pcm_get_sample_rate (host->mrg));
+
+     /* mixed once enough is queued for all the frames, or padded with
+      * silence when fewer were queued and no more came since the last mix,
+      * as at the end of a stream
+      */
+     needed = _mrg_resampler_needed (client->resampler, frames);
+     queued = mmm_pcm_get_queued_frames (client->mmm);
+     if (queued >= needed || (queued > 0 && queued == client->queued))
      {
-        float factor = mmm_pcm_get_sample_rate (client->mmm) * 1.0 /
-                       mrg_pcm_get_sample_rate (host->mrg);
-        int read = 0;
-        int16_t *dst = (void*) data;
-        int remaining = frames;
-        int requested;
-
-        MmmPCM client_format = mmm_pcm_get_format (client->mmm);
-        MmmPCM host_format = mrg_pcm_get_format (host->mrg);
-
-        int cbpf = mmm_pcm_bytes_per_frame (client_format);
-        int cchannels = mmm_pcm_channels (client_format);
-        int cbps = cbpf / cchannels;
-
-        int hbpf = mmm_pcm_bytes_per_frame (host_format);
-        int hchannels = mmm_pcm_channels (host_format);
-        int hbps = hbpf / hchannels;
-
-        int cfloat = 0;
-
-        if (client_format == MMM_f32 ||
-          client_format == MMM_f32S)
-        cfloat = 1;
-
-        if (mmm_pcm_get_queued_frames (client->mmm) >= frames)
-          do {
-            requested = remaining;
-            {
-              int request = remaining * factor;
-              {
-                uint8_t tempbuf[request * 8];
-
-                read = mmm_pcm_read (client->mmm, (void*)tempbuf, request);
-
-                if (read)
-                {
-                  uint8_t *tdst = (void*)dst;
-
-                  if (cfloat)
-                  {
-                    int i;
-                    for (i = 0; i < read / factor; i ++)
-                    {
-                      int j;
-                      for (j = 0; j < hchannels; j ++)
-                      {
-                        int cchan = j >= cchannels ? cchannels-1 : j; // mono to stereo
-                        float val = *(float*)(&tempbuf[((int)(i * factor)) * cbpf + cchan * cbps]);
-                        int16_t ival = val * (1<<15);
-                        *(int16_t*)(&tdst[i * hbpf + j * hbps]) += ival;
-                      }
-                    }
-                  }
-                  else
-                  {
-                    int i;
-                    for (i = 0; i < read / factor; i ++)
-                    {
-                      int j;
-                      for (j = 0; j < hchannels; j ++)
-                      {
-                        int cchan = j >= cchannels ? cchannels-1 : j; // mono to stereo, FIXME: stereo to mono just gets first channel not a mix
-                        int16_t ival = *(int16_t*)(&tempbuf[((int)(i * factor)) * cbpf + cchan * cbps]);
-                        *(int16_t*)(&tdst[i * hbpf + j * hbps]) += ival;
-
-                      }
-                    }
-                  }
-
-                  remaining -= read / factor;
-                  got_data++;
-                }
-              }
-            }
-          } while ((read == requested) && remaining > 0);
+       uint8_t tempbuf[needed * cbpf + 1];
+       float in[needed * 2 + 1];
+       float out[frames * 2];
+       int read = needed ? mmm_pcm_read (client->mmm, (void*)tempbuf,
+                                         queued < needed ? queued : needed) : 0;
+       int produced;
+       int i;
+
+       if (client_format == MMM_f32 || client_format == MMM_f32S)
+         for (i = 0; i < read; i++)
+         {
+           float *src = (float*)(tempbuf + i * cbpf);
+           in[i * 2 + 0] = src[0];
+           in[i * 2 + 1] = src[right];
+         }
+       else
+         for (i = 0; i < read; i++)
+         {
+           int16_t *src = (int16_t*)(tempbuf + i * cbpf);
+           in[i * 2 + 0] = src[0] * (1.0f / 32767.0f);
+           in[i * 2 + 1] = src[right] * (1.0f / 32767.0f);
+         }
+       if (read < 0)
+         read = 0;
+       memset (in + read * 2, 0, (needed - read) * 2 * sizeof (float));
+
+       produced = _mrg_resampler_process (client->resampler, in, needed,
+                                          NULL, out, frames);
+       if (!mrg_client_get_mute (client))
+         _mrg_pcm_mix (mix, out, mrg_client_get_gain (client), produced * 2);
+       got_data++;
      }
+     client->queued = mmm_pcm_get_queued_frames (client->mmm);
+     if (client->queued > 0)
+       (*pending)++;
    }
-   pthread_mutex_unlock (&host_mutex);
+   __atomic_add_fetch (&host->audio_epoch, 1, __ATOMIC_SEQ_CST);
+   __atomic_store_n (&host->audio_busy, 0, __ATOMIC_SEQ_CST);
    if (got_data)
    {
+     _mrg_pcm_limit (mix, data, frames * 2);
      mrg_pcm_queue (host->mrg, (void *)data, frames);
    }
    return got_data;
 }
 
+int mrg_host_audio_iteration (MrgHost *host)
+{
+  int pending;
+  return audio_iteration (host, &pending);
+}
+
 static void mrg_client_press (MrgEvent *event, void *client_, void *host_)
 {
   MrgHost *host = host_;
@@ -727,11 +869,15 @@ static void init_env (MrgHost *host, const char *path)
 
 static void reapclients(void);
 
+static void audio_thread_quit (MrgHost *host);
+
 void mrg_host_destroy (MrgHost *host)
 {
+  mrg_remove_idle (host->mrg, host->idle_id);
   mrg_host_monitor_dir (host);
   reapclients();
   mrg_host_monitor_dir (host);
+  audio_thread_quit (host);
   free (host);
 }
 
@@ -747,6 +893,15 @@ static int host_idle_check (Mrg *mrg, void *data)
     MrgClient *client = l->data;
 
     int x, y, width, height;
+
+    /* clients queuing audio do not signal, the idle audio thread is woken
+     * from here
+     */
+    if (client->mmm && !client->mrg &&
+        __atomic_load_n (&host->audio_idle, __ATOMIC_SEQ_CST) &&
+        mmm_pcm_get_queued_frames (client->mmm) > 0)
+      wake_audio (host);
+
     if (client->pid != -1)
     {
       if (client->mmm)
@@ -764,18 +919,78 @@ static int host_idle_check (Mrg *mrg, void *data)
   return 1;
 }
 
+#define MRG_HOST_AUDIO_WAIT_MS 20 /* before playback, about a period */
+
+/* while clients have audio queued, or the output has frames left to play,
+ * mixes each time the output took a period, waking at least every
+ * MRG_HOST_AUDIO_WAIT_MS for when playback has not started. Otherwise the
+ * period ticks are stopped and it sleeps until woken by host_idle_check,
+ * a change of clients or mrg_host_destroy.
+ */
 static void *audio_thread (MrgHost *host)
 {
-  //int c;
-  for (;;) {
-    if (mrg_host_audio_iteration (host))
-      usleep (400);
-    else
-      usleep (5000);
+  struct pollfd fds[2];
+  uint64_t count;
+  int armed = 0;
+  int i;
+
+  fds[0].fd = host->audio_period;
+  fds[0].events = POLLIN;
+  fds[1].fd = host->audio_wake;
+  fds[1].events = POLLIN;
+
+  while (!__atomic_load_n (&host->audio_quit, __ATOMIC_SEQ_CST))
+  {
+    int pending;
+    int active = audio_iteration (host, &pending) || pending ||
+                 mrg_pcm_get_queued (host->mrg) > 0;
+
+    if (active != armed)
+    {
+      _mrg_pcm_period_arm (host->mrg, host->audio_period, active);
+      armed = active;
+    }
+    __atomic_store_n (&host->audio_idle, !active, __ATOMIC_SEQ_CST);
+    /* without a wake fd, it has to keep looking */
+    if (poll (fds, 2,
+              active || fds[1].fd < 0 ? MRG_HOST_AUDIO_WAIT_MS : -1) > 0)
+      for (i = 0; i < 2; i++)
+        if ((fds[i].revents & POLLIN) &&
+            read (fds[i].fd, &count, sizeof (count)) < 0 &&
+            errno != EAGAIN && errno != EINTR)
+          fds[i].fd = -1;
+    __atomic_store_n (&host->audio_idle, 0, __ATOMIC_SEQ_CST);
   }
+  if (armed)
+    _mrg_pcm_period_arm (host->mrg, host->audio_period, 0);
   return NULL;
 }
 
+/* stops the audio thread, and releases what only it used */
+static void audio_thread_quit (MrgHost *host)
+{
+  MrgAudioClients *clients;
+
+  __atomic_store_n (&host->audio_quit, 1, __ATOMIC_SEQ_CST);
+  wake_audio (host);
+  pthread_join (host->audio_tid, NULL);
+
+  _mrg_pcm_period_close (host->mrg, host->audio_period);
+  if (host->audio_wake >= 0)
+    close (host->audio_wake);
+
+  pthread_mutex_lock (&host_mutex);
+  clients = host->audio_clients;
+  host->audio_clients = NULL;
+  if (clients)
+  {
+    clients->retired_next = host->audio_retired;
+    host->audio_retired = clients;
+  }
+  reclaim_audio_clients (host);
+  pthread_mutex_unlock (&host_mutex);
+}
+
 static MrgHost *mrg__host = NULL;
 static void reapclients(void)
 {
@@ -789,7 +1004,6 @@ static void reapclients(void)
 MrgHost *mrg_host_new (Mrg *mrg, const char *path)
 {
   MrgHost *host = calloc (sizeof (MrgHost), 1);
-  pthread_t tid;
   pthread_mutex_init(&host_mutex, NULL);
   if (!path)
     path = "/tmp/mrg";
@@ -799,10 +1013,12 @@ MrgHost *mrg_host_new (Mrg *mrg, const char *path)
     }
   init_env (host, path);
   host->mrg = mrg;
+  host->audio_wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  host->audio_period = _mrg_pcm_period_open (mrg);
 
-  mrg_add_idle (mrg, host_idle_check, host);
+  host->idle_id = mrg_add_idle (mrg, host_idle_check, host);
 
-  pthread_create (&tid, NULL,(void*)audio_thread, host);
+  pthread_create (&host->audio_tid, NULL,(void*)audio_thread, host);
   mrg__host = host;
   return host;
 }
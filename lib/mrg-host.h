@@ -38,6 +38,14 @@ void       mrg_client_get_size       (MrgClient *client, int *width, int *height
 void       mrg_client_set_size       (MrgClient *client, int width,  int height);
 const char *mrg_client_get_title     (MrgClient *client);
 
+/* the gain of the audio of a client when mixed, 1.0 by default, and
+ * whether it is muted; a muted client's audio is still consumed
+ */
+void       mrg_client_set_gain       (MrgClient *client, float gain);
+float      mrg_client_get_gain       (MrgClient *client);
+void       mrg_client_set_mute       (MrgClient *client, int mute);
+int        mrg_client_get_mute       (MrgClient *client);
+
 void        mrg_client_send_message  (MrgClient *client, const char *message);
 const char *mrg_client_get_message   (MrgClient *client);
 int         mrg_client_has_message   (MrgClient *client);
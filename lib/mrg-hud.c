@@ -0,0 +1,222 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* performance heads up display, drawn by _mrg_debug_overlays on top of
+ * the frame after the ui callback has run. It is drawn with plain cairo
+ * rather than mrg_print, so that it does not add to the layout, style and
+ * listener numbers it is showing. Toggled with F12 or shown from the start
+ * with MRG_HUD set.
+ */
+
+#include "mrg-internal.h"
+
+#define MRG_HUD_SAMPLES     120
+#define MRG_HUD_WIDTH       (MRG_HUD_SAMPLES * 2 + 12)
+#define MRG_HUD_LINE        12
+#define MRG_HUD_GRAPH       48
+#define MRG_HUD_GRAPH_MS    33.3   /* frame time at the top of the graph */
+#define MRG_HUD_BUDGET_MS   16.7   /* frames slower than this are red */
+#define MRG_HUD_HEIGHT      (MRG_HUD_GRAPH + MRG_HUD_LINE * (MRG_PHASE_COUNT + 6) + 12)
+
+struct _MrgHud {
+  float        frame_ms[MRG_HUD_SAMPLES];
+  int          sample;       /* next slot in frame_ms to write */
+  int          owns_profile; /* frame stats collection was enabled by us */
+  MrgRectangle dirty;        /* the dirty rectangle before the hud area was
+                                added to it */
+};
+
+static int hud_show (Mrg *mrg, int shown)
+{
+  if (shown && !mrg->hud)
+  {
+    mrg->hud = calloc (sizeof (MrgHud), 1);
+    if (!mrg_get_collect_frame_stats (mrg))
+    {
+      mrg_set_collect_frame_stats (mrg, 1);
+      mrg->hud->owns_profile = 1;
+    }
+    return 1;
+  }
+  else if (!shown && mrg->hud)
+  {
+    if (mrg->hud->owns_profile)
+      mrg_set_collect_frame_stats (mrg, 0);
+    free (mrg->hud);
+    mrg->hud = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+void mrg_set_hud (Mrg *mrg, int shown)
+{
+  if (hud_show (mrg, shown))
+    mrg_queue_draw (mrg, NULL);
+}
+
+int mrg_get_hud (Mrg *mrg)
+{
+  return mrg->hud != NULL;
+}
+
+static void hud_toggle (MrgEvent *event, void *data1, void *data2)
+{
+  mrg_set_hud (event->mrg, !mrg_get_hud (event->mrg));
+  mrg_event_stop_propagate (event);
+}
+
+static void hud_rectangle (Mrg *mrg, MrgRectangle *rect)
+{
+  rect->x = mrg_width (mrg) - MRG_HUD_WIDTH - 8;
+  rect->y = 8;
+  rect->width = MRG_HUD_WIDTH;
+  rect->height = MRG_HUD_HEIGHT;
+}
+
+/* called from _mrg_init, before the backend is ready for queued draws */
+void _mrg_hud_init (Mrg *mrg)
+{
+  if (getenv ("MRG_HUD"))
+    hud_show (mrg, 1);
+}
+
+/* called from mrg_prepare after bindings have been cleared and before the
+ * clip is set up; the hud area is repainted with every frame that is drawn,
+ * without causing any frames of its own.
+ */
+void _mrg_hud_prepare (Mrg *mrg)
+{
+  MrgRectangle rect;
+
+  mrg_add_binding (mrg, "F12", NULL, "toggle performance HUD",
+                   hud_toggle, NULL);
+  if (!mrg->hud)
+    return;
+
+  mrg->hud->dirty = mrg->dirty;
+  hud_rectangle (mrg, &rect);
+  _mrg_rectangle_combine_bounds (&mrg->dirty, &rect);
+}
+
+void _mrg_hud_frame (Mrg *mrg)
+{
+  MrgHud *hud = mrg->hud;
+  hud->frame_ms[hud->sample] = mrg->frame_stats.frame_ms;
+  hud->sample = (hud->sample + 1) % MRG_HUD_SAMPLES;
+}
+
+static void hud_text (cairo_t *cr, float x, float y, const char *format, ...)
+{
+  char buf[128];
+  va_list ap;
+  va_start (ap, format);
+  vsnprintf (buf, sizeof (buf), format, ap);
+  va_end (ap);
+  cairo_move_to (cr, x, y);
+  cairo_show_text (cr, buf);
+}
+
+void _mrg_hud_draw (Mrg *mrg)
+{
+  const MrgFrameStats *stats = mrg_get_frame_stats (mrg);
+  MrgHud  *hud = mrg->hud;
+  cairo_t *cr = mrg_cr (mrg);
+  MrgRectangle rect;
+  float x, y;
+  float phase_total = 0.0;
+  int i;
+
+  hud_rectangle (mrg, &rect);
+  cairo_save (cr);
+
+  /* the dirty rectangle as queued by the application */
+  cairo_set_line_width (cr, 1);
+  cairo_set_source_rgba (cr, 1, 0, 1, 0.8);
+  cairo_rectangle (cr, hud->dirty.x + 0.5, hud->dirty.y + 0.5,
+                   hud->dirty.width - 1, hud->dirty.height - 1);
+  cairo_stroke (cr);
+
+  cairo_set_source_rgba (cr, 0, 0, 0, 0.75);
+  cairo_rectangle (cr, rect.x, rect.y, rect.width, rect.height);
+  cairo_fill (cr);
+
+  x = rect.x + 6;
+  y = rect.y + 6;
+
+  /* frame time history, oldest to the left */
+  cairo_set_source_rgba (cr, 1, 1, 1, 0.3);
+  cairo_rectangle (cr, x, y + MRG_HUD_GRAPH * (1.0 - MRG_HUD_BUDGET_MS / MRG_HUD_GRAPH_MS),
+                   MRG_HUD_SAMPLES * 2, 1);
+  cairo_fill (cr);
+  for (i = 0; i < MRG_HUD_SAMPLES; i++)
+  {
+    float ms = hud->frame_ms[(hud->sample + i) % MRG_HUD_SAMPLES];
+    float h = MRG_HUD_GRAPH * ms / MRG_HUD_GRAPH_MS;
+    if (h > MRG_HUD_GRAPH)
+      h = MRG_HUD_GRAPH;
+    if (ms > MRG_HUD_BUDGET_MS)
+      cairo_set_source_rgba (cr, 1, 0.2, 0.2, 0.9);
+    else
+      cairo_set_source_rgba (cr, 0.3, 1, 0.3, 0.9);
+    cairo_rectangle (cr, x + i * 2, y + MRG_HUD_GRAPH - h, 2, h);
+    cairo_fill (cr);
+  }
+  y += MRG_HUD_GRAPH + MRG_HUD_LINE;
+
+  cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL,
+                          CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size (cr, 10);
+  cairo_set_source_rgb (cr, 1, 1, 1);
+
+  hud_text (cr, x, y, "frame %i  %.2fms", stats->frame_no, stats->frame_ms);
+  y += MRG_HUD_LINE;
+
+  /* exclusive phase times, with a bar relative to the frame time */
+  for (i = 0; i < MRG_PHASE_COUNT; i++)
+    phase_total += stats->phase_ms[i];
+  for (i = 0; i < MRG_PHASE_COUNT; i++)
+  {
+    float frac = stats->frame_ms > 0.0 ? stats->phase_ms[i] / stats->frame_ms : 0.0;
+    if (frac > 1.0)
+      frac = 1.0;
+    cairo_set_source_rgba (cr, 0.4, 0.6, 1.0, 0.6);
+    cairo_rectangle (cr, x + 150, y - 8, (rect.width - 162) * frac, 8);
+    cairo_fill (cr);
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    hud_text (cr, x, y, "%-9s %7.2fms %5i", mrg_phase_name (i),
+              stats->phase_ms[i], stats->phase_calls[i]);
+    y += MRG_HUD_LINE;
+  }
+  hud_text (cr, x, y, "%-9s %7.2fms", "other",
+            stats->frame_ms > phase_total ? stats->frame_ms - phase_total : 0.0);
+  y += MRG_HUD_LINE;
+
+  hud_text (cr, x, y, "items %i  listeners %i", stats->items, stats->listeners);
+  y += MRG_HUD_LINE;
+  hud_text (cr, x, y, "image cache %.1fMB in %i", stats->image_cache_bytes / (1024.0 * 1024.0),
+            stats->image_cache_images);
+  y += MRG_HUD_LINE;
+  hud_text (cr, x, y, "  hits %li misses %li evicted %li",
+            stats->image_cache_hits, stats->image_cache_misses,
+            stats->image_cache_evictions);
+  y += MRG_HUD_LINE;
+  hud_text (cr, x, y, "dirty %ix%i+%i+%i", hud->dirty.width, hud->dirty.height,
+            hud->dirty.x, hud->dirty.y);
+
+  cairo_restore (cr);
+}
@@ -15,177 +15,337 @@
  * License along with this library. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
+#include <sys/stat.h>
 #include "mrg-internal.h"
+#include "mrg-pixels.h"
+#include "mrg-hash.h"
 #define  STB_IMAGE_IMPLEMENTATION
+/* the failure reason is a global, written by concurrent decodes */
+#define  STBI_NO_FAILURE_STRINGS
 #include "stb_image.h"
 
+typedef struct MrgImageDecode MrgImageDecode;
+
+#define MRG_IMAGE_LEVELS  12
+
+/* an image is kept at the sizes it is drawn at, level n being the full
+ * resolution downscaled n times by half. Smaller levels are made as they
+ * are needed, and for images decoded from files the larger levels no
+ * longer drawn are dropped, to be decoded again when drawn large again.
+ */
 struct _MrgImage
 {
   char *path;
-  cairo_surface_t *surface;
+  int   width;
+  int   height;              /* of the full resolution, 0 when not known */
+  cairo_surface_t *levels[MRG_IMAGE_LEVELS]; /* all NULL while decoding,
+                                                or when that failed */
+  int   level_frame_no[MRG_IMAGE_LEVELS];    /* last frame drawing it */
+  int   from_file;           /* path is a file it can be decoded from */
+  long long file_mtime;      /* in ns, and */
+  long      file_size;       /* of the file, when it has disk cache entries */
+  MrgImageDecode *decode;    /* while queued or decoding */
+
+  unsigned int hash;
+  long         bytes;
+  int          frame_no;  /* last frame drawing it, pinned while current */
+  MrgImage    *hash_next; /* in the bucket chain */
+  MrgImage    *newer;     /* in the least recently used order */
+  MrgImage    *older;
 };
 
-static int compute_size (int w, int h)
+static long compute_size (MrgImage *image)
 {
-  return w * h * 4 + sizeof (MrgImage) + 1024;
+  long size = sizeof (MrgImage) + 1024;
+  int i;
+
+  for (i = 0; i < MRG_IMAGE_LEVELS; i++)
+    if (image->levels[i])
+      size += cairo_image_surface_get_stride (image->levels[i]) *
+              (long)cairo_image_surface_get_height (image->levels[i]);
+  return size;
 }
 
-static long image_cache_size = 0;
-static int image_cache_max_size_mb = 384;
+static int has_levels (MrgImage *image)
+{
+  int i;
+  for (i = 0; i < MRG_IMAGE_LEVELS; i++)
+    if (image->levels[i])
+      return 1;
+  return 0;
+}
 
-static MrgList *image_cache = NULL;
+#define MRG_IMAGE_CACHE_BUCKETS  64 /* initial, doubled as images are added */
+#define MRG_IMAGE_DECODE_THREADS 2
+#define MRG_IMAGE_DECODE_EXPIRE  8  /* frames a queued decode is kept without
+                                       its image being drawn */
+#define MRG_IMAGE_EID_MEMO       256 /* buffers with a remembered eid, must
+                                       be 256 as indexed by 8 bits of hash */
+#define MRG_IMAGE_DISK_CACHE_MAX_PIXELS (2048 * 2048) /* largest level stored */
 
-static void free_image (void *data, void *foo)
+/* an image decoded by the decode threads, in async mode */
+struct MrgImageDecode
 {
-  MrgImage *image = data;
-  free (image->path);
-  cairo_surface_destroy (image->surface);
-  free (data);
-}
+  MrgImage        *image;    /* NULL once forgotten, only used by the ui */
+  char            *path;     /* decoded from the file, or */
+  char            *contents; /* from a copy of the encoded data */
+  long             length;
+  cairo_surface_t *surface;  /* the result */
+  MrgImageDecode  *next;
+};
 
+/* the eid of an immutable buffer passed without one */
+typedef struct MrgImageEid
+{
+  const char *data;
+  int         length;
+  char        eid[40];
+} MrgImageEid;
 
-void forget_image (MrgImage *image)
+/* every instance keeps its own decoded images, so instances on different
+ * threads do not share cache state. Images are found through a hash table
+ * keyed on path or eid, and kept in least recently used order for eviction.
+ */
+struct _MrgImageCache
 {
-  int w, h;
-  w = cairo_image_surface_get_width (image->surface);
-  h = cairo_image_surface_get_height (image->surface);
-  mrg_list_remove (&image_cache, image);
-  image_cache_size -= compute_size (w, h);
-}
+  MrgImage   **buckets;
+  int          n_buckets;
+  int          count;
+  MrgImage    *newest;
+  MrgImage    *oldest;
+  long         size;
+  int          max_size_mb;
+
+  long         hits;
+  long         misses;
+  long         evictions;
+
+  int              async;
+  int              decode_threads;
+  pthread_t       *decoders;  /* started by the first async decode */
+  pthread_mutex_t  decode_mutex;
+  pthread_cond_t   decode_cond;
+  int              decode_quit;
+  MrgImageDecode  *queued;    /* oldest first */
+  MrgImageDecode  *queued_last;
+  MrgImageDecode  *decoded;
+
+  int              disk_cache_mb;
+  MrgDiskCache    *disk_cache; /* opened on first use */
+
+  int              immutable;
+  MrgImageEid     *eids;       /* direct mapped on address and length */
+};
 
-static void trim_cache (void)
+static MrgImageCache *image_cache (Mrg *mrg)
 {
-  while (image_cache_size > image_cache_max_size_mb * 1024 * 1024)
+  if (!mrg->image_cache)
   {
-    MrgImage *image;
-    int item = mrg_list_length (image_cache);
-    item = random() % item;
-    image = mrg_list_nth (image_cache, item)->data;
-    forget_image (image);
+    mrg->image_cache = calloc (sizeof (MrgImageCache), 1);
+    mrg->image_cache->max_size_mb = 384;
+    mrg->image_cache->n_buckets = MRG_IMAGE_CACHE_BUCKETS;
+    mrg->image_cache->buckets = calloc (sizeof (MrgImage*),
+                                        MRG_IMAGE_CACHE_BUCKETS);
+    mrg->image_cache->decode_threads = MRG_IMAGE_DECODE_THREADS;
+    if (getenv ("MRG_IMAGE_ASYNC"))
+      mrg->image_cache->async = atoi (getenv ("MRG_IMAGE_ASYNC"));
+    if (getenv ("MRG_IMAGE_THREADS"))
+      mrg->image_cache->decode_threads = atoi (getenv ("MRG_IMAGE_THREADS"));
+    if (mrg->image_cache->decode_threads < 1)
+      mrg->image_cache->decode_threads = 1;
+    if (getenv ("MRG_IMAGE_DISK_CACHE_MB"))
+      mrg->image_cache->disk_cache_mb = atoi (getenv ("MRG_IMAGE_DISK_CACHE_MB"));
   }
+  return mrg->image_cache;
 }
 
-void mrg_set_image_cache_mb (Mrg *mrg, int new_max_size)
+static MrgDiskCache *disk_cache (MrgImageCache *cache)
 {
-  image_cache_max_size_mb = new_max_size;
-  trim_cache ();
+  if (!cache->disk_cache && cache->disk_cache_mb > 0)
+    cache->disk_cache = _mrg_disk_cache_new (cache->disk_cache_mb * 1024L * 1024L);
+  return cache->disk_cache;
 }
 
-int mrg_get_image_cache_mb (Mrg *mrg)
+static void free_image (MrgImage *image)
 {
-  return image_cache_max_size_mb;
-}
+  int i;
 
-#include "mrg-sha256.h"
+  free (image->path);
+  for (i = 0; i < MRG_IMAGE_LEVELS; i++)
+    if (image->levels[i])
+      cairo_surface_destroy (image->levels[i]);
+  free (image);
+}
 
-/* transcribes a binary digest to ascii
- */
-static void
-bin2hex (const unsigned char *bin,
-         char                *ascii,
-         int                  hash_length)
-{
-  int c;
-  char *hex="0123456789abcdef";
-  for (c=0; c<hash_length; c++)
-   {
-     ascii[c*2+0]=hex[bin[c]/16];
-     ascii[c*2+1]=hex[bin[c]%16];
-   }
-  ascii[hash_length*2]=0;
-}
-
-// creates an exclusive id, by hashing the data, the result
-// in eid should be able to hold at least 100 chars
-static void data_to_eid (const char *data,
-                         int         length,
-                         char       *eid)
+static void lru_unlink (MrgImageCache *cache, MrgImage *image)
 {
-  unsigned char hash[32];
-  SHA256_CTX ctx;
-  sha256_init (&ctx);
-  sha256_update (&ctx, (void*)data, length);
-  sha256_final (&ctx, hash);
-  bin2hex (hash, eid, 32);
+  if (image->newer)
+    image->newer->older = image->older;
+  else
+    cache->newest = image->older;
+  if (image->older)
+    image->older->newer = image->newer;
+  else
+    cache->oldest = image->newer;
+  image->newer = image->older = NULL;
 }
 
-MrgImage *mrg_query_image_memory (Mrg *mrg,
-                                  const char *contents,
-                                  int         length,
-                                  const char *eid,
-                                  int        *width,
-                                  int        *height)
+static void lru_push (MrgImageCache *cache, MrgImage *image)
 {
-  int w, h, comp;
-  char temp[96]="";
-  if (eid == NULL)
-    {
-      data_to_eid (contents, length, temp);
-      eid = &temp[0];
-    }
+  image->older = cache->newest;
+  image->newer = NULL;
+  if (cache->newest)
+    cache->newest->newer = image;
+  else
+    cache->oldest = image;
+  cache->newest = image;
+}
 
-  for (MrgList *l = image_cache; l; l = l->next)
+/* marks image as drawn in the current frame, and most recently used */
+static void touch_image (Mrg *mrg, MrgImageCache *cache, MrgImage *image)
+{
+  image->frame_no = mrg->frame_stats.frame_no;
+  if (cache->newest != image)
   {
-    MrgImage *image = l->data;
-    if (!strcmp (image->path, eid))
-    {
-      if (width)
-        *width = cairo_image_surface_get_width (image->surface);
-      if (height)
-        *height = cairo_image_surface_get_height (image->surface);
-      return image;
-    }
+    lru_unlink (cache, image);
+    lru_push (cache, image);
   }
+}
 
-  unsigned char *data = stbi_load_from_memory ((void*)contents, length, &w, &h, &comp, 4);
-  if (data)
+static MrgImage *lookup_image (MrgImageCache *cache, const char *key)
+{
+  unsigned int hash = _mrg_fnv1a_string (key);
+  MrgImage *image;
+
+  for (image = cache->buckets[hash & (cache->n_buckets - 1)];
+       image; image = image->hash_next)
+    if (image->hash == hash && !strcmp (image->path, key))
+      return image;
+  return NULL;
+}
+
+static void grow_buckets (MrgImageCache *cache)
+{
+  int n_buckets = cache->n_buckets * 2;
+  MrgImage **buckets = calloc (sizeof (MrgImage*), n_buckets);
+  int i;
+
+  for (i = 0; i < cache->n_buckets; i++)
   {
-    MrgImage *image = malloc (sizeof (MrgImage));
-    image->surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, w, h);
-    image->path = strdup (eid);
+    MrgImage *image = cache->buckets[i];
+    while (image)
     {
-      int i;
-      char *src = (void*) data;
-      char *dst = (void*)cairo_image_surface_get_data (image->surface);
-      /* XXX: this depends on endianness of platform */
-      for (i = 0; i < w * h; i++)
-      {
-        dst[i*4 + 0] = src[i*4 + 2];
-        dst[i*4 + 1] = src[i*4 + 1];
-        dst[i*4 + 2] = src[i*4 + 0];
-        dst[i*4 + 3] = src[i*4 + 3];
-      }
+      MrgImage *next = image->hash_next;
+      image->hash_next = buckets[image->hash & (n_buckets - 1)];
+      buckets[image->hash & (n_buckets - 1)] = image;
+      image = next;
     }
-    mrg_list_prepend_full (&image_cache, image,
-                           (void*)free_image, NULL);
-    free (data);
+  }
+  free (cache->buckets);
+  cache->buckets = buckets;
+  cache->n_buckets = n_buckets;
+}
 
-    image_cache_size +=
-        compute_size (w, h);
+static void forget_image (MrgImageCache *cache, MrgImage *image)
+{
+  MrgImage **link = &cache->buckets[image->hash & (cache->n_buckets - 1)];
 
-    return mrg_query_image (mrg, eid, width, height);
-  }
-  return NULL;
+  /* the decode is dropped, or its result discarded, later */
+  if (image->decode)
+    image->decode->image = NULL;
+  while (*link != image)
+    link = &(*link)->hash_next;
+  *link = image->hash_next;
+  lru_unlink (cache, image);
+  cache->count --;
+  cache->size -= image->bytes;
+  free_image (image);
 }
 
-void mrg_forget_image (Mrg *mrg,
-                       const char *path)
+/* evicts the least recently used images until within the budget, images
+ * drawn in the current frame are kept even when that exceeds it
+ */
+static void trim_cache (Mrg *mrg, MrgImageCache *cache)
 {
-  MrgList *l;
+  MrgImage *image = cache->oldest;
 
-  if (!path)
-    return;
-  for (l = image_cache; l; l = l->next)
+  while (image && cache->size > cache->max_size_mb * 1024L * 1024L)
   {
-    MrgImage *image = l->data;
-    if (!strcmp (image->path, path))
+    MrgImage *newer = image->newer;
+    if (image->frame_no != mrg->frame_stats.frame_no)
     {
-      forget_image (image);
-      return;
+      forget_image (cache, image);
+      cache->evictions ++;
     }
+    image = newer;
   }
 }
 
+static void update_size (MrgImageCache *cache, MrgImage *image)
+{
+  cache->size -= image->bytes;
+  image->bytes = compute_size (image);
+  cache->size += image->bytes;
+}
+
+/* sets the full resolution level */
+static void set_surface (Mrg *mrg, MrgImageCache *cache, MrgImage *image,
+                         cairo_surface_t *surface)
+{
+  if (image->levels[0])
+    cairo_surface_destroy (image->levels[0]);
+  image->levels[0] = surface;
+  image->level_frame_no[0] = mrg->frame_stats.frame_no;
+  image->width = cairo_image_surface_get_width (surface);
+  image->height = cairo_image_surface_get_height (surface);
+  update_size (cache, image);
+}
+
+/* adds an image without surface, for key */
+static MrgImage *insert_image (Mrg *mrg, MrgImageCache *cache,
+                               const char *key)
+{
+  MrgImage *image = calloc (sizeof (MrgImage), 1);
+  int bucket;
+
+  image->path = strdup (key);
+  image->hash = _mrg_fnv1a_string (key);
+
+  if (cache->count >= cache->n_buckets)
+    grow_buckets (cache);
+  bucket = image->hash & (cache->n_buckets - 1);
+  image->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = image;
+  cache->count ++;
+  lru_push (cache, image);
+  touch_image (mrg, cache, image);
+  return image;
+}
+
+/* takes ownership of surface, and returns the added image */
+static MrgImage *add_image (Mrg *mrg, MrgImageCache *cache,
+                            const char *key, cairo_surface_t *surface)
+{
+  MrgImage *image = insert_image (mrg, cache, key);
+
+  set_surface (mrg, cache, image, surface);
+  trim_cache (mrg, cache);
+  return image;
+}
+
+/* images still being decoded are only returned once their size is known */
+static MrgImage *found_image (MrgImage *image, int *width, int *height)
+{
+  if (!has_levels (image) && (image->width <= 0 || image->height <= 0))
+    return NULL;
+  if (width)
+    *width = image->width;
+  if (height)
+    *height = image->height;
+  return image;
+}
+
 static int suffix_is_png (const char *path)
 {
   int len;
@@ -206,67 +366,627 @@ static int suffix_is_png (const char *path)
   return 0;
 }
 
+/* decodes the file at path, or the encoded contents, and is called from
+ * the decode threads as well as the ui
+ */
+static cairo_surface_t *decode_surface (const char *path,
+                                        const char *contents,
+                                        long        length)
+{
+  cairo_surface_t *surface = NULL;
+  char *file_contents = NULL;
+  unsigned char *data;
+  int w, h, comp;
+
+  if (path && suffix_is_png (path))
+  {
+    /* use cairo and thus the full libpng for decoding PNG images
+     */
+    surface = cairo_image_surface_create_from_png (path);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS)
+    {
+      cairo_surface_destroy (surface);
+      return NULL;
+    }
+    return surface;
+  }
+
+  if (path) /* some other type of file, try stb image */
+  {
+    _mrg_file_get_contents (path, &file_contents, &length);
+    if (!file_contents)
+      return NULL;
+    contents = file_contents;
+  }
+
+  data = stbi_load_from_memory ((void*)contents, length, &w, &h, &comp, 4);
+  if (data)
+  {
+    /* images with an alpha channel are kept as ARGB32 unless opaque */
+    int alpha = comp == 2 || comp == 4;
+    int translucent = 0;
+    unsigned char *dst;
+    int stride, y;
+
+    surface = cairo_image_surface_create (alpha ? CAIRO_FORMAT_ARGB32 :
+                                                  CAIRO_FORMAT_RGB24, w, h);
+    dst = cairo_image_surface_get_data (surface);
+    stride = cairo_image_surface_get_stride (surface);
+    for (y = 0; y < h; y++)
+      translucent |= _mrg_rgba_to_cairo (data + y * w * 4,
+                                         (uint32_t*)(dst + y * stride), w);
+    cairo_surface_mark_dirty (surface);
+    free (data);
+
+    if (alpha && !translucent)
+    {
+      cairo_surface_t *opaque = cairo_image_surface_create (
+                                    CAIRO_FORMAT_RGB24, w, h);
+      memcpy (cairo_image_surface_get_data (opaque), dst, (size_t)stride * h);
+      cairo_surface_mark_dirty (opaque);
+      cairo_surface_destroy (surface);
+      surface = opaque;
+    }
+  }
+  free (file_contents);
+  return surface;
+}
+
+static void *image_decoder (void *data)
+{
+  MrgImageCache *cache = data;
+
+  while (1)
+  {
+    MrgImageDecode *decode;
+
+    pthread_mutex_lock (&cache->decode_mutex);
+    while (!cache->queued && !cache->decode_quit)
+      pthread_cond_wait (&cache->decode_cond, &cache->decode_mutex);
+    if (cache->decode_quit)
+    {
+      pthread_mutex_unlock (&cache->decode_mutex);
+      return NULL;
+    }
+    decode = cache->queued;
+    cache->queued = decode->next;
+    if (!cache->queued)
+      cache->queued_last = NULL;
+    pthread_mutex_unlock (&cache->decode_mutex);
+
+    decode->surface = decode_surface (decode->path, decode->contents,
+                                      decode->length);
+
+    pthread_mutex_lock (&cache->decode_mutex);
+    decode->next = cache->decoded;
+    cache->decoded = decode;
+    pthread_mutex_unlock (&cache->decode_mutex);
+  }
+  return NULL;
+}
+
+static void free_decode (MrgImageDecode *decode)
+{
+  if (decode->image)
+    decode->image->decode = NULL;
+  if (decode->surface)
+    cairo_surface_destroy (decode->surface);
+  free (decode->path);
+  free (decode->contents);
+  free (decode);
+}
+
+/* queues the decoding of the full resolution of image by the decode
+ * threads, from the file at path or a copy of contents; when not yet known
+ * its size is taken from the header when that can be read
+ */
+static MrgImage *queue_decode (Mrg *mrg, MrgImageCache *cache,
+                               MrgImage *image, const char *path,
+                               const char *contents, long length)
+{
+  MrgImageDecode *decode = calloc (sizeof (MrgImageDecode), 1);
+  int known = image->width > 0;
+  int comp;
+
+  if (path)
+  {
+    decode->path = strdup (path);
+    if (!known && !stbi_info (path, &image->width, &image->height, &comp))
+      image->width = image->height = 0;
+  }
+  else
+  {
+    decode->contents = malloc (length);
+    memcpy (decode->contents, contents, length);
+    decode->length = length;
+    if (!known && !stbi_info_from_memory ((void*)contents, length,
+                                          &image->width, &image->height,
+                                          &comp))
+      image->width = image->height = 0;
+  }
+  decode->image = image;
+  image->decode = decode;
+
+  if (!cache->decoders)
+  {
+    int i;
+    pthread_mutex_init (&cache->decode_mutex, NULL);
+    pthread_cond_init (&cache->decode_cond, NULL);
+    cache->decoders = calloc (sizeof (pthread_t), cache->decode_threads);
+    for (i = 0; i < cache->decode_threads; i++)
+      pthread_create (&cache->decoders[i], NULL, image_decoder, cache);
+  }
+
+  pthread_mutex_lock (&cache->decode_mutex);
+  if (cache->queued_last)
+    cache->queued_last->next = decode;
+  else
+    cache->queued = decode;
+  cache->queued_last = decode;
+  pthread_cond_signal (&cache->decode_cond);
+  pthread_mutex_unlock (&cache->decode_mutex);
+  return image;
+}
+
+/* called as a frame is begun, gives decoded images their surface and drops
+ * the queued decodes of images no longer drawn
+ */
+void _mrg_image_cache_prepare (Mrg *mrg)
+{
+  MrgImageCache *cache = mrg->image_cache;
+  MrgImageDecode *decoded, *expired = NULL, *last = NULL;
+  MrgImageDecode **link;
+
+  if (!cache || !cache->decoders)
+    return;
+
+  pthread_mutex_lock (&cache->decode_mutex);
+  decoded = cache->decoded;
+  cache->decoded = NULL;
+  for (link = &cache->queued; *link;)
+  {
+    MrgImageDecode *decode = *link;
+    if (!decode->image ||
+        mrg->frame_stats.frame_no - decode->image->frame_no >
+          MRG_IMAGE_DECODE_EXPIRE)
+    {
+      *link = decode->next;
+      decode->next = expired;
+      expired = decode;
+    }
+    else
+    {
+      last = decode;
+      link = &decode->next;
+    }
+  }
+  cache->queued_last = last;
+  pthread_mutex_unlock (&cache->decode_mutex);
+
+  while (expired)
+  {
+    MrgImageDecode *next = expired->next;
+    /* forgotten, to be queued again when drawn again */
+    if (expired->image && !has_levels (expired->image))
+      forget_image (cache, expired->image);
+    free_decode (expired);
+    expired = next;
+  }
+
+  while (decoded)
+  {
+    MrgImageDecode *next = decoded->next;
+    MrgImage *image = decoded->image;
+    if (image)
+    {
+      if (decoded->surface)
+        set_surface (mrg, cache, image, decoded->surface);
+      else if (!has_levels (image))
+        image->width = image->height = 0; /* failed, until forgotten */
+      decoded->surface = NULL;
+    }
+    free_decode (decoded);
+    decoded = next;
+  }
+  trim_cache (mrg, cache);
+}
+
+/* queues a redraw when decodes have finished since the frame was begun */
+void _mrg_image_cache_poll (Mrg *mrg)
+{
+  MrgImageCache *cache = mrg->image_cache;
+  int decoded;
+
+  if (!cache || !cache->decoders)
+    return;
+  pthread_mutex_lock (&cache->decode_mutex);
+  decoded = cache->decoded != NULL;
+  pthread_mutex_unlock (&cache->decode_mutex);
+  if (decoded)
+    mrg_queue_draw (mrg, NULL);
+}
+
+void mrg_set_image_decode_async (Mrg *mrg, int async)
+{
+  image_cache (mrg)->async = async;
+}
+
+int mrg_get_image_decode_async (Mrg *mrg)
+{
+  return image_cache (mrg)->async;
+}
+
+void mrg_set_image_disk_cache_mb (Mrg *mrg, int max_size)
+{
+  MrgImageCache *cache = image_cache (mrg);
+
+  cache->disk_cache_mb = max_size;
+  if (cache->disk_cache)
+  {
+    /* opened again with the new budget when next used */
+    _mrg_disk_cache_free (cache->disk_cache);
+    cache->disk_cache = NULL;
+  }
+}
+
+int mrg_get_image_disk_cache_mb (Mrg *mrg)
+{
+  return image_cache (mrg)->disk_cache_mb;
+}
+
+void mrg_set_image_cache_mb (Mrg *mrg, int new_max_size)
+{
+  image_cache (mrg)->max_size_mb = new_max_size;
+  trim_cache (mrg, image_cache (mrg));
+}
+
+int mrg_get_image_cache_mb (Mrg *mrg)
+{
+  return image_cache (mrg)->max_size_mb;
+}
+
+void _mrg_image_cache_stats (Mrg *mrg, MrgFrameStats *stats)
+{
+  MrgImageCache *cache = mrg->image_cache;
+
+  stats->image_cache_bytes     = cache ? cache->size : 0;
+  stats->image_cache_images    = cache ? cache->count : 0;
+  stats->image_cache_hits      = cache ? cache->hits : 0;
+  stats->image_cache_misses    = cache ? cache->misses : 0;
+  stats->image_cache_evictions = cache ? cache->evictions : 0;
+}
+
+void _mrg_image_cache_free (Mrg *mrg)
+{
+  MrgImageCache *cache = mrg->image_cache;
+
+  if (!cache)
+    return;
+  if (cache->decoders)
+  {
+    int i;
+    pthread_mutex_lock (&cache->decode_mutex);
+    cache->decode_quit = 1;
+    pthread_cond_broadcast (&cache->decode_cond);
+    pthread_mutex_unlock (&cache->decode_mutex);
+    for (i = 0; i < cache->decode_threads; i++)
+      pthread_join (cache->decoders[i], NULL);
+    free (cache->decoders);
+    while (cache->queued)
+    {
+      MrgImageDecode *next = cache->queued->next;
+      free_decode (cache->queued);
+      cache->queued = next;
+    }
+    while (cache->decoded)
+    {
+      MrgImageDecode *next = cache->decoded->next;
+      free_decode (cache->decoded);
+      cache->decoded = next;
+    }
+    pthread_mutex_destroy (&cache->decode_mutex);
+    pthread_cond_destroy (&cache->decode_cond);
+  }
+  if (cache->disk_cache)
+    _mrg_disk_cache_free (cache->disk_cache);
+  while (mrg->image_cache->newest)
+    forget_image (mrg->image_cache, mrg->image_cache->newest);
+  free (mrg->image_cache->buckets);
+  free (mrg->image_cache->eids);
+  free (mrg->image_cache);
+  mrg->image_cache = NULL;
+}
+
+/* creates an exclusive id, by hashing the data, the result in eid should
+ * be able to hold at least 33 chars
+ */
+static void data_to_eid (const char *data,
+                         int         length,
+                         char       *eid)
+{
+  uint64_t hash[2];
+  _mrg_hash128 (data, length, 0, hash);
+  sprintf (eid, "%016llx%016llx",
+           (unsigned long long)hash[0], (unsigned long long)hash[1]);
+}
+
+/* the id of contents, remembered by address and length of the buffer when
+ * buffers are immutable, rather than hashing it on every lookup
+ */
+static const char *contents_to_eid (MrgImageCache *cache,
+                                    const char    *contents,
+                                    int            length,
+                                    char          *temp)
+{
+  MrgImageEid *memo;
+
+  if (!cache->immutable)
+  {
+    data_to_eid (contents, length, temp);
+    return temp;
+  }
+  if (!cache->eids)
+    cache->eids = calloc (sizeof (MrgImageEid), MRG_IMAGE_EID_MEMO);
+  memo = &cache->eids[((uint64_t)((uintptr_t)contents ^ length) *
+                       0x9e3779b97f4a7c15ull) >> 56];
+  if (memo->data != contents || memo->length != length)
+  {
+    data_to_eid (contents, length, memo->eid);
+    memo->data = contents;
+    memo->length = length;
+  }
+  return memo->eid;
+}
+
+void mrg_set_image_memory_immutable (Mrg *mrg, int immutable)
+{
+  MrgImageCache *cache = image_cache (mrg);
+
+  cache->immutable = immutable;
+  if (!immutable)
+  {
+    free (cache->eids);
+    cache->eids = NULL;
+  }
+}
+
+int mrg_get_image_memory_immutable (Mrg *mrg)
+{
+  return image_cache (mrg)->immutable;
+}
+
+MrgImage *mrg_query_image_memory (Mrg *mrg,
+                                  const char *contents,
+                                  int         length,
+                                  const char *eid,
+                                  int        *width,
+                                  int        *height)
+{
+  MrgImageCache *cache = image_cache (mrg);
+  MrgImage *image;
+  char temp[40];
+
+  if (eid == NULL)
+    eid = contents_to_eid (cache, contents, length, temp);
+
+  image = lookup_image (cache, eid);
+  if (image)
+  {
+    cache->hits ++;
+    touch_image (mrg, cache, image);
+    return found_image (image, width, height);
+  }
+
+  cache->misses ++;
+  if (cache->async)
+    return found_image (queue_decode (mrg, cache, insert_image (mrg, cache, eid),
+                                      NULL, contents, length),
+                        width, height);
+  {
+    cairo_surface_t *surface = decode_surface (NULL, contents, length);
+    if (surface)
+      return found_image (add_image (mrg, cache, eid, surface), width, height);
+  }
+  return NULL;
+}
+
+void mrg_forget_image (Mrg *mrg,
+                       const char *path)
+{
+  MrgImage *image;
+
+  if (!path || !mrg->image_cache)
+    return;
+  image = lookup_image (mrg->image_cache, path);
+  if (image)
+    forget_image (mrg->image_cache, image);
+}
+
 MrgImage *mrg_query_image (Mrg        *mrg,
                            const char *path,
                            int        *width,
                            int        *height)
 {
-  MrgList *l;
+  MrgImageCache *cache = image_cache (mrg);
+  MrgImage *image;
 
   if (!path)
     return NULL;
-  for (l = image_cache; l; l = l->next)
+  image = lookup_image (cache, path);
+  if (image)
+  {
+    cache->hits ++;
+    touch_image (mrg, cache, image);
+    return found_image (image, width, height);
+  }
+  cache->misses ++;
+  if (disk_cache (cache))
   {
-    MrgImage *image = l->data;
-    if (!strcmp (image->path, path))
+    /* with a disk cache only the header is read, the file is decoded when
+     * drawn at a size not found on disk */
+    struct stat st;
+    int w, h, comp;
+    if (stat (path, &st) == 0 && st.st_size > 0 &&
+        stbi_info (path, &w, &h, &comp))
     {
-      if (width)
-        *width = cairo_image_surface_get_width (image->surface);
-      if (height)
-        *height = cairo_image_surface_get_height (image->surface);
-      return image;
+      image = insert_image (mrg, cache, path);
+      image->from_file = 1;
+      image->width = w;
+      image->height = h;
+      image->file_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+      image->file_size = st.st_size;
+      update_size (cache, image);
+      trim_cache (mrg, cache);
+      return found_image (image, width, height);
     }
   }
-  trim_cache ();
+  if (cache->async)
   {
-#if 1
-    if (suffix_is_png (path))
+    image = insert_image (mrg, cache, path);
+    image->from_file = 1;
+    return found_image (queue_decode (mrg, cache, image, path, NULL, 0),
+                        width, height);
+  }
+  {
+    /* non-png files are cached by path, rather than by a digest of their
+     * contents, to not read the file again on every lookup */
+    cairo_surface_t *surface = decode_surface (path, NULL, 0);
+    if (surface)
     {
-      /* use cairo and thus the full libpng for decoding PNG images
-       */
-      cairo_surface_t *surface = cairo_image_surface_create_from_png (path);
-      if (surface)
-      {
-        int w = cairo_image_surface_get_width (surface);
-        int h = cairo_image_surface_get_height (surface);
-        MrgImage *image = malloc (sizeof (MrgImage));
-        image->path = strdup (path);
-        image->surface = surface;
-        mrg_list_prepend_full (&image_cache, image, (void*)free_image, NULL);
+      image = add_image (mrg, cache, path, surface);
+      image->from_file = 1;
+      return found_image (image, width, height);
+    }
+  }
+  return NULL;
+}
 
-        image_cache_size += compute_size (w, h);
+/* a 2x2 box filter, halving the size of src */
+static cairo_surface_t *downscale (cairo_surface_t *src)
+{
+  int sw = cairo_image_surface_get_width (src);
+  int sh = cairo_image_surface_get_height (src);
+  int sstride = cairo_image_surface_get_stride (src);
+  int w = sw > 1 ? sw / 2 : 1;
+  int h = sh > 1 ? sh / 2 : 1;
+  cairo_surface_t *dst = cairo_image_surface_create (
+                             cairo_image_surface_get_format (src), w, h);
+  int dstride = cairo_image_surface_get_stride (dst);
+  unsigned char *sdata, *ddata;
+  int x, y, c;
 
-        return mrg_query_image (mrg, path, width, height);
+  cairo_surface_flush (src);
+  sdata = cairo_image_surface_get_data (src);
+  ddata = cairo_image_surface_get_data (dst);
+  for (y = 0; y < h; y++)
+  {
+    const unsigned char *row0 = sdata + (y * 2) * sstride;
+    const unsigned char *row1 = sdata + (y * 2 + 1 < sh ? y * 2 + 1 : y * 2) * sstride;
+    unsigned char *out = ddata + y * dstride;
+    for (x = 0; x < w; x++)
+    {
+      int x0 = x * 2 * 4;
+      int x1 = (x * 2 + 1 < sw ? x * 2 + 1 : x * 2) * 4;
+      for (c = 0; c < 4; c++)
+        out[x * 4 + c] = (row0[x0 + c] + row0[x1 + c] +
+                          row1[x0 + c] + row1[x1 + c] + 2) / 4;
+    }
+  }
+  cairo_surface_mark_dirty (dst);
+  return dst;
+}
+
+/* the level for drawing at a device size of dw x dh, the smallest at
+ * least that large, made when missing. Returns NULL while the image is
+ * still being decoded.
+ */
+static cairo_surface_t *image_level (Mrg *mrg, MrgImage *image,
+                                     double dw, double dh)
+{
+  MrgImageCache *cache = mrg->image_cache;
+  int level = 0;
+  int i;
+
+  while (level + 1 < MRG_IMAGE_LEVELS &&
+         (image->width >> (level + 1)) >= dw &&
+         (image->height >> (level + 1)) >= dh &&
+         (image->width >> (level + 1)) > 0 &&
+         (image->height >> (level + 1)) > 0)
+    level ++;
+
+  if (!image->levels[level])
+  {
+    int made;
+
+    for (i = level - 1; i >= 0 && !image->levels[i]; i--);
+    if (i < 0 && level > 0 && image->file_size && cache->disk_cache)
+    {
+      image->levels[level] = _mrg_disk_cache_load (cache->disk_cache,
+          image->path, image->file_mtime, image->file_size,
+          image->width >> level, image->height >> level);
+      if (image->levels[level])
+        i = level;
+    }
+    if (i < 0 && image->from_file)
+    {
+      /* the larger levels were dropped, decode the full resolution again */
+      if (cache->async)
+      {
+        if (!image->decode)
+          queue_decode (mrg, cache, image, image->path, NULL, 0);
+      }
+      else
+      {
+        cairo_surface_t *surface = decode_surface (image->path, NULL, 0);
+        if (surface)
+        {
+          set_surface (mrg, cache, image, surface);
+          i = 0;
+        }
+        else if (!has_levels (image))
+          image->from_file = 0; /* failed, not tried again until forgotten */
       }
     }
-    else /* some other type of file, try stb image */
-#endif
+    if (i < 0)
     {
-      char *contents = NULL;
-      long length;
-      _mrg_file_get_contents (path, &contents, &length);
+      /* meanwhile, draw a smaller level scaled up */
+      for (i = level + 1; i < MRG_IMAGE_LEVELS && !image->levels[i]; i++);
+      if (i >= MRG_IMAGE_LEVELS)
+        return NULL;
+      image->level_frame_no[i] = mrg->frame_stats.frame_no;
+      return image->levels[i];
+    }
+    made = i < level;
+    for (i = i + 1; i <= level; i++)
+      image->levels[i] = downscale (image->levels[i - 1]);
+    update_size (cache, image);
+    trim_cache (mrg, cache);
+
+    if (made && level > 0 && image->file_size && cache->disk_cache &&
+        (image->width >> level) * (long)(image->height >> level) <=
+          MRG_IMAGE_DISK_CACHE_MAX_PIXELS)
+      _mrg_disk_cache_store (cache->disk_cache, image->path,
+                             image->file_mtime, image->file_size,
+                             image->levels[level]);
+  }
+  image->level_frame_no[level] = mrg->frame_stats.frame_no;
 
-      if (contents)
+  /* larger levels not drawn in this or the previous frame are dropped */
+  if (image->from_file && level > 0)
+  {
+    int dropped = 0;
+    for (i = 0; i < level; i++)
+      if (image->levels[i] &&
+          mrg->frame_stats.frame_no - image->level_frame_no[i] > 1)
       {
-         MrgImage *image = mrg_query_image_memory (mrg,
-                                                   contents, length, NULL,
-                                                   width, height);
-         free (contents);
-         return image;
+        cairo_surface_destroy (image->levels[i]);
+        image->levels[i] = NULL;
+        dropped = 1;
       }
-    }
+    if (dropped)
+      update_size (cache, image);
   }
-  return NULL;
+  return image->levels[level];
 }
 
 static void _mrg_image (Mrg *mrg,
@@ -277,7 +997,6 @@ static void _mrg_image (Mrg *mrg,
 {
   cairo_t *cr = mrg_cr (mrg);
   cairo_surface_t *surface = NULL;
-  surface = image->surface;
 
   if (width == -1 && height == -1)
   {
@@ -295,14 +1014,26 @@ static void _mrg_image (Mrg *mrg,
   if (used_height)
     *used_height = height;
 
+  /* the size in device space, to pick the level to draw */
+  {
+    double wx = width, wy = 0, hx = 0, hy = height;
+    cairo_user_to_device_distance (cr, &wx, &wy);
+    cairo_user_to_device_distance (cr, &hx, &hy);
+    surface = image_level (mrg, image, sqrt (wx * wx + wy * wy),
+                                       sqrt (hx * hx + hy * hy));
+  }
+  if (!surface) /* still being decoded */
+    return;
+
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   cairo_save (cr);
 
   cairo_rectangle (cr, x0, y0, width, height);
   cairo_clip (cr);
   cairo_translate (cr, x0, y0);
   cairo_scale (cr,
-      width / orig_width,
-      height / orig_height);
+      width / cairo_image_surface_get_width (surface),
+      height / cairo_image_surface_get_height (surface));
 
   cairo_set_source_surface (cr, surface, 0, 0);
   if (opacity >= 1.0f)
@@ -310,6 +1041,7 @@ static void _mrg_image (Mrg *mrg,
   else
     cairo_paint_with_alpha (cr, opacity);
   cairo_restore (cr);
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 }
 
 void mrg_image (Mrg *mrg, float x0, float y0, float width, float height, float opacity, const char *path, int *used_width, int *used_height)
@@ -345,5 +1077,9 @@ void mrg_image_memory (Mrg *mrg, float x0, float y0, float width, float height,
 
 cairo_surface_t *mrg_image_get_surface (MrgImage *image)
 {
-  return image->surface;
+  int i;
+  for (i = 0; i < MRG_IMAGE_LEVELS; i++)
+    if (image->levels[i])
+      return image->levels[i];
+  return NULL;
 }
@@ -50,7 +50,17 @@ struct _MrgStyleNode
 };
 
 typedef struct _MrgHtml      MrgHtml;
+typedef struct _MrgRecord    MrgRecord;
+typedef struct _MrgProfile   MrgProfile;
+typedef struct _MrgHud       MrgHud;
+typedef struct _MrgRetained  MrgRetained;
+typedef struct _MrgRaster    MrgRaster;
+typedef struct _MrgImageCache MrgImageCache;
+typedef struct _MrgDiskCache MrgDiskCache;
 typedef struct _MrgHtmlState MrgHtmlState;
+typedef struct _MrgXmlParser MrgXmlParser;
+typedef struct _MrgXmlIndex  MrgXmlIndex;
+typedef struct _MrgXmlShapes MrgXmlShapes;
 
 /* minimal utility class to keep track of callbacks that have been
  * interspersed with drawing, possibly containing conditional calls.
@@ -87,15 +97,74 @@ typedef struct MrgItem {
   float          y1;
 
   cairo_path_t   *path;
-  double          path_hash;
+  uint64_t        path_hash;
+
+  /* identity used for recycling the item in the following frame; the
+   * id_ptr of the element it was registered in, or the first callback
+   * and its data when there is none.
+   */
+  void           *id_ptr;
+  MrgCb           id_cb;
+  void           *id_data1;
+  void           *id_data2;
+  struct MrgItem *hash_next;
 
   MrgType   types; /* all cb's ored together */
   MrgItemCb cb[MRG_MAX_CBS];
   int       cb_count;
 
   int       ref_count;
+  int       focus_no; /* index in focus tab-order, -1 when not focusable */
 } MrgItem;
 
+/* the finalizer of listener data, with its arguments */
+typedef struct MrgClosure {
+  void (*finalize)(void *listen_data, void *listen_data2, void *finalize_data);
+  void  *data1;
+  void  *data2;
+  void  *finalize_data;
+} MrgClosure;
+
+/* chained hash table of items keyed on path_hash, linked through
+ * MrgItem.hash_next; one holds the items of the frame being built, the
+ * other the items of the previous frame until they are either recycled or
+ * dropped.
+ */
+typedef struct MrgItemTable {
+  MrgItem **buckets;
+  int       size;
+  int       count;
+} MrgItemTable;
+
+/* per frame index of focusable items, filled in as listeners are
+ * registered and queried by the keyboard focus commands; entries are kept
+ * in registration order which doubles as the tab-order, the grid used
+ * for directional lookups is built lazily on the first query of a frame.
+ */
+typedef struct MrgFocusEntry {
+  MrgItem *item;
+  float    x; /* center in device coordinates */
+  float    y;
+} MrgFocusEntry;
+
+typedef struct MrgFocusIndex {
+  MrgFocusEntry *entries;
+  int            count;
+  int            allocated;
+
+  int           *cell_start;    /* cols * rows + 1 offsets into cell_entries */
+  int           *cell_entries;
+  int            cells_allocated;
+  int            cell_entries_allocated;
+  int            cols;
+  int            rows;
+  float          x0;
+  float          y0;
+  float          cell_width;
+  float          cell_height;
+  int            built;
+} MrgFocusIndex;
+
 /*
  *   div { float:fixed; float-fixed-x: 0% width: 40%; padding-right: 2em; }
  */
@@ -144,6 +213,17 @@ void mrg_resized         (Mrg *mrg, int width, int height, long time);
 
 void _mrg_item_ref (MrgItem *mrg);
 void _mrg_item_unref (MrgItem *mrg);
+void _mrg_items_destroy (Mrg *mrg);
+void _mrg_clear_text_closures (Mrg *mrg);
+void _mrg_defer_finalize (Mrg *mrg,
+                          void (*finalize)(void *listen_data,
+                                           void *listen_data2,
+                                           void *finalize_data),
+                          void *data1, void *data2, void *finalize_data);
+
+void _mrg_focus_add   (Mrg *mrg, MrgItem *item, cairo_t *cr);
+void _mrg_focus_clear (Mrg *mrg);
+void _mrg_focus_free  (MrgFocusIndex *focus);
 
 /**
  * mrg_clear:
@@ -206,9 +286,99 @@ struct _MrgGeoCache
   int gen;
 };
 
-#define MRG_XML_MAX_ATTRIBUTES    32
-#define MRG_XML_MAX_ATTRIBUTE_LEN 32
-#define MRG_XML_MAX_VALUE_LEN     640
+/* atoms that the xml renderer looks for, a parsed document gives these
+ * names these numbers, other tag and attribute names get numbers from
+ * MRG_ATOM_COUNT on. Keep in sync with the names in mrg-xml-doc.c
+ */
+enum {
+  MRG_ATOM_NONE = 0,
+  MRG_ATOM_A,
+  MRG_ATOM_BR,
+  MRG_ATOM_CLASS,
+  MRG_ATOM_D,
+  MRG_ATOM_DD,
+  MRG_ATOM_DT,
+  MRG_ATOM_G,
+  MRG_ATOM_HEIGHT,
+  MRG_ATOM_HR,
+  MRG_ATOM_HREF,
+  MRG_ATOM_ID,
+  MRG_ATOM_IMG,
+  MRG_ATOM_INPUT,
+  MRG_ATOM_LI,
+  MRG_ATOM_LINK,
+  MRG_ATOM_META,
+  MRG_ATOM_P,
+  MRG_ATOM_PATH,
+  MRG_ATOM_POLYGON,
+  MRG_ATOM_RECT,
+  MRG_ATOM_REL,
+  MRG_ATOM_SRC,
+  MRG_ATOM_STYLE,
+  MRG_ATOM_TABLE,
+  MRG_ATOM_TD,
+  MRG_ATOM_TEXT,
+  MRG_ATOM_TR,
+  MRG_ATOM_TRANSFORM,
+  MRG_ATOM_WIDTH,
+  MRG_ATOM_X,
+  MRG_ATOM_Y,
+  MRG_ATOM_COUNT
+};
+
+typedef enum {
+  MRG_XML_NODE_ELEMENT, /* mrg_start_with_style, until the matching END */
+  MRG_XML_NODE_END,     /* mrg_end */
+  MRG_XML_NODE_WORD,    /* printed text */
+  MRG_XML_NODE_SPACE,   /* whitespace, collapsed according to white-space */
+  MRG_XML_NODE_PRINT,   /* resolved entity */
+  MRG_XML_NODE_ENTITY,  /* unknown entity, printed dimmed */
+  MRG_XML_NODE_STYLE    /* content of a style element */
+} MrgXmlNodeType;
+
+#define MRG_XML_NODE_LISTEN_DONE  (1<<0) /* END of an explicit </a> */
+#define MRG_XML_NODE_IS_WORD      (1<<1) /* STYLE that was a word, these end
+                                            a whitespace run like WORDs */
+
+/* the nodes of a document are stored in document order, an element is
+ * followed by its children and then its END node; an element thus spans
+ * the nodes up to and including nodes[end].
+ */
+typedef struct MrgXmlNode {
+  uint8_t  type;
+  uint8_t  flags;
+  uint16_t n_attrs;
+  uint32_t atom;   /* tag of elements and ENDs */
+  uint32_t pos;    /* offset in the source, the id_ptr of elements */
+  uint32_t text;   /* in strings; selector of elements, text of others */
+  uint32_t style;  /* in strings; css from style and presentation attributes */
+  uint32_t attrs;  /* index of the first attribute in attrs */
+  uint32_t end;    /* index of the END node of an element */
+} MrgXmlNode;
+
+typedef struct MrgXmlAttr {
+  uint32_t atom;
+  uint32_t value;  /* in strings */
+} MrgXmlAttr;
+
+struct _MrgXmlDoc {
+  MrgXmlNode *nodes;
+  int         n_nodes;
+  MrgXmlAttr *attrs;
+  int         n_attrs;
+  uint32_t   *atoms;   /* in strings, the name of each atom */
+  int         n_atoms;
+  char       *strings; /* all text of the document, 0 terminated; the
+                          string at offset 0 is empty */
+  int         strings_length;
+  int         sheets_end; /* the STYLE nodes and LINK elements are all
+                             before this node */
+
+  MrgXmlParser *parser; /* while the document is being streamed */
+  int           incremental;
+  MrgXmlIndex  *index;  /* where layout can resume, for incremental */
+  MrgXmlShapes *shapes; /* parsed svg paths and transforms */
+};
 
 struct _MrgHtmlState
 {
@@ -230,11 +400,6 @@ struct _MrgHtml
   MrgHtmlState *state;
   int state_no;
   MrgList *geo_cache;
-
-  char         attribute[MRG_XML_MAX_ATTRIBUTES][MRG_XML_MAX_ATTRIBUTE_LEN];
-  char  value[MRG_XML_MAX_ATTRIBUTES][MRG_XML_MAX_VALUE_LEN];
-
-  int   attributes;
 };
 
 #define MRG_MAX_DEVICES 16
@@ -286,6 +451,9 @@ struct _Mrg {
   MrgString     *style_global;
 
   MrgList       *items; 
+  MrgItemTable   item_table; /* items of this frame, by path */
+  MrgItemTable   item_pool;  /* items of the previous frame */
+  MrgFocusIndex  focus;
 
   //MrgItem       *grab;
 
@@ -376,6 +544,11 @@ struct _Mrg {
   int          text_listen_count;
   int          text_listen_active;
 
+  /* finalized along with the text closures, see _mrg_defer_finalize */
+  MrgClosure  *deferred;
+  int          deferred_count;
+  int          deferred_allocated;
+
   MrgList     *idles;
   int          idle_id;
 
@@ -387,6 +560,35 @@ struct _Mrg {
 
   int          printing;
   cairo_t     *printing_cr;
+
+  MrgRecord   *record; /* input event recording/replay, when active */
+
+  MrgProfile   *profile; /* phase timing, when collecting frame stats */
+  MrgFrameStats frame_stats;
+  int           listen_count;
+
+  long          frame_start;        /* in _mrg_ticks */
+  long          frame_end;
+  long          prev_frame_ticks;   /* duration of the previous frame */
+  long          prev_frame_present;
+  long          prev_idle_ticks;
+  float         target_fps;
+
+  MrgImageCache *image_cache; /* decoded images, created on first use */
+  int           hl_state;     /* of the C syntax highlighter */
+
+  MrgHud       *hud; /* performance overlay, when shown */
+
+  MrgRetained  *retained; /* recordings of mrg_start_cached subtrees */
+  int           retained_recording; /* nesting of those being recorded,
+                                       nothing is culled while recording */
+
+  MrgRaster    *raster; /* tile parallel rasterization, with
+                           MRG_RENDER_THREADS */
+  int           render_pipeline; /* MRG_RENDER_PIPELINE, frames are
+                                    painted while the next is built */
+  MrgList      *shown_items; /* with the pipeline, the items of the frame
+                                on screen, that events are matched with */
 };
 
 int _mrg_file_get_contents (const char  *path,
@@ -408,6 +610,8 @@ char *_mrg_http_post (const char *ip,
                       int         length,
                       int        *ret_length);
 MrgGeoCache *_mrg_get_cache (MrgHtml *ctx, void *id_ptr);
+void _mrg_xml_index_free (MrgXmlIndex *index);
+void _mrg_xml_shapes_free (MrgXmlShapes *shapes);
 
 void _mrg_border_left (Mrg *mrg, int x, int y, int width, int height);
 void _mrg_border_right (Mrg *mrg, int x, int y, int width, int height);
@@ -445,6 +649,69 @@ char *_mrg_resolve_uri (const char *base_uri, const char *uri);
 
 void _mrg_idle_iteration (Mrg *mrg);
 
+/* us since the first call */
+long _mrg_ticks (void);
+
+void _mrg_record_event (Mrg *mrg, MrgType type, float x, float y, int arg,
+                        uint32_t time, const char *string);
+void _mrg_record_flush (Mrg *mrg);
+int  _mrg_replay_size  (const char *path, int *width, int *height);
+
+void _mrg_profile_init  (Mrg *mrg);
+void _mrg_profile_begin (Mrg *mrg, MrgPhase phase);
+void _mrg_profile_end   (Mrg *mrg, MrgPhase phase);
+void _mrg_profile_frame (Mrg *mrg, long frame_start, long frame_end);
+
+void _mrg_hud_init      (Mrg *mrg);
+void _mrg_hud_prepare   (Mrg *mrg);
+void _mrg_hud_frame     (Mrg *mrg);
+void _mrg_hud_draw      (Mrg *mrg);
+
+void _mrg_retained_end     (Mrg *mrg);
+void _mrg_retained_frame   (Mrg *mrg);
+void _mrg_retained_destroy (Mrg *mrg);
+void _mrg_retained_box     (Mrg *mrg, float x, float y,
+                            float width, float height, int hover);
+
+void     _mrg_raster_init    (Mrg *mrg);
+cairo_t *_mrg_raster_cr      (Mrg *mrg);
+int      _mrg_raster_threads (Mrg *mrg);
+MrgFocusIndex *_mrg_raster_focus (Mrg *mrg);
+int      _mrg_raster_flush   (Mrg *mrg);
+void     _mrg_raster_present (Mrg *mrg);
+void     _mrg_raster_poll    (Mrg *mrg);
+void     _mrg_raster_destroy (Mrg *mrg);
+
+void _mrg_rectangle_combine_bounds (MrgRectangle       *rect_dest,
+                                    const MrgRectangle *rect_other);
+void _mrg_image_cache_stats   (Mrg *mrg, MrgFrameStats *stats);
+void _mrg_image_cache_prepare (Mrg *mrg);
+void _mrg_image_cache_poll    (Mrg *mrg);
+void _mrg_image_cache_free    (Mrg *mrg);
+
+MrgDiskCache    *_mrg_disk_cache_new   (long max_bytes);
+void             _mrg_disk_cache_free  (MrgDiskCache *cache);
+cairo_surface_t *_mrg_disk_cache_load  (MrgDiskCache *cache, const char *path,
+                                        long long mtime, long size,
+                                        int width, int height);
+void             _mrg_disk_cache_store (MrgDiskCache *cache, const char *path,
+                                        long long mtime, long size,
+                                        cairo_surface_t *surface);
+
+int  _mrg_pcm_period_open  (Mrg *mrg);
+void _mrg_pcm_period_arm   (Mrg *mrg, int fd, int armed);
+void _mrg_pcm_period_close (Mrg *mrg, int fd);
+
+#if MRG_PROFILE
+#define MRG_PROFILE_BEGIN(mrg, phase) \
+  do { if ((mrg)->profile) _mrg_profile_begin ((mrg), (phase)); } while (0)
+#define MRG_PROFILE_END(mrg, phase) \
+  do { if ((mrg)->profile) _mrg_profile_end ((mrg), (phase)); } while (0)
+#else
+#define MRG_PROFILE_BEGIN(mrg, phase) do {} while (0)
+#define MRG_PROFILE_END(mrg, phase)   do {} while (0)
+#endif
+
 void *mrg_mmm (Mrg *mrg);
 
 #if MRG_LOG
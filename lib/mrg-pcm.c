@@ -0,0 +1,617 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "mrg-pcm.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define MRG_PCM_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define MRG_PCM_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* the indices are published with release stores and read with acquire
+ * loads, so the frames written before an index is advanced are seen by
+ * the other side once it sees the index
+ */
+#define load_acquire(p)     __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+
+int _mrg_pcm_ring_init (MrgPcmRing *ring, int size)
+{
+  uint32_t pot = 1;
+
+  while (pot < (uint32_t)size)
+    pot *= 2;
+  memset (ring, 0, sizeof (MrgPcmRing));
+  ring->frames = malloc (pot * 2 * sizeof (int16_t));
+  if (!ring->frames)
+    return -1;
+  ring->size = pot;
+  return 0;
+}
+
+void _mrg_pcm_ring_fini (MrgPcmRing *ring)
+{
+  free (ring->frames);
+  ring->frames = NULL;
+}
+
+int _mrg_pcm_ring_queued (MrgPcmRing *ring)
+{
+  return load_acquire (&ring->write) - load_acquire (&ring->read);
+}
+
+int _mrg_pcm_ring_space (MrgPcmRing *ring)
+{
+  return ring->size - _mrg_pcm_ring_queued (ring);
+}
+
+/* copies count frames between the ring at index and frames, in at most two
+ * runs as the ring wraps
+ */
+static void copy_frames (MrgPcmRing *ring, uint32_t index,
+                         int16_t *frames, int count, int to_ring)
+{
+  uint32_t start = index & (ring->size - 1);
+  uint32_t first = ring->size - start;
+  int16_t *at = ring->frames + start * 2;
+
+  if (first > (uint32_t)count)
+    first = count;
+  if (to_ring)
+  {
+    memcpy (at, frames, first * 4);
+    memcpy (ring->frames, frames + first * 2, (count - first) * 4);
+  }
+  else
+  {
+    memcpy (frames, at, first * 4);
+    memcpy (frames + first * 2, ring->frames, (count - first) * 4);
+  }
+}
+
+int _mrg_pcm_ring_write (MrgPcmRing *ring, const int16_t *frames, int count)
+{
+  uint32_t write = ring->write;
+  uint32_t space = ring->size - (write - load_acquire (&ring->read));
+
+  if ((uint32_t)count > space)
+    count = space;
+  if (count <= 0)
+    return 0;
+  copy_frames (ring, write, (int16_t*)frames, count, 1);
+  store_release (&ring->write, write + count);
+  return count;
+}
+
+int _mrg_pcm_ring_read (MrgPcmRing *ring, int16_t *frames, int count)
+{
+  uint32_t read = ring->read;
+  uint32_t queued = load_acquire (&ring->write) - read;
+  int got = (uint32_t)count < queued ? count : (int)queued;
+
+  if (got > 0)
+  {
+    copy_frames (ring, read, frames, got, 0);
+    store_release (&ring->read, read + got);
+    ring->playing = 1;
+  }
+  if (got < count)
+  {
+    memset (frames + got * 2, 0, (count - got) * 4);
+    if (ring->playing)
+      __atomic_add_fetch (&ring->underruns, 1, __ATOMIC_RELAXED);
+    ring->playing = 0;
+  }
+  return got;
+}
+
+int _mrg_pcm_ring_underruns (MrgPcmRing *ring)
+{
+  return __atomic_load_n (&ring->underruns, __ATOMIC_RELAXED);
+}
+
+#define MRG_RESAMPLER_BUFFER  4096  /* input frames kept at most */
+#define MRG_RESAMPLER_BETA    8.0   /* of the kaiser window */
+#define MRG_RESAMPLER_CUTOFF  0.92  /* of the lower nyquist frequency */
+
+struct _MrgResampler
+{
+  int     quality;
+  int     taps;       /* 2 for linear */
+  double  step;       /* input frames per output frame */
+  double  position;   /* of the next output frame, in the buffer */
+  float  *table;      /* sinc phases, MRG_RESAMPLER_PHASES + 1 rows */
+  float  *buffer;     /* interleaved input frames, the filter history
+                         first */
+  int     buffered;
+  MrgResampleKernel kernel;
+};
+
+static void resample_kernel_c (const float *in, const float *row0,
+                               const float *row1, float frac, int taps,
+                               float *out)
+{
+  float left = 0.0f;
+  float right = 0.0f;
+  int i;
+
+  for (i = 0; i < taps * 2; i += 2)
+  {
+    float c = row0[i] + frac * (row1[i] - row0[i]);
+    left  += in[i] * c;
+    right += in[i + 1] * c;
+  }
+  out[0] = left;
+  out[1] = right;
+}
+
+#if MRG_PCM_X86
+static void resample_kernel_sse (const float *in, const float *row0,
+                                 const float *row1, float frac, int taps,
+                                 float *out)
+{
+  __m128 f = _mm_set1_ps (frac);
+  __m128 acc0 = _mm_setzero_ps ();
+  __m128 acc1 = _mm_setzero_ps ();
+  int i;
+
+  for (i = 0; i < taps * 2; i += 8)
+  {
+    __m128 a0 = _mm_loadu_ps (row0 + i);
+    __m128 a1 = _mm_loadu_ps (row0 + i + 4);
+    __m128 c0 = _mm_add_ps (a0, _mm_mul_ps (f, _mm_sub_ps (_mm_loadu_ps (row1 + i), a0)));
+    __m128 c1 = _mm_add_ps (a1, _mm_mul_ps (f, _mm_sub_ps (_mm_loadu_ps (row1 + i + 4), a1)));
+    acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (in + i), c0));
+    acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (in + i + 4), c1));
+  }
+  /* L R L R, summed to the first two lanes */
+  acc0 = _mm_add_ps (acc0, acc1);
+  acc0 = _mm_add_ps (acc0, _mm_movehl_ps (acc0, acc0));
+  out[0] = _mm_cvtss_f32 (acc0);
+  out[1] = _mm_cvtss_f32 (_mm_shuffle_ps (acc0, acc0, 1));
+}
+#endif
+
+#if MRG_PCM_NEON
+static void resample_kernel_neon (const float *in, const float *row0,
+                                  const float *row1, float frac, int taps,
+                                  float *out)
+{
+  float32x4_t acc0 = vdupq_n_f32 (0.0f);
+  float32x4_t acc1 = vdupq_n_f32 (0.0f);
+  float32x2_t sum;
+  int i;
+
+  for (i = 0; i < taps * 2; i += 8)
+  {
+    float32x4_t a0 = vld1q_f32 (row0 + i);
+    float32x4_t a1 = vld1q_f32 (row0 + i + 4);
+    float32x4_t c0 = vmlaq_n_f32 (a0, vsubq_f32 (vld1q_f32 (row1 + i), a0), frac);
+    float32x4_t c1 = vmlaq_n_f32 (a1, vsubq_f32 (vld1q_f32 (row1 + i + 4), a1), frac);
+    acc0 = vmlaq_f32 (acc0, vld1q_f32 (in + i), c0);
+    acc1 = vmlaq_f32 (acc1, vld1q_f32 (in + i + 4), c1);
+  }
+  acc0 = vaddq_f32 (acc0, acc1);
+  sum = vadd_f32 (vget_low_f32 (acc0), vget_high_f32 (acc0));
+  vst1_f32 (out, sum);
+}
+#endif
+
+int _mrg_resample_kernel_impls (const char        **names,
+                                MrgResampleKernel  *funcs,
+                                int                 max)
+{
+  int n = 0;
+#define ADD(name, func) \
+  if (n < max) { names[n] = name; funcs[n] = func; n++; }
+
+  ADD ("c", resample_kernel_c);
+#if MRG_PCM_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2"))
+    ADD ("sse", resample_kernel_sse);
+#endif
+#if MRG_PCM_NEON
+  ADD ("neon", resample_kernel_neon);
+#endif
+#undef ADD
+  return n;
+}
+
+static MrgResampleKernel resample_kernel = NULL;
+static pthread_once_t resample_kernel_once = PTHREAD_ONCE_INIT;
+
+static void choose_resample_kernel (void)
+{
+  const char        *names[4];
+  MrgResampleKernel  funcs[4];
+  int n = _mrg_resample_kernel_impls (names, funcs, 4);
+  resample_kernel = funcs[n - 1];
+}
+
+/* the zeroth order modified bessel function of the first kind */
+static double bessel_i0 (double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  int k;
+
+  for (k = 1; k < 50; k++)
+  {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12)
+      break;
+  }
+  return sum;
+}
+
+/* the phases of the filter, row p being the coefficients for an output
+ * frame p / MRG_RESAMPLER_PHASES of a frame past the center tap; each row
+ * is normalized for unity gain
+ */
+static void build_table (MrgResampler *resampler)
+{
+  int    half = resampler->taps / 2;
+  double cutoff = MRG_RESAMPLER_CUTOFF;
+  double i0_beta = bessel_i0 (MRG_RESAMPLER_BETA);
+  double row[MRG_RESAMPLER_TAPS];
+  int    p, k;
+
+  if (resampler->step > 1.0)
+    cutoff /= resampler->step;
+  else if (resampler->step == 1.0)
+    cutoff = 1.0; /* the phases at whole frames pass frames unchanged */
+  for (p = 0; p <= MRG_RESAMPLER_PHASES; p++)
+  {
+    float *out = resampler->table + p * resampler->taps * 2;
+    double frac = (double)p / MRG_RESAMPLER_PHASES;
+    double sum = 0.0;
+
+    for (k = 0; k < resampler->taps; k++)
+    {
+      double x = k - (half - 1) - frac;
+      double t = x / half;
+      double window = fabs (t) < 1.0 ?
+        bessel_i0 (MRG_RESAMPLER_BETA * sqrt (1.0 - t * t)) / i0_beta : 0.0;
+      double sinc = x == 0.0 ? 1.0 : sin (M_PI * cutoff * x) / (M_PI * cutoff * x);
+      row[k] = cutoff * sinc * window;
+      sum += row[k];
+    }
+    for (k = 0; k < resampler->taps; k++)
+      out[k * 2] = out[k * 2 + 1] = row[k] / sum;
+  }
+}
+
+MrgResampler *_mrg_resampler_new (int quality)
+{
+  MrgResampler *resampler = calloc (sizeof (MrgResampler), 1);
+
+  pthread_once (&resample_kernel_once, choose_resample_kernel);
+  resampler->quality = quality;
+  resampler->kernel = resample_kernel;
+  resampler->taps = quality == MRG_RESAMPLER_SINC ? MRG_RESAMPLER_TAPS : 2;
+  resampler->buffer = calloc (sizeof (float) * 2,
+                              MRG_RESAMPLER_BUFFER + resampler->taps);
+  if (quality == MRG_RESAMPLER_SINC)
+    resampler->table = malloc (sizeof (float) * 2 * resampler->taps *
+                               (MRG_RESAMPLER_PHASES + 1));
+  /* silence before the first frame, for the taps ahead of it */
+  resampler->buffered = resampler->taps / 2 - 1;
+  resampler->position = resampler->taps / 2 - 1;
+  _mrg_resampler_set_rates (resampler, 1.0, 1.0);
+  return resampler;
+}
+
+void _mrg_resampler_free (MrgResampler *resampler)
+{
+  free (resampler->table);
+  free (resampler->buffer);
+  free (resampler);
+}
+
+int _mrg_resampler_quality (MrgResampler *resampler)
+{
+  return resampler->quality;
+}
+
+void _mrg_resampler_set_kernel (MrgResampler *resampler,
+                                MrgResampleKernel kernel)
+{
+  resampler->kernel = kernel;
+}
+
+void _mrg_resampler_set_rates (MrgResampler *resampler,
+                               double in_rate, double out_rate)
+{
+  double step = in_rate / out_rate;
+  /* the cutoff is the same for all upsampling */
+  int rebuild = resampler->table &&
+                (resampler->step == 0.0 || step >= 1.0 ||
+                 resampler->step >= 1.0);
+
+  if (step == resampler->step)
+    return;
+  resampler->step = step;
+  if (rebuild)
+    build_table (resampler);
+}
+
+int _mrg_resampler_needed (MrgResampler *resampler, int out_frames)
+{
+  int half = resampler->taps / 2;
+  int last;
+
+  if (out_frames <= 0)
+    return 0;
+  last = (int)(resampler->position + (out_frames - 1) * resampler->step);
+  return last + half + 1 - resampler->buffered > 0 ?
+         last + half + 1 - resampler->buffered : 0;
+}
+
+int _mrg_resampler_process (MrgResampler *resampler,
+                            const float *in, int in_frames,
+                            int *consumed,
+                            float *out, int max_out)
+{
+  int    half = resampler->taps / 2;
+  int    stride = resampler->taps * 2;
+  int    capacity = MRG_RESAMPLER_BUFFER + resampler->taps;
+  float *buffer = resampler->buffer;
+  int    used = 0;
+  int    produced = 0;
+
+  for (;;)
+  {
+    int count = capacity - resampler->buffered;
+    int before = produced;
+    int drop;
+
+    /* only what is needed for the frames asked for is taken, the rest is
+     * left with the caller rather than delayed here */
+    if (count > in_frames - used)
+      count = in_frames - used;
+    if (count > _mrg_resampler_needed (resampler, max_out - produced))
+      count = _mrg_resampler_needed (resampler, max_out - produced);
+    memcpy (buffer + resampler->buffered * 2, in + used * 2,
+            count * 2 * sizeof (float));
+    resampler->buffered += count;
+    used += count;
+
+    while (produced < max_out)
+    {
+      int   i = (int)resampler->position;
+      float frac = resampler->position - i;
+      float *dst = out + produced * 2;
+
+      if (i + half >= resampler->buffered)
+        break;
+      if (resampler->table)
+      {
+        float phase = frac * MRG_RESAMPLER_PHASES;
+        int   p = (int)phase;
+        resampler->kernel (buffer + (i - half + 1) * 2,
+                           resampler->table + p * stride,
+                           resampler->table + (p + 1) * stride,
+                           phase - p, resampler->taps, dst);
+      }
+      else
+      {
+        const float *a = buffer + i * 2;
+        dst[0] = a[0] + frac * (a[2] - a[0]);
+        dst[1] = a[1] + frac * (a[3] - a[1]);
+      }
+      produced ++;
+      resampler->position += resampler->step;
+    }
+
+    /* frames before the first tap of the next output are no longer needed */
+    drop = (int)resampler->position - half + 1;
+    if (drop > resampler->buffered)
+      drop = resampler->buffered;
+    if (drop > 0)
+    {
+      memmove (buffer, buffer + drop * 2,
+               (resampler->buffered - drop) * 2 * sizeof (float));
+      resampler->buffered -= drop;
+      resampler->position -= drop;
+    }
+
+    if (used >= in_frames || produced >= max_out ||
+        (!count && produced == before))
+      break;
+  }
+  if (consumed)
+    *consumed = used;
+  return produced;
+}
+
+static void pcm_mix_c (float *acc, const float *src, float gain, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    acc[i] += src[i] * gain;
+}
+
+static inline float soft_limit (float x)
+{
+  const float knee = MRG_PCM_LIMIT_KNEE;
+  float a = fabsf (x);
+
+  if (a > knee)
+    a = 1.0f - (1.0f - knee) * (1.0f - knee) / (a - 2.0f * knee + 1.0f);
+  return x < 0.0f ? -a : a;
+}
+
+static void pcm_limit_c (const float *acc, int16_t *dst, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    dst[i] = lrintf (soft_limit (acc[i]) * 32767.0f);
+}
+
+#if MRG_PCM_X86
+static void pcm_mix_sse (float *acc, const float *src, float gain, int count)
+{
+  __m128 g = _mm_set1_ps (gain);
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    __m128 a0 = _mm_add_ps (_mm_loadu_ps (acc + i),
+                            _mm_mul_ps (_mm_loadu_ps (src + i), g));
+    __m128 a1 = _mm_add_ps (_mm_loadu_ps (acc + i + 4),
+                            _mm_mul_ps (_mm_loadu_ps (src + i + 4), g));
+    _mm_storeu_ps (acc + i, a0);
+    _mm_storeu_ps (acc + i + 4, a1);
+  }
+  pcm_mix_c (acc + i, src + i, gain, count - i);
+}
+
+static inline __m128 soft_limit_sse (__m128 x)
+{
+  const __m128 knee = _mm_set1_ps (MRG_PCM_LIMIT_KNEE);
+  const __m128 one = _mm_set1_ps (1.0f);
+  const __m128 sign_mask = _mm_set1_ps (-0.0f);
+  const __m128 scale = _mm_set1_ps ((1.0f - MRG_PCM_LIMIT_KNEE) *
+                                    (1.0f - MRG_PCM_LIMIT_KNEE));
+  const __m128 offset = _mm_set1_ps (1.0f - 2.0f * MRG_PCM_LIMIT_KNEE);
+  __m128 sign = _mm_and_ps (x, sign_mask);
+  __m128 a = _mm_andnot_ps (sign_mask, x);
+  __m128 limited = _mm_sub_ps (one, _mm_div_ps (scale, _mm_add_ps (a, offset)));
+  __m128 above = _mm_cmpgt_ps (a, knee);
+
+  a = _mm_or_ps (_mm_and_ps (above, limited), _mm_andnot_ps (above, a));
+  return _mm_or_ps (a, sign);
+}
+
+static void pcm_limit_sse (const float *acc, int16_t *dst, int count)
+{
+  const __m128 full = _mm_set1_ps (32767.0f);
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    __m128i lo = _mm_cvtps_epi32 (_mm_mul_ps (soft_limit_sse (_mm_loadu_ps (acc + i)), full));
+    __m128i hi = _mm_cvtps_epi32 (_mm_mul_ps (soft_limit_sse (_mm_loadu_ps (acc + i + 4)), full));
+    _mm_storeu_si128 ((__m128i*)(dst + i), _mm_packs_epi32 (lo, hi));
+  }
+  pcm_limit_c (acc + i, dst + i, count - i);
+}
+#endif
+
+#if MRG_PCM_NEON
+static void pcm_mix_neon (float *acc, const float *src, float gain, int count)
+{
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    vst1q_f32 (acc + i, vmlaq_n_f32 (vld1q_f32 (acc + i),
+                                     vld1q_f32 (src + i), gain));
+    vst1q_f32 (acc + i + 4, vmlaq_n_f32 (vld1q_f32 (acc + i + 4),
+                                         vld1q_f32 (src + i + 4), gain));
+  }
+  pcm_mix_c (acc + i, src + i, gain, count - i);
+}
+
+static inline float32x4_t soft_limit_neon (float32x4_t x)
+{
+  const float32x4_t knee = vdupq_n_f32 (MRG_PCM_LIMIT_KNEE);
+  const float32x4_t one = vdupq_n_f32 (1.0f);
+  const float32x4_t scale = vdupq_n_f32 ((1.0f - MRG_PCM_LIMIT_KNEE) *
+                                         (1.0f - MRG_PCM_LIMIT_KNEE));
+  const float32x4_t offset = vdupq_n_f32 (1.0f - 2.0f * MRG_PCM_LIMIT_KNEE);
+  float32x4_t a = vabsq_f32 (x);
+  float32x4_t limited = vsubq_f32 (one, vdivq_f32 (scale, vaddq_f32 (a, offset)));
+
+  a = vbslq_f32 (vcgtq_f32 (a, knee), limited, a);
+  /* the sign of x, with the magnitude of a */
+  return vbslq_f32 (vdupq_n_u32 (0x80000000), x, a);
+}
+
+static void pcm_limit_neon (const float *acc, int16_t *dst, int count)
+{
+  const float32x4_t full = vdupq_n_f32 (32767.0f);
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    int32x4_t lo = vcvtnq_s32_f32 (vmulq_f32 (soft_limit_neon (vld1q_f32 (acc + i)), full));
+    int32x4_t hi = vcvtnq_s32_f32 (vmulq_f32 (soft_limit_neon (vld1q_f32 (acc + i + 4)), full));
+    vst1q_s16 (dst + i, vcombine_s16 (vqmovn_s32 (lo), vqmovn_s32 (hi)));
+  }
+  pcm_limit_c (acc + i, dst + i, count - i);
+}
+#endif
+
+int _mrg_pcm_mix_impls (const char  **names,
+                        MrgPcmMix    *mixes,
+                        MrgPcmLimit  *limits,
+                        int           max)
+{
+  int n = 0;
+#define ADD(name, mix, limit) \
+  if (n < max) { names[n] = name; mixes[n] = mix; limits[n] = limit; n++; }
+
+  ADD ("c", pcm_mix_c, pcm_limit_c);
+#if MRG_PCM_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2"))
+    ADD ("sse", pcm_mix_sse, pcm_limit_sse);
+#endif
+#if MRG_PCM_NEON
+  ADD ("neon", pcm_mix_neon, pcm_limit_neon);
+#endif
+#undef ADD
+  return n;
+}
+
+static MrgPcmMix      pcm_mix = NULL;
+static MrgPcmLimit    pcm_limit = NULL;
+static pthread_once_t pcm_mix_once = PTHREAD_ONCE_INIT;
+
+static void choose_pcm_mix (void)
+{
+  const char  *names[4];
+  MrgPcmMix    mixes[4];
+  MrgPcmLimit  limits[4];
+  int n = _mrg_pcm_mix_impls (names, mixes, limits, 4);
+  pcm_mix = mixes[n - 1];
+  pcm_limit = limits[n - 1];
+}
+
+void _mrg_pcm_mix (float *acc, const float *src, float gain, int count)
+{
+  pthread_once (&pcm_mix_once, choose_pcm_mix);
+  pcm_mix (acc, src, gain, count);
+}
+
+void _mrg_pcm_limit (const float *acc, int16_t *dst, int count)
+{
+  pthread_once (&pcm_mix_once, choose_pcm_mix);
+  pcm_limit (acc, dst, count);
+}
@@ -0,0 +1,135 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MRG_PCM_H
+#define MRG_PCM_H
+
+#include <stdint.h>
+
+/* a single producer, single consumer ring of interleaved stereo s16
+ * frames. The producer only advances write and the consumer only read,
+ * so neither side takes a lock or allocates once the ring is made.
+ */
+typedef struct MrgPcmRing
+{
+  int16_t  *frames;
+  uint32_t  size;       /* in frames, a power of two */
+  uint32_t  write;      /* free running counts of frames, wrapping */
+  uint32_t  read;
+  int       playing;    /* the consumer has had frames since running out */
+  uint32_t  underruns;  /* times the consumer ran out while playing, which
+                           includes the end of every stream */
+} MrgPcmRing;
+
+/* size is rounded up to a power of two, returns -1 when out of memory */
+int  _mrg_pcm_ring_init      (MrgPcmRing *ring, int size);
+void _mrg_pcm_ring_fini      (MrgPcmRing *ring);
+
+/* frames queued, and room for more; exact for the side asking and a lower
+ * bound for the other
+ */
+int  _mrg_pcm_ring_queued    (MrgPcmRing *ring);
+int  _mrg_pcm_ring_space     (MrgPcmRing *ring);
+
+/* the producer side, queues up to count frames and returns how many fit */
+int  _mrg_pcm_ring_write     (MrgPcmRing *ring, const int16_t *frames,
+                              int count);
+
+/* the consumer side, fills count frames, with silence for frames not yet
+ * queued, and returns how many were queued ones
+ */
+int  _mrg_pcm_ring_read      (MrgPcmRing *ring, int16_t *frames, int count);
+
+int  _mrg_pcm_ring_underruns (MrgPcmRing *ring);
+
+/* resampling of a stream of interleaved stereo float frames, keeping the
+ * fractional position and the frames the filter still needs between
+ * calls. The windowed sinc quality is a polyphase filter of
+ * MRG_RESAMPLER_TAPS taps, interpolating between its phases, with the
+ * cutoff lowered when downsampling; the linear one interpolates between
+ * neighbouring frames.
+ */
+typedef struct _MrgResampler MrgResampler;
+
+/* the same values as MrgResample */
+#define MRG_RESAMPLER_LINEAR 0
+#define MRG_RESAMPLER_SINC   1
+
+#define MRG_RESAMPLER_TAPS   32
+#define MRG_RESAMPLER_PHASES 256
+
+MrgResampler *_mrg_resampler_new       (int quality);
+void          _mrg_resampler_free      (MrgResampler *resampler);
+int           _mrg_resampler_quality   (MrgResampler *resampler);
+void          _mrg_resampler_set_rates (MrgResampler *resampler,
+                                        double in_rate, double out_rate);
+
+/* input frames still needed before out_frames frames can be produced */
+int           _mrg_resampler_needed    (MrgResampler *resampler,
+                                        int out_frames);
+
+/* takes up to in_frames frames of in, setting consumed to how many, and
+ * produces up to max_out frames in out, returning how many
+ */
+int           _mrg_resampler_process   (MrgResampler *resampler,
+                                        const float *in, int in_frames,
+                                        int *consumed,
+                                        float *out, int max_out);
+
+/* one stereo output frame of the sinc filter: taps frames of in weighted
+ * by row0 + frac * (row1 - row0), the rows holding every coefficient twice
+ * to match the interleaved channels
+ */
+typedef void (*MrgResampleKernel) (const float *in, const float *row0,
+                                   const float *row1, float frac, int taps,
+                                   float *out);
+
+/* lists the kernels the cpu supports, the portable one first and the
+ * fastest last, returns how many were stored
+ */
+int _mrg_resample_kernel_impls (const char        **names,
+                                MrgResampleKernel  *funcs,
+                                int                 max);
+
+/* makes the resampler use kernel, for comparing them */
+void _mrg_resampler_set_kernel (MrgResampler *resampler,
+                                MrgResampleKernel kernel);
+
+/* mixing of streams of float samples: each stream is added with its gain
+ * to a float accumulator, which is brought to s16 through a soft limiter,
+ * linear up to MRG_PCM_LIMIT_KNEE of full scale and approaching full scale
+ * smoothly above it, rather than wrapping or clipping hard
+ */
+#define MRG_PCM_LIMIT_KNEE 0.75f
+
+typedef void (*MrgPcmMix)   (float *acc, const float *src, float gain,
+                             int count);
+typedef void (*MrgPcmLimit) (const float *acc, int16_t *dst, int count);
+
+/* the fastest implementations the cpu supports */
+void _mrg_pcm_mix   (float *acc, const float *src, float gain, int count);
+void _mrg_pcm_limit (const float *acc, int16_t *dst, int count);
+
+/* lists the implementations the cpu supports, the portable ones first and
+ * the fastest last, returns how many were stored
+ */
+int _mrg_pcm_mix_impls (const char  **names,
+                        MrgPcmMix    *mixes,
+                        MrgPcmLimit  *limits,
+                        int           max);
+
+#endif
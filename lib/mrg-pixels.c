@@ -0,0 +1,215 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* pixel format conversion of decoded images, with SSE2, AVX2 or NEON
+ * variants chosen by what the cpu supports when first used. All variants
+ * give the same result as the portable one: the color components are
+ * premultiplied as c * a / 255 rounded to nearest, computed as
+ *
+ *   t = c * a + 128;  (t + (t >> 8)) >> 8
+ *
+ * which is exact for all 8 bit c and a, and keeps a for c = 255.
+ */
+
+#include <pthread.h>
+#include "mrg-pixels.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define MRG_PIXELS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MRG_PIXELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+static inline uint32_t mul_un8 (uint32_t c, uint32_t a)
+{
+  uint32_t t = c * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static int rgba_to_cairo_c (const uint8_t *src, uint32_t *dst, int count)
+{
+  uint32_t opaque = 255;
+  int i;
+
+  for (i = 0; i < count; i++, src += 4)
+  {
+    uint32_t a = src[3];
+    opaque &= a;
+    dst[i] = (a << 24) |
+             (mul_un8 (src[0], a) << 16) |
+             (mul_un8 (src[1], a) << 8) |
+              mul_un8 (src[2], a);
+  }
+  return opaque != 255;
+}
+
+#if MRG_PIXELS_X86
+
+/* premultiplies the components of two pixels widened to 16 bit, and swaps
+ * r and b, keeping a
+ */
+static inline __m128i premultiply_sse2 (__m128i px)
+{
+  const __m128i alpha_lane = _mm_set_epi16 (255, 0, 0, 0, 255, 0, 0, 0);
+  const __m128i keep_alpha = _mm_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1);
+  __m128i a = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (px,
+                 _MM_SHUFFLE (3, 3, 3, 3)), _MM_SHUFFLE (3, 3, 3, 3));
+  __m128i t;
+
+  a = _mm_or_si128 (_mm_and_si128 (a, keep_alpha), alpha_lane);
+  t = _mm_add_epi16 (_mm_mullo_epi16 (px, a), _mm_set1_epi16 (128));
+  t = _mm_srli_epi16 (_mm_add_epi16 (t, _mm_srli_epi16 (t, 8)), 8);
+  return _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (t,
+            _MM_SHUFFLE (3, 0, 1, 2)), _MM_SHUFFLE (3, 0, 1, 2));
+}
+
+static int rgba_to_cairo_sse2 (const uint8_t *src, uint32_t *dst, int count)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i opaque = _mm_set1_epi32 (-1);
+  int i;
+
+  for (i = 0; i + 4 <= count; i += 4)
+  {
+    __m128i px = _mm_loadu_si128 ((const __m128i*)(src + i * 4));
+    __m128i lo = premultiply_sse2 (_mm_unpacklo_epi8 (px, zero));
+    __m128i hi = premultiply_sse2 (_mm_unpackhi_epi8 (px, zero));
+    opaque = _mm_and_si128 (opaque, px);
+    _mm_storeu_si128 ((__m128i*)(dst + i), _mm_packus_epi16 (lo, hi));
+  }
+  opaque = _mm_cmpeq_epi32 (_mm_or_si128 (opaque, _mm_set1_epi32 (0x00ffffff)),
+                            _mm_set1_epi32 (-1));
+  return (_mm_movemask_epi8 (opaque) != 0xffff) |
+         rgba_to_cairo_c (src + i * 4, dst + i, count - i);
+}
+
+__attribute__((target ("avx2")))
+static inline __m256i premultiply_avx2 (__m256i px)
+{
+  const __m256i alpha_lane = _mm256_set_epi16 (255, 0, 0, 0, 255, 0, 0, 0,
+                                               255, 0, 0, 0, 255, 0, 0, 0);
+  const __m256i keep_alpha = _mm256_set_epi16 (0, -1, -1, -1, 0, -1, -1, -1,
+                                               0, -1, -1, -1, 0, -1, -1, -1);
+  __m256i a = _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (px,
+                 _MM_SHUFFLE (3, 3, 3, 3)), _MM_SHUFFLE (3, 3, 3, 3));
+  __m256i t;
+
+  a = _mm256_or_si256 (_mm256_and_si256 (a, keep_alpha), alpha_lane);
+  t = _mm256_add_epi16 (_mm256_mullo_epi16 (px, a), _mm256_set1_epi16 (128));
+  t = _mm256_srli_epi16 (_mm256_add_epi16 (t, _mm256_srli_epi16 (t, 8)), 8);
+  return _mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 (t,
+            _MM_SHUFFLE (3, 0, 1, 2)), _MM_SHUFFLE (3, 0, 1, 2));
+}
+
+/* the unpacking and packing work within each 128 bit half, and thus keep
+ * the pixels in order
+ */
+__attribute__((target ("avx2")))
+static int rgba_to_cairo_avx2 (const uint8_t *src, uint32_t *dst, int count)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i opaque = _mm256_set1_epi32 (-1);
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    __m256i px = _mm256_loadu_si256 ((const __m256i*)(src + i * 4));
+    __m256i lo = premultiply_avx2 (_mm256_unpacklo_epi8 (px, zero));
+    __m256i hi = premultiply_avx2 (_mm256_unpackhi_epi8 (px, zero));
+    opaque = _mm256_and_si256 (opaque, px);
+    _mm256_storeu_si256 ((__m256i*)(dst + i), _mm256_packus_epi16 (lo, hi));
+  }
+  opaque = _mm256_cmpeq_epi32 (
+      _mm256_or_si256 (opaque, _mm256_set1_epi32 (0x00ffffff)),
+      _mm256_set1_epi32 (-1));
+  return ((unsigned)_mm256_movemask_epi8 (opaque) != 0xffffffffu) |
+         rgba_to_cairo_c (src + i * 4, dst + i, count - i);
+}
+#endif
+
+#if MRG_PIXELS_NEON
+static inline uint8x8_t premultiply_neon (uint8x8_t c, uint8x8_t a)
+{
+  uint16x8_t t = vmull_u8 (c, a);
+  return vraddhn_u16 (t, vrshrq_n_u16 (t, 8));
+}
+
+static int rgba_to_cairo_neon (const uint8_t *src, uint32_t *dst, int count)
+{
+  uint8x8_t opaque = vdup_n_u8 (255);
+  int i;
+
+  for (i = 0; i + 8 <= count; i += 8)
+  {
+    uint8x8x4_t px = vld4_u8 (src + i * 4);
+    uint8x8x4_t out;
+    out.val[0] = premultiply_neon (px.val[2], px.val[3]);
+    out.val[1] = premultiply_neon (px.val[1], px.val[3]);
+    out.val[2] = premultiply_neon (px.val[0], px.val[3]);
+    out.val[3] = px.val[3];
+    opaque = vand_u8 (opaque, px.val[3]);
+    vst4_u8 ((uint8_t*)(dst + i), out);
+  }
+  return (vminv_u8 (opaque) != 255) |
+         rgba_to_cairo_c (src + i * 4, dst + i, count - i);
+}
+#endif
+
+int _mrg_rgba_to_cairo_impls (const char     **names,
+                              MrgRgbaToCairo  *funcs,
+                              int              max)
+{
+  int n = 0;
+#define ADD(name, func) \
+  if (n < max) { names[n] = name; funcs[n] = func; n++; }
+
+  ADD ("c", rgba_to_cairo_c);
+#if MRG_PIXELS_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2"))
+    ADD ("sse2", rgba_to_cairo_sse2);
+  if (__builtin_cpu_supports ("avx2"))
+    ADD ("avx2", rgba_to_cairo_avx2);
+#endif
+#if MRG_PIXELS_NEON
+  ADD ("neon", rgba_to_cairo_neon);
+#endif
+#undef ADD
+  return n;
+}
+
+static MrgRgbaToCairo rgba_to_cairo = NULL;
+static pthread_once_t rgba_to_cairo_once = PTHREAD_ONCE_INIT;
+
+static void choose_rgba_to_cairo (void)
+{
+  const char     *names[4];
+  MrgRgbaToCairo  funcs[4];
+  int n = _mrg_rgba_to_cairo_impls (names, funcs, 4);
+  rgba_to_cairo = funcs[n - 1];
+}
+
+int _mrg_rgba_to_cairo (const uint8_t *src, uint32_t *dst, int count)
+{
+  pthread_once (&rgba_to_cairo_once, choose_rgba_to_cairo);
+  return rgba_to_cairo (src, dst, count);
+}
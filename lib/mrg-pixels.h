@@ -0,0 +1,40 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MRG_PIXELS_H
+#define MRG_PIXELS_H
+
+#include <stdint.h>
+
+/* converts count pixels of 8 bit R G B A, as decoded by stb_image, to the
+ * native endian premultiplied 0xAARRGGBB of CAIRO_FORMAT_ARGB32, which is
+ * also valid CAIRO_FORMAT_RGB24 when opaque. Returns 1 when a pixel is
+ * not opaque.
+ */
+typedef int (*MrgRgbaToCairo) (const uint8_t *src, uint32_t *dst, int count);
+
+/* the fastest implementation the cpu supports */
+int _mrg_rgba_to_cairo (const uint8_t *src, uint32_t *dst, int count);
+
+/* lists the implementations the cpu supports, the portable one first and
+ * the fastest last, returns how many were stored
+ */
+int _mrg_rgba_to_cairo_impls (const char     **names,
+                              MrgRgbaToCairo  *funcs,
+                              int              max);
+
+#endif
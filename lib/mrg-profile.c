@@ -0,0 +1,203 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* per frame breakdown of where time goes, scopes are opened and closed
+ * with MRG_PROFILE_BEGIN/MRG_PROFILE_END, which compile to nothing when
+ * MRG_PROFILE is 0. Time is accounted exclusively, a nested scope pauses
+ * its parent, so the phases of a frame add up to at most its frame time.
+ *
+ * Collection is enabled with mrg_set_collect_frame_stats, by setting
+ * MRG_FRAME_STATS, or by setting MRG_TRACE to the path of a file to write
+ * a chrome://tracing / perfetto compatible trace-event JSON to.
+ */
+
+#include "mrg-internal.h"
+
+#define MRG_PROFILE_MAX_DEPTH 64
+
+typedef struct MrgProfileScope {
+  MrgPhase phase;
+  long     begin;  /* when the scope was entered, for the trace */
+  long     resume; /* start of the not yet accounted part */
+} MrgProfileScope;
+
+struct _MrgProfile {
+  MrgProfileScope stack[MRG_PROFILE_MAX_DEPTH];
+  int             depth;
+
+  long            phase_ticks[MRG_PHASE_COUNT];
+  int             phase_calls[MRG_PHASE_COUNT];
+
+  FILE           *trace;
+  int             pid;
+};
+
+static const char *phase_names[MRG_PHASE_COUNT]={
+  "cascade",
+  "style",
+  "layout",
+  "paint",
+  "listen",
+  "hit-test",
+  "flush",
+  "raster",
+};
+
+const char *mrg_phase_name (MrgPhase phase)
+{
+  if (phase < 0 || phase >= MRG_PHASE_COUNT)
+    return "unknown";
+  return phase_names[phase];
+}
+
+static void trace_event (MrgProfile *profile, const char *name,
+                         long begin, long duration)
+{
+  fprintf (profile->trace,
+  "{\"name\":\"%s\",\"cat\":\"mrg\",\"ph\":\"X\",\"ts\":%li,\"dur\":%li,\"pid\":%i,\"tid\":1},\n",
+           name, begin, duration, profile->pid);
+}
+
+void mrg_set_collect_frame_stats (Mrg *mrg, int enabled)
+{
+  if (enabled && !mrg->profile)
+  {
+    mrg->profile = calloc (sizeof (MrgProfile), 1);
+    mrg->profile->pid = getpid ();
+  }
+  else if (!enabled && mrg->profile)
+  {
+    if (mrg->profile->trace)
+    {
+      /* a closing entry keeps the array valid JSON */
+      fprintf (mrg->profile->trace,
+        "{\"name\":\"end\",\"ph\":\"i\",\"ts\":%li,\"pid\":%i,\"tid\":1}]\n",
+               _mrg_ticks (), mrg->profile->pid);
+      fclose (mrg->profile->trace);
+    }
+    free (mrg->profile);
+    mrg->profile = NULL;
+  }
+}
+
+int mrg_get_collect_frame_stats (Mrg *mrg)
+{
+  return mrg->profile != NULL;
+}
+
+void _mrg_profile_init (Mrg *mrg)
+{
+  if (getenv ("MRG_TRACE"))
+  {
+    FILE *trace = fopen (getenv ("MRG_TRACE"), "w");
+    if (!trace)
+    {
+      fprintf (stderr, "mrg: unable to open %s for tracing\n",
+               getenv ("MRG_TRACE"));
+      return;
+    }
+    mrg_set_collect_frame_stats (mrg, 1);
+    mrg->profile->trace = trace;
+    fprintf (trace, "[\n");
+  }
+  else if (getenv ("MRG_FRAME_STATS"))
+  {
+    mrg_set_collect_frame_stats (mrg, 1);
+  }
+}
+
+void _mrg_profile_begin (Mrg *mrg, MrgPhase phase)
+{
+  MrgProfile *profile = mrg->profile;
+  long now = _mrg_ticks ();
+
+  if (profile->depth >= MRG_PROFILE_MAX_DEPTH)
+  {
+    profile->depth++; /* keep begin/end balanced, but stop accounting */
+    return;
+  }
+  if (profile->depth)
+  {
+    MrgProfileScope *parent = &profile->stack[profile->depth-1];
+    profile->phase_ticks[parent->phase] += now - parent->resume;
+  }
+  profile->stack[profile->depth].phase = phase;
+  profile->stack[profile->depth].begin = now;
+  profile->stack[profile->depth].resume = now;
+  profile->depth++;
+  profile->phase_calls[phase]++;
+}
+
+void _mrg_profile_end (Mrg *mrg, MrgPhase phase)
+{
+  MrgProfile *profile = mrg->profile;
+  MrgProfileScope *scope;
+  long now = _mrg_ticks ();
+
+  if (profile->depth <= 0)
+    return;
+  if (--profile->depth >= MRG_PROFILE_MAX_DEPTH)
+    return;
+
+  scope = &profile->stack[profile->depth];
+  profile->phase_ticks[scope->phase] += now - scope->resume;
+  if (profile->trace)
+    trace_event (profile, phase_names[scope->phase],
+                 scope->begin, now - scope->begin);
+
+  if (profile->depth)
+    profile->stack[profile->depth-1].resume = now;
+}
+
+/* called at the end of mrg_flush, publishes what was gathered since the
+ * previous frame, hit-testing of events between frames is thus accounted
+ * to the frame that follows them.
+ */
+void _mrg_profile_frame (Mrg *mrg, long frame_start, long frame_end)
+{
+  MrgFrameStats *stats = &mrg->frame_stats;
+  MrgProfile *profile = mrg->profile;
+  int i;
+
+  stats->frame_ms = (frame_end - frame_start) / 1000.0f;
+  stats->items = mrg->item_table.count;
+  stats->listeners = mrg->listen_count;
+  _mrg_image_cache_stats (mrg, stats);
+  stats->frame_no ++;
+
+  if (!profile)
+    return;
+
+  for (i = 0; i < MRG_PHASE_COUNT; i++)
+  {
+    stats->phase_ms[i] = profile->phase_ticks[i] / 1000.0f;
+    stats->phase_calls[i] = profile->phase_calls[i];
+    profile->phase_ticks[i] = 0;
+    profile->phase_calls[i] = 0;
+  }
+
+  if (profile->trace)
+  {
+    trace_event (profile, "frame", frame_start, frame_end - frame_start);
+    fflush (profile->trace);
+  }
+}
+
+const MrgFrameStats *mrg_get_frame_stats (Mrg *mrg)
+{
+  return &mrg->frame_stats;
+}
@@ -0,0 +1,492 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* tile parallel rasterization for the backends drawing into pixels, when
+ * MRG_RENDER_THREADS is set to more than 1 the frame is drawn into a cairo
+ * recording surface, that is painted when the frame is flushed, by that
+ * many threads each painting a horizontal band of the pixels.
+ *
+ * Painting a recording replays its commands into an image of the band,
+ * which is then copied, clipped to the dirty rows, into the pixels; as the
+ * bands are only offset by whole pixels the result is the same as drawing
+ * into the pixels directly.
+ *
+ * cairo changes a recording surface when it is painted from, attaching a
+ * proxy for the replay, so each band gets a recording of its own: the
+ * frame is drawn through a tee surface into one recording per band. Where
+ * cairo is built without tee surfaces the bands are painted one at a time.
+ *
+ * With MRG_RENDER_PIPELINE set the flush does not wait for the painting,
+ * the next frame is built while the render threads paint the previous one,
+ * which is handed to the backend once painted - when the next frame is
+ * flushed, or earlier when noticed by the idle iteration. Events are
+ * matched against the items of the frame on screen, which are kept, along
+ * with the text closures of the frame and those deferred while building
+ * it, until the frame is replaced.
+ */
+
+#include <pthread.h>
+#include "mrg-internal.h"
+#if CAIRO_HAS_TEE_SURFACE
+#include <cairo-tee.h>
+#endif
+
+#define MRG_RASTER_MAX_THREADS 64
+
+typedef struct MrgRasterWorker {
+  MrgRaster *raster;
+  int        no;
+  pthread_t  tid;
+} MrgRasterWorker;
+
+/* what is kept of a frame handed to the render threads */
+typedef struct MrgRasterFrame {
+  MrgRectangle      dirty;     /* mrg->dirty the frame was drawn with */
+  MrgList          *items;     /* referenced */
+  MrgClosure       *closures;  /* text and deferred closures */
+  int               closure_count;
+  MrgFocusIndex     focus;     /* the focus_no of its items index this */
+} MrgRasterFrame;
+
+struct _MrgRaster {
+  int              threads;
+  int              first_worker; /* 1 when the flushing thread paints too */
+  int              pipelined;
+  MrgRasterWorker *workers;
+
+  pthread_mutex_t  mutex;
+  pthread_cond_t   start;
+  pthread_cond_t   done;
+  int              generation; /* incremented for each frame to paint */
+  int              pending;    /* workers still painting their band */
+  int              quit;
+
+  int              recordings; /* of a frame, one per band or a shared one */
+  pthread_mutex_t  paint_mutex; /* painting from a shared recording */
+
+  cairo_surface_t *drawing;    /* what the frame being drawn goes into */
+  cairo_surface_t *drawn[MRG_RASTER_MAX_THREADS];    /* its recordings */
+  cairo_surface_t *painting[MRG_RASTER_MAX_THREADS]; /* of the frame painted */
+
+  unsigned char   *pixels;     /* what the frame is painted into */
+  int              rowstride;
+  int              width;
+  MrgRectangle     clip;       /* the dirty part, in pixels */
+
+  int              busy;       /* a frame is painted but not presented */
+  MrgRasterFrame   painted;
+  MrgRasterFrame   shown;
+  MrgFocusIndex    focus_spare; /* of a released frame, reused by mrg */
+};
+
+static void raster_band (MrgRaster *raster, int no)
+{
+  MrgRectangle *clip = &raster->clip;
+  int y0 = clip->y + clip->height * no / raster->threads;
+  int y1 = clip->y + clip->height * (no + 1) / raster->threads;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+
+  if (y1 <= y0)
+    return;
+
+  surface = cairo_image_surface_create_for_data (
+      raster->pixels + y0 * raster->rowstride, CAIRO_FORMAT_ARGB32,
+      raster->width, y1 - y0, raster->rowstride);
+  cr = cairo_create (surface);
+  cairo_rectangle (cr, clip->x, 0, clip->width, y1 - y0);
+  cairo_clip (cr);
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  if (raster->recordings > 1)
+  {
+    cairo_set_source_surface (cr, raster->painting[no], 0, -y0);
+    cairo_paint (cr);
+  }
+  else
+  {
+    pthread_mutex_lock (&raster->paint_mutex);
+    cairo_set_source_surface (cr, raster->painting[0], 0, -y0);
+    cairo_paint (cr);
+    pthread_mutex_unlock (&raster->paint_mutex);
+  }
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
+}
+
+static void *raster_worker (void *data)
+{
+  MrgRasterWorker *worker = data;
+  MrgRaster *raster = worker->raster;
+  int generation = 0;
+
+  while (1)
+  {
+    pthread_mutex_lock (&raster->mutex);
+    while (raster->generation == generation && !raster->quit)
+      pthread_cond_wait (&raster->start, &raster->mutex);
+    generation = raster->generation;
+    if (raster->quit)
+    {
+      pthread_mutex_unlock (&raster->mutex);
+      return NULL;
+    }
+    pthread_mutex_unlock (&raster->mutex);
+
+    raster_band (raster, worker->no);
+
+    pthread_mutex_lock (&raster->mutex);
+    if (--raster->pending == 0)
+      pthread_cond_signal (&raster->done);
+    pthread_mutex_unlock (&raster->mutex);
+  }
+  return NULL;
+}
+
+static void recordings_destroy (cairo_surface_t **recordings, int count)
+{
+  int i;
+  for (i = 0; i < count; i++)
+  {
+    if (recordings[i])
+      cairo_surface_destroy (recordings[i]);
+    recordings[i] = NULL;
+  }
+}
+
+static void raster_wait (MrgRaster *raster)
+{
+  pthread_mutex_lock (&raster->mutex);
+  while (raster->pending)
+    pthread_cond_wait (&raster->done, &raster->mutex);
+  pthread_mutex_unlock (&raster->mutex);
+}
+
+void _mrg_raster_init (Mrg *mrg)
+{
+  MrgRaster *raster;
+  int threads = 0;
+  int pipelined = 0;
+  int i;
+
+  if (getenv ("MRG_RENDER_THREADS"))
+    threads = atoi (getenv ("MRG_RENDER_THREADS"));
+  if (getenv ("MRG_RENDER_PIPELINE"))
+    pipelined = atoi (getenv ("MRG_RENDER_PIPELINE"));
+  if (threads <= 1 && !pipelined)
+    return;
+  if (threads < 1)
+    threads = 1;
+  if (threads > MRG_RASTER_MAX_THREADS)
+    threads = MRG_RASTER_MAX_THREADS;
+
+  raster = calloc (sizeof (MrgRaster), 1);
+  raster->threads = threads;
+  raster->pipelined = pipelined;
+  /* unless pipelined, the first band is painted by the flushing thread */
+  raster->first_worker = pipelined ? 0 : 1;
+#if CAIRO_HAS_TEE_SURFACE
+  raster->recordings = threads;
+#else
+  raster->recordings = 1;
+#endif
+  pthread_mutex_init (&raster->mutex, NULL);
+  pthread_mutex_init (&raster->paint_mutex, NULL);
+  pthread_cond_init (&raster->start, NULL);
+  pthread_cond_init (&raster->done, NULL);
+
+  raster->workers = calloc (sizeof (MrgRasterWorker), threads);
+  for (i = raster->first_worker; i < threads; i++)
+  {
+    raster->workers[i].raster = raster;
+    raster->workers[i].no = i;
+    pthread_create (&raster->workers[i].tid, NULL, raster_worker,
+                    &raster->workers[i]);
+  }
+  mrg->raster = raster;
+  mrg->render_pipeline = pipelined;
+}
+
+/* the number of threads painting a frame */
+int _mrg_raster_threads (Mrg *mrg)
+{
+  return mrg->raster ? mrg->raster->threads : 1;
+}
+
+/* the cairo context to draw the frame with, drawing into the recordings */
+cairo_t *_mrg_raster_cr (Mrg *mrg)
+{
+  MrgRaster *raster = mrg->raster;
+  cairo_rectangle_t extents = {0, 0, mrg->width, mrg->height};
+  cairo_surface_t *image;
+  cairo_font_options_t *font_options;
+  cairo_t *cr;
+  int i;
+
+  for (i = 0; i < raster->recordings; i++)
+    raster->drawn[i] = cairo_recording_surface_create (
+        CAIRO_CONTENT_COLOR_ALPHA, &extents);
+#if CAIRO_HAS_TEE_SURFACE
+  if (raster->recordings > 1)
+  {
+    raster->drawing = cairo_tee_surface_create (raster->drawn[0]);
+    for (i = 1; i < raster->recordings; i++)
+      cairo_tee_surface_add (raster->drawing, raster->drawn[i]);
+  }
+  else
+#endif
+    raster->drawing = cairo_surface_reference (raster->drawn[0]);
+  cr = cairo_create (raster->drawing);
+
+  /* text is to be laid out as when drawing into the pixels */
+  image = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
+  font_options = cairo_font_options_create ();
+  cairo_surface_get_font_options (image, font_options);
+  cairo_set_font_options (cr, font_options);
+  cairo_font_options_destroy (font_options);
+  cairo_surface_destroy (image);
+  return cr;
+}
+
+static void frame_release (Mrg *mrg, MrgRasterFrame *frame)
+{
+  MrgRaster *raster = mrg->raster;
+  MrgList *l;
+  int i;
+
+  for (l = frame->items; l; l = l->next)
+    _mrg_item_unref (l->data);
+  mrg_list_free (&frame->items);
+  for (i = 0; i < frame->closure_count; i++)
+    frame->closures[i].finalize (frame->closures[i].data1,
+                                 frame->closures[i].data2,
+                                 frame->closures[i].finalize_data);
+  free (frame->closures);
+  frame->closures = NULL;
+  frame->closure_count = 0;
+  _mrg_focus_free (&raster->focus_spare);
+  raster->focus_spare = frame->focus;
+  memset (&frame->focus, 0, sizeof (MrgFocusIndex));
+}
+
+/* keeps what events of the frame just drawn need, until it is replaced
+ * on screen
+ */
+static void frame_keep (Mrg *mrg, MrgRasterFrame *frame)
+{
+  MrgRaster *raster = mrg->raster;
+  MrgList *l;
+  int i;
+
+  frame->dirty = mrg->dirty;
+  for (l = mrg->items; l; l = l->next)
+  {
+    _mrg_item_ref (l->data);
+    mrg_list_prepend (&frame->items, l->data);
+  }
+  mrg_list_reverse (&frame->items);
+
+  frame->closures = malloc (sizeof (MrgClosure) *
+                     (mrg->text_listen_count + mrg->deferred_count + 1));
+  for (i = 0; i < mrg->text_listen_count; i++)
+  {
+    MrgClosure *closure;
+    if (!mrg->text_listen_finalize[i])
+      continue;
+    closure = &frame->closures[frame->closure_count++];
+    closure->finalize = mrg->text_listen_finalize[i];
+    closure->data1 = mrg->text_listen_data1[i];
+    closure->data2 = mrg->text_listen_data2[i];
+    closure->finalize_data = mrg->text_listen_finalize_data[i];
+    mrg->text_listen_finalize[i] = NULL;
+  }
+  memcpy (&frame->closures[frame->closure_count], mrg->deferred,
+          sizeof (MrgClosure) * mrg->deferred_count);
+  frame->closure_count += mrg->deferred_count;
+  mrg->deferred_count = 0;
+
+  /* the focus index is kept with the items, mrg continues with the
+   * allocations of one released earlier
+   */
+  frame->focus = mrg->focus;
+  mrg->focus = raster->focus_spare;
+  memset (&raster->focus_spare, 0, sizeof (MrgFocusIndex));
+  _mrg_focus_clear (mrg);
+}
+
+/* the focus index of the frame on screen */
+MrgFocusIndex *_mrg_raster_focus (Mrg *mrg)
+{
+  return &mrg->raster->shown.focus;
+}
+
+/* hands the painted frame to the backend, waiting for the painting to
+ * finish first
+ */
+void _mrg_raster_present (Mrg *mrg)
+{
+  MrgRaster *raster = mrg->raster;
+  MrgRectangle dirty;
+  cairo_t *cr;
+
+  if (!raster || !raster->busy)
+    return;
+  raster_wait (raster);
+  raster->busy = 0;
+  recordings_destroy (raster->painting, raster->recordings);
+
+  /* the backend flushes what it is told is dirty and mrg->cr, which
+   * belong to the frame being drawn
+   */
+  dirty = mrg->dirty;
+  cr = mrg->cr;
+  mrg->dirty = raster->painted.dirty;
+  mrg->cr = NULL;
+  if (mrg->backend->mrg_flush)
+    mrg->backend->mrg_flush (mrg);
+  mrg->dirty = dirty;
+  mrg->cr = cr;
+
+  frame_release (mrg, &raster->shown);
+  raster->shown = raster->painted;
+  memset (&raster->painted, 0, sizeof (MrgRasterFrame));
+  mrg->shown_items = raster->shown.items;
+}
+
+/* presents the frame being painted, if it is done */
+void _mrg_raster_poll (Mrg *mrg)
+{
+  MrgRaster *raster = mrg->raster;
+  int done;
+
+  if (!raster->busy)
+    return;
+  pthread_mutex_lock (&raster->mutex);
+  done = raster->pending == 0;
+  pthread_mutex_unlock (&raster->mutex);
+  if (done)
+    _mrg_raster_present (mrg);
+}
+
+/* paints the recorded frame into the pixels of the backend, ending the
+ * drawing of the frame. Returns 1 when the frame is still being painted,
+ * and is to be presented later by _mrg_raster_present.
+ */
+int _mrg_raster_flush (Mrg *mrg)
+{
+  MrgRaster *raster = mrg->raster;
+  MrgRectangle *clip = &raster->clip;
+
+  if (!mrg->cr || !raster->drawing)
+    return 0;
+
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_RASTER);
+  cairo_destroy (mrg->cr);
+  mrg->cr = NULL;
+
+  /* the previous frame is done with the pixels and the threads */
+  _mrg_raster_present (mrg);
+
+  cairo_surface_finish (raster->drawing);
+  cairo_surface_destroy (raster->drawing);
+  raster->drawing = NULL;
+  memcpy (raster->painting, raster->drawn,
+          sizeof (cairo_surface_t*) * raster->recordings);
+  memset (raster->drawn, 0, sizeof (raster->drawn));
+  raster->pixels = mrg_get_pixels (mrg, &raster->rowstride);
+  raster->width = mrg->width;
+  clip->x = 0;
+  clip->y = 0;
+  clip->width = mrg->width;
+  clip->height = mrg->height;
+  if (mrg->do_clip)
+  {
+    int x1, y1;
+    clip->x = floorf (mrg->dirty.x * mrg->ddpx);
+    clip->y = floorf (mrg->dirty.y * mrg->ddpx);
+    x1 = ceilf ((mrg->dirty.x + mrg->dirty.width) * mrg->ddpx);
+    y1 = ceilf ((mrg->dirty.y + mrg->dirty.height) * mrg->ddpx);
+    if (clip->x < 0) clip->x = 0;
+    if (clip->y < 0) clip->y = 0;
+    if (x1 > mrg->width)  x1 = mrg->width;
+    if (y1 > mrg->height) y1 = mrg->height;
+    clip->width = x1 - clip->x;
+    clip->height = y1 - clip->y;
+  }
+
+  if (clip->width > 0 && clip->height > 0)
+  {
+    pthread_mutex_lock (&raster->mutex);
+    raster->pending = raster->threads - raster->first_worker;
+    raster->generation++;
+    pthread_cond_broadcast (&raster->start);
+    pthread_mutex_unlock (&raster->mutex);
+  }
+
+  if (raster->pipelined)
+  {
+    frame_keep (mrg, &raster->painted);
+    raster->busy = 1;
+    MRG_PROFILE_END (mrg, MRG_PHASE_RASTER);
+    return 1;
+  }
+
+  if (clip->width > 0 && clip->height > 0)
+  {
+    raster_band (raster, 0);
+    raster_wait (raster);
+  }
+  recordings_destroy (raster->painting, raster->recordings);
+  MRG_PROFILE_END (mrg, MRG_PHASE_RASTER);
+  return 0;
+}
+
+void _mrg_raster_destroy (Mrg *mrg)
+{
+  MrgRaster *raster = mrg->raster;
+  int i;
+
+  if (!raster)
+    return;
+
+  _mrg_raster_present (mrg);
+  frame_release (mrg, &raster->shown);
+  mrg->shown_items = NULL;
+
+  pthread_mutex_lock (&raster->mutex);
+  raster->quit = 1;
+  pthread_cond_broadcast (&raster->start);
+  pthread_mutex_unlock (&raster->mutex);
+  for (i = raster->first_worker; i < raster->threads; i++)
+    pthread_join (raster->workers[i].tid, NULL);
+
+  if (mrg->cr)
+  {
+    cairo_destroy (mrg->cr);
+    mrg->cr = NULL;
+  }
+  if (raster->drawing)
+    cairo_surface_destroy (raster->drawing);
+  recordings_destroy (raster->drawn, raster->recordings);
+  _mrg_focus_free (&raster->focus_spare);
+  pthread_mutex_destroy (&raster->mutex);
+  pthread_mutex_destroy (&raster->paint_mutex);
+  pthread_cond_destroy (&raster->start);
+  pthread_cond_destroy (&raster->done);
+  free (raster->workers);
+  free (raster);
+  mrg->raster = NULL;
+}
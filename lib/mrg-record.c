@@ -0,0 +1,327 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* recording of the input events fed to mrg, and headless replay of such
+ * recordings with timing measurements, making interaction heavy
+ * performance problems reproducible:
+ *
+ *   MRG_RECORD=/tmp/log mrg browser foo.html
+ *   MRG_BACKEND=mem MRG_REPLAY=/tmp/log mrg browser foo.html
+ *
+ * setting MRG_REPLAY_FAST replays as fast as possible instead of at the
+ * recorded pace. The log is a header followed by fixed size records in
+ * host byte order, each optionally followed by the bytes of a string.
+ */
+
+#include "mrg-internal.h"
+
+#define MRG_RECORD_MAGIC "mrgrec1\n"
+#define MRG_RECORD_NULL  0xffffffffu /* string_length of a NULL string */
+
+typedef struct MrgRecordHeader {
+  char    magic[8];
+  int32_t width;
+  int32_t height;
+} MrgRecordHeader;
+
+typedef struct MrgRecordEvent {
+  int32_t  type;          /* MrgType of the entry point */
+  int32_t  arg;           /* device_no, keyval or scroll direction */
+  int64_t  ticks;         /* us since recording started */
+  float    x;
+  float    y;
+  uint32_t time;          /* event time as passed to mrg */
+  uint32_t string_length; /* bytes of string following the record, or
+                             MRG_RECORD_NULL */
+} MrgRecordEvent;
+
+struct _MrgRecord {
+  FILE *file;         /* NULL while replaying */
+  long  start_ticks;
+  long  pending_ticks; /* oldest event not yet followed by a flush, or -1 */
+
+  int   events;
+  int   frames;
+  long  latency_total;
+  long  latency_max;
+  long  latency_last;
+  int   latency_count;
+};
+
+static MrgRecord *mrg_record_new (void)
+{
+  MrgRecord *record = calloc (sizeof (MrgRecord), 1);
+  record->start_ticks = _mrg_ticks ();
+  record->pending_ticks = -1;
+  return record;
+}
+
+int mrg_record_start (Mrg *mrg, const char *path)
+{
+  MrgRecordHeader header = {MRG_RECORD_MAGIC, 0, 0};
+  MrgRecord *record;
+  FILE *file;
+
+  mrg_record_stop (mrg);
+
+  file = fopen (path, "wb");
+  if (!file)
+  {
+    fprintf (stderr, "mrg: unable to open %s for recording\n", path);
+    return -1;
+  }
+  header.width = mrg->width;
+  header.height = mrg->height;
+  fwrite (&header, sizeof (header), 1, file);
+
+  record = mrg_record_new ();
+  record->file = file;
+  mrg->record = record;
+  return 0;
+}
+
+static void mrg_record_report (MrgRecord *record, const char *what)
+{
+  fprintf (stderr, "%s: %i events %i frames", what,
+           record->events, record->frames);
+  if (record->latency_count)
+    fprintf (stderr, " latency to flush avg %.3fms max %.3fms",
+             record->latency_total / 1000.0 / record->latency_count,
+             record->latency_max / 1000.0);
+  fprintf (stderr, "\n");
+}
+
+void mrg_record_stop (Mrg *mrg)
+{
+  MrgRecord *record = mrg->record;
+  if (!record)
+    return;
+  mrg->record = NULL;
+  if (record->file)
+  {
+    mrg_record_report (record, "mrg record");
+    fclose (record->file);
+  }
+  free (record);
+}
+
+void _mrg_record_event (Mrg *mrg, MrgType type, float x, float y, int arg,
+                        uint32_t time, const char *string)
+{
+  MrgRecord *record = mrg->record;
+  long ticks = _mrg_ticks ();
+
+  record->events ++;
+  if (record->pending_ticks < 0)
+    record->pending_ticks = ticks;
+
+  if (record->file)
+  {
+    MrgRecordEvent event;
+    event.type = type;
+    event.arg = arg;
+    event.ticks = ticks - record->start_ticks;
+    event.x = x;
+    event.y = y;
+    event.time = time ? time : mrg_ms (mrg);
+    event.string_length = string ? strlen (string) : MRG_RECORD_NULL;
+    fwrite (&event, sizeof (event), 1, record->file);
+    if (string && event.string_length)
+      fwrite (string, event.string_length, 1, record->file);
+  }
+}
+
+/* called from mrg_flush, the time since the oldest event not yet
+ * reflected on screen is the event to flush latency.
+ */
+void _mrg_record_flush (Mrg *mrg)
+{
+  MrgRecord *record = mrg->record;
+
+  record->frames ++;
+  if (record->pending_ticks >= 0)
+  {
+    long latency = _mrg_ticks () - record->pending_ticks;
+    record->latency_last = latency;
+    record->latency_total += latency;
+    if (latency > record->latency_max)
+      record->latency_max = latency;
+    record->latency_count ++;
+    record->pending_ticks = -1;
+  }
+}
+
+static const char *event_name (MrgType type)
+{
+  switch (type)
+  {
+    case MRG_PRESS:    return "press";
+    case MRG_MOTION:   return "motion";
+    case MRG_RELEASE:  return "release";
+    case MRG_KEY_DOWN: return "key";
+    case MRG_SCROLL:   return "scroll";
+    case MRG_MESSAGE:  return "message";
+    default:           return "unknown";
+  }
+}
+
+static void replay_frame (Mrg *mrg)
+{
+  mrg_prepare (mrg);
+  if (mrg->ui_update)
+    mrg->ui_update (mrg, mrg->user_data);
+  mrg_flush (mrg);
+}
+
+/* the size of the window a recording was made in, returns 0 on success */
+int _mrg_replay_size (const char *path, int *width, int *height)
+{
+  MrgRecordHeader header;
+  FILE *file = fopen (path, "rb");
+  int ret = -1;
+
+  if (!file)
+    return -1;
+  if (fread (&header, sizeof (header), 1, file) == 1 &&
+      !memcmp (header.magic, MRG_RECORD_MAGIC, 8) &&
+      header.width > 0 && header.height > 0)
+  {
+    *width = header.width;
+    *height = header.height;
+    ret = 0;
+  }
+  fclose (file);
+  return ret;
+}
+
+int mrg_replay (Mrg *mrg, const char *path, int max_speed)
+{
+  MrgRecordHeader header;
+  MrgRecordEvent  event;
+  MrgRecord      *record;
+  FILE *file;
+  char    *string = NULL;
+  uint32_t string_allocated = 0;
+  long  handle_total = 0;
+  long  handle_max = 0;
+
+  file = fopen (path, "rb");
+  if (!file)
+  {
+    fprintf (stderr, "mrg: unable to open %s for replay\n", path);
+    return -1;
+  }
+  if (fread (&header, sizeof (header), 1, file) != 1 ||
+      memcmp (header.magic, MRG_RECORD_MAGIC, 8))
+  {
+    fprintf (stderr, "mrg: %s is not an mrg event recording\n", path);
+    fclose (file);
+    return -1;
+  }
+
+  mrg_record_stop (mrg);
+  if (header.width > 0 && header.height > 0)
+    mrg_set_size (mrg, header.width, header.height);
+
+  /* an initial frame, so that there is something to hit-test against */
+  replay_frame (mrg);
+
+  record = mrg_record_new ();
+  mrg->record = record;
+
+  while (fread (&event, sizeof (event), 1, file) == 1)
+  {
+    const char *arg = NULL;
+    long start, handled;
+    int  frames;
+
+    if (event.string_length != MRG_RECORD_NULL)
+    {
+      if (event.string_length + 1 > string_allocated)
+      {
+        string_allocated = event.string_length + 1;
+        string = realloc (string, string_allocated);
+      }
+      if (event.string_length &&
+          fread (string, event.string_length, 1, file) != 1)
+        break;
+      string[event.string_length] = 0;
+      arg = string;
+    }
+
+    if (!max_speed)
+    {
+      long delay = event.ticks - (_mrg_ticks () - record->start_ticks);
+      if (delay > 0)
+        usleep (delay);
+    }
+
+    _mrg_idle_iteration (mrg);
+    if (_mrg_is_dirty (mrg))
+      replay_frame (mrg);
+
+    /* the entry points log the event to the record themselves */
+    frames = record->frames;
+    start = _mrg_ticks ();
+    switch (event.type)
+    {
+      case MRG_PRESS:
+        mrg_pointer_press (mrg, event.x, event.y, event.arg, event.time);
+        break;
+      case MRG_MOTION:
+        mrg_pointer_motion (mrg, event.x, event.y, event.arg, event.time);
+        break;
+      case MRG_RELEASE:
+        mrg_pointer_release (mrg, event.x, event.y, event.arg, event.time);
+        break;
+      case MRG_KEY_DOWN:
+        mrg_key_press (mrg, event.arg, arg, event.time);
+        break;
+      case MRG_SCROLL:
+        mrg_scrolled (mrg, event.x, event.y, event.arg, event.time);
+        break;
+      case MRG_MESSAGE:
+        mrg_incoming_message (mrg, arg, event.time);
+        break;
+      default:
+        break;
+    }
+    handled = _mrg_ticks () - start;
+    handle_total += handled;
+    if (handled > handle_max)
+      handle_max = handled;
+
+    if (_mrg_is_dirty (mrg))
+      replay_frame (mrg);
+
+    fprintf (stderr, "event %i %s handle %.3fms", record->events,
+             event_name (event.type), handled / 1000.0);
+    if (record->frames != frames)
+      fprintf (stderr, " flush %.3fms", record->latency_last / 1000.0);
+    fprintf (stderr, "\n");
+  }
+
+  if (record->events)
+    fprintf (stderr, "mrg replay: handle avg %.3fms max %.3fms\n",
+             handle_total / 1000.0 / record->events, handle_max / 1000.0);
+  mrg_record_report (record, "mrg replay");
+
+  mrg_record_stop (mrg);
+  free (string);
+  fclose (file);
+  return 0;
+}
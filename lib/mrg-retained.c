@@ -0,0 +1,547 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* retained subtrees, the content of an element started with
+ * mrg_start_cached is drawn into a cairo recording surface - by making it
+ * the printing_cr - and the listeners it registered are kept along with
+ * the layout state it ended in. In later frames where the element starts
+ * in the same layout state with the same version, the recording is painted
+ * and the listeners registered again with the current transform, instead
+ * of laying out the content again.
+ *
+ * Layout uses the geometry of the previous frame in places, a recording is
+ * thus only replayed once it has been made twice from the same state.
+ *
+ * Nothing is recorded when frames are painted by several render threads,
+ * see mrg-raster.c.
+ */
+
+#include "mrg-internal.h"
+
+#define MRG_RETAINED_DEPTH 16
+
+typedef struct MrgRetainedListener {
+  cairo_matrix_t matrix;   /* the transform it was registered with */
+  cairo_path_t   path;
+  void          *id_ptr;
+  MrgItemCb     *cb;
+  int            cb_count;
+} MrgRetainedListener;
+
+/* a block the :hover state of which follows from the pointer position */
+typedef struct MrgRetainedBox {
+  cairo_matrix_t matrix;
+  float          x;
+  float          y;
+  float          width;
+  float          height;
+  int            hover;
+} MrgRetainedBox;
+
+typedef struct MrgRetainedEntry {
+  void            *id_ptr;
+  int              version;
+  int              frame;     /* the last frame it was used in */
+  int              valid;     /* has a recording */
+  int              settled;   /* recorded twice from the same state */
+
+  cairo_matrix_t   matrix;    /* the transform it was recorded with */
+  cairo_surface_t *recording;
+
+  /* layout state at the start, the recording applies when it is the same */
+  float            start_x;
+  float            start_y;
+  MrgState         start_state;
+  MrgHtmlState    *start_html;
+  int              html_count;
+  int              pointer_down;
+
+  /* and at the end, restored when replaying */
+  float            end_x;
+  float            end_y;
+  MrgState         end_state;
+  MrgHtmlState    *end_html;
+
+  MrgRetainedListener *listeners;
+  int                  listener_count;
+
+  MrgRetainedBox      *boxes;
+  int                  box_count;
+  int                  boxes_allocated;
+
+  MrgClosure          *closures;  /* of text listens */
+  int                  closure_count;
+} MrgRetainedEntry;
+
+typedef struct MrgRetainedActive {
+  MrgRetainedEntry *entry;
+  int               state_no;  /* of the element */
+  int               recording;
+  cairo_t          *prev_cr;   /* printing_cr to restore */
+  MrgList          *items;     /* mrg->items at the start */
+  int               text_listen_count;
+  int               text_listen_active;
+} MrgRetainedActive;
+
+struct _MrgRetained {
+  MrgList          *entries;
+  int               frame;
+  MrgRetainedActive active[MRG_RETAINED_DEPTH];
+  int               depth;
+};
+
+/* the listener data of the recording can still be pointed at by items of
+ * frames on screen, it is finalized when they are gone
+ */
+static void entry_clear (Mrg *mrg, MrgRetainedEntry *entry)
+{
+  int i, j;
+
+  if (entry->recording)
+    cairo_surface_destroy (entry->recording);
+  entry->recording = NULL;
+
+  for (i = 0; i < entry->listener_count; i++)
+  {
+    MrgRetainedListener *listener = &entry->listeners[i];
+    for (j = 0; j < listener->cb_count; j++)
+      if (listener->cb[j].finalize)
+        _mrg_defer_finalize (mrg, listener->cb[j].finalize,
+                             listener->cb[j].data1,
+                             listener->cb[j].data2,
+                             listener->cb[j].finalize_data);
+    free (listener->cb);
+    free (listener->path.data);
+  }
+  free (entry->listeners);
+  entry->listeners = NULL;
+  entry->listener_count = 0;
+
+  for (i = 0; i < entry->closure_count; i++)
+    _mrg_defer_finalize (mrg, entry->closures[i].finalize,
+                         entry->closures[i].data1,
+                         entry->closures[i].data2,
+                         entry->closures[i].finalize_data);
+  free (entry->closures);
+  entry->closures = NULL;
+  entry->closure_count = 0;
+
+  free (entry->start_html);
+  free (entry->end_html);
+  entry->start_html = entry->end_html = NULL;
+  entry->box_count = 0;
+  entry->valid = 0;
+}
+
+static void entry_free (void *data, void *mrg)
+{
+  MrgRetainedEntry *entry = data;
+  entry_clear (mrg, entry);
+  free (entry->boxes);
+  free (entry);
+}
+
+static MrgRetainedEntry *entry_get (Mrg *mrg, void *id_ptr)
+{
+  MrgRetained *retained = mrg->retained;
+  MrgRetainedEntry *entry;
+  MrgList *l;
+  for (l = retained->entries; l; l = l->next)
+  {
+    entry = l->data;
+    if (entry->id_ptr == id_ptr)
+      return entry;
+  }
+  entry = calloc (sizeof (MrgRetainedEntry), 1);
+  entry->id_ptr = id_ptr;
+  mrg_list_prepend_full (&retained->entries, entry, entry_free, mrg);
+  return entry;
+}
+
+/* the parts of the state the layout of the content depends on, style_id
+ * is a copy made for each frame
+ */
+static int state_equal (MrgState *a, MrgState *b)
+{
+  return !memcmp (&a->style, &b->style, sizeof (MrgStyle)) &&
+         a->wrap_edge_left  == b->wrap_edge_left &&
+         a->wrap_edge_right == b->wrap_edge_right &&
+         a->wrap_edge_data  == b->wrap_edge_data &&
+         a->edge_top    == b->edge_top &&
+         a->edge_left   == b->edge_left &&
+         a->edge_right  == b->edge_right &&
+         a->edge_bottom == b->edge_bottom &&
+         a->skip_lines  == b->skip_lines &&
+         a->max_lines   == b->max_lines &&
+         a->span_bg_started == b->span_bg_started &&
+         a->children    == b->children;
+}
+
+/* the transform taking what was recorded with entry->matrix to the
+ * current transform
+ */
+static void replay_transform (MrgRetainedEntry *entry, cairo_matrix_t *current,
+                              cairo_matrix_t *delta)
+{
+  cairo_matrix_t inverse = entry->matrix;
+  cairo_matrix_invert (&inverse);
+  cairo_matrix_multiply (delta, &inverse, current);
+}
+
+static int hover_unchanged (Mrg *mrg, MrgRetainedEntry *entry,
+                            cairo_matrix_t *delta)
+{
+  int i;
+  for (i = 0; i < entry->box_count; i++)
+  {
+    MrgRetainedBox *box = &entry->boxes[i];
+    cairo_matrix_t transform;
+    double x = mrg_pointer_x (mrg);
+    double y = mrg_pointer_y (mrg);
+    int hover;
+
+    cairo_matrix_multiply (&transform, &box->matrix, delta);
+    cairo_matrix_invert (&transform);
+    cairo_matrix_transform_point (&transform, &x, &y);
+    hover = x >= box->x && x < box->x + box->width &&
+            y >= box->y && y < box->y + box->height;
+    if (hover != box->hover)
+      return 0;
+    if (hover && mrg->pointer_down[1] != entry->pointer_down)
+      return 0;
+  }
+  return 1;
+}
+
+static int entry_applies (Mrg *mrg, MrgRetainedEntry *entry, int version,
+                          cairo_matrix_t *delta)
+{
+  MrgHtml *ctx = &mrg->html;
+  return entry->valid &&
+         entry->version == version &&
+         entry->start_x == mrg->x &&
+         entry->start_y == mrg->y &&
+         entry->html_count == ctx->state_no + 1 &&
+         state_equal (&entry->start_state, mrg->state) &&
+         !memcmp (entry->start_html, ctx->states,
+                  sizeof (MrgHtmlState) * entry->html_count) &&
+         hover_unchanged (mrg, entry, delta);
+}
+
+static void box_add (MrgRetainedEntry *entry, cairo_matrix_t *matrix,
+                     float x, float y, float width, float height, int hover)
+{
+  MrgRetainedBox *box;
+  if (entry->box_count + 1 > entry->boxes_allocated)
+  {
+    entry->boxes_allocated = entry->boxes_allocated * 2 + 16;
+    entry->boxes = realloc (entry->boxes, sizeof (MrgRetainedBox) * entry->boxes_allocated);
+  }
+  box = &entry->boxes[entry->box_count++];
+  box->matrix = *matrix;
+  box->x = x;
+  box->y = y;
+  box->width = width;
+  box->height = height;
+  box->hover = hover;
+}
+
+/* the innermost subtree being recorded, if any */
+static MrgRetainedEntry *recording_entry (MrgRetained *retained)
+{
+  int i;
+  for (i = retained->depth - 1; i >= 0; i--)
+    if (retained->active[i].recording)
+      return retained->active[i].entry;
+  return NULL;
+}
+
+void _mrg_retained_box (Mrg *mrg, float x, float y, float width, float height,
+                        int hover)
+{
+  MrgRetainedEntry *entry = recording_entry (mrg->retained);
+  cairo_matrix_t matrix;
+  if (!entry)
+    return;
+  cairo_get_matrix (mrg_cr (mrg), &matrix);
+  box_add (entry, &matrix, x, y, width, height, hover);
+  if (hover)
+    entry->pointer_down = mrg->pointer_down[1];
+}
+
+static void replay (Mrg *mrg, MrgRetainedEntry *entry, cairo_matrix_t *delta)
+{
+  MrgRetainedEntry *outer = recording_entry (mrg->retained);
+  MrgHtml *ctx = &mrg->html;
+  cairo_t *cr = mrg_cr (mrg);
+  char    *style_id = mrg->state->style_id;
+  void    *id_ptr = mrg->state->style.id_ptr;
+  int i, j;
+
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
+  cairo_save (cr);
+  cairo_set_matrix (cr, delta);
+  cairo_set_source_surface (cr, entry->recording, 0, 0);
+  cairo_paint (cr);
+  cairo_restore (cr);
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
+
+  for (i = 0; i < entry->listener_count; i++)
+  {
+    MrgRetainedListener *listener = &entry->listeners[i];
+    cairo_matrix_t transform;
+
+    cairo_matrix_multiply (&transform, &listener->matrix, delta);
+    cairo_save (cr);
+    cairo_set_matrix (cr, &transform);
+    cairo_new_path (cr);
+    cairo_append_path (cr, &listener->path);
+    /* the id used for recycling the item is that of the style */
+    mrg->state->style.id_ptr = listener->id_ptr;
+    for (j = 0; j < listener->cb_count; j++)
+      mrg_listen_full (mrg, listener->cb[j].types, listener->cb[j].cb,
+                       listener->cb[j].data1, listener->cb[j].data2,
+                       NULL, NULL);
+    cairo_new_path (cr);
+    cairo_restore (cr);
+  }
+  mrg->state->style.id_ptr = id_ptr;
+
+  /* an enclosing recording needs the hover boxes in this one */
+  if (outer)
+    for (i = 0; i < entry->box_count; i++)
+    {
+      MrgRetainedBox *box = &entry->boxes[i];
+      cairo_matrix_t transform;
+      cairo_matrix_multiply (&transform, &box->matrix, delta);
+      box_add (outer, &transform, box->x, box->y, box->width, box->height,
+               box->hover);
+    }
+
+  mrg->x = entry->end_x;
+  mrg->y = entry->end_y;
+  *mrg->state = entry->end_state;
+  mrg->state->style_id = style_id;
+  memcpy (ctx->states, entry->end_html, sizeof (MrgHtmlState) * entry->html_count);
+  ctx->state = &ctx->states[ctx->state_no];
+}
+
+static void record_start (Mrg *mrg, MrgRetainedEntry *entry,
+                          MrgRetainedActive *active)
+{
+  MrgHtml *ctx = &mrg->html;
+  cairo_t *cr = mrg_cr (mrg);
+  cairo_t *rec;
+  cairo_matrix_t font_matrix;
+  cairo_font_options_t *options;
+
+  entry_clear (mrg, entry);
+
+  entry->start_x = mrg->x;
+  entry->start_y = mrg->y;
+  entry->start_state = *mrg->state;
+  entry->html_count = ctx->state_no + 1;
+  entry->start_html = malloc (sizeof (MrgHtmlState) * entry->html_count);
+  memcpy (entry->start_html, ctx->states, sizeof (MrgHtmlState) * entry->html_count);
+
+  /* the recording context continues where cr is; the font options of the
+   * target are carried over, since a recording surface does not hint
+   * metrics and text would otherwise be measured differently
+   */
+  cairo_get_matrix (cr, &entry->matrix);
+  entry->recording = cairo_recording_surface_create (CAIRO_CONTENT_COLOR_ALPHA, NULL);
+  rec = cairo_create (entry->recording);
+  cairo_set_matrix (rec, &entry->matrix);
+  cairo_set_source (rec, cairo_get_source (cr));
+  cairo_set_font_face (rec, cairo_get_font_face (cr));
+  cairo_get_font_matrix (cr, &font_matrix);
+  cairo_set_font_matrix (rec, &font_matrix);
+  options = cairo_font_options_create ();
+  cairo_surface_get_font_options (cairo_get_target (cr), options);
+  {
+    /* along with those set on cr, when its target is a recording too */
+    cairo_font_options_t *cr_options = cairo_font_options_create ();
+    cairo_get_font_options (cr, cr_options);
+    cairo_font_options_merge (options, cr_options);
+    cairo_font_options_destroy (cr_options);
+  }
+  cairo_set_font_options (rec, options);
+  cairo_font_options_destroy (options);
+  cairo_set_antialias (rec, cairo_get_antialias (cr));
+  cairo_set_line_width (rec, cairo_get_line_width (cr));
+  cairo_set_fill_rule (rec, cairo_get_fill_rule (cr));
+  cairo_set_operator (rec, cairo_get_operator (cr));
+
+  active->recording = 1;
+  active->prev_cr = mrg->printing_cr;
+  active->items = mrg->items;
+  active->text_listen_count = mrg->text_listen_count;
+  active->text_listen_active = mrg->text_listen_active;
+  mrg->printing_cr = rec;
+  mrg->retained_recording++;
+}
+
+static void record_end (Mrg *mrg, MrgRetainedActive *active)
+{
+  MrgRetainedEntry *entry = active->entry;
+  MrgHtml *ctx = &mrg->html;
+  MrgList *l;
+  int i;
+
+  cairo_destroy (mrg->printing_cr);
+  mrg->printing_cr = active->prev_cr;
+  mrg->retained_recording--;
+
+  entry->end_x = mrg->x;
+  entry->end_y = mrg->y;
+  entry->end_state = *mrg->state;
+  entry->end_html = malloc (sizeof (MrgHtmlState) * entry->html_count);
+  memcpy (entry->end_html, ctx->states, sizeof (MrgHtmlState) * entry->html_count);
+
+  /* the items registered since the start, items are prepended */
+  for (l = mrg->items; l != active->items; l = l->next)
+    entry->listener_count++;
+  entry->listeners = calloc (sizeof (MrgRetainedListener), entry->listener_count);
+  i = entry->listener_count;
+  for (l = mrg->items; l != active->items; l = l->next)
+  {
+    MrgItem *item = l->data;
+    MrgRetainedListener *listener = &entry->listeners[--i];
+    int j;
+
+    listener->matrix = item->inv_matrix;
+    cairo_matrix_invert (&listener->matrix);
+    listener->path.status = CAIRO_STATUS_SUCCESS;
+    listener->path.num_data = item->path->num_data;
+    listener->path.data = malloc (sizeof (cairo_path_data_t) * item->path->num_data);
+    memcpy (listener->path.data, item->path->data,
+            sizeof (cairo_path_data_t) * item->path->num_data);
+    listener->id_ptr = item->id_ptr;
+    listener->cb_count = item->cb_count;
+    listener->cb = malloc (sizeof (MrgItemCb) * item->cb_count);
+    memcpy (listener->cb, item->cb, sizeof (MrgItemCb) * item->cb_count);
+    /* the callback data lives as long as the recording now */
+    for (j = 0; j < item->cb_count; j++)
+      item->cb[j].finalize = NULL;
+  }
+
+  for (i = active->text_listen_count; i < mrg->text_listen_count; i++)
+    if (mrg->text_listen_finalize[i])
+    {
+      MrgClosure *closure;
+      entry->closures = realloc (entry->closures,
+                   sizeof (MrgClosure) * (entry->closure_count + 1));
+      closure = &entry->closures[entry->closure_count++];
+      closure->finalize = mrg->text_listen_finalize[i];
+      closure->data1 = mrg->text_listen_data1[i];
+      closure->data2 = mrg->text_listen_data2[i];
+      closure->finalize_data = mrg->text_listen_finalize_data[i];
+      mrg->text_listen_finalize[i] = NULL;
+    }
+
+  /* content leaving a text listen open cannot be replayed */
+  entry->valid = mrg->text_listen_active == active->text_listen_active;
+}
+
+int mrg_start_cached (Mrg *mrg, const char *style_id, void *id_ptr, int version)
+{
+  MrgRetained       *retained;
+  MrgRetainedEntry  *entry;
+  MrgRetainedActive *active;
+  cairo_matrix_t     current, delta;
+  int                applies;
+
+  mrg_start (mrg, style_id, id_ptr);
+
+  /* a recording painted into the frame would be painted from by all the
+   * render threads at once
+   */
+  if (!id_ptr || !mrg->in_paint || mrg->printing || mrg_is_terminal (mrg) ||
+      _mrg_raster_threads (mrg) > 1)
+    return 1;
+  if (!mrg->retained)
+    mrg->retained = calloc (sizeof (MrgRetained), 1);
+  retained = mrg->retained;
+  if (retained->depth >= MRG_RETAINED_DEPTH)
+    return 1;
+
+  entry = entry_get (mrg, id_ptr);
+  entry->frame = retained->frame;
+  applies = 0;
+  if (entry->valid)
+  {
+    cairo_get_matrix (mrg_cr (mrg), &current);
+    replay_transform (entry, &current, &delta);
+    applies = entry_applies (mrg, entry, version, &delta);
+  }
+
+  active = &retained->active[retained->depth++];
+  memset (active, 0, sizeof (MrgRetainedActive));
+  active->entry = entry;
+  active->state_no = mrg->state_no;
+
+  if (applies && entry->settled)
+  {
+    replay (mrg, entry, &delta);
+    return 0;
+  }
+
+  record_start (mrg, entry, active);
+  entry->version = version;
+  entry->settled = applies;
+  return 1;
+}
+
+void _mrg_retained_end (Mrg *mrg)
+{
+  MrgRetained *retained = mrg->retained;
+  MrgRetainedActive *active;
+
+  if (!retained->depth ||
+      retained->active[retained->depth - 1].state_no != mrg->state_no)
+    return;
+  active = &retained->active[--retained->depth];
+  if (active->recording)
+    record_end (mrg, active);
+}
+
+/* drops the recordings that were not used in the frame that ended */
+void _mrg_retained_frame (Mrg *mrg)
+{
+  MrgRetained *retained = mrg->retained;
+  MrgList *l, *unused = NULL;
+
+  for (l = retained->entries; l; l = l->next)
+  {
+    MrgRetainedEntry *entry = l->data;
+    if (entry->frame != retained->frame)
+      mrg_list_prepend (&unused, entry);
+  }
+  for (l = unused; l; l = l->next)
+    mrg_list_remove (&retained->entries, l->data);
+  mrg_list_free (&unused);
+  retained->frame++;
+}
+
+void _mrg_retained_destroy (Mrg *mrg)
+{
+  if (!mrg->retained)
+    return;
+  mrg_list_free (&mrg->retained->entries);
+  free (mrg->retained);
+  mrg->retained = NULL;
+}
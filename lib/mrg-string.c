@@ -205,18 +205,29 @@ mrg_string_set (MrgString *string, const char *new_string)
 }
 
 #include "mrg-list.h"
+#include <pthread.h>
+
+/* interned strings are shared by all instances in the process, and live
+ * until exit; the lock lets instances on different threads intern
+ */
 static MrgList *interns = NULL;
+static pthread_mutex_t interns_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 const char * mrg_intern_string (const char *str)
 {
   MrgList *i;
+  pthread_mutex_lock (&interns_mutex);
   for (i = interns; i; i = i->next)
   {
     if (!strcmp (i->data, str))
+    {
+      pthread_mutex_unlock (&interns_mutex);
       return i->data;
+    }
   }
   str = strdup (str);
   mrg_list_append (&interns, (void*)str);
+  pthread_mutex_unlock (&interns_mutex);
   return str;
 }
 
@@ -1393,6 +1393,7 @@ void mrg_set_style (Mrg *mrg, const char *style)
 {
   MrgStyle *s;
 
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_STYLE);
   css_parse_properties (mrg, style, mrg_css_handle_property_pass0);
   css_parse_properties (mrg, style, mrg_css_handle_property_pass1);
   css_parse_properties (mrg, style, mrg_css_handle_property_pass1med);
@@ -1452,6 +1453,7 @@ void mrg_set_style (Mrg *mrg, const char *style)
   }
 
   css_parse_properties (mrg, style, mrg_css_handle_property_pass2);
+  MRG_PROFILE_END (mrg, MRG_PHASE_STYLE);
 }
 
 void _mrg_init_style (Mrg *mrg)
@@ -308,6 +308,23 @@ void mrg_start_with_stylef (Mrg *mrg, const char *style_id, void *id_ptr,
                        const char *format, ...);
 void mrg_end       (Mrg *mrg);
 
+/**
+ * mrg_start_cached:
+ * @mrg the mrg-context
+ * @style_id and @id_ptr as for mrg_start, id_ptr identifies the recording
+ * @version to be changed by the caller whenever the content changes
+ *
+ * Like mrg_start, but what is drawn until the matching mrg_end, and the
+ * listeners registered, are recorded. In later frames where the element
+ * starts at the same place and with the same style and version the
+ * recording is replayed and 0 returned; the content is then to be skipped,
+ * with mrg_end called right away. Returns 1 when the content is to be
+ * generated. Stylesheets added in the content do not apply after it when
+ * it is replayed.
+ */
+int  mrg_start_cached (Mrg *mrg, const char *style_id, void *id_ptr,
+                       int version);
+
 
 void mrg_stylesheet_clear (Mrg *mrg);
 void mrg_stylesheet_add (Mrg *mrg, const char *css, const char *uri,
@@ -138,92 +138,90 @@ enum {
   MRG_HL_COMMENT_STAR = 9,
 };
 
-static int hl_state_c = MRG_HL_NEUTRAL;
-
-static void mrg_hl_token (cairo_t *cr, const char *word)
+static void mrg_hl_token (Mrg *mrg, cairo_t *cr, const char *word)
 {
-  switch (hl_state_c)
+  switch (mrg->hl_state)
   {
     case MRG_HL_NEUTRAL:
       if (!strcmp (word, "\""))
       {
-        hl_state_c = MRG_HL_STRING;
+        mrg->hl_state = MRG_HL_STRING;
       }
       else if (!strcmp (word, "'"))
       {
-        hl_state_c = MRG_HL_QSTRING;
+        mrg->hl_state = MRG_HL_QSTRING;
       }
       else if (!strcmp (word, "/"))
       {
-        hl_state_c = MRG_HL_SLASH;
+        mrg->hl_state = MRG_HL_SLASH;
       }
       break;
     case MRG_HL_SLASH:
       if (!strcmp (word, "/"))
       {
-        hl_state_c = MRG_HL_LINECOMMENT;
+        mrg->hl_state = MRG_HL_LINECOMMENT;
       } else if (!strcmp (word, "*"))
       {
-        hl_state_c = MRG_HL_COMMENT;
+        mrg->hl_state = MRG_HL_COMMENT;
       } else
       {
-        hl_state_c = MRG_HL_NEUTRAL;
+        mrg->hl_state = MRG_HL_NEUTRAL;
       }
       break;
     case MRG_HL_LINECOMMENT:
       if (!strcmp (word, "\n"))
       {
-        hl_state_c = MRG_HL_NEXT_NEUTRAL;
+        mrg->hl_state = MRG_HL_NEXT_NEUTRAL;
       }
       break;
     case MRG_HL_COMMENT:
       if (!strcmp (word, "*"))
       {
-        hl_state_c = MRG_HL_COMMENT_STAR;
+        mrg->hl_state = MRG_HL_COMMENT_STAR;
       }
       break;
     case MRG_HL_COMMENT_STAR:
       if (!strcmp (word, "/"))
       {
-        hl_state_c = MRG_HL_NEUTRAL;
+        mrg->hl_state = MRG_HL_NEUTRAL;
       }
       else
       {
-        hl_state_c = MRG_HL_COMMENT;
+        mrg->hl_state = MRG_HL_COMMENT;
       }
       break;
     case MRG_HL_STRING:
       if (!strcmp (word, "\""))
       {
-        hl_state_c = MRG_HL_NEXT_NEUTRAL;
+        mrg->hl_state = MRG_HL_NEXT_NEUTRAL;
       }
       else if (!strcmp (word, "\\"))
       {
-        hl_state_c = MRG_HL_STRING_ESC;
+        mrg->hl_state = MRG_HL_STRING_ESC;
       }
       break;
     case MRG_HL_STRING_ESC:
-      hl_state_c = MRG_HL_STRING;
+      mrg->hl_state = MRG_HL_STRING;
       break;
     case MRG_HL_QSTRING:
       if (!strcmp (word, "'"))
       {
-        hl_state_c = MRG_HL_NEXT_NEUTRAL;
+        mrg->hl_state = MRG_HL_NEXT_NEUTRAL;
       }
       else if (!strcmp (word, "\\"))
       {
-        hl_state_c = MRG_HL_QSTRING_ESC;
+        mrg->hl_state = MRG_HL_QSTRING_ESC;
       }
       break;
     case MRG_HL_QSTRING_ESC:
-      hl_state_c = MRG_HL_QSTRING;
+      mrg->hl_state = MRG_HL_QSTRING;
       break;
     case MRG_HL_NEXT_NEUTRAL:
-      hl_state_c = MRG_HL_NEUTRAL;
+      mrg->hl_state = MRG_HL_NEUTRAL;
       break;
   }
 
-  switch (hl_state_c)
+  switch (mrg->hl_state)
   {
     case MRG_HL_NEUTRAL:
       if (is_a_number (word))
@@ -252,7 +250,7 @@ static void mrg_hl_token (cairo_t *cr, const char *word)
 }
 
 /* hook syntax highlighter in here..  */
-void mrg_hl_text (cairo_t *cr, const char *text)
+void mrg_hl_text (Mrg *mrg, cairo_t *cr, const char *text)
 {
   int i;
   MrgString *word = mrg_string_new ("");
@@ -280,11 +278,11 @@ void mrg_hl_text (cairo_t *cr, const char *text)
       case '(':
         if (word->length)
         {
-          mrg_hl_token (cr, word->str);
+          mrg_hl_token (mrg, cr, word->str);
           mrg_string_set (word, "");
         }
         mrg_string_append_byte (word, text[i]);
-        mrg_hl_token (cr, word->str);
+        mrg_hl_token (mrg, cr, word->str);
         mrg_string_set (word, "");
         break;
       default:
@@ -294,7 +292,7 @@ void mrg_hl_text (cairo_t *cr, const char *text)
     }
   }
   if (word->length)
-    mrg_hl_token (cr, word->str);
+    mrg_hl_token (mrg, cr, word->str);
 
   mrg_string_free (word, 1);
 }
@@ -365,6 +363,7 @@ float mrg_draw_string (Mrg *mrg, MrgStyle *style,
   }
   else if (mrg->in_paint)
   {
+    MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
     cairo_set_font_size (cr, style->font_size);
 
     if (style->text_stroke_width > 0.01)
@@ -389,7 +388,7 @@ float mrg_draw_string (Mrg *mrg, MrgStyle *style,
     if (style->syntax_highlight[0] == 0)
       cairo_show_text (cr, string);
     else if (!strcmp (style->syntax_highlight, "C"))
-      mrg_hl_text (cr, string);
+      mrg_hl_text (mrg, cr, string);
     else
       cairo_show_text (cr, string);
 
@@ -414,6 +413,7 @@ float mrg_draw_string (Mrg *mrg, MrgStyle *style,
         cairo_stroke (cr);
       }
     cairo_move_to (cr, new_x, y);
+    MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
   }
 
   if (mrg->text_listen_active)
@@ -454,6 +454,7 @@ float paint_span_bg_final (Mrg   *mrg, float x, float y,
   if (style->display != MRG_DISPLAY_INLINE)
     return 0.0;
 
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   if (style->background_color.alpha > 0.001)
   {
     cairo_save (cr);
@@ -470,6 +471,7 @@ float paint_span_bg_final (Mrg   *mrg, float x, float y,
   _mrg_border_top_r (mrg, x, y - mrg_em (mrg) , width, mrg_em (mrg));
   _mrg_border_bottom_r (mrg, x, y - mrg_em (mrg), width, mrg_em (mrg));
   _mrg_border_right (mrg, x, y - mrg_em (mrg), width, mrg_em (mrg));
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 
   return style->padding_right + style->border_right_width;
 }
@@ -493,6 +495,7 @@ float paint_span_bg (Mrg   *mrg, float x, float y,
     mrg->state->span_bg_started = 1;
   }
 
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   if (style->background_color.alpha > 0.001)
   {
     cairo_save (cr);
@@ -517,6 +520,7 @@ float paint_span_bg (Mrg   *mrg, float x, float y,
     _mrg_border_top_m (mrg, x, y - mrg_em (mrg) , width, mrg_em (mrg));
     _mrg_border_bottom_m (mrg, x, y - mrg_em (mrg), width, mrg_em (mrg));
   }
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 
   return left_pad + left_border;
 }
@@ -532,10 +536,11 @@ mrg_addstr (Mrg *mrg, float x, float y, const char *string, int utf8_length)
     double tx = x;
     double ty = y;
     cairo_user_to_device (mrg_cr (mrg), &tx, &ty);
-    if (ty > mrg->height * 2 ||
-        tx > mrg->width * 2 ||
-        tx < -mrg->width * 2 ||
-        ty < -mrg->height * 2)
+    if (!mrg->retained_recording &&
+        (ty > mrg->height * 2 ||
+         tx > mrg->width * 2 ||
+         tx < -mrg->width * 2 ||
+         ty < -mrg->height * 2))
     {
       /* bailing early*/
     }
@@ -1174,7 +1179,13 @@ int mrg_print (Mrg *mrg, const char *string)
     return 0;
 
   if (mrg_edge_left(mrg) != mrg_edge_right(mrg))
-   return mrg_print_wrap (mrg, 1, string, strlen (string), mrg->state->max_lines, mrg->state->skip_lines, mrg->cursor_pos, NULL, NULL);
+  {
+    int wraps;
+    MRG_PROFILE_BEGIN (mrg, MRG_PHASE_LAYOUT);
+    wraps = mrg_print_wrap (mrg, 1, string, strlen (string), mrg->state->max_lines, mrg->state->skip_lines, mrg->cursor_pos, NULL, NULL);
+    MRG_PROFILE_END (mrg, MRG_PHASE_LAYOUT);
+    return wraps;
+  }
 
   ret  = mrg_addstr (mrg, mrg->x, mrg->y, string, mrg_utf8_strlen (string));
   mrg->x += ret;
@@ -1183,7 +1194,7 @@ int mrg_print (Mrg *mrg, const char *string)
 
 void _mrg_text_prepare (Mrg *mrg)
 {
-  hl_state_c = MRG_HL_NEUTRAL;
+  mrg->hl_state = MRG_HL_NEUTRAL;
 }
 
 void _mrg_text_init (Mrg *mrg)
@@ -87,6 +87,41 @@ void mrg_xml_render (Mrg *mrg,
                      void *finalize_data,
                      char *html);
 
+/* a document parsed once, for rendering repeatedly without tokenizing,
+ * html does not need to be kept around after parsing.
+ */
+typedef struct _MrgXmlDoc MrgXmlDoc;
+
+MrgXmlDoc *mrg_xml_doc_new  (const char *html);
+void       mrg_xml_doc_free (MrgXmlDoc *doc);
+
+/* parsing as the source arrives; chunks can be split anywhere, and the
+ * document can be rendered between feeds with what has been parsed so far.
+ * Finishing flushes the end of the source, a finished document is the same
+ * as one created with mrg_xml_doc_new.
+ */
+MrgXmlDoc *mrg_xml_doc_new_stream   (void);
+void       mrg_xml_doc_feed         (MrgXmlDoc *doc, const char *data, int length);
+void       mrg_xml_doc_finish       (MrgXmlDoc *doc);
+int        mrg_xml_doc_is_finished  (MrgXmlDoc *doc);
+
+/* with incremental layout, rendering a document only lays out what is
+ * needed to cover the current clip, plus a clip height of margin above
+ * and below. Where the blocks of the document start is remembered, such
+ * that rendering further down starts at the nearest block above instead of
+ * at the top. Meant for long documents of mostly plain blocks, like logs;
+ * the remembered positions are dropped when the width changes.
+ */
+void       mrg_xml_doc_set_incremental (MrgXmlDoc *doc, int incremental);
+
+void mrg_xml_render_doc (Mrg *mrg,
+                         char *uri_base,
+                         void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                         void *link_data,
+                         void *(finalize)(void *listen_data, void *listen_data2, void *finalize_data),
+                         void *finalize_data,
+                         MrgXmlDoc *doc);
+
 void mrg_xml_renderf (Mrg *mrg,
                       char *uri_base,
                       void (*link_cb) (MrgEvent *event, void *href, void *link_data),
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "mrg-list.h"
 #include "mrg-config.h"
 #include "mrg-string.h"
@@ -466,7 +467,11 @@ typedef struct _CacheEntry {
   long  length;
 } CacheEntry;
 
+/* the fetched contents are shared by all instances in the process, the
+ * lock is held while the list is walked or extended but not while fetching
+ */
 static MrgList *cache = NULL;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 char *_mrg_resolve_uri (const char *base_uri, const char *uri)
 {
@@ -594,6 +599,7 @@ mrg_get_contents_default (const char  *referer,
   /* should resolve before mrg_get_contents  */
   char *uri = _mrg_resolve_uri (referer, input_uri);
 
+  pthread_mutex_lock (&cache_mutex);
   for (i = cache; i; i = i->next)
   {
     CacheEntry *entry = i->data;
@@ -602,6 +608,7 @@ mrg_get_contents_default (const char  *referer,
       *contents = malloc (entry->length + 1);
       memcpy (*contents, entry->contents, entry->length);
       (*contents)[entry->length]=0;
+      pthread_mutex_unlock (&cache_mutex);
       free (uri);
       if (length) *length = entry->length;
       if (length)
@@ -615,6 +622,8 @@ mrg_get_contents_default (const char  *referer,
     }
   }
 
+  pthread_mutex_unlock (&cache_mutex);
+
   {
     CacheEntry *entry = calloc (sizeof (CacheEntry), 1);
     char *c = NULL;
@@ -630,7 +639,6 @@ mrg_get_contents_default (const char  *referer,
       entry->contents = NULL;
       entry->length = 0;
     }
-    mrg_list_prepend (&cache, entry);
 
 #if MRG_URI_LOG
     if (c)
@@ -639,6 +647,24 @@ mrg_get_contents_default (const char  *referer,
       fprintf (stderr, "FAIL\t%s\n", uri);
 #endif
 
+    /* another thread may have fetched the same uri meanwhile, keep the
+     * entry that made it into the cache first
+     */
+    pthread_mutex_lock (&cache_mutex);
+    for (i = cache; i; i = i->next)
+      if (!strcmp (((CacheEntry*)i->data)->uri, uri))
+        break;
+    if (i)
+    {
+      free (entry->contents);
+      free (entry->uri);
+      free (entry);
+    }
+    else
+    {
+      mrg_list_prepend (&cache, entry);
+    }
+    pthread_mutex_unlock (&cache_mutex);
   }
 
 
@@ -0,0 +1,669 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* parsing of xml/html into the flat node array that mrg_xml_render_doc
+ * walks. Everything that does not depend on layout is resolved here, once:
+ * lowercasing, implied closing of tags, entities, selectors and the css of
+ * presentation attributes. A document is three blocks of memory; nodes,
+ * attributes and a string arena that nodes and attributes index into.
+ */
+
+#include "mrg.h"
+#include "mrg-xml.h"
+#include "mrg-internal.h"
+#include "mrg-hash.h"
+
+/* in the order of the MRG_ATOM_ enum */
+static const char *atom_names[MRG_ATOM_COUNT]={
+  "",
+  "a",
+  "br",
+  "class",
+  "d",
+  "dd",
+  "dt",
+  "g",
+  "height",
+  "hr",
+  "href",
+  "id",
+  "img",
+  "input",
+  "li",
+  "link",
+  "meta",
+  "p",
+  "path",
+  "polygon",
+  "rect",
+  "rel",
+  "src",
+  "style",
+  "table",
+  "td",
+  "text",
+  "tr",
+  "transform",
+  "width",
+  "x",
+  "y",
+};
+
+static const char *entities[][2]={
+  {"shy",    ""},   // soft hyphen,. should be made use of in wrapping..
+  {"nbsp",   " "},  //
+  {"lt",     "<"},
+  {"gt",     ">"},
+  {"trade",  "™"},
+  {"copy",   "©"},
+  {"middot", "·"},
+  {"bull",   "•"},
+  {"Oslash", "Ø"},
+  {"oslash", "ø"},
+  {"hellip", "…"},
+  {"aring",  "å"},
+  {"Aring",  "Å"},
+  {"aelig",  "æ"},
+  {"AElig",  "Æ"},
+  {"Aelig",  "Æ"},
+  {"laquo",  "«"},
+  {"raquo",  "»"},
+
+  /*the above were added as encountered, the rest in anticipation  */
+
+  {"reg",    "®"},
+  {"deg",    "°"},
+  {"plusmn", "±"},
+  {"sup2",   "²"},
+  {"sup3",   "³"},
+  {"sup1",   "¹"},
+  {"ordm",   "º"},
+  {"para",   "¶"},
+  {"cedil",  "¸"},
+  {"bull",   "·"},
+  {"amp",   "&"},
+  {"mdash",  "–"},
+  {"apos",   "'"},
+  {"quot",   "\""},
+  {"iexcl",  "¡"},
+  {"cent",   "¢"},
+  {"pound",  "£"},
+  {"euro",   "€"},
+  {"yen",    "¥"},
+  {"curren", "¤"},
+  {"sect",   "§"},
+  {"phi",    "Φ"},
+  {"omega",  "Ω"},
+  {"alpha",  "α"},
+
+  /* XXX: incomplete */
+
+  {NULL, NULL}
+};
+
+/* xml attributes that are turned into css declarations */
+static const char *style_attributes[] ={
+  "fill-rule",
+  "font-size",
+  "font-family",
+  "fill-color",
+  "fill",
+  "stroke-width",
+  "stroke-color",
+  "stroke-linecap",
+  "stroke-miterlimit",
+  "stroke-linejoin",
+  "stroke",
+  "color",
+  "background-color",
+  "background",
+  NULL};
+
+struct _MrgXmlParser {
+  MrgXmlDoc *doc;
+  int        nodes_allocated;
+  int        attrs_allocated;
+  int        atoms_allocated;
+  int        strings_allocated;
+
+  uint32_t  *atom_hash;   /* atom + 1 for used slots */
+  int        atom_hash_size;
+
+  uint32_t  *stack;       /* indices of open elements */
+  int        depth;
+  int        stack_allocated;
+
+  MrgXml    *xmltok;
+  char      *source;      /* what the tokenizer still refers to */
+  int        source_length;
+  int        source_allocated;
+  int        source_base; /* offset of source in the whole source */
+  char      *data;        /* the current token, NUL terminated */
+  int        data_allocated;
+  MrgString *scratch;
+
+  int        in_style;
+  int        should_be_empty;
+  int        tagpos;
+  int        first_attr;
+  uint32_t   pending_attr;
+};
+
+static void parser_free (MrgXmlParser *p)
+{
+  xmltok_free (p->xmltok);
+  mrg_string_free (p->scratch, 1);
+  free (p->atom_hash);
+  free (p->stack);
+  free (p->source);
+  free (p->data);
+  free (p);
+}
+
+static uint32_t doc_add_string (MrgXmlParser *p, const char *str, int length)
+{
+  MrgXmlDoc *doc = p->doc;
+  uint32_t offset = doc->strings_length;
+
+  if (doc->strings_length + length + 1 > p->strings_allocated)
+  {
+    while (doc->strings_length + length + 1 > p->strings_allocated)
+      p->strings_allocated = p->strings_allocated * 2 + 1024;
+    doc->strings = realloc (doc->strings, p->strings_allocated);
+  }
+  memcpy (&doc->strings[offset], str, length);
+  doc->strings[offset + length] = 0;
+  doc->strings_length += length + 1;
+  return offset;
+}
+
+static void atom_hash_insert (MrgXmlParser *p, uint32_t atom)
+{
+  const char *name = &p->doc->strings[p->doc->atoms[atom]];
+  uint32_t i = _mrg_fnv1a_string (name) & (p->atom_hash_size - 1);
+  while (p->atom_hash[i])
+    i = (i + 1) & (p->atom_hash_size - 1);
+  p->atom_hash[i] = atom + 1;
+}
+
+static uint32_t doc_atom (MrgXmlParser *p, const char *name)
+{
+  MrgXmlDoc *doc = p->doc;
+  uint32_t i = _mrg_fnv1a_string (name) & (p->atom_hash_size - 1);
+  uint32_t atom;
+
+  while (p->atom_hash[i])
+  {
+    atom = p->atom_hash[i] - 1;
+    if (!strcmp (&doc->strings[doc->atoms[atom]], name))
+      return atom;
+    i = (i + 1) & (p->atom_hash_size - 1);
+  }
+
+  if (doc->n_atoms + 1 > p->atoms_allocated)
+  {
+    p->atoms_allocated *= 2;
+    doc->atoms = realloc (doc->atoms, sizeof (uint32_t) * p->atoms_allocated);
+  }
+  atom = doc->n_atoms++;
+  doc->atoms[atom] = doc_add_string (p, name, strlen (name));
+
+  /* keep the load at most a half */
+  if (doc->n_atoms * 2 > p->atom_hash_size)
+  {
+    uint32_t j;
+    free (p->atom_hash);
+    p->atom_hash_size *= 2;
+    p->atom_hash = calloc (sizeof (uint32_t), p->atom_hash_size);
+    for (j = 0; j < doc->n_atoms; j++)
+      atom_hash_insert (p, j);
+  }
+  else
+    atom_hash_insert (p, atom);
+  return atom;
+}
+
+static const char *atom_name (MrgXmlDoc *doc, uint32_t atom)
+{
+  return &doc->strings[doc->atoms[atom]];
+}
+
+static MrgXmlNode *doc_add_node (MrgXmlParser *p, MrgXmlNodeType type,
+                                 int pos, const char *text)
+{
+  MrgXmlDoc  *doc = p->doc;
+  MrgXmlNode *node;
+
+  if (doc->n_nodes + 1 > p->nodes_allocated)
+  {
+    p->nodes_allocated = p->nodes_allocated * 2 + 256;
+    doc->nodes = realloc (doc->nodes, sizeof (MrgXmlNode) * p->nodes_allocated);
+  }
+  node = &doc->nodes[doc->n_nodes++];
+  memset (node, 0, sizeof (MrgXmlNode));
+  node->type = type;
+  node->pos = pos;
+  if (text)
+    node->text = doc_add_string (p, text, strlen (text));
+  return node;
+}
+
+static void doc_add_attr (MrgXmlParser *p, uint32_t atom, const char *value)
+{
+  MrgXmlDoc *doc = p->doc;
+  if (doc->n_attrs + 1 > p->attrs_allocated)
+  {
+    p->attrs_allocated = p->attrs_allocated * 2 + 64;
+    doc->attrs = realloc (doc->attrs, sizeof (MrgXmlAttr) * p->attrs_allocated);
+  }
+  doc->attrs[doc->n_attrs].atom = atom;
+  doc->attrs[doc->n_attrs].value = doc_add_string (p, value, strlen (value));
+  doc->n_attrs++;
+}
+
+static const char *doc_attr (MrgXmlDoc *doc, int first, int count, uint32_t atom)
+{
+  int i;
+  for (i = first; i < first + count; i++)
+    if (doc->attrs[i].atom == atom)
+      return &doc->strings[doc->attrs[i].value];
+  return NULL;
+}
+
+static uint32_t parent_atom (MrgXmlParser *p, int up)
+{
+  return p->doc->nodes[p->stack[p->depth - up]].atom;
+}
+
+static void close_element (MrgXmlParser *p, int flags)
+{
+  MrgXmlNode *node;
+  uint32_t    element;
+
+  if (p->depth <= 0)
+    return;
+  element = p->stack[--p->depth];
+  node = doc_add_node (p, MRG_XML_NODE_END, p->doc->nodes[element].pos, NULL);
+  node->atom = p->doc->nodes[element].atom;
+  node->flags = flags;
+  p->doc->nodes[element].end = p->doc->n_nodes - 1;
+}
+
+/* the selector of an element is its tag, classes and id, combined as
+ * tag.class1.class2#id
+ */
+static void open_element (MrgXmlParser *p, uint32_t atom, int pos,
+                          int first_attr, int n_attrs,
+                          MrgString *scratch)
+{
+  MrgXmlDoc  *doc = p->doc;
+  const char *klass = doc_attr (doc, first_attr, n_attrs, MRG_ATOM_CLASS);
+  const char *id    = doc_attr (doc, first_attr, n_attrs, MRG_ATOM_ID);
+  MrgXmlNode *node;
+  uint32_t    selector;
+  uint32_t    style;
+  int i;
+
+  mrg_string_set (scratch, atom_name (doc, atom));
+  if (klass)
+  {
+    mrg_string_append_byte (scratch, '.');
+    for (; *klass; klass++)
+      mrg_string_append_byte (scratch, *klass == ' ' ? '.' : *klass);
+  }
+  if (id)
+  {
+    mrg_string_append_byte (scratch, '#');
+    mrg_string_append_str (scratch, id);
+  }
+  selector = doc_add_string (p, scratch->str, scratch->length);
+
+  mrg_string_clear (scratch);
+  for (i = first_attr; i < first_attr + n_attrs; i++)
+  {
+    const char *name = atom_name (doc, doc->attrs[i].atom);
+    int j;
+    for (j = 0; style_attributes[j]; j++)
+      if (!strcmp (name, style_attributes[j]))
+      {
+        mrg_string_append_printf (scratch, "%s: %s;",
+            style_attributes[j], &doc->strings[doc->attrs[i].value]);
+        break;
+      }
+  }
+  mrg_string_append_str (scratch, doc_attr (doc, first_attr, n_attrs, MRG_ATOM_STYLE));
+  style = scratch->length ? doc_add_string (p, scratch->str, scratch->length) : 0;
+
+  node = doc_add_node (p, MRG_XML_NODE_ELEMENT, pos, NULL);
+  node->atom = atom;
+  node->text = selector;
+  node->style = style;
+  node->attrs = first_attr;
+  node->n_attrs = n_attrs;
+
+  if (p->depth + 1 > p->stack_allocated)
+  {
+    p->stack_allocated = p->stack_allocated * 2 + 64;
+    p->stack = realloc (p->stack, sizeof (uint32_t) * p->stack_allocated);
+  }
+  p->stack[p->depth++] = doc->n_nodes - 1;
+}
+
+static int is_implied_close (uint32_t atom, uint32_t open)
+{
+  return (atom == MRG_ATOM_DD && open == MRG_ATOM_DT) ||
+         (atom == MRG_ATOM_LI && open == MRG_ATOM_LI) ||
+         (atom == MRG_ATOM_DT && open == MRG_ATOM_DD) ||
+         (atom == MRG_ATOM_TD && open == MRG_ATOM_TD) ||
+         (atom == MRG_ATOM_TR && open == MRG_ATOM_TR) ||
+         (atom == MRG_ATOM_DD && open == MRG_ATOM_DD) ||
+         (atom == MRG_ATOM_P  && open == MRG_ATOM_P);
+}
+
+static void parse_token (MrgXmlParser *p, int type, char *data, int pos)
+{
+  uint32_t atom;
+
+  if (type == t_tag ||
+      type == t_att ||
+      type == t_endtag ||
+      type == t_closeemptytag ||
+      type == t_closetag)
+  {
+    int i;
+    for (i = 0; data[i]; i++)
+      data[i] = tolower (data[i]);
+  }
+
+  switch (type)
+  {
+    case t_entity:
+      if (data[0]=='#')
+      {
+        char c[2] = {atoi (&data[1]), 0};
+        if (c[0])
+          doc_add_node (p, MRG_XML_NODE_PRINT, pos, c);
+      }
+      else
+      {
+        int i;
+        for (i = 0; entities[i][0]; i++)
+          if (!strcmp (data, entities[i][0]))
+            break;
+        if (entities[i][0])
+          doc_add_node (p, MRG_XML_NODE_PRINT, pos, entities[i][1]);
+        else
+          doc_add_node (p, MRG_XML_NODE_ENTITY, pos, data);
+      }
+      break;
+    case t_word:
+      if (p->in_style)
+      {
+        doc_add_node (p, MRG_XML_NODE_STYLE, pos, data)->flags =
+          MRG_XML_NODE_IS_WORD;
+        p->doc->sheets_end = p->doc->n_nodes;
+      }
+      else
+        doc_add_node (p, MRG_XML_NODE_WORD, pos, data);
+      break;
+    case t_whitespace:
+      doc_add_node (p, p->in_style ? MRG_XML_NODE_STYLE : MRG_XML_NODE_SPACE,
+                    pos, data);
+      if (p->in_style)
+        p->doc->sheets_end = p->doc->n_nodes;
+      break;
+    case t_tag:
+      p->first_attr = p->doc->n_attrs;
+      p->pending_attr = MRG_ATOM_NONE;
+      p->tagpos = pos;
+      break;
+    case t_att:
+      p->pending_attr = doc_atom (p, data);
+      break;
+    case t_val:
+      doc_add_attr (p, p->pending_attr, data);
+      break;
+    case t_endtag:
+      atom = doc_atom (p, data);
+
+      if (p->depth && atom == MRG_ATOM_TR && parent_atom (p, 1) == MRG_ATOM_TD)
+      {
+        close_element (p, 0);
+        close_element (p, 0);
+      }
+      if (p->depth && atom == MRG_ATOM_TR && parent_atom (p, 1) == MRG_ATOM_TD)
+      {
+        close_element (p, 0);
+        close_element (p, 0);
+      }
+      else if (p->depth && is_implied_close (atom, parent_atom (p, 1)))
+      {
+        close_element (p, 0);
+      }
+
+      open_element (p, atom, p->tagpos, p->first_attr,
+                    p->doc->n_attrs - p->first_attr, p->scratch);
+      if (atom == MRG_ATOM_LINK)
+        p->doc->sheets_end = p->doc->n_nodes;
+
+      p->in_style = (atom == MRG_ATOM_STYLE);
+      p->should_be_empty = 0;
+
+      if (atom == MRG_ATOM_LINK ||
+          atom == MRG_ATOM_META ||
+          atom == MRG_ATOM_INPUT ||
+          atom == MRG_ATOM_IMG ||
+          atom == MRG_ATOM_BR ||
+          atom == MRG_ATOM_HR)
+      {
+        p->should_be_empty = 1;
+        close_element (p, 0);
+      }
+      break;
+
+    case t_closeemptytag:
+    case t_closetag:
+      if (!p->should_be_empty)
+        p->in_style = 0;
+      if (!p->should_be_empty && p->depth)
+      {
+        uint32_t closed;
+        int up;
+
+        atom = doc_atom (p, data);
+        closed = parent_atom (p, 1);
+        close_element (p, atom == MRG_ATOM_A ? MRG_XML_NODE_LISTEN_DONE : 0);
+
+        if (closed != atom)
+        {
+          if (closed == MRG_ATOM_P)
+          {
+            close_element (p, 0);
+            break;
+          }
+          for (up = 1; up <= 5; up++)
+            if (p->depth >= up && parent_atom (p, up) == atom)
+            {
+              fprintf (stderr, "%i: fixing close of %s when %s is open\n",
+                       pos, data, atom_name (p->doc, closed));
+              while (up--)
+                close_element (p, 0);
+              break;
+            }
+          if (up > 5)
+          {
+            if (atom == MRG_ATOM_TABLE && closed == MRG_ATOM_TD)
+            {
+              close_element (p, 0);
+              close_element (p, 0);
+            }
+            else if (atom == MRG_ATOM_TABLE && closed == MRG_ATOM_TR)
+            {
+              close_element (p, 0);
+            }
+            else
+              fprintf (stderr, "%i closed %s but %s is open\n", pos, data,
+                       atom_name (p->doc, closed));
+          }
+        }
+      }
+      break;
+  }
+}
+
+/* parses the complete tokens in the source, the token in progress at its
+ * end is continued by the next feed
+ */
+static void parse_source (MrgXmlParser *p)
+{
+  int type;
+  int offset = 0, length = 0, pos = 0;
+
+  while ((type = xmltok_get_slice (p->xmltok, &offset, &length, &pos)) != t_eof)
+  {
+    if (length + 1 > p->data_allocated)
+    {
+      p->data_allocated = (length + 1) * 2;
+      p->data = realloc (p->data, p->data_allocated);
+    }
+    memcpy (p->data, p->source + offset, length);
+    p->data[length] = 0;
+
+    parse_token (p, type, p->data, p->source_base + pos);
+  }
+}
+
+/* a document that is parsed as its source arrives, in chunks passed to
+ * mrg_xml_doc_feed; it can be rendered at any point, the elements that
+ * are still open are ended where the nodes parsed so far end.
+ */
+MrgXmlDoc *mrg_xml_doc_new_stream (void)
+{
+  MrgXmlParser *p = calloc (sizeof (MrgXmlParser), 1);
+  MrgXmlDoc *doc;
+  uint32_t i;
+
+  doc = calloc (sizeof (MrgXmlDoc), 1);
+  doc->parser = p;
+  p->doc = doc;
+
+  doc_add_string (p, "", 0);
+  p->atoms_allocated = MRG_ATOM_COUNT * 2;
+  doc->atoms = malloc (sizeof (uint32_t) * p->atoms_allocated);
+  p->atom_hash_size = 128;
+  p->atom_hash = calloc (sizeof (uint32_t), p->atom_hash_size);
+  for (i = 0; i < MRG_ATOM_COUNT; i++)
+  {
+    doc->atoms[i] = i ? doc_add_string (p, atom_names[i], strlen (atom_names[i])) : 0;
+    doc->n_atoms++;
+    atom_hash_insert (p, i);
+  }
+
+  p->scratch = mrg_string_new ("");
+  p->pending_attr = MRG_ATOM_NONE;
+  p->xmltok = xmltok_slice_new ("", 0);
+  return doc;
+}
+
+/* only the part of the source the tokenizer has not finished with is
+ * kept, the nodes are all that remains of the rest.
+ */
+void mrg_xml_doc_feed (MrgXmlDoc *doc, const char *data, int length)
+{
+  MrgXmlParser *p = doc->parser;
+  int needed;
+
+  if (!p || length <= 0)
+    return;
+
+  needed = xmltok_slice_needed (p->xmltok);
+  memmove (p->source, p->source + needed, p->source_length - needed);
+  p->source_length -= needed;
+  p->source_base += needed;
+
+  if (p->source_length + length > p->source_allocated)
+  {
+    p->source_allocated = (p->source_length + length) * 2;
+    p->source = realloc (p->source, p->source_allocated);
+  }
+  memcpy (p->source + p->source_length, data, length);
+  p->source_length += length;
+
+  xmltok_slice_rebuffer (p->xmltok, p->source, p->source_length, needed);
+  parse_source (p);
+}
+
+/* the end of the source, closes what is still open and releases the
+ * parser; the document does not change after this.
+ */
+void mrg_xml_doc_finish (MrgXmlDoc *doc)
+{
+  MrgXmlParser *p = doc->parser;
+
+  if (!p)
+    return;
+
+  /* a trailing space terminates a word at the very end */
+  mrg_xml_doc_feed (doc, " ", 1);
+
+  if (p->depth != 0)
+  {
+    fprintf (stderr, "html parsing unbalanced, %i open tags.. \n", p->depth);
+    while (p->depth > 0)
+    {
+      fprintf (stderr, " %s ", atom_name (doc, parent_atom (p, 1)));
+      close_element (p, 0);
+    }
+    fprintf (stderr, "\n");
+  }
+
+  /* trim the arena to what is used */
+  doc->nodes = realloc (doc->nodes, sizeof (MrgXmlNode) * (doc->n_nodes + 1));
+  doc->attrs = realloc (doc->attrs, sizeof (MrgXmlAttr) * (doc->n_attrs + 1));
+  doc->strings = realloc (doc->strings, doc->strings_length);
+
+  parser_free (p);
+  doc->parser = NULL;
+}
+
+int mrg_xml_doc_is_finished (MrgXmlDoc *doc)
+{
+  return doc->parser == NULL;
+}
+
+MrgXmlDoc *mrg_xml_doc_new (const char *html)
+{
+  MrgXmlDoc *doc = mrg_xml_doc_new_stream ();
+  mrg_xml_doc_feed (doc, html, strlen (html));
+  mrg_xml_doc_finish (doc);
+  return doc;
+}
+
+void mrg_xml_doc_free (MrgXmlDoc *doc)
+{
+  if (!doc)
+    return;
+  free (doc->nodes);
+  free (doc->attrs);
+  free (doc->atoms);
+  free (doc->strings);
+  if (doc->parser)
+    parser_free (doc->parser);
+  _mrg_xml_index_free (doc->index);
+  _mrg_xml_shapes_free (doc->shapes);
+  free (doc);
+}
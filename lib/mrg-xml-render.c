@@ -193,6 +193,7 @@ static void mrg_path_fill_stroke (Mrg *mrg)
 {
   cairo_t *cr = mrg_cr (mrg);
   MrgStyle *style = mrg_style (mrg);
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   if (style->fill_color.alpha > 0.001)
   {
     mrg_cairo_set_source_color (cr, &style->fill_color);
@@ -206,6 +207,7 @@ static void mrg_path_fill_stroke (Mrg *mrg)
     cairo_stroke (cr);
   }
   cairo_new_path (cr);
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 }
 
 void _mrg_border_top (Mrg *mrg, int x, int y, int width, int height)
@@ -435,11 +437,13 @@ void _mrg_border_right (Mrg *mrg, int x, int y, int width, int height)
 
 static void mrg_box (Mrg *mrg, int x, int y, int width, int height)
 {
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   _mrg_draw_background_increment (mrg, &mrg->html, 1);
   _mrg_border_top (mrg, x, y, width, height);
   _mrg_border_left (mrg, x, y, width, height);
   _mrg_border_right (mrg, x, y, width, height);
   _mrg_border_bottom (mrg, x, y, width, height);
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 }
 
 static void mrg_box_fill (Mrg *mrg, MrgStyle *style, float x, float y, float width, float height)
@@ -451,6 +455,7 @@ static void mrg_box_fill (Mrg *mrg, MrgStyle *style, float x, float y, float wid
   height = floor (y + height) - floor(y);
   y = floor (y);
 
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
   cairo_save (cr);
   {
     cairo_new_path (cr);
@@ -465,6 +470,7 @@ static void mrg_box_fill (Mrg *mrg, MrgStyle *style, float x, float y, float wid
     cairo_fill (cr);
   }
   cairo_restore (cr);
+  MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
 }
 
 /*
@@ -905,6 +911,10 @@ void _mrg_layout_post (Mrg *mrg, MrgHtml *ctx)
       {
         geo->hover = 0;
       }
+      if (mrg->retained_recording)
+        _mrg_retained_box (mrg, ctx->state->block_start_x,
+                           ctx->state->block_start_y - mrg_em (mrg),
+                           geo->width, geo->height, geo->hover);
     }
 
     //mrg_edge_right (mrg) - mrg_edge_left (mrg), mrg_y (mrg) - (ctx->state->block_start_y - mrg_em(mrg)));
@@ -941,81 +951,6 @@ void _mrg_layout_post (Mrg *mrg, MrgHtml *ctx)
   ctx->state = &ctx->states[ctx->state_no];
 }
 
-enum {
-  HTML_ATT_UNKNOWN = 0,
-  HTML_ATT_STYLE,
-  HTML_ATT_CLASS,
-  HTML_ATT_ID,
-  HTML_ATT_HREF,
-  HTML_ATT_REL,
-  HTML_ATT_SRC
-};
-
-static char *entities[][2]={
-  {"shy",    ""},   // soft hyphen,. should be made use of in wrapping..
-  {"nbsp",   " "},  //
-  {"lt",     "<"},
-  {"gt",     ">"},
-  {"trade",  "™"},
-  {"copy",   "©"},
-  {"middot", "·"},
-  {"bull",   "•"},
-  {"Oslash", "Ø"},
-  {"oslash", "ø"},
-  {"hellip", "…"},
-  {"aring",  "å"},
-  {"Aring",  "Å"},
-  {"aelig",  "æ"},
-  {"AElig",  "Æ"},
-  {"Aelig",  "Æ"},
-  {"laquo",  "«"},
-  {"raquo",  "»"},
-
-  /*the above were added as encountered, the rest in anticipation  */
-
-  {"reg",    "®"},
-  {"deg",    "°"},
-  {"plusmn", "±"},
-  {"sup2",   "²"},
-  {"sup3",   "³"},
-  {"sup1",   "¹"},
-  {"ordm",   "º"},
-  {"para",   "¶"},
-  {"cedil",  "¸"},
-  {"bull",   "·"},
-  {"amp",   "&"},
-  {"mdash",  "–"},
-  {"apos",   "'"},
-  {"quot",   "\""},
-  {"iexcl",  "¡"},
-  {"cent",   "¢"},
-  {"pound",  "£"},
-  {"euro",   "€"},
-  {"yen",    "¥"},
-  {"curren", "¤"},
-  {"sect",   "§"},
-  {"phi",    "Φ"},
-  {"omega",  "Ω"},
-  {"alpha",  "α"},
-
-  /* XXX: incomplete */
-
-  {NULL, NULL}
-};
-
-static const char *get_attr (MrgHtml *ctx, const char *attr)
-{
-  int i;
-  for (i = 0; i < ctx->attributes; i++)
-  {
-    if (!strcmp (ctx->attribute[i], attr))
-    {
-      return ctx->value[i];
-    }
-  }
-  return NULL;
-}
-
 static void
 mrg_parse_transform (Mrg *mrg, cairo_matrix_t *matrix, const char *str)
 {
@@ -1123,18 +1058,76 @@ mrg_parse_transform (Mrg *mrg, cairo_matrix_t *matrix, const char *str)
   }
 }
 
-int
-mrg_parse_svg_path (Mrg *mrg, const char *str)
+/* svg path data and polygon points are parsed into a cairo_path_t of our
+ * own, rather than directly into the cairo context, so that the parsed path
+ * can be kept with the document and replayed with cairo_append_path.
+ */
+typedef struct MrgPathData {
+  cairo_path_t path;
+  int          allocated;
+  double       x, y;             /* current point */
+  double       start_x, start_y; /* of the current sub path */
+} MrgPathData;
+
+static cairo_path_data_t *
+path_add (MrgPathData *p, cairo_path_data_type_t type, int length)
+{
+  cairo_path_data_t *data;
+  if (p->path.num_data + length > p->allocated)
+  {
+    p->allocated = p->allocated * 2 + 64;
+    p->path.data = realloc (p->path.data, sizeof (cairo_path_data_t) * p->allocated);
+  }
+  data = &p->path.data[p->path.num_data];
+  data->header.type = type;
+  data->header.length = length;
+  p->path.num_data += length;
+  return data;
+}
+
+static void path_move_to (MrgPathData *p, double x, double y)
+{
+  cairo_path_data_t *data = path_add (p, CAIRO_PATH_MOVE_TO, 2);
+  data[1].point.x = p->x = p->start_x = x;
+  data[1].point.y = p->y = p->start_y = y;
+}
+
+static void path_line_to (MrgPathData *p, double x, double y)
+{
+  cairo_path_data_t *data = path_add (p, CAIRO_PATH_LINE_TO, 2);
+  data[1].point.x = p->x = x;
+  data[1].point.y = p->y = y;
+}
+
+static void path_curve_to (MrgPathData *p, double x1, double y1,
+                                           double x2, double y2,
+                                           double x3, double y3)
+{
+  cairo_path_data_t *data = path_add (p, CAIRO_PATH_CURVE_TO, 4);
+  data[1].point.x = x1;
+  data[1].point.y = y1;
+  data[2].point.x = x2;
+  data[2].point.y = y2;
+  data[3].point.x = p->x = x3;
+  data[3].point.y = p->y = y3;
+}
+
+static void path_close_path (MrgPathData *p)
+{
+  path_add (p, CAIRO_PATH_CLOSE_PATH, 1);
+  p->x = p->start_x;
+  p->y = p->start_y;
+}
+
+static void
+parse_svg_path (Mrg *mrg, MrgPathData *p, const char *str)
 {
-  cairo_t *cr = mrg_cr (mrg);
   char  command = 'm';
   char *s;
   int numbers = 0;
   double number[12];
 
-  if (!str)
-    return -1;
-  cairo_move_to (cr, 0, 0);
+  path_move_to (p, 0, 0);
 
   s = (void*)str;
 again:
@@ -1146,7 +1139,7 @@ again:
     {
       case 'z':
       case 'Z':
-        cairo_close_path (cr);
+        path_close_path (p);
         break;
       case 'm':
       case 'a':
@@ -1184,7 +1177,7 @@ again:
         case 'm':
           if (numbers == 2)
           {
-            cairo_rel_move_to (cr, number[0], number[1]);
+            path_move_to (p, p->x + number[0], p->y + number[1]);
             s++;
             goto again;
           }
@@ -1192,7 +1185,7 @@ again:
         case 'l':
           if (numbers == 2)
           {
-            cairo_rel_line_to (cr, number[0], number[1]);
+            path_line_to (p, p->x + number[0], p->y + number[1]);
             s++;
             goto again;
           }
@@ -1200,9 +1193,9 @@ again:
         case 'c':
           if (numbers == 6)
           {
-            cairo_rel_curve_to (cr, number[0], number[1],
-                                    number[2], number[3],
-                                    number[4], number[5]);
+            path_curve_to (p, p->x + number[0], p->y + number[1],
+                              p->x + number[2], p->y + number[3],
+                              p->x + number[4], p->y + number[5]);
             s++;
             goto again;
           }
@@ -1210,7 +1203,7 @@ again:
         case 'M':
           if (numbers == 2)
           {
-            cairo_move_to (cr, number[0], number[1]);
+            path_move_to (p, number[0], number[1]);
             s++;
             goto again;
           }
@@ -1218,7 +1211,7 @@ again:
         case 'L':
           if (numbers == 2)
           {
-            cairo_line_to (cr, number[0], number[1]);
+            path_line_to (p, number[0], number[1]);
             s++;
             goto again;
           }
@@ -1226,9 +1219,9 @@ again:
         case 'C':
           if (numbers == 6)
           {
-            cairo_curve_to (cr, number[0], number[1],
-                                number[2], number[3],
-                                number[4], number[5]);
+            path_curve_to (p, number[0], number[1],
+                              number[2], number[3],
+                              number[4], number[5]);
             s++;
             goto again;
           }
@@ -1242,21 +1235,31 @@ again:
         break;
     }
   }
+}
+
+int
+mrg_parse_svg_path (Mrg *mrg, const char *str)
+{
+  MrgPathData path;
+
+  if (!str)
+    return -1;
+  memset (&path, 0, sizeof (path));
+  parse_svg_path (mrg, &path, str);
+  cairo_append_path (mrg_cr (mrg), &path.path);
+  free (path.path.data);
   return 0;
 }
 
 static void
-mrg_parse_polygon (Mrg *mrg, const char *str)
+parse_polygon (Mrg *mrg, MrgPathData *p, const char *str)
 {
-  cairo_t *cr = mrg_cr (mrg);
   char *s;
   int numbers = 0;
   int started = 0;
   double number[12];
 
-  if (!str)
-    return;
-  cairo_move_to (cr, 0, 0);
+  path_move_to (p, 0, 0);
 
   s = (void*)str;
 again:
@@ -1274,10 +1277,10 @@ again:
       if (numbers == 2)
       {
         if (started)
-          cairo_line_to (cr, number[0], number[1]);
+          path_line_to (p, number[0], number[1]);
         else
         {
-          cairo_move_to (cr, number[0], number[1]);
+          path_move_to (p, number[0], number[1]);
           started = 1;
         }
         s++;
@@ -1289,492 +1292,572 @@ again:
   }
 }
 
-void mrg_xml_render (Mrg *mrg,
-                     char *uri_base,
-                     void (*link_cb) (MrgEvent *event, void *href, void *link_data),
-                     void *link_data,
-                     void *(finalize)(void *listen_data, void *listen_data2, void *finalize_data),
-                     void *finalize_data,
-                     char *html_)
+static const char *node_attr (MrgXmlDoc *doc, MrgXmlNode *node, uint32_t atom)
 {
-  char *html;
-  MrgXml *xmltok;
-  MrgHtml *ctx        = &mrg->html;
-  char tag[64][16];
-  int pos             = 0;
-  int type            = t_none;
-  static int depth    = 0;
-  int in_style        = 0;
-  int should_be_empty = 0;
-  int tagpos          = 0;
-  MrgString *style = mrg_string_new ("");
-  int whitespaces = 0;
-
-  html = malloc (strlen (html_) + 3);
-  sprintf (html, "%s ", html_);
-  xmltok = xmltok_buf_new (html);
+  uint32_t i;
+  for (i = node->attrs; i < node->attrs + node->n_attrs; i++)
+    if (doc->attrs[i].atom == atom)
+      return &doc->strings[doc->attrs[i].value];
+  return NULL;
+}
 
+static void link_stylesheet (Mrg *mrg, MrgXmlDoc *doc, MrgXmlNode *node,
+                             char *uri_base)
+{
+  const char *rel;
+  if ((rel=node_attr (doc, node, MRG_ATOM_REL)) && !strcmp (rel, "stylesheet") && node_attr (doc, node, MRG_ATOM_HREF))
   {
-    int no = mrg->text_listen_count;
-    mrg->text_listen_data1[no] = link_data;
-    mrg->text_listen_data2[no] = html_;
-    mrg->text_listen_finalize[no] = (void*)finalize;
-    mrg->text_listen_finalize_data[no] = finalize_data;
-    mrg->text_listen_count++;
+    char *contents;
+    long length;
+    mrg_get_contents (mrg, uri_base, node_attr (doc, node, MRG_ATOM_HREF), &contents, &length);
+    if (contents)
+    {
+      mrg_stylesheet_add (mrg, contents, uri_base, MRG_STYLE_XML, NULL);
+      free (contents);
+    }
   }
+}
 
-  _mrg_set_wrap_edge_vfuncs (mrg, wrap_edge_left, wrap_edge_right, ctx);
-  _mrg_set_post_nl (mrg, _mrg_draw_background_increment, ctx);
-  ctx->mrg = mrg;
-  ctx->state = &ctx->states[0];
+/* the parsed transform or path of an svg element, kept with the document
+ * so that it is only parsed in the first frame it is rendered in
+ */
+typedef struct MrgXmlShape {
+  cairo_matrix_t matrix; /* transform of g */
+  cairo_path_t   path;   /* of path and polygon */
+} MrgXmlShape;
+
+struct _MrgXmlShapes {
+  MrgXmlShape **shape;   /* by node, NULL until parsed */
+  int           count;
+};
 
-  while (type != t_eof)
+void _mrg_xml_shapes_free (MrgXmlShapes *shapes)
+{
+  int i;
+  if (!shapes)
+    return;
+  for (i = 0; i < shapes->count; i++)
+    if (shapes->shape[i])
+    {
+      free (shapes->shape[i]->path.data);
+      free (shapes->shape[i]);
+    }
+  free (shapes->shape);
+  free (shapes);
+}
+
+static MrgXmlShape *node_shape (Mrg *mrg, MrgXmlDoc *doc, MrgXmlNode *node)
+{
+  MrgXmlShapes *shapes;
+  MrgXmlShape  *shape;
+  MrgPathData   path;
+  int no = node - doc->nodes;
+
+  if (!doc->shapes)
+    doc->shapes = calloc (sizeof (MrgXmlShapes), 1);
+  shapes = doc->shapes;
+  if (no >= shapes->count)
+  {
+    /* a streamed document grows, make room for all nodes so far */
+    shapes->shape = realloc (shapes->shape, sizeof (MrgXmlShape*) * doc->n_nodes);
+    memset (&shapes->shape[shapes->count], 0,
+            sizeof (MrgXmlShape*) * (doc->n_nodes - shapes->count));
+    shapes->count = doc->n_nodes;
+  }
+  if (shapes->shape[no])
+    return shapes->shape[no];
+
+  shape = calloc (sizeof (MrgXmlShape), 1);
+  memset (&path, 0, sizeof (path));
+  switch (node->atom)
   {
-    char *data = NULL;
-    type = xmltok_get (xmltok, &data, &pos);
-
-    if (type == t_tag ||
-        type == t_att ||
-        type == t_endtag ||
-        type == t_closeemptytag ||
-        type == t_closetag)
+    case MRG_ATOM_G:
+      mrg_parse_transform (mrg, &shape->matrix,
+                           node_attr (doc, node, MRG_ATOM_TRANSFORM));
+      break;
+    case MRG_ATOM_POLYGON:
+      if (node_attr (doc, node, MRG_ATOM_D))
+        parse_polygon (mrg, &path, node_attr (doc, node, MRG_ATOM_D));
+      break;
+    case MRG_ATOM_PATH:
+      if (node_attr (doc, node, MRG_ATOM_D))
+        parse_svg_path (mrg, &path, node_attr (doc, node, MRG_ATOM_D));
+      break;
+  }
+  shape->path = path.path;
+  if (shape->path.num_data)
+    shape->path.data = realloc (shape->path.data,
+                          sizeof (cairo_path_data_t) * shape->path.num_data);
+  shapes->shape[no] = shape;
+  return shape;
+}
+
+static void render_element (Mrg *mrg, MrgXmlDoc *doc, MrgXmlNode *node,
+                            char *uri_base,
+                            void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                            void *link_data)
+{
+  MrgHtml *ctx = &mrg->html;
+  const char *selector = &doc->strings[node->text];
+  char combined[256];
+
+  { // XXX : perhaps do this a tiny bit differently?
+    MrgGeoCache *geo = _mrg_get_cache (ctx, (void*)(size_t)(node->pos));
+    if (geo && geo->hover)
     {
-      int i;
-      for (i = 0; data[i]; i++)
-        data[i] = tolower (data[i]);
+      snprintf (combined, sizeof (combined), "%s%s", selector,
+                mrg->pointer_down[1] ? ":active:hover" : ":hover");
+      selector = combined;
     }
+  }
+  mrg_start_with_style (mrg, selector, (void*)((size_t)node->pos),
+                        &doc->strings[node->style]);
+
+  switch (node->atom)
+  {
+    case MRG_ATOM_G:
+      if (node_attr (doc, node, MRG_ATOM_TRANSFORM))
+        cairo_transform (mrg_cr (mrg), &node_shape (mrg, doc, node)->matrix);
+      break;
 
-    switch (type)
+    case MRG_ATOM_POLYGON:
+    case MRG_ATOM_PATH:
+      cairo_append_path (mrg_cr (mrg), &node_shape (mrg, doc, node)->path);
+      mrg_path_fill_stroke (mrg);
+      break;
+
+    case MRG_ATOM_RECT:
     {
-      case t_entity:
-        {
-          int i;
-          int dealt_with = 0;
-          if (data[0]=='#')
-          {
-            int c = atoi (&data[1]);
-            mrg_printf (mrg, "%c", c);
-          }
-          else
-          for (i = 0; entities[i][0] && !dealt_with; i++)
-            if (!strcmp (data, entities[i][0]))
-            {
-              mrg_print (mrg, entities[i][1]);
-              dealt_with = 1;
-            }
+      float width, height, x, y;
+      const char *val;
+      val = node_attr (doc, node, MRG_ATOM_WIDTH);
+      width = val ? mrg_parse_float (mrg, val, NULL) : 0;
+      val = node_attr (doc, node, MRG_ATOM_HEIGHT);
+      height = val ? mrg_parse_float (mrg, val, NULL) : 0;
+      val = node_attr (doc, node, MRG_ATOM_X);
+      x = val ? mrg_parse_float (mrg, val, NULL) : 0;
+      val = node_attr (doc, node, MRG_ATOM_Y);
+      y = val ? mrg_parse_float (mrg, val, NULL) : 0;
+
+      cairo_rectangle (mrg_cr (mrg), x, y, width, height);
+      mrg_path_fill_stroke (mrg);
+      break;
+    }
 
-          if (!dealt_with){
-            mrg_start (mrg, "dim", (void*)((size_t)pos));
-            mrg_print (mrg, data);
-            mrg_end (mrg);
-          }
-        }
-        break;
-      case t_word:
-        if (in_style)
-        {
-          mrg_stylesheet_add (mrg, data, uri_base, MRG_STYLE_XML, NULL);
-        }
-        else
-        {
-          mrg_print (mrg, data);
-        }
-        whitespaces = 0;
-        break;
+    case MRG_ATOM_TEXT:
+      mrg->x = mrg_parse_float (mrg, node_attr (doc, node, MRG_ATOM_X), NULL);
+      mrg->y = mrg_parse_float (mrg, node_attr (doc, node, MRG_ATOM_Y), NULL);
+      break;
 
-      case t_whitespace:
-        if (in_style)
-        {
-          mrg_stylesheet_add (mrg, data, uri_base, MRG_STYLE_XML, NULL);
-        }
-        else
+    case MRG_ATOM_A:
+      if (link_cb && node_attr (doc, node, MRG_ATOM_HREF))
+        mrg_text_listen_full (mrg, MRG_CLICK, link_cb, _mrg_resolve_uri (uri_base, node_attr (doc, node, MRG_ATOM_HREF)), link_data, (void*)free, NULL); //XXX: free is not invoked according to valgrind
+      break;
+
+    case MRG_ATOM_LINK:
+      link_stylesheet (mrg, doc, node, uri_base);
+      break;
+
+    case MRG_ATOM_IMG:
+      if (node_attr (doc, node, MRG_ATOM_SRC))
+      {
+        int img_width, img_height;
+        const char *src = node_attr (doc, node, MRG_ATOM_SRC);
+
+        if (mrg_query_image (mrg, src, &img_width, &img_height))
         {
-          switch (mrg_style (mrg)->white_space)
+          float width = mrg_style(mrg)->width;
+          float height = mrg_style(mrg)->height;
+
+          if (width < 1)
           {
-            case MRG_WHITE_SPACE_PRE: /* handles as pre-wrap for now */
-            case MRG_WHITE_SPACE_PRE_WRAP:
-              mrg_print (mrg, data);
-              break;
-            case MRG_WHITE_SPACE_PRE_LINE:
-              switch (*data)
-              {
-                case ' ':
-                  whitespaces ++;
-                  if (whitespaces == 1)
-                    mrg_print (mrg, " ");
-                  break;
-                case '\n':
-                  whitespaces = 0;
-                  break;
-              }
-              break;
-            case MRG_WHITE_SPACE_NOWRAP: /* XXX: handled like normal, this is bad.. */
-            case MRG_WHITE_SPACE_NORMAL: 
-              whitespaces ++;
-              if (whitespaces == 1)
-                mrg_print (mrg, " ");
-              break;
+             width = img_width;
+          }
+          if (height < 1)
+          {
+             height = img_height *1.0 / img_width * width;
           }
-        }
-        break;
-      case t_tag:
-        ctx->attributes = 0;
-        tagpos = pos;
-        mrg_string_clear (style);
-        break;
-      case t_att:
-        if (ctx->attributes < MRG_XML_MAX_ATTRIBUTES-1)
-          strncpy (ctx->attribute[ctx->attributes], data, MRG_XML_MAX_ATTRIBUTE_LEN-1);
-        break;
-      case t_val:
-        if (ctx->attributes < MRG_XML_MAX_ATTRIBUTES-1)
-          strncpy (ctx->value[ctx->attributes++], data, MRG_XML_MAX_VALUE_LEN-1);
-        break;
-      case t_endtag:
 
+          _mrg_draw_background_increment (mrg, &mrg->html, 0);
+          mrg->y += height;
 
-        if (depth && ((!strcmp (data, "tr") && !strcmp (tag[depth-1], "td"))))
-        {
-          mrg_end (mrg);
-          depth--;
-          mrg_end (mrg);
-          depth--;
-        }
-        if (depth && ((!strcmp (data, "tr") && !strcmp (tag[depth-1], "td"))))
-        {
-          mrg_end (mrg);
-          depth--;
-          mrg_end (mrg);
-          depth--;
+          mrg_image (mrg,
+          mrg->x,
+          mrg->y - height,
+          width,
+          height,
+          1.0f,
+          src, NULL, NULL);
+
+          mrg->x += width;
         }
-        else if (depth && ((!strcmp (data, "dd") && !strcmp (tag[depth-1], "dt")) ||
-                      (!strcmp (data, "li") && !strcmp (tag[depth-1], "li")) ||
-                      (!strcmp (data, "dt") && !strcmp (tag[depth-1], "dd")) ||
-                      (!strcmp (data, "td") && !strcmp (tag[depth-1], "td")) ||
-                      (!strcmp (data, "tr") && !strcmp (tag[depth-1], "tr")) ||
-                      (!strcmp (data, "dd") && !strcmp (tag[depth-1], "dd")) ||
-                      (!strcmp (data, "p") && !strcmp (tag[depth-1], "p"))))
+        else
         {
-          mrg_end (mrg);
-          depth--;
+          mrg_printf (mrg, "![%s]", src);
         }
+      }
+      break;
+  }
+}
 
-        strcpy (tag[depth], data);
-        depth ++;
+/* incremental layout; the index is a list of points where layout can
+ * resume, recorded in document order after the end of block elements, with
+ * the elements that were open at that point. Layout resumes by starting
+ * those elements again where they started, and continuing with the node
+ * after the block at the recorded position.
+ */
 
-        {
-          char combined[256]="";
-          char *klass = (void*)get_attr (ctx, "class");
-          /* XXX: spaces in class should be turned into .s making
-           * it possible to use multiple classes
-           */
-          const char *id = get_attr (ctx, "id");
+#define MRG_XML_INDEX_SPACING 256.0 /* minimum distance between resume points */
+
+typedef struct MrgXmlOpen {
+  uint32_t node;
+  float    x;               /* where the element was started */
+  float    y;
+  int      children_before; /* count of preceding siblings, for nth-child */
+  int      block;           /* a plain block, that layout can resume in */
+} MrgXmlOpen;
+
+typedef struct MrgXmlResume {
+  uint32_t node;            /* the node to continue with */
+  float    x;
+  float    y;
+  float    vmarg;
+  int      whitespaces;
+  int      children;        /* of the innermost open element */
+  int      depth;
+  int      first_open;      /* in index->open */
+} MrgXmlResume;
+
+struct _MrgXmlIndex {
+  float         width;      /* layout the index was recorded for */
+  float         x;
+  float         y;
+
+  MrgXmlResume *resume;
+  int           count;
+  int           allocated;
+
+  MrgXmlOpen   *open;
+  int           open_count;
+  int           open_allocated;
+};
 
-          const char *pseudo = "";
+void _mrg_xml_index_free (MrgXmlIndex *index)
+{
+  if (!index)
+    return;
+  free (index->resume);
+  free (index->open);
+  free (index);
+}
 
-          if (klass)
-          {
-            klass = strdup (klass);
-            if(1){
-              int i;
-              for (i = 0; klass[i]; i++)
-                if (klass[i] == ' ')
-                  klass[i]='.';
-            }
-          }
+void mrg_xml_doc_set_incremental (MrgXmlDoc *doc, int incremental)
+{
+  doc->incremental = incremental;
+  if (!incremental)
+  {
+    _mrg_xml_index_free (doc->index);
+    doc->index = NULL;
+  }
+}
 
-          //if (mrg_style(mrg)->id_ptr)
-          { // XXX : perhaps do this a tiny bit differently?
-            MrgGeoCache *geo = _mrg_get_cache (ctx, (void*)(size_t)(tagpos));
-            if (geo && geo->hover)
-            {
-              if (mrg->pointer_down[1])
-                pseudo = ":active:hover";
-              else
-                pseudo = ":hover";
-            }
-          }
-          sprintf (combined, "%s%s%s%s%s%s",
-              data,
-              klass?".":"",
-              klass?klass:"",
-              id?"#":"",
-              id?id:"", pseudo);
-
-          if (klass)
-            free (klass);
-          {
-            /* collect XML attributes and convert into CSS declarations */
-            const char *style_attribute[] ={
-              "fill-rule",
-              "font-size",
-              "font-family",
-              "fill-color",
-              "fill",
-              "stroke-width",
-              "stroke-color",
-              "stroke-linecap",
-              "stroke-miterlimit",
-              "stroke-linejoin",
-              "stroke",
-              "color",
-              "background-color",
-              "background",
-              NULL};
-
-            int i;
-            for (i = 0; i < ctx->attributes; i++)
-            {
-              int j;
-              for (j = 0; style_attribute[j]; j++)
-                if (!strcmp (ctx->attribute[i], style_attribute[j]))
-                {
-                  mrg_string_append_printf (style, "%s: %s;",
-                      style_attribute[j], ctx->value[i]);
-                  break;
-                }
-            }
-          }
-          mrg_string_append_str (style, get_attr (ctx, "style"));
-          mrg_start_with_style (mrg, combined, (void*)((size_t)tagpos), style->str);
-        }
+static int has_floats (MrgHtml *ctx)
+{
+  int i;
+  for (i = 0; i <= ctx->state_no; i++)
+    if (ctx->states[i].floats)
+      return 1;
+  return 0;
+}
 
-        if (!strcmp (data, "g"))
-        {
-          const char *transform;
-          if ((transform = get_attr (ctx, "transform")))
-            {
-              cairo_matrix_t matrix;
-              mrg_parse_transform (mrg, &matrix, transform);
-              cairo_transform (mrg_cr (mrg), &matrix);
-            }
-        }
+static void index_record (Mrg *mrg, MrgXmlIndex *index, uint32_t node,
+                          MrgXmlOpen *open, int depth, int whitespaces)
+{
+  MrgXmlResume *resume;
 
-        if (!strcmp (data, "polygon"))
-        {
-          mrg_parse_polygon (mrg, get_attr (ctx, "d"));
-          mrg_path_fill_stroke (mrg);
-        }
+  if (index->count)
+  {
+    MrgXmlResume *last = &index->resume[index->count-1];
+    if (node <= last->node || mrg->y < last->y + MRG_XML_INDEX_SPACING)
+      return;
+  }
+  else if (mrg->y < index->y + MRG_XML_INDEX_SPACING)
+    return;
 
-        if (!strcmp (data, "path"))
-        {
-          mrg_parse_svg_path (mrg, get_attr (ctx, "d"));
-          mrg_path_fill_stroke (mrg);
-        }
+  if (index->count + 1 > index->allocated)
+  {
+    index->allocated = index->allocated * 2 + 64;
+    index->resume = realloc (index->resume, sizeof (MrgXmlResume) * index->allocated);
+  }
+  if (index->open_count + depth > index->open_allocated)
+  {
+    index->open_allocated = (index->open_count + depth) * 2 + 64;
+    index->open = realloc (index->open, sizeof (MrgXmlOpen) * index->open_allocated);
+  }
 
-        if (!strcmp (data, "rect"))
-        {
-          float width, height, x, y;
-          const char *val;
-          val = get_attr (ctx, "width");
-          width = val ? mrg_parse_float (mrg, val, NULL) : 0;
-          val = get_attr (ctx, "height");
-          height = val ? mrg_parse_float (mrg, val, NULL) : 0;
-          val = get_attr (ctx, "x");
-          x = val ? mrg_parse_float (mrg, val, NULL) : 0;
-          val = get_attr (ctx, "y");
-          y = val ? mrg_parse_float (mrg, val, NULL) : 0;
-
-          cairo_rectangle (mrg_cr (mrg), x, y, width, height);
-          mrg_path_fill_stroke (mrg);
-        }
+  resume = &index->resume[index->count++];
+  resume->node = node;
+  resume->x = mrg->x;
+  resume->y = mrg->y;
+  resume->vmarg = mrg->html.state->vmarg;
+  resume->whitespaces = whitespaces;
+  resume->children = mrg->state->children;
+  resume->depth = depth;
+  resume->first_open = index->open_count;
+  memcpy (&index->open[index->open_count], open, sizeof (MrgXmlOpen) * depth);
+  index->open_count += depth;
+}
 
-        if (!strcmp (data, "text"))
-        {
-          mrg->x = mrg_parse_float (mrg, get_attr (ctx, "x"), NULL);
-          mrg->y = mrg_parse_float (mrg, get_attr (ctx, "y"), NULL);
-        }
+/* the last resume point at or above y, or NULL */
+static MrgXmlResume *index_find (MrgXmlIndex *index, float y)
+{
+  int min = 0, max = index->count;
+  while (min < max)
+  {
+    int mid = (min + max) / 2;
+    if (index->resume[mid].y <= y)
+      min = mid + 1;
+    else
+      max = mid;
+  }
+  return min ? &index->resume[min-1] : NULL;
+}
 
-        if (!strcmp (data, "a"))
-        {
-          if (link_cb && get_attr (ctx, "href")) 
-            mrg_text_listen_full (mrg, MRG_CLICK, link_cb, _mrg_resolve_uri (uri_base,  get_attr (ctx, "href")), link_data, (void*)free, NULL); //XXX: free is not invoked according to valgrind
-        }
+/* prepares for laying out only what is visible; returns the node to start
+ * with, and sets the y coordinate to stop at
+ */
+static int incremental_start (Mrg *mrg, MrgXmlDoc *doc, char *uri_base,
+                              void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                              void *link_data,
+                              MrgXmlOpen *open, int *depth,
+                              int *whitespaces, float *stop_y)
+{
+  MrgXmlIndex  *index;
+  MrgXmlResume *resume;
+  double x0, y0, x1, y1;
+  float  margin;
+  int    i;
+
+  cairo_clip_extents (mrg_cr (mrg), &x0, &y0, &x1, &y1);
+  margin = y1 - y0;
+  *stop_y = y1 + margin;
+
+  if (!doc->index)
+    doc->index = calloc (sizeof (MrgXmlIndex), 1);
+  index = doc->index;
+  if (index->width != mrg_width (mrg) ||
+      index->x != mrg->x ||
+      index->y != mrg->y)
+  {
+    index->width = mrg_width (mrg);
+    index->x = mrg->x;
+    index->y = mrg->y;
+    index->count = 0;
+    index->open_count = 0;
+  }
 
-        if (!strcmp (data, "style"))
-          in_style = 1;
-        else
-          in_style = 0;
+  resume = index_find (index, y0 - margin);
+  if (!resume)
+    return 0;
 
-        should_be_empty = 0;
+  /* the styling in what is skipped still applies */
+  for (i = 0; i < resume->node && i < doc->sheets_end; i++)
+  {
+    MrgXmlNode *node = &doc->nodes[i];
+    if (node->type == MRG_XML_NODE_STYLE)
+      mrg_stylesheet_add (mrg, &doc->strings[node->text], uri_base,
+                          MRG_STYLE_XML, NULL);
+    else if (node->type == MRG_XML_NODE_ELEMENT && node->atom == MRG_ATOM_LINK)
+      link_stylesheet (mrg, doc, node, uri_base);
+  }
 
-        if (!strcmp (data, "link"))
-        {
-          const char *rel;
-          if ((rel=get_attr (ctx, "rel")) && !strcmp (rel, "stylesheet") && get_attr (ctx, "href"))
-          {
-            char *contents;
-            long length;
-            mrg_get_contents (mrg, uri_base, get_attr (ctx, "href"), &contents, &length);
-            if (contents)
-            {
-              mrg_stylesheet_add (mrg, contents, uri_base, MRG_STYLE_XML, NULL);
-              free (contents);
-            }
-          }
-        }
+  for (i = 0; i < resume->depth; i++)
+  {
+    open[i] = index->open[resume->first_open + i];
+    mrg->state->children = open[i].children_before;
+    mrg->x = open[i].x;
+    mrg->y = open[i].y;
+    render_element (mrg, doc, &doc->nodes[open[i].node], uri_base,
+                    link_cb, link_data);
+  }
+  *depth = resume->depth;
+
+  mrg->state->children = resume->children;
+  mrg->x = resume->x;
+  mrg->y = resume->y;
+  mrg->html.state->vmarg = resume->vmarg;
+  *whitespaces = resume->whitespaces;
+  return resume->node;
+}
 
-        if (!strcmp (data, "img") && get_attr (ctx, "src"))
-        {
-          int img_width, img_height;
-          const char *src = get_attr (ctx, "src");
+static void render_nodes (Mrg *mrg, MrgXmlDoc *doc,
+                          char *uri_base,
+                          void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                          void *link_data)
+{
+  MrgHtml *ctx = &mrg->html;
+  MrgXmlOpen open[MRG_MAX_STYLE_DEPTH];
+  int   depth = 0;
+  int   unsafe = 0;   /* open elements layout cannot resume in */
+  float stop_y = 0.0;
+  int   whitespaces = 0;
+  int   i = 0;
 
-          if (mrg_query_image (mrg, src, &img_width, &img_height))
-          {
-            float width = mrg_style(mrg)->width;
-            float height = mrg_style(mrg)->height;
+  _mrg_set_wrap_edge_vfuncs (mrg, wrap_edge_left, wrap_edge_right, ctx);
+  _mrg_set_post_nl (mrg, _mrg_draw_background_increment, ctx);
+  ctx->mrg = mrg;
+  ctx->state = &ctx->states[ctx->state_no];
 
-            if (width < 1)
-            {
-               width = img_width;
-            }
-            if (height < 1)
-            {
-               height = img_height *1.0 / img_width * width;
-            }
+  if (doc->incremental)
+    i = incremental_start (mrg, doc, uri_base, link_cb, link_data,
+                           open, &depth, &whitespaces, &stop_y);
 
-            _mrg_draw_background_increment (mrg, &mrg->html, 0);
-            mrg->y += height;
+  for (; i < doc->n_nodes; i++)
+  {
+    MrgXmlNode *node = &doc->nodes[i];
+    const char *data = &doc->strings[node->text];
 
-            mrg_image (mrg,
-            mrg->x,
-            mrg->y - height,
-            width,
-            height,
-            1.0f,
-            src, NULL, NULL);
+    if (doc->incremental && mrg->y > stop_y)
+      break;
 
-            mrg->x += width;
-          }
-          else
-          {
-            mrg_printf (mrg, "![%s]", src);
-          }
+    switch (node->type)
+    {
+      case MRG_XML_NODE_ELEMENT:
+        if (depth < MRG_MAX_STYLE_DEPTH)
+        {
+          open[depth].node = i;
+          open[depth].x = mrg->x;
+          open[depth].y = mrg->y;
+          open[depth].children_before = mrg->state->children;
         }
-#if 1
-        if (!strcmp (data, "link") ||
-            !strcmp (data, "meta") ||
-            !strcmp (data, "input") ||
-            !strcmp (data, "img") ||
-            !strcmp (data, "br") ||
-            !strcmp (data, "hr"))
+        render_element (mrg, doc, node, uri_base, link_cb, link_data);
+        if (depth < MRG_MAX_STYLE_DEPTH)
         {
-          should_be_empty = 1;
-          mrg_end (mrg);
-          depth--;
+          MrgStyle *style = mrg_style (mrg);
+          open[depth].block = style->display == MRG_DISPLAY_BLOCK &&
+                              !style->float_ &&
+                              style->position == MRG_POSITION_STATIC;
+          if (!open[depth].block)
+            unsafe++;
         }
-#endif
+        else
+          unsafe++;
+        depth++;
         break;
-
-      case t_closeemptytag:
-      case t_closetag:
-        if (!should_be_empty)
+      case MRG_XML_NODE_END:
+      {
+        int was_block = depth > 0 && depth <= MRG_MAX_STYLE_DEPTH &&
+                        open[depth-1].block;
+        if (node->flags & MRG_XML_NODE_LISTEN_DONE)
+          mrg_text_listen_done (mrg);
+        mrg_end (mrg);
+        if (depth > 0)
         {
-          if (!strcmp (data, "a"))
-          {
-            mrg_text_listen_done (mrg);
-          }
-          in_style = 0;
-          mrg_end (mrg);
           depth--;
-
-          if (strcmp (tag[depth], data))
-          {
-            if (!strcmp (tag[depth], "p"))
-            {
-              mrg_end (mrg);
-              depth --;
-            } else 
-            if (depth > 0 && !strcmp (tag[depth-1], data))
-            {
-              fprintf (stderr, "%i: fixing close of %s when %s is open\n", pos, data, tag[depth]);
-
-              mrg_end (mrg);
-              depth --;
-            }
-            else if (depth > 1 && !strcmp (tag[depth-2], data))
-            {
-              int i;
-              fprintf (stderr, "%i: fixing close of %s when %s was open\n", pos, data, tag[depth]);
-
-              for (i = 0; i < 2; i ++)
-              {
-                depth --;
-                mrg_end (mrg);
-              }
-            }
-            else if (depth > 2 && !strcmp (tag[depth-3], data))
-            {
-              int i;
-              fprintf (stderr, "%i: fixing close of %s when %s wass open\n", pos, data, tag[depth]);
-
-              for (i = 0; i < 3; i ++)
-              {
-                depth --;
-                mrg_end (mrg);
-              }
-            }
-            else if (depth > 3 && !strcmp (tag[depth-4], data))
-            {
-              int i;
-              fprintf (stderr, "%i: fixing close of %s when %s wasss open\n", pos, data, tag[depth]);
-
-              for (i = 0; i < 4; i ++)
-              {
-                depth --;
-                mrg_end (mrg);
-              }
-            }
-            else if (depth > 4 && !strcmp (tag[depth-5], data))
-            {
-              int i;
-              fprintf (stderr, "%i: fixing close of %s when %s wassss open\n", pos, data, tag[depth]);
-
-              for (i = 0; i < 5; i ++)
-              {
-                depth --;
-                mrg_end (mrg);
-              }
-
-            }
-            else
+          if (!was_block)
+            unsafe--;
+        }
+        if (doc->incremental && was_block && !unsafe && !has_floats (ctx))
+          index_record (mrg, doc->index, i + 1, open, depth, whitespaces);
+        break;
+      }
+      case MRG_XML_NODE_PRINT:
+        mrg_print (mrg, data);
+        break;
+      case MRG_XML_NODE_ENTITY:
+        mrg_start (mrg, "dim", (void*)((size_t)node->pos));
+        mrg_print (mrg, data);
+        mrg_end (mrg);
+        break;
+      case MRG_XML_NODE_STYLE:
+        mrg_stylesheet_add (mrg, data, uri_base, MRG_STYLE_XML, NULL);
+        if (node->flags & MRG_XML_NODE_IS_WORD)
+          whitespaces = 0;
+        break;
+      case MRG_XML_NODE_WORD:
+        mrg_print (mrg, data);
+        whitespaces = 0;
+        break;
+      case MRG_XML_NODE_SPACE:
+        switch (mrg_style (mrg)->white_space)
+        {
+          case MRG_WHITE_SPACE_PRE: /* handles as pre-wrap for now */
+          case MRG_WHITE_SPACE_PRE_WRAP:
+            mrg_print (mrg, data);
+            break;
+          case MRG_WHITE_SPACE_PRE_LINE:
+            switch (*data)
             {
-              if (!strcmp (data, "table") && !strcmp (tag[depth], "td"))
-              {
-                depth--;
-                mrg_end (mrg);
-                depth--;
-                mrg_end (mrg);
-              }
-              else if (!strcmp (data, "table") && !strcmp (tag[depth], "tr"))
-              {
-                depth--;
-                mrg_end (mrg);
-              }
-              else
-              fprintf (stderr, "%i closed %s but %s is open\n", pos, data, tag[depth]);
+              case ' ':
+                whitespaces ++;
+                if (whitespaces == 1)
+                  mrg_print (mrg, " ");
+                break;
+              case '\n':
+                whitespaces = 0;
+                break;
             }
-          }
+            break;
+          case MRG_WHITE_SPACE_NOWRAP: /* XXX: handled like normal, this is bad.. */
+          case MRG_WHITE_SPACE_NORMAL: 
+            whitespaces ++;
+            if (whitespaces == 1)
+              mrg_print (mrg, " ");
+            break;
         }
         break;
     }
   }
 
-  xmltok_free (xmltok);
-  if (depth!=0){
-    fprintf (stderr, "html parsing unbalanced, %i open tags.. \n", depth);
-    while (depth > 0)
-    {
-      fprintf (stderr, " %s ", tag[depth-1]);
-      mrg_end (mrg);
-      depth--;
-    }
-    fprintf (stderr, "\n");
+  /* what the nodes so far, or the laid out part, leave open */
+  while (depth > 0)
+  {
+    depth--;
+    if (depth < MRG_MAX_STYLE_DEPTH &&
+        doc->nodes[open[depth].node].atom == MRG_ATOM_A)
+      mrg_text_listen_done (mrg);
+    mrg_end (mrg);
   }
+}
+
+/* data2 of the finalize callback is what the caller rendered, the
+ * document or the html string.
+ */
+static void add_finalize (Mrg *mrg, void *link_data, void *data2,
+                          void *finalize, void *finalize_data)
+{
+  int no = mrg->text_listen_count;
+  mrg->text_listen_data1[no] = link_data;
+  mrg->text_listen_data2[no] = data2;
+  mrg->text_listen_finalize[no] = finalize;
+  mrg->text_listen_finalize_data[no] = finalize_data;
+  mrg->text_listen_count++;
+}
+
+void mrg_xml_render_doc (Mrg *mrg,
+                         char *uri_base,
+                         void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                         void *link_data,
+                         void *(finalize)(void *listen_data, void *listen_data2, void *finalize_data),
+                         void *finalize_data,
+                         MrgXmlDoc *doc)
+{
+  add_finalize (mrg, link_data, doc, (void*)finalize, finalize_data);
+  render_nodes (mrg, doc, uri_base, link_cb, link_data);
+}
 
-//  mrg_list_free (&ctx->geo_cache); /* XXX: no point in doing that here */
-  mrg_string_free (style, 1);
-  free (html);
+void mrg_xml_render (Mrg *mrg,
+                     char *uri_base,
+                     void (*link_cb) (MrgEvent *event, void *href, void *link_data),
+                     void *link_data,
+                     void *(finalize)(void *listen_data, void *listen_data2, void *finalize_data),
+                     void *finalize_data,
+                     char *html_)
+{
+  MrgXmlDoc *doc = mrg_xml_doc_new (html_);
+  add_finalize (mrg, link_data, html_, (void*)finalize, finalize_data);
+  render_nodes (mrg, doc, uri_base, link_cb, link_data);
+  mrg_xml_doc_free (doc);
 }
 
 void mrg_xml_renderf (Mrg *mrg,
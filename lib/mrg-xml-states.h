@@ -0,0 +1,95 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2002, 2003, 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* states of the xml tokenizer, shared between mrg-xml.c and gen-xml-table.c
+ * which turns the rules for them into the tables of mrg-xml-table.inc
+ */
+
+#ifndef MRG_XML_STATES_H
+#define MRG_XML_STATES_H
+
+enum
+{
+  s_null = 0,
+  s_start,
+  s_tag,
+  s_tagnamestart,
+  s_tagname,
+  s_tagnamedone,
+  s_intag,
+  s_attstart,
+  s_attname,
+  s_attdone,
+  s_att,
+  s_atteq,
+  s_eqquot,
+  s_eqvalstart,
+  s_eqapos,
+  s_eqaposval,
+  s_eqaposvaldone,
+  s_eqval,
+  s_eqvaldone,
+  s_eqquotval,
+  s_eqquotvaldone,
+  s_tagend,
+  s_empty,
+  s_inempty,
+  s_emptyend,
+  s_whitespace,
+  s_whitespacedone,
+  s_entitystart,
+  s_entity,
+  s_entitydone,
+  s_word,
+  s_worddone,
+  s_tagclose,
+  s_tagclosenamestart,
+  s_tagclosename,
+  s_tagclosedone,
+  s_tagexcl,
+  s_commentdash1,
+  s_commentdash2,
+  s_incomment,
+  s_commentenddash1,
+  s_commentenddash2,
+  s_commentdone,
+  s_dtd,
+  s_prolog,
+  s_prologq,
+  s_prologdone,
+  s_eof,
+  s_error,
+  s_count
+};
+
+/* a transition is stored as (next_state << 2) | charhandling */
+enum
+{
+  c_nil = 0,
+  c_eat = 1,                    /* request that another char be used for the next state */
+  c_store = 2                   /* store the current char in the output buffer */
+};
+
+#define XML_NEXT_STATE(transition)   ((transition) >> 2)
+
+/* xml_run_stop value for states without a run, and for runs that end on
+ * more than one byte value
+ */
+#define XML_RUN_NONE    -1
+#define XML_RUN_TABLE   -2
+
+#endif
@@ -36,252 +36,17 @@ struct _MrgXml
   int       inbufpos;
 
   int       line_no;
-};
-
-enum
-{
-  s_null = 0,
-  s_start,
-  s_tag,
-  s_tagnamestart,
-  s_tagname,
-  s_tagnamedone,
-  s_intag,
-  s_attstart,
-  s_attname,
-  s_attdone,
-  s_att,
-  s_atteq,
-  s_eqquot,
-  s_eqvalstart,
-  s_eqapos,
-  s_eqaposval,
-  s_eqaposvaldone,
-  s_eqval,
-  s_eqvaldone,
-  s_eqquotval,
-  s_eqquotvaldone,
-  s_tagend,
-  s_empty,
-  s_inempty,
-  s_emptyend,
-  s_whitespace,
-  s_whitespacedone,
-  s_entitystart,
-  s_entity,
-  s_entitydone,
-  s_word,
-  s_worddone,
-  s_tagclose,
-  s_tagclosenamestart,
-  s_tagclosename,
-  s_tagclosedone,
-  s_tagexcl,
-  s_commentdash1,
-  s_commentdash2,
-  s_incomment,
-  s_commentenddash1,
-  s_commentenddash2,
-  s_commentdone,
-  s_dtd,
-  s_prolog,
-  s_prologq,
-  s_prologdone,
-  s_eof,
-  s_error
-};
 
-char     *c_ws = " \n\r\t";
-
-enum
-{
-  c_nil = 0,
-  c_eat = 1,                    /* request that another char be used for the next state */
-  c_store = 2                   /* store the current char in the output buffer */
+  int       zero_copy;   /* tokenizing a caller owned buffer into slices */
+  int       token_start; /* slice of the token in progress, -1 when */
+  int       token_end;   /* nothing has been stored yet */
+  int       tag_offset;  /* slice of the last t_tag, for the t_endtag and */
+  int       tag_length;  /* t_closeemptytag that follow it */
+  int       dtd_depth;
 };
 
-typedef struct
-{
-  int       state;
-  char     *chars;
-  unsigned char r_start;
-  unsigned char r_end;
-  int       next_state;
-  int       resetbuf;
-  int       charhandling;
-  int       return_type;        /* if set return current buf, with type set to the type */
-}
-state_entry;
-
-#define max_entries 20
-
-static state_entry state_table[s_error][max_entries];
-
-static void
-a (int state,
-   char *chars,
-   unsigned char r_start,
-   unsigned char r_end, int charhandling, int next_state)
-{
-  int       no = 0;
-
-  while (state_table[state][no].state != s_null)
-    no++;
-  state_table[state][no].state = state;
-  state_table[state][no].r_start = r_start;
-  if (chars)
-    state_table[state][no].chars = strdup (chars);
-  state_table[state][no].r_end = r_end;
-  state_table[state][no].charhandling = charhandling;
-  state_table[state][no].next_state = next_state;
-}
-
-static void
-r (int state, int return_type, int next_state)
-{
-  state_table[state][0].state = state;
-  state_table[state][0].return_type = return_type;
-  state_table[state][0].next_state = next_state;
-}
-
-/* *INDENT-OFF* */
-
-static void
-init_statetable (void) {
-    static int inited=0;
-    if(inited)
-        return;
-    inited=1;
-    memset(state_table,0,sizeof(state_table));
-    a(s_start,        "<",    0,0,            c_eat,            s_tag);
-    a(s_start,        c_ws,    0,0,            c_eat+c_store,    s_whitespace);
-    a(s_start,        "&",    0,0,            c_eat,            s_entitystart);
-    a(s_start,        NULL,    0,255,            c_eat+c_store,    s_word);
-
-    a(s_tag,        c_ws,    0,0,            c_eat,            s_tag);
-    a(s_tag,        "/",    0,0,            c_eat,            s_tagclose);
-    a(s_tag,        "!",    0,0,            c_eat,            s_tagexcl);
-    a(s_tag,        "?",    0,0,            c_eat,            s_prolog);
-    a(s_tag,        NULL,    0,255,            c_eat+c_store,    s_tagnamestart);
-
-    a(s_tagclose,    NULL,    0,255,            c_eat+c_store,    s_tagclosenamestart);
-    a(s_tagclosenamestart,    ">",    0,0,    c_eat,            s_tagclosedone);
-    a(s_tagclosenamestart,    NULL,    0,255,    c_eat+c_store,    s_tagclosename);
-    a(s_tagclosename,    ">",    0,0,        c_eat,            s_tagclosedone);
-    a(s_tagclosename,    NULL,    0,255,        c_eat+c_store,    s_tagclosename);
-    r(s_tagclosedone,    t_closetag,                            s_start);
-
-    a(s_whitespace,        c_ws,    0,0,        c_eat+c_store,    s_whitespace);
-    a(s_whitespace,        NULL,    0,255,        c_nil,            s_whitespacedone);
-    r(s_whitespacedone,    t_whitespace,                        s_start);
-
-    a(s_entitystart,";",    0,0,            c_eat,            s_entitydone);
-    a(s_entitystart,NULL,    0,255,            c_eat+c_store,    s_entity);
-    a(s_entity,        ";",    0,0,            c_eat,            s_entitydone);
-    a(s_entity,NULL,        0,255,            c_eat+c_store,    s_entity);
-    r(s_entitydone,    t_entity,                                s_start);
-
-    a(s_word,        c_ws,    0,0,            c_nil,            s_worddone);
-    a(s_word,        "<&",    0,0,            c_nil,            s_worddone);
-    a(s_word,        NULL,    0,255,            c_eat+c_store,    s_word);
-    r(s_worddone,    t_word,                                    s_start);
-
-    a(s_tagnamestart,c_ws,    0,0,            c_nil,            s_tagnamedone);
-    a(s_tagnamestart,    "/>",    0,0,        c_nil,            s_tagnamedone);
-    a(s_tagnamestart,NULL,    0,255,            c_eat+c_store,    s_tagname);
-    a(s_tagname,    c_ws,    0,0,            c_nil,            s_tagnamedone);
-    a(s_tagname,    "/>",    0,0,            c_nil,            s_tagnamedone);
-    a(s_tagname,    NULL,    0,255,            c_eat+c_store,    s_tagname);
-    r(s_tagnamedone,    t_tag,                                s_intag);
-
-    a(s_intag,        c_ws,    0,0,            c_eat,            s_intag);
-    a(s_intag,        ">",    0,0,            c_eat,            s_tagend);
-    a(s_intag,        "/",    0,0,            c_eat,            s_empty);
-    a(s_intag,        NULL,    0,255,            c_eat+c_store,    s_attstart);
-
-    a(s_attstart,    c_ws,    0,0,            c_eat,            s_attdone);
-    a(s_attstart,    "=/>",    0,0,            c_nil,            s_attdone);
-    a(s_attstart,    NULL,    0,255,            c_eat+c_store,    s_attname);
-    a(s_attname,    "=/>",    0,0,            c_nil,            s_attdone);
-    a(s_attname,    c_ws,    0,0,            c_eat,            s_attdone);
-    a(s_attname,    NULL,    0,255,            c_eat+c_store,    s_attname);
-    r(s_attdone,    t_att,                                    s_att);
-    a(s_att,        c_ws,    0,0,            c_eat,            s_att);
-    a(s_att,        "=",    0,0,            c_eat,            s_atteq);
-    a(s_att,        NULL,    0,255,            c_eat,            s_intag);
-    a(s_atteq,        "'",    0,0,            c_eat,            s_eqapos);
-    a(s_atteq,        "\"",    0,0,            c_eat,            s_eqquot);
-    a(s_atteq,        c_ws,    0,0,            c_eat,            s_atteq);
-    a(s_atteq,        NULL,    0,255,            c_nil,            s_eqval);
-
-    a(s_eqapos,        "'",    0,0,            c_eat,            s_eqaposvaldone);
-    a(s_eqapos,        NULL,    0,255,            c_eat+c_store,    s_eqaposval);
-    a(s_eqaposval,        "'",    0,0,        c_eat,            s_eqaposvaldone);
-    a(s_eqaposval,        NULL,    0,255,        c_eat+c_store,    s_eqaposval);
-    r(s_eqaposvaldone,    t_val,                                    s_intag);
-
-    a(s_eqquot,        "\"",    0,0,            c_eat,            s_eqquotvaldone);
-    a(s_eqquot,        NULL,    0,255,            c_eat+c_store,    s_eqquotval);
-    a(s_eqquotval,        "\"",    0,0,        c_eat,            s_eqquotvaldone);
-    a(s_eqquotval,        NULL,    0,255,        c_eat+c_store,    s_eqquotval);
-    r(s_eqquotvaldone,    t_val,                                    s_intag);
-
-    a(s_eqval,        c_ws,    0,0,            c_nil,            s_eqvaldone);
-    a(s_eqval,        "/>",    0,0,            c_nil,            s_eqvaldone);
-    a(s_eqval,        NULL,    0,255,            c_eat+c_store,    s_eqval);
-
-    r(s_eqvaldone,    t_val,                                    s_intag);
-
-    r(s_tagend,        t_endtag,                s_start);
-
-    r(s_empty,              t_endtag,                               s_inempty);
-    a(s_inempty,        ">",0,0,                c_eat,            s_emptyend);
-    a(s_inempty,        NULL,0,255,                c_eat,            s_inempty);
-    r(s_emptyend,    t_closeemptytag,                        s_start);
-
-    a(s_prolog,        "?",0,0,                c_eat,            s_prologq);
-    a(s_prolog,        NULL,0,255,                c_eat+c_store,    s_prolog);
-
-    a(s_prologq,    ">",0,0,                c_eat,            s_prologdone);
-    a(s_prologq,    NULL,0,255,                c_eat+c_store,    s_prolog);
-    r(s_prologdone,    t_prolog,                s_start);
-
-    a(s_tagexcl,    "-",0,0,                c_eat,            s_commentdash1);
-    a(s_tagexcl,    "D",0,0,                c_nil,            s_dtd);
-    a(s_tagexcl,    NULL,0,255,                c_eat,            s_start);
-
-    a(s_commentdash1,    "-",0,0,                c_eat,            s_commentdash2);
-    a(s_commentdash1,    NULL,0,255,                c_eat,            s_error);
-
-    a(s_commentdash2,    "-",0,0,                c_eat,            s_commentenddash1);
-    a(s_commentdash2,    NULL,0,255,                c_eat+c_store,    s_incomment);
-
-    a(s_incomment   ,    "-",0,0,                c_eat,            s_commentenddash1);
-    a(s_incomment   ,    NULL,0,255,                c_eat+c_store,    s_incomment);
-
-    a(s_commentenddash1,    "-",0,0,            c_eat,            s_commentenddash2);
-    a(s_commentenddash1,    NULL,0,255,            c_eat+c_store,    s_incomment);
-
-    a(s_commentenddash2,    ">",0,0,            c_eat,            s_commentdone);
-    a(s_commentenddash2,    NULL,0,255,            c_eat+c_store,    s_incomment);
-
-    r(s_commentdone,    t_comment,                s_start);
-
-}
-
-/* *INDENT-ON* */
-
-static int
-is_oneof (char c, char *chars)
-{
-  while (*chars)
-    {
-      if (c == *chars)
-        return 1;
-      chars++;
-    }
-  return 0;
-}
+#include "mrg-xml-states.h"
+#include "mrg-xml-table.inc"
 
 static int
 nextchar (MrgXml *t)
@@ -319,9 +84,6 @@ nextchar (MrgXml *t)
 int
 xmltok_get (MrgXml *t, char **data, int *pos)
 {
-  state_entry *s;
-
-  init_statetable ();
   mrg_string_clear (t->curdata);
   while (1)
     {
@@ -379,44 +141,201 @@ xmltok_get (MrgXml *t, char **data, int *pos)
           if (pos)*pos = t->inbufpos;
           return t_dtd;
         }
-      s = &state_table[t->state][0];
-      while (s->state)
+      if (xml_return_type[t->state] != t_none)
+        {
+          int type = xml_return_type[t->state];
+          *data = (char *) mrg_string_get (t->curdata);
+          t->state = xml_return_state[t->state];
+          if (type == t_tag)
+            mrg_string_set (t->curtag, mrg_string_get (t->curdata));
+          if (type == t_endtag)
+            *data = (char *) mrg_string_get (t->curtag);
+          if (type == t_closeemptytag)
+            *data = (char *) mrg_string_get (t->curtag);
+          if (pos)
+            *pos = t->inbufpos;
+          return type;
+        }
+      {
+        int transition = xml_transitions[t->state][t->c];
+        if (transition & c_store)
+          mrg_string_append_byte (t->curdata, t->c);
+        if (transition & c_eat)
+          t->c_held = 0;
+        t->state = XML_NEXT_STATE (transition);
+      }
+    }
+  if (pos)
+    *pos = t->inbufpos;
+  return t_eof;
+}
+
+/* the end of the run of bytes that state stores while staying in itself,
+ * starting at pos
+ */
+static int
+scan_run (const unsigned char *buf, int pos, int length, int state)
+{
+  int stop = xml_run_stop[state];
+
+  if (stop >= 0)
+    {
+      const unsigned char *found = memchr (buf + pos, stop, length - pos);
+      return found ? found - buf : length;
+    }
+  else
+    {
+      const unsigned char *transitions = xml_transitions[state];
+      unsigned char self = (state << 2) | c_eat | c_store;
+      while (pos < length && transitions[buf[pos]] == self)
+        pos++;
+      return pos;
+    }
+}
+
+/* like xmltok_get, but for a tokenizer created with xmltok_slice_new, the
+ * token is returned as the offset and length of its bytes in the buffer
+ * rather than copied. The stored bytes of comments and prologs are not
+ * contiguous, for them the slice spans from the first to the last one.
+ *
+ * t_eof is returned when the end of the buffer is reached, the token in
+ * progress continues when more data is provided with xmltok_slice_rebuffer.
+ */
+int
+xmltok_get_slice (MrgXml *t, int *offset, int *length, int *pos)
+{
+  const unsigned char *buf = t->inbuf;
+
+  while (1)
+    {
+      int transition;
+
+      if (!t->c_held)
         {
-          if (s->return_type != t_none)
+          if (t->inbufpos >= t->inbuflen)
             {
-              *data = (char *) mrg_string_get (t->curdata);
-              t->state = s->next_state;
-              if (s->return_type == t_tag)
-                mrg_string_set (t->curtag, mrg_string_get (t->curdata));
-              if (s->return_type == t_endtag)
-                *data = (char *) mrg_string_get (t->curtag);
-              if (s->return_type == t_closeemptytag)
-                *data = (char *) mrg_string_get (t->curtag);
-              if (pos)
-                *pos = t->inbufpos;
-              return s->return_type;
+              if (pos)*pos = t->inbufpos;
+              return t_eof;
             }
-          if ((s->chars && is_oneof (t->c, s->chars))
-              || ((s->r_start + s->r_end)
-                  && (t->c >= s->r_start && t->c <= s->r_end)))
+          t->c = buf[t->inbufpos++];
+          t->c_held = 1;
+        }
+      if (t->state == s_dtd)
+        {
+          if (t->token_start < 0)
             {
-              if (s->charhandling & c_store)
+              t->token_start = t->inbufpos - 1;
+              t->dtd_depth = 1;
+            }
+          else
+            {
+              t->inbufpos--; /* resuming, the held byte is not counted yet */
+            }
+          t->c_held = 0;
+          while (t->dtd_depth)
+            {
+              if (t->inbufpos >= t->inbuflen)
                 {
-                  mrg_string_append_byte (t->curdata, t->c);
+                  if (pos)*pos = t->inbufpos;
+                  return t_eof;
                 }
-              if (s->charhandling & c_eat)
+              switch (buf[t->inbufpos++])
                 {
-                  t->c_held = 0;
+                case '<':
+                  t->dtd_depth++;
+                  break;
+                case '>':
+                  t->dtd_depth--;
+                  break;
                 }
-              t->state = s->next_state;
-              break;
             }
-          s++;
+          t->state = s_start;
+
+          *offset = t->token_start;
+          *length = t->inbufpos - 1 - t->token_start;
+          t->token_start = -1;
+          if (pos)*pos = t->inbufpos;
+          return t_dtd;
         }
+      if (xml_return_type[t->state] != t_none)
+        {
+          int type = xml_return_type[t->state];
+
+          if (t->token_start < 0)
+            t->token_start = t->token_end = t->inbufpos - t->c_held;
+          t->state = xml_return_state[t->state];
+          if (type == t_tag)
+            {
+              t->tag_offset = t->token_start;
+              t->tag_length = t->token_end - t->token_start;
+            }
+          if (type == t_endtag || type == t_closeemptytag)
+            {
+              t->token_start = t->tag_offset;
+              t->token_end = t->tag_offset + t->tag_length;
+            }
+          *offset = t->token_start;
+          *length = t->token_end - t->token_start;
+          t->token_start = -1;
+          if (pos)
+            *pos = t->inbufpos;
+          return type;
+        }
+
+      transition = xml_transitions[t->state][t->c];
+      if (transition & c_store)
+        {
+          if (t->token_start < 0)
+            t->token_start = t->inbufpos - 1;
+          t->token_end = t->inbufpos;
+        }
+      if (transition & c_eat)
+        {
+          t->c_held = 0;
+          if (transition == ((t->state << 2) | c_eat | c_store))
+            {
+              /* staying in the same state storing, take the whole run */
+              t->inbufpos = t->token_end = scan_run (buf, t->inbufpos,
+                                                     t->inbuflen, t->state);
+            }
+        }
+      t->state = XML_NEXT_STATE (transition);
     }
-  if (pos)
-    *pos = t->inbufpos;
-  return t_eof;
+}
+
+/* the first offset in the buffer the tokenizer still refers to, what is
+ * before it can be discarded
+ */
+int
+xmltok_slice_needed (MrgXml *t)
+{
+  int needed = t->inbufpos - t->c_held;
+
+  if (t->token_start >= 0 && t->token_start < needed)
+    needed = t->token_start;
+  /* the tag name is returned again for the end of the tag */
+  if (t->state >= s_tagnamedone && t->state <= s_emptyend &&
+      t->tag_offset < needed)
+    needed = t->tag_offset;
+  return needed;
+}
+
+/* continue tokenizing in buf, which holds the data of the previous buffer
+ * from offset discarded on, followed by new data. Offsets returned from
+ * then on are relative to buf.
+ */
+void
+xmltok_slice_rebuffer (MrgXml *t, const char *buf, int length, int discarded)
+{
+  t->inbuf = (void*)buf;
+  t->inbuflen = length;
+  t->inbufpos -= discarded;
+  if (t->token_start >= 0)
+    {
+      t->token_start -= discarded;
+      t->token_end -= discarded;
+    }
+  t->tag_offset -= discarded;
 }
 
 MrgXml *
@@ -449,6 +368,28 @@ xmltok_buf_new (char *membuf)
   return ret;
 }
 
+/* a tokenizer for xmltok_get_slice over length bytes of buf, which is
+ * neither copied nor modified and has to stay around until the tokenizer
+ * is freed; it can thus be a mmap'd file.
+ */
+MrgXml *
+xmltok_slice_new (const char *buf, int length)
+{
+  MrgXml *ret;
+
+  ret = calloc (1, sizeof (MrgXml));
+  ret->file_in = NULL;
+  ret->state = s_start;
+  ret->curtag = mrg_string_new ("");
+  ret->curdata = mrg_string_new ("");
+  ret->inbuf = (void*)buf;
+  ret->inbuflen = length;
+  ret->inbufpos = 0;
+  ret->zero_copy = 1;
+  ret->token_start = -1;
+  return ret;
+}
+
 void
 xmltok_free (MrgXml *t)
 {
@@ -475,5 +416,16 @@ char     *endomission_tags[] = {
 int
 xmltok_lineno (MrgXml *t)
 {
+  if (t->zero_copy)
+    {
+      /* not tracked while scanning slices, only needed for messages;
+       * counted from the start of the current buffer
+       */
+      int i, line_no = 0;
+      for (i = 0; i < t->inbufpos; i++)
+        if (t->inbuf[i] == '\n')
+          line_no++;
+      return line_no;
+    }
   return t->line_no;
 }
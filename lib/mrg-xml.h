@@ -45,8 +45,13 @@ enum
 
 MrgXml *xmltok_new (FILE * file_in);
 MrgXml *xmltok_buf_new (char *membuf);
+MrgXml *xmltok_slice_new (const char *buf, int length);
 void    xmltok_free (MrgXml *t);
 int     xmltok_lineno (MrgXml *t);
 int     xmltok_get (MrgXml *t, char **data, int *pos);
+int     xmltok_get_slice (MrgXml *t, int *offset, int *length, int *pos);
+int     xmltok_slice_needed (MrgXml *t);
+void    xmltok_slice_rebuffer (MrgXml *t, const char *buf, int length,
+                               int discarded);
 
 #endif /*XMLTOK_H */
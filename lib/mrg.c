@@ -18,6 +18,7 @@
 #include "mrg-config.h"
 #include "mrg-internal.h"
 #include <sys/time.h>
+#include <pthread.h>
 
 void mrg_quit (Mrg *mrg)
 {
@@ -36,6 +37,8 @@ void _mrg_init (Mrg *mrg, int width, int height)
   mrg->state->style.color.blue = 0;
   mrg->state->style.color.alpha = 1;
   mrg->ddpx = 1;
+  mrg->prev_frame_ticks = 10000;
+  mrg->target_fps = 60;
   if (getenv ("MRG_DDPX"))
   {
     mrg->ddpx = strtod (getenv ("MRG_DDPX"), NULL);
@@ -75,24 +78,33 @@ void _mrg_init (Mrg *mrg, int width, int height)
 
   if (getenv ("MRG_RESTARTER"))
     mrg_restarter_init (mrg);
+
+  if (getenv ("MRG_RECORD"))
+    mrg_record_start (mrg, getenv ("MRG_RECORD"));
+
+  _mrg_profile_init (mrg);
+  _mrg_hud_init (mrg);
 }
 
 
 static struct timeval start_time;
+static pthread_once_t start_time_once = PTHREAD_ONCE_INIT;
 
 #define usecs(time)    ((time.tv_sec - start_time.tv_sec) * 1000000 + time.     tv_usec)
 
 static void
-init_ticks (void)
+set_start_time (void)
 {
-  static int done = 0;
-
-  if (done)
-    return;
-  done = 1;
   gettimeofday (&start_time, NULL);
 }
-static inline long
+
+/* the ticks count from the first use in the process, by any instance */
+static void
+init_ticks (void)
+{
+  pthread_once (&start_time_once, set_start_time);
+}
+long
 _mrg_ticks (void)
 {
   struct timeval measure_time;
@@ -201,8 +213,9 @@ Mrg *mrg_new (int width, int height, const char *backend)
       exit (-1);
     }
   }
-  if (mrg)
-    mrg_style_defaults (mrg);
+  if (!mrg)
+    return NULL; /* mrg_new2 told why */
+  mrg_style_defaults (mrg);
   mrg->edited_str = mrg_string_new ("");
   signal(SIGCHLD, SIG_IGN);
   return mrg;
@@ -210,6 +223,17 @@ Mrg *mrg_new (int width, int height, const char *backend)
 
 void mrg_destroy (Mrg *mrg)
 {
+  mrg_record_stop (mrg);
+  _mrg_retained_destroy (mrg);
+  _mrg_raster_destroy (mrg);
+  _mrg_image_cache_free (mrg);
+  _mrg_focus_free (&mrg->focus);
+  _mrg_items_destroy (mrg);
+  _mrg_clear_text_closures (mrg);
+  free (mrg->deferred);
+  if (mrg->hud)
+    free (mrg->hud);
+  mrg_set_collect_frame_stats (mrg, 0);
   if (mrg->backend->mrg_destroy)
     mrg->backend->mrg_destroy (mrg);
   if (mrg->edited_str)
@@ -246,7 +270,7 @@ int  _mrg_has_quit (Mrg *mrg)
   return mrg?mrg->quit:1;
 }
 
-static void 
+void
 _mrg_rectangle_combine_bounds (MrgRectangle       *rect_dest,
                                const MrgRectangle *rect_other)
 {
@@ -378,6 +402,13 @@ cairo_t *mrg_cr (Mrg *mrg)
     if (mrg->cr)
       return mrg->cr;
 
+    if (mrg->raster)
+    {
+      mrg->cr = _mrg_raster_cr (mrg);
+      cairo_set_antialias (mrg->cr, CAIRO_ANTIALIAS_FAST);
+      return mrg->cr;
+    }
+
     width = mrg->width;
     height = mrg->height;
 
@@ -395,9 +426,6 @@ cairo_t *mrg_cr (Mrg *mrg)
   return cr;
 }
 
-static long  frame_start;
-static long  frame_end;
-
 void _mrg_bindings_key_down (MrgEvent *event, void *data1, void *data2);
 void mrg_text_edit_bindings (Mrg *mrg);
 void mrg_focus_bindings (Mrg *mrg);
@@ -415,15 +443,18 @@ typedef struct IdleCb {
   int   id;
 } IdleCb;
 
-static long prev_ticks = 0;
-
 void _mrg_idle_iteration (Mrg *mrg)
 {
   MrgList *l;
   MrgList *to_remove = NULL;
   long ticks = _mrg_ticks ();
-  long tick_delta = (prev_ticks == 0) ? 0 : ticks - prev_ticks;
-  prev_ticks = ticks;
+  long tick_delta = (mrg->prev_idle_ticks == 0) ? 0 : ticks - mrg->prev_idle_ticks;
+  mrg->prev_idle_ticks = ticks;
+
+  if (mrg->raster)
+    _mrg_raster_poll (mrg);
+  if (mrg->image_cache)
+    _mrg_image_cache_poll (mrg);
 
   if (!mrg->idles)
   {
@@ -462,7 +493,7 @@ void mrg_prepare (Mrg *mrg)
   mrg->state->bg = 7;
 
   if (!mrg->printing)
-    frame_start = _mrg_ticks ();
+    mrg->frame_start = _mrg_ticks ();
 
   if (mrg->edited_str == NULL)
     mrg->edited_str = mrg_string_new ("");
@@ -470,6 +501,11 @@ void mrg_prepare (Mrg *mrg)
     mrg_string_set (mrg->edited_str, "");
   mrg->got_edit = 0;
   mrg_clear (mrg);
+  if (!mrg->printing)
+  {
+    _mrg_hud_prepare (mrg);
+    _mrg_image_cache_prepare (mrg);
+  }
   mrg->in_paint ++;
 
   _mrg_text_prepare (mrg);
@@ -503,11 +539,13 @@ void mrg_prepare (Mrg *mrg)
      * is quite performance sensitive, thus knowing the best way
      * to achieve it with CSS is good.
      */
+    MRG_PROFILE_BEGIN (mrg, MRG_PHASE_PAINT);
     mrg_cairo_set_source_color (cr, &mrg_style(mrg)->background_color);
     cairo_save (cr);
     cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
     cairo_paint (cr);
     cairo_restore (cr);
+    MRG_PROFILE_END (mrg, MRG_PHASE_PAINT);
     mrg_cairo_set_source_color (cr, &mrg_style(mrg)->color);
   }
 
@@ -520,13 +558,12 @@ void mrg_prepare (Mrg *mrg)
 #endif
 }
 
-static long prev_frame_ticks = 10000;
-
 void mrg_flush  (Mrg *mrg)
 {
   cairo_new_path (mrg_cr (mrg));
 
-  //_mrg_debug_overlays (mrg);
+  if (mrg->hud && !mrg->printing)
+    _mrg_debug_overlays (mrg);
   mrg_end (mrg);
 
   if (mrg->got_edit && mrg->text_edit_blocked <= 0)
@@ -536,16 +573,31 @@ void mrg_flush  (Mrg *mrg)
 
   cairo_restore (mrg_cr (mrg));
 
-  if (mrg->backend->mrg_flush)
+  MRG_PROFILE_BEGIN (mrg, MRG_PHASE_FLUSH);
+  if (mrg->raster && !mrg->printing && _mrg_raster_flush (mrg))
+  {
+    /* flushed by _mrg_raster_present once painted */
+  }
+  else if (mrg->backend->mrg_flush)
     mrg->backend->mrg_flush (mrg);
+  MRG_PROFILE_END (mrg, MRG_PHASE_FLUSH);
   mrg->dirty = mrg->dirty_during_paint;
   _mrg_set_clean_ddp (mrg);
 
   mrg->in_paint --;
-  frame_end = _mrg_ticks ();
+  if (mrg->retained && !mrg->printing)
+    _mrg_retained_frame (mrg);
+  mrg->frame_end = _mrg_ticks ();
+  if (mrg->record)
+    _mrg_record_flush (mrg);
 
-  prev_frame_ticks = (frame_end - frame_start);
-  //fprintf (stderr, "(%f)", (frame_end - frame_start) / 1000.0);
+  mrg->prev_frame_ticks = (mrg->frame_end - mrg->frame_start);
+  if (!mrg->printing)
+  {
+    _mrg_profile_frame (mrg, mrg->frame_start, mrg->frame_end);
+    if (mrg->hud)
+      _mrg_hud_frame (mrg);
+  }
 }
 
 void mrg_warp_pointer (Mrg *mrg, float x, float y)
@@ -664,7 +716,10 @@ void mrg_start_with_style (Mrg        *mrg,
     cairo_save (mrg_cr (mrg));
 
   {
-    char *collated_style = _mrg_stylesheet_collate_style (mrg);
+    char *collated_style;
+    MRG_PROFILE_BEGIN (mrg, MRG_PHASE_CASCADE);
+    collated_style = _mrg_stylesheet_collate_style (mrg);
+    MRG_PROFILE_END (mrg, MRG_PHASE_CASCADE);
     if (collated_style)
     {
       mrg_set_style (mrg, collated_style);
@@ -703,6 +758,8 @@ void mrg_start (Mrg *mrg, const char *style_id, void *id_ptr)
 
 void mrg_end (Mrg *mrg)
 {
+  if (mrg->retained)
+    _mrg_retained_end (mrg);
   _mrg_layout_post (mrg, &mrg->html);
   if (mrg->state->style_id)
   {
@@ -799,6 +856,8 @@ void _mrg_set_post_nl (Mrg *mrg,
 
 unsigned char *mrg_get_pixels (Mrg *mrg, int *rowstride)
 {
+  if (mrg->raster)
+    _mrg_raster_present (mrg);
   if (mrg->backend->mrg_get_pixels)
     return mrg->backend->mrg_get_pixels (mrg, rowstride);
   return NULL;
@@ -809,22 +868,18 @@ float mrg_ddpx (Mrg *mrg)
   return mrg->ddpx;
 }
 
-static long prev_frame_present = 0;
-
 float mrg_prev_frame_time (Mrg *mrg)
 {
-  return prev_frame_ticks / 1000.0;
+  return mrg->prev_frame_ticks / 1000.0;
 }
 
-static float target_fps = 60;
-
 void mrg_set_target_fps (Mrg *mrg, float fps)
 {
-  target_fps = fps;
+  mrg->target_fps = fps;
 }
 float mrg_get_target_fps (Mrg *mrg)
 {
-  return target_fps;
+  return mrg->target_fps;
 }
 
 #include <cairo-pdf.h>
@@ -882,15 +937,15 @@ void mrg_render_svg (Mrg *mrg, const char *svg_path)
 
 void  mrg_ui_update (Mrg *mrg)
 {
-  if (target_fps > 0 && prev_frame_present)
+  if (mrg->target_fps > 0 && mrg->prev_frame_present)
   {
-    long target_tick = prev_frame_present + 1000000/ target_fps;
+    long target_tick = mrg->prev_frame_present + 1000000/ mrg->target_fps;
     long now = _mrg_ticks ();
     long delta = target_tick - now;
 
-    if (delta > prev_frame_ticks)
+    if (delta > mrg->prev_frame_ticks)
     {
-       usleep ((delta - prev_frame_ticks) * 0.5);
+       usleep ((delta - mrg->prev_frame_ticks) * 0.5);
     }
   }
 
@@ -899,7 +954,7 @@ void  mrg_ui_update (Mrg *mrg)
     mrg->ui_update (mrg, mrg->user_data);
   mrg_flush (mrg);
 
-  prev_frame_present = _mrg_ticks ();
+  mrg->prev_frame_present = _mrg_ticks ();
 }
 
 static void mrg_mrg_press (MrgEvent *event, void *mrg, void *data2)
@@ -1098,6 +1153,15 @@ mrg_get_contents (Mrg         *mrg,
 
 #if MRG_LOG
 
+static int log_level = 0;
+static pthread_once_t log_level_once = PTHREAD_ONCE_INIT;
+
+static void init_log_level (void)
+{
+  if (getenv ("MRG_LOG_LEVEL"))
+    log_level = atoi(getenv("MRG_LOG_LEVEL"));
+}
+
 void __mrg_log (Mrg        *mrg,
                 const char *file,
                 const char *function,
@@ -1105,14 +1169,7 @@ void __mrg_log (Mrg        *mrg,
                 int         type,
                 const char *message)
 {
-  static int inited = 0;
-  static int log_level = 0;
-  if (!inited)
-  {
-    inited = 1;
-    if (getenv ("MRG_LOG_LEVEL"))
-      log_level = atoi(getenv("MRG_LOG_LEVEL"));
-  }
+  pthread_once (&log_level_once, init_log_level);
   if (type > log_level)
     return;
   switch (type)
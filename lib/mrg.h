@@ -91,6 +91,7 @@ MrgImage *mrg_query_image_memory (Mrg *mrg,
                                   int        *width,
                                   int        *height);
 
+/* the surface is NULL while the image is being decoded asynchronously */
 cairo_surface_t *mrg_image_get_surface (MrgImage *image);
 
 
@@ -102,6 +103,35 @@ void mrg_image_memory (Mrg *mrg, float x0, float y0, float width, float height,
 void mrg_set_image_cache_mb (Mrg *mrg, int new_max_size);
 int mrg_get_image_cache_mb (Mrg *mrg);
 
+/* with async image decoding, images not yet in the cache are decoded by
+ * worker threads (MRG_IMAGE_THREADS, 2 by default), mrg_image draws
+ * nothing and mrg_query_image returns an image only when its size can be
+ * read from the header, until the decode is done and a redraw queued.
+ * Decodes still queued when the image has not been drawn for a few frames
+ * are dropped. Off by default, or as set by MRG_IMAGE_ASYNC.
+ */
+void mrg_set_image_decode_async (Mrg *mrg, int async);
+int  mrg_get_image_decode_async (Mrg *mrg);
+
+/* with a disk cache budget (in MB), images from files are also kept
+ * downscaled on disk, in $XDG_CACHE_HOME/mrg, and an image drawn smaller
+ * than it is is loaded from there instead of being decoded again. The files
+ * are then only decoded when drawn, and mrg_image_get_surface returns NULL
+ * for images not yet drawn. Off (0) by default, or as set by
+ * MRG_IMAGE_DISK_CACHE_MB.
+ */
+void mrg_set_image_disk_cache_mb (Mrg *mrg, int max_size);
+int  mrg_get_image_disk_cache_mb (Mrg *mrg);
+
+/* images from memory passed without an eid are identified by a hash of
+ * the encoded data; when the application promises that buffers are
+ * immutable, that is that a buffer at the same address and of the same
+ * length always holds the same data, the id is remembered for recently
+ * used buffers instead of hashing them on every call. Off by default.
+ */
+void mrg_set_image_memory_immutable (Mrg *mrg, int immutable);
+int  mrg_get_image_memory_immutable (Mrg *mrg);
+
 /* built in http / local file URI fetcher, this is the callback interface
  * that needs to be implemented for mrg_xml_render if external resources (css
  * files / png images) are to be retrieved and rendered.
@@ -143,6 +173,53 @@ int mrg_add_timeout_full (Mrg *mrg, int ms, int (*idle_cb)(Mrg *mrg, void *idle_
 
 float mrg_prev_frame_time (Mrg *mrg);
 
+/* phases of a frame that are timed when collecting frame stats */
+typedef enum {
+  MRG_PHASE_CASCADE,  /* matching the stylesheet against the element stack */
+  MRG_PHASE_STYLE,    /* parsing css properties in mrg_set_style */
+  MRG_PHASE_LAYOUT,   /* word wrapping text */
+  MRG_PHASE_PAINT,    /* cairo drawing of text, boxes, paths and images */
+  MRG_PHASE_LISTEN,   /* registering listeners */
+  MRG_PHASE_HIT_TEST, /* finding items hit by events */
+  MRG_PHASE_FLUSH,    /* handing the frame to the backend */
+  MRG_PHASE_RASTER,   /* painting the recorded frame in tiles, with
+                         MRG_RENDER_THREADS, nested in flush */
+  MRG_PHASE_COUNT
+} MrgPhase;
+
+typedef struct _MrgFrameStats MrgFrameStats;
+
+struct _MrgFrameStats {
+  int   frame_no;
+  float frame_ms;                     /* from mrg_prepare to end of mrg_flush */
+  float phase_ms[MRG_PHASE_COUNT];    /* exclusive of nested phases */
+  int   phase_calls[MRG_PHASE_COUNT];
+  int   items;                        /* distinct listening areas */
+  int   listeners;                    /* mrg_listen calls */
+  long  image_cache_bytes;            /* decoded images held by the cache */
+  int   image_cache_images;
+  long  image_cache_hits;             /* lookups since mrg_new */
+  long  image_cache_misses;
+  long  image_cache_evictions;        /* images dropped to stay within
+                                         mrg_set_image_cache_mb */
+};
+
+/* statistics of the last completed frame, the per phase breakdown is only
+ * gathered when enabled with mrg_set_collect_frame_stats, MRG_FRAME_STATS
+ * or MRG_TRACE, and mrg is built with MRG_PROFILE.
+ */
+const MrgFrameStats *mrg_get_frame_stats (Mrg *mrg);
+void        mrg_set_collect_frame_stats (Mrg *mrg, int enabled);
+int         mrg_get_collect_frame_stats (Mrg *mrg);
+const char *mrg_phase_name (MrgPhase phase);
+
+/* an overlay showing a frame time graph, the phase breakdown of the last
+ * frame, item and listener counts, image cache use and the dirty rectangle.
+ * Toggled with F12, and shown from the start when MRG_HUD is set.
+ */
+void mrg_set_hud (Mrg *mrg, int shown);
+int  mrg_get_hud (Mrg *mrg);
+
 /* send a message to the host, the host can communicate back
  * through MESSAGE eventsusing mrg_client_send_message
  */
@@ -154,6 +231,19 @@ void mrg_window_set_value (Mrg *mrg, const char *name, const char *value);
 void mrg_set_target_fps (Mrg *mrg, float fps);
 float mrg_get_target_fps (Mrg *mrg);
 
+/* record the input events fed to mrg to a file, also enabled by setting
+ * MRG_RECORD to a path.
+ */
+int  mrg_record_start (Mrg *mrg, const char *path);
+void mrg_record_stop  (Mrg *mrg);
+
+/* feed the events of a recording to mrg, rendering a frame after each
+ * event that causes a redraw and reporting handling time and time to the
+ * following flush to stderr. Done by the mem backend's main when
+ * MRG_REPLAY is set, MRG_REPLAY_FAST makes it ignore recorded timing.
+ */
+int  mrg_replay       (Mrg *mrg, const char *path, int max_speed);
+
 #include "mrg-events.h"
 #include "mrg-text.h"
 #include "mrg-style.h"
@@ -176,6 +176,15 @@ struct _Nchanterm {
   int      mouse_fd;
   int      utf8;
   int      is_st;
+
+  int      had_full;        /* frames until the next full refresh */
+  int      mouse_state;     /* buttons held, as last read from mouse_fd */
+  const char *mev_type;     /* queued mouse event */
+  int      mev_x;
+  int      mev_y;
+  int      mev_q;
+  char     event_buf[256];  /* returned by nct_get_event for synthesized
+                               event names */
 };
 
 /* a quite minimal core set of terminal escape sequences are used to do all
@@ -438,18 +447,17 @@ void nct_flush (Nchanterm *n)
   int x, y;
   int w = n->cells_width;
   int h = n->cells_height;
-  static int had_full = -1;
   int cx=-1, cy=-1;
   nct_cells_ensure (n);
 
-  if (had_full <=0)
+  if (n->had_full <=0)
     {
-      had_full = 40; // do a full refresh every now and then.
+      n->had_full = 40; // do a full refresh every now and then.
       nct_cells_clear_front (n);
     }
   else
     {
-      had_full--;
+      n->had_full--;
     }
 
   for (y = 1; y <= h; y ++)
@@ -766,6 +774,9 @@ static const NcKeyCode keycodes[]={
   {NULL, NULL,  ""}
 };
 
+/* the tty modes belong to the controlling terminal of the process, not to
+ * a Nchanterm instance, and are restored at exit
+ */
 static struct termios orig_attr; /* in order to restore at exit */
 static int    nc_is_raw = 0;
 static int    atexit_registered = 0;
@@ -863,7 +874,6 @@ int nct_has_event (Nchanterm UNUSED *n, int delay_ms)
 
 static const char *mouse_get_event_int (Nchanterm *n, int *x, int *y)
 {
-  static int prev_state = 0;
   const char *ret = "mouse-motion";
   float relx, rely;
   signed char buf[3];
@@ -882,44 +892,39 @@ static const char *mouse_get_event_int (Nchanterm *n, int *x, int *y)
   if (x) *x = n->mouse_x;
   if (y) *y = n->mouse_y;
 
-  if ((prev_state & 1) != (buf[0] & 1))
+  if ((n->mouse_state & 1) != (buf[0] & 1))
     {
       if (buf[0] & 1) ret = "mouse-press";
     }
   else if (buf[0] & 1)
     ret = "mouse-drag";
 
-  if ((prev_state & 2) != (buf[0] & 2))
+  if ((n->mouse_state & 2) != (buf[0] & 2))
     {
       if (buf[0] & 2) ret = "mouse2-press";
     }
   else if (buf[0] & 2)
     ret = "mouse2-drag";
 
-  if ((prev_state & 4) != (buf[0] & 4))
+  if ((n->mouse_state & 4) != (buf[0] & 4))
     {
       if (buf[0] & 4) ret = "mouse1-press";
     }
   else if (buf[0] & 4)
     ret = "mouse1-drag";
 
-  prev_state = buf[0];
+  n->mouse_state = buf[0];
   return ret;
 }
 
-static const char *mev_type = NULL;
-static int         mev_x = 0;
-static int         mev_y = 0;
-static int         mev_q = 0;
-
-static const char *mouse_get_event (Nchanterm UNUSED *n, int *x, int *y)
+static const char *mouse_get_event (Nchanterm *n, int *x, int *y)
 {
-  if (!mev_q)
+  if (!n->mev_q)
     return NULL;
-  *x = mev_x;
-  *y = mev_y;
-  mev_q = 0;
-  return mev_type;
+  *x = n->mev_x;
+  *y = n->mev_y;
+  n->mev_q = 0;
+  return n->mev_type;
 }
 
 static int mouse_has_event (Nchanterm *n)
@@ -930,7 +935,7 @@ static int mouse_has_event (Nchanterm *n)
   if (mouse_mode == NC_MOUSE_NONE)
     return 0;
 
-  if (mev_q)
+  if (n->mev_q)
     return 1;
 
   if (n->mouse_fd == -1)
@@ -949,27 +954,27 @@ static int mouse_has_event (Nchanterm *n)
       int nx = 0, ny = 0;
       const char *type = mouse_get_event_int (n, &nx, &ny);
 
-      if ((mouse_mode < NC_MOUSE_DRAG && mev_type && !strcmp (mev_type, "drag")) ||
-          (mouse_mode < NC_MOUSE_ALL && mev_type && !strcmp (mev_type, "motion")))
+      if ((mouse_mode < NC_MOUSE_DRAG && n->mev_type && !strcmp (n->mev_type, "drag")) ||
+          (mouse_mode < NC_MOUSE_ALL && n->mev_type && !strcmp (n->mev_type, "motion")))
         {
-          mev_q = 0;
+          n->mev_q = 0;
           return mouse_has_event (n);
         }
 
-      if ((mev_type && !strcmp (type, mev_type) && !strcmp (type, "mouse-motion")) ||
-         (mev_type && !strcmp (type, mev_type) && !strcmp (type, "mouse1-drag")) ||
-         (mev_type && !strcmp (type, mev_type) && !strcmp (type, "mouse2-drag")))
+      if ((n->mev_type && !strcmp (type, n->mev_type) && !strcmp (type, "mouse-motion")) ||
+         (n->mev_type && !strcmp (type, n->mev_type) && !strcmp (type, "mouse1-drag")) ||
+         (n->mev_type && !strcmp (type, n->mev_type) && !strcmp (type, "mouse2-drag")))
         {
-          if (nx == mev_x && ny == mev_y)
+          if (nx == n->mev_x && ny == n->mev_y)
           {
-            mev_q = 0;
+            n->mev_q = 0;
             return mouse_has_event (n);
           }
         }
-      mev_x = nx;
-      mev_y = ny;
-      mev_type = type;
-      mev_q = 1;
+      n->mev_x = nx;
+      n->mev_y = ny;
+      n->mev_type = type;
+      n->mev_q = 1;
     }
   return retval != 0;
 }
@@ -1094,14 +1099,14 @@ const char *nct_get_event (Nchanterm *n, int timeoutms, int *x, int *y)
                   case 67: return "mouse-motion";
                            /* have a separate mouse-drag ? */
                   default: {
-                             static char rbuf[100];
+                             char *rbuf = n->event_buf;
                              sprintf (rbuf, "mouse (unhandled state: %i)", buf[3]);
                              return rbuf;
                            }
                 }
             case 0: /* no matches, bail*/
               { 
-                static char ret[256];
+                char *ret = n->event_buf;
                 if (length == 0 && nct_utf8_len (buf[0])>1) /* single unicode
                                                                char */
                   {
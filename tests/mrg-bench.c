@@ -0,0 +1,399 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* headless rendering benchmark, renders each document given on the
+ * command line a number of frames with the mem backend and reports the
+ * median and 99th percentile frame time, the median cascade and layout
+ * time and the allocations per frame as tab separated values:
+ *
+ *   mrg-bench [-n frames] [-o results.tsv] [-b baseline.tsv] [-t 0.25]
+ *             [-d] [-c] [-s pixels] docs..
+ *
+ * Documents are parsed every frame with mrg_xml_render, or with -d parsed
+ * once into an MrgXmlDoc that is rendered with mrg_xml_render_doc, like the
+ * browser does; the two are not comparable against the same baseline. With
+ * -c the MrgXmlDoc is rendered in mrg_start_cached, and with -s the
+ * document is scrolled by that many pixels each frame, for measuring the
+ * replay of recordings while scrolling.
+ *
+ * When a baseline produced by an earlier run with -o is given, documents
+ * whose median frame time or allocation count grew by more than the
+ * tolerance are reported, and the exit status is non-zero. Timings only
+ * compare meaningfully on the same machine, which is why no baseline is
+ * shipped; create one with -o on the machine running the benchmark.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mrg.h"
+
+#define BENCH_WIDTH   240 /* same size as the reference renderings */
+#define BENCH_HEIGHT  320
+#define BENCH_WARMUP  2   /* layout settles on the second frame */
+
+static long allocations = 0;
+
+#ifdef __GLIBC__
+/* count allocations by interposing the allocator entry points used by
+ * libmrg, frees are not of interest. Render threads and image decoders
+ * allocate as well, hence the atomic increments.
+ */
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *malloc (size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+  __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc (ptr, size);
+}
+
+/* the strdup of libc allocates without going through malloc above */
+char *strdup (const char *s)
+{
+  size_t length = strlen (s) + 1;
+  char *ret = malloc (length);
+  if (ret)
+    memcpy (ret, s, length);
+  return ret;
+}
+#endif
+
+typedef struct BenchResult {
+  char  document[256];
+  int   frames;
+  float frame_median;
+  float frame_p99;
+  float cascade_median;
+  float layout_median;
+  float allocs;
+} BenchResult;
+
+typedef struct BenchDoc {
+  char      *uri;
+  char      *contents;
+  MrgXmlDoc *xml;      /* with -d */
+  int        cached;   /* with -c */
+  float      scroll;   /* with -s */
+  int        frame;
+} BenchDoc;
+
+static void render_ui (Mrg *mrg, void *data)
+{
+  BenchDoc *doc = data;
+  cairo_t  *cr = mrg_cr (mrg);
+
+  cairo_save (cr);
+  cairo_translate (cr, 0, -fmodf (doc->frame++ * doc->scroll, BENCH_HEIGHT * 4));
+  mrg_stylesheet_clear (mrg);
+  if (doc->cached)
+  {
+    if (mrg_start_cached (mrg, "div", doc->xml, 0))
+      mrg_xml_render_doc (mrg, doc->uri, NULL, NULL, NULL, NULL, doc->xml);
+    mrg_end (mrg);
+  }
+  else if (doc->xml)
+    mrg_xml_render_doc (mrg, doc->uri, NULL, NULL, NULL, NULL, doc->xml);
+  else
+    mrg_xml_render (mrg, doc->uri, NULL, NULL, NULL, NULL, doc->contents);
+  cairo_restore (cr);
+}
+
+static int compare_float (const void *a, const void *b)
+{
+  float fa = *(const float*)a;
+  float fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+/* nearest rank percentile, sorts the samples */
+static float percentile (float *samples, int count, float p)
+{
+  int rank = ceilf (count * p / 100.0f) - 1;
+  qsort (samples, count, sizeof (float), compare_float);
+  if (rank < 0)
+    rank = 0;
+  if (rank >= count)
+    rank = count - 1;
+  return samples[rank];
+}
+
+static int bench_document (const char *path, int frames, int retained,
+                           int cached, float scroll, BenchResult *result)
+{
+  const MrgFrameStats *stats;
+  BenchDoc doc = {NULL, NULL, NULL, 0, 0.0, 0};
+  float *frame_ms, *cascade_ms, *layout_ms;
+  char  *real;
+  long   length;
+  long   allocations_start;
+  Mrg   *mrg;
+  int    i;
+
+  real = realpath (path, NULL);
+  if (!real)
+  {
+    fprintf (stderr, "mrg-bench: %s not found\n", path);
+    return -1;
+  }
+  doc.uri = malloc (strlen (real) + 8);
+  sprintf (doc.uri, "file://%s", real);
+  free (real);
+
+  mrg = mrg_new (BENCH_WIDTH, BENCH_HEIGHT, "mem");
+  mrg_get_contents (mrg, NULL, doc.uri, &doc.contents, &length);
+  if (!doc.contents)
+  {
+    fprintf (stderr, "mrg-bench: unable to load %s\n", path);
+    mrg_destroy (mrg);
+    free (doc.uri);
+    return -1;
+  }
+  frame_ms   = malloc (sizeof (float) * frames);
+  cascade_ms = malloc (sizeof (float) * frames);
+  layout_ms  = malloc (sizeof (float) * frames);
+  if (retained || cached)
+    doc.xml = mrg_xml_doc_new (doc.contents);
+  doc.cached = cached;
+  doc.scroll = scroll;
+
+  mrg_set_target_fps (mrg, 0);
+  mrg_set_collect_frame_stats (mrg, 1);
+  mrg_css_set (mrg, "document { background: #ffff;}");
+  mrg_set_ui (mrg, render_ui, &doc);
+
+  for (i = 0; i < BENCH_WARMUP; i++)
+  {
+    mrg_queue_draw (mrg, NULL);
+    mrg_ui_update (mrg);
+  }
+
+  allocations_start = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+  for (i = 0; i < frames; i++)
+  {
+    mrg_queue_draw (mrg, NULL);
+    mrg_ui_update (mrg);
+    stats = mrg_get_frame_stats (mrg);
+    frame_ms[i]   = stats->frame_ms;
+    cascade_ms[i] = stats->phase_ms[MRG_PHASE_CASCADE];
+    layout_ms[i]  = stats->phase_ms[MRG_PHASE_LAYOUT];
+  }
+
+  /* the basename, so that baselines do not depend on where the tree is */
+  snprintf (result->document, sizeof (result->document), "%s",
+            strrchr (path, '/') ? strrchr (path, '/') + 1 : path);
+  result->frames = frames;
+  result->allocs = (__atomic_load_n (&allocations, __ATOMIC_RELAXED) -
+                    allocations_start) / (float)frames;
+  result->frame_median   = percentile (frame_ms, frames, 50);
+  result->frame_p99      = percentile (frame_ms, frames, 99);
+  result->cascade_median = percentile (cascade_ms, frames, 50);
+  result->layout_median  = percentile (layout_ms, frames, 50);
+
+  mrg_destroy (mrg);
+  mrg_xml_doc_free (doc.xml);
+  free (doc.contents);
+  free (doc.uri);
+  free (frame_ms);
+  free (cascade_ms);
+  free (layout_ms);
+  return 0;
+}
+
+static const char *header =
+  "# document\tframes\tframe_median_ms\tframe_p99_ms\tcascade_median_ms\tlayout_median_ms\tallocs_per_frame\n";
+
+static void write_result (FILE *file, BenchResult *result)
+{
+  fprintf (file, "%s\t%i\t%.3f\t%.3f\t%.3f\t%.3f\t%.1f\n",
+           result->document, result->frames,
+           result->frame_median, result->frame_p99,
+           result->cascade_median, result->layout_median,
+           result->allocs);
+}
+
+static BenchResult *read_results (const char *path, int *count)
+{
+  BenchResult *results = NULL;
+  BenchResult  result;
+  char  line[1024];
+  FILE *file = fopen (path, "r");
+  int   allocated = 0;
+
+  *count = 0;
+  if (!file)
+    return NULL;
+  while (fgets (line, sizeof (line), file))
+  {
+    if (line[0] == '#')
+      continue;
+    if (sscanf (line, "%255[^\t]\t%i\t%f\t%f\t%f\t%f\t%f",
+                result.document, &result.frames,
+                &result.frame_median, &result.frame_p99,
+                &result.cascade_median, &result.layout_median,
+                &result.allocs) != 7)
+      continue;
+    if (*count + 1 > allocated)
+    {
+      allocated = allocated * 2 + 8;
+      results = realloc (results, sizeof (BenchResult) * allocated);
+    }
+    results[(*count)++] = result;
+  }
+  fclose (file);
+  return results;
+}
+
+static int compare_baseline (BenchResult *result,
+                             BenchResult *baseline, int baseline_count,
+                             float tolerance)
+{
+  int i;
+  for (i = 0; i < baseline_count; i++)
+    if (!strcmp (baseline[i].document, result->document))
+    {
+      int regressed = 0;
+      if (result->frame_median > baseline[i].frame_median * (1.0 + tolerance))
+      {
+        fprintf (stderr, "REGRESSION %s: median frame %.3fms, baseline %.3fms\n",
+                 result->document, result->frame_median,
+                 baseline[i].frame_median);
+        regressed = 1;
+      }
+      if (result->allocs > baseline[i].allocs * (1.0 + tolerance))
+      {
+        fprintf (stderr, "REGRESSION %s: %.1f allocations per frame, baseline %.1f\n",
+                 result->document, result->allocs, baseline[i].allocs);
+        regressed = 1;
+      }
+      return regressed;
+    }
+  fprintf (stderr, "mrg-bench: %s not in baseline\n", result->document);
+  return 0;
+}
+
+static void usage (void)
+{
+  fprintf (stderr, "usage: mrg-bench [-n frames] [-o results.tsv] [-b baseline.tsv] [-t tolerance] [-d] [-c] [-s pixels] documents..\n");
+}
+
+int main (int argc, char **argv)
+{
+  const char  *output_path = NULL;
+  const char  *baseline_path = NULL;
+  BenchResult *baseline = NULL;
+  int    baseline_count = 0;
+  float  tolerance = 0.25;
+  int    frames = 50;
+  int    retained = 0;
+  int    cached = 0;
+  float  scroll = 0.0;
+  int    regressions = 0;
+  int    failures = 0;
+  FILE  *output = NULL;
+  int    i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (!argv[i+1])
+    {
+      usage ();
+      return 1;
+    }
+    if (!strcmp (argv[i], "-n"))
+      frames = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "-o"))
+      output_path = argv[++i];
+    else if (!strcmp (argv[i], "-b"))
+      baseline_path = argv[++i];
+    else if (!strcmp (argv[i], "-t"))
+      tolerance = atof (argv[++i]);
+    else if (!strcmp (argv[i], "-d"))
+      retained = 1;
+    else if (!strcmp (argv[i], "-c"))
+      cached = 1;
+    else if (!strcmp (argv[i], "-s"))
+      scroll = atof (argv[++i]);
+    else
+    {
+      usage ();
+      return 1;
+    }
+  }
+  if (i >= argc || frames <= 0)
+  {
+    usage ();
+    return 1;
+  }
+
+  if (baseline_path)
+  {
+    baseline = read_results (baseline_path, &baseline_count);
+    if (!baseline)
+      fprintf (stderr, "mrg-bench: no baseline in %s, not comparing\n",
+               baseline_path);
+  }
+  if (output_path)
+  {
+    output = fopen (output_path, "w");
+    if (!output)
+    {
+      fprintf (stderr, "mrg-bench: unable to write %s\n", output_path);
+      return 1;
+    }
+    fputs (header, output);
+  }
+
+  fputs (header, stdout);
+  for (; i < argc; i++)
+  {
+    BenchResult result;
+    if (bench_document (argv[i], frames, retained, cached, scroll,
+                        &result))
+    {
+      failures ++;
+      continue;
+    }
+    write_result (stdout, &result);
+    fflush (stdout);
+    if (output)
+      write_result (output, &result);
+    if (baseline)
+      regressions += compare_baseline (&result, baseline, baseline_count,
+                                       tolerance);
+  }
+
+  if (output)
+    fclose (output);
+  free (baseline);
+  return (regressions || failures) ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* checks the 128 bit hash identifying images in memory against the
+ * verification value of MurmurHash3_x64_128, and that it does not depend
+ * on alignment:
+ *
+ *   mrg-hash [-b]
+ *
+ * With -b hashing an encoded image sized buffer is timed instead, against
+ * the SHA-256 previously used.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mrg-hash.h"
+#include "mrg-sha256.h"
+
+#define BENCH_BYTES  (4 * 1024 * 1024)
+#define BENCH_RUNS   20
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* the value SMHasher checks implementations against: the hashes of the
+ * keys 0, 0 1, 0 1 2 ... with seeds 256 down, hashed together
+ */
+static int verify (void)
+{
+  uint8_t  key[256];
+  uint8_t  hashes[256 * 16];
+  uint64_t hash[2];
+  int      i, j;
+
+  for (i = 0; i < 256; i++)
+  {
+    key[i] = i;
+    _mrg_hash128 (key, i, 256 - i, hash);
+    for (j = 0; j < 16; j++)
+      hashes[i * 16 + j] = hash[j / 8] >> ((j % 8) * 8);
+  }
+  _mrg_hash128 (hashes, sizeof (hashes), 0, hash);
+  return (uint32_t)hash[0] == 0x6384ba69;
+}
+
+static int check_alignment (void)
+{
+  uint8_t  *buf = malloc (1024 + 16);
+  uint64_t  expected[2], got[2];
+  int       failures = 0;
+  int       length, offset;
+
+  for (length = 0; length < 1024; length += 7)
+  {
+    for (offset = 0; offset < length; offset++)
+      buf[offset] = offset * 31;
+    _mrg_hash128 (buf, length, 0, expected);
+    for (offset = 1; offset < 16; offset++)
+    {
+      memmove (buf + offset, buf + offset - 1, length);
+      _mrg_hash128 (buf + offset, length, 0, got);
+      if (memcmp (got, expected, sizeof (got)))
+      {
+        fprintf (stderr, "hash of %i bytes differs at offset %i\n",
+                 length, offset);
+        failures ++;
+      }
+    }
+    memmove (buf, buf + 15, length);
+  }
+  free (buf);
+  return failures;
+}
+
+static void bench_hash128 (const uint8_t *data, int length)
+{
+  uint64_t hash[2];
+  _mrg_hash128 (data, length, 0, hash);
+}
+
+static void bench_sha256 (const uint8_t *data, int length)
+{
+  unsigned char hash[32];
+  SHA256_CTX ctx;
+  sha256_init (&ctx);
+  sha256_update (&ctx, data, length);
+  sha256_final (&ctx, hash);
+}
+
+static void bench (const char *name,
+                   void (*func) (const uint8_t *data, int length))
+{
+  uint8_t *data = malloc (BENCH_BYTES);
+  double   best = 0;
+  int      i;
+
+  for (i = 0; i < BENCH_BYTES; i++)
+    data[i] = i * 13;
+  for (i = 0; i < BENCH_RUNS; i++)
+  {
+    double start = now_ms ();
+    func (data, BENCH_BYTES);
+    if (i == 0 || now_ms () - start < best)
+      best = now_ms () - start;
+  }
+  printf ("%-8s %8.3fms %8.1f MB/s\n", name, best,
+          BENCH_BYTES / best / 1000.0);
+  free (data);
+}
+
+int main (int argc, char **argv)
+{
+  int failures = 0;
+
+  if (argc > 1 && !strcmp (argv[1], "-b"))
+  {
+    bench ("hash128", bench_hash128);
+    bench ("sha256", bench_sha256);
+    return 0;
+  }
+
+  if (!verify ())
+  {
+    fprintf (stderr, "verification value differs\n");
+    failures ++;
+  }
+  failures += check_alignment ();
+  printf ("%s hash128\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
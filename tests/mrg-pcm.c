@@ -0,0 +1,501 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* checks the ring of frames queued for playback, with a producer and a
+ * consumer thread moving frames through a small ring in chunks of varying
+ * size, and that running out of frames is counted as an underrun:
+ *
+ *   mrg-pcm
+ *
+ * With -s, frames queued with mrg_pcm_queue are checked to reach the sink
+ * set by MRG_PCM_SINK, which has to be the path of a file, queuing a chunk
+ * each time the period fd tells a period was played:
+ *
+ *   MRG_PCM_SINK=out.raw mrg-pcm -s
+ *
+ * The resampler is checked by the signal to noise ratio of a resampled
+ * sine sweep against the sweep computed at the output rate, for each
+ * kernel the cpu supports, and the mixing kernels against the portable
+ * ones and for not wrapping around when streams add up. With -b the speed
+ * of resampling, and of mixing a varying number of streams, is reported
+ * instead.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include "mrg.h"
+#include "mrg-internal.h"
+#include "mrg-pcm.h"
+
+#define RING_FRAMES    1000  /* rounded up to 1024 */
+#define STREAM_FRAMES  (1 << 20)
+#define SINK_FRAMES    12000
+#define SWEEP_SECONDS  2.0
+#define SWEEP_FROM     20.0
+#define BENCH_SECONDS  10
+#define BENCH_RUNS     5
+#define MIX_SAMPLES    2000  /* a period of 1000 stereo frames */
+
+static MrgPcmRing ring;
+
+static void *producer (void *data)
+{
+  int16_t chunk[300 * 2];
+  int sent = 0;
+  unsigned int seed = 1;
+
+  while (sent < STREAM_FRAMES)
+  {
+    int count = rand_r (&seed) % 300 + 1;
+    int written, i;
+    if (count > STREAM_FRAMES - sent)
+      count = STREAM_FRAMES - sent;
+    for (i = 0; i < count; i++)
+    {
+      chunk[i * 2 + 0] = (sent + i) & 0x7fff;
+      chunk[i * 2 + 1] = ~((sent + i) & 0x7fff);
+    }
+    written = _mrg_pcm_ring_write (&ring, chunk, count);
+    sent += written;
+    if (written < count)
+      usleep (10);
+  }
+  return NULL;
+}
+
+static int check_ring (void)
+{
+  int16_t  chunk[500 * 2];
+  int      received = 0;
+  int      failures = 0;
+  unsigned int seed = 2;
+  pthread_t tid;
+
+  _mrg_pcm_ring_init (&ring, RING_FRAMES);
+  pthread_create (&tid, NULL, producer, NULL);
+  while (received < STREAM_FRAMES && failures < 10)
+  {
+    int count = rand_r (&seed) % 500 + 1;
+    int got = _mrg_pcm_ring_read (&ring, chunk, count);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+      int16_t left = i < got ? (received + i) & 0x7fff : 0;
+      int16_t right = i < got ? ~((received + i) & 0x7fff) : 0;
+      if (chunk[i * 2] != left || chunk[i * 2 + 1] != right)
+      {
+        fprintf (stderr, "frame %i of %i is %i %i\n", received + i, got,
+                 chunk[i * 2], chunk[i * 2 + 1]);
+        failures ++;
+        break;
+      }
+    }
+    received += got;
+    if (!got)
+      usleep (10);
+  }
+  pthread_join (tid, NULL);
+  _mrg_pcm_ring_fini (&ring);
+  printf ("%s ring\n", failures ? "FAIL" : "PASS");
+  return failures;
+}
+
+static int check_underruns (void)
+{
+  int16_t frames[64 * 2] = {0,};
+  int failures = 0;
+
+  _mrg_pcm_ring_init (&ring, 64);
+  /* silence before anything is queued is not an underrun */
+  _mrg_pcm_ring_read (&ring, frames, 16);
+  failures += _mrg_pcm_ring_underruns (&ring) != 0;
+  /* running out while playing is, once until frames are queued again */
+  _mrg_pcm_ring_write (&ring, frames, 10);
+  failures += _mrg_pcm_ring_read (&ring, frames, 16) != 10;
+  _mrg_pcm_ring_read (&ring, frames, 16);
+  failures += _mrg_pcm_ring_underruns (&ring) != 1;
+  _mrg_pcm_ring_write (&ring, frames, 16);
+  _mrg_pcm_ring_read (&ring, frames, 16);
+  failures += _mrg_pcm_ring_underruns (&ring) != 1;
+  _mrg_pcm_ring_read (&ring, frames, 16);
+  failures += _mrg_pcm_ring_underruns (&ring) != 2;
+  /* and it only takes what fits */
+  failures += _mrg_pcm_ring_write (&ring, frames, 100) != 64;
+  _mrg_pcm_ring_fini (&ring);
+  printf ("%s underruns\n", failures ? "FAIL" : "PASS");
+  return failures;
+}
+
+static int check_sink (void)
+{
+  const char *path = getenv ("MRG_PCM_SINK");
+  int16_t    *frames = malloc (SINK_FRAMES * 4);
+  int16_t    *played;
+  long        length;
+  int         failures = 0;
+  int         queued = 0;
+  int         start, i;
+  FILE       *file;
+  Mrg        *mrg;
+  struct pollfd period;
+  uint64_t    count;
+
+  if (!path || !strcmp (path, "null") || !strcmp (path, "alsa"))
+  {
+    fprintf (stderr, "MRG_PCM_SINK has to be the path of a file\n");
+    return 1;
+  }
+  for (i = 0; i < SINK_FRAMES; i++)
+  {
+    frames[i * 2 + 0] = i + 1;
+    frames[i * 2 + 1] = -(i + 1);
+  }
+
+  mrg = mrg_new (64, 64, "mem");
+  mrg_pcm_set_format (mrg, MRG_s16S);
+  mrg_pcm_set_sample_rate (mrg, 48000);
+  period.fd = _mrg_pcm_period_open (mrg);
+  period.events = POLLIN;
+  failures += period.fd < 0;
+  _mrg_pcm_period_arm (mrg, period.fd, 1);
+  while (!failures && queued < SINK_FRAMES)
+  {
+    int chunk = mrg_pcm_get_frame_chunk (mrg);
+    if (chunk > SINK_FRAMES - queued)
+      chunk = SINK_FRAMES - queued;
+    queued += mrg_pcm_queue (mrg, (void*)(frames + queued * 2), chunk);
+    if (queued < SINK_FRAMES)
+    {
+      if (poll (&period, 1, 1000) != 1 ||
+          read (period.fd, &count, sizeof (count)) != sizeof (count))
+      {
+        fprintf (stderr, "no period played\n");
+        failures ++;
+      }
+    }
+  }
+  while (mrg_pcm_get_queued (mrg) > 0)
+    usleep (10000);
+  usleep (50000); /* for the last period to be written */
+
+  file = fopen (path, "rb");
+  fseek (file, 0, SEEK_END);
+  length = ftell (file) / 4;
+  fseek (file, 0, SEEK_SET);
+  played = malloc (length * 4);
+  length = fread (played, 4, length, file);
+  fclose (file);
+
+  for (start = 0; start < length && played[start * 2] == 0; start++);
+  if (failures || length - start < SINK_FRAMES)
+    failures ++;
+  for (i = 0; !failures && i < SINK_FRAMES; i++)
+    if (played[(start + i) * 2] != frames[i * 2] ||
+        played[(start + i) * 2 + 1] != frames[i * 2 + 1])
+    {
+      fprintf (stderr, "played frame %i differs\n", i);
+      failures ++;
+    }
+
+  printf ("%s sink, %i underruns\n", failures ? "FAIL" : "PASS",
+          mrg_pcm_get_underruns (mrg));
+  free (frames);
+  free (played);
+  _mrg_pcm_period_close (mrg, period.fd);
+  mrg_destroy (mrg);
+  return failures;
+}
+
+static double sweep (double t, double to)
+{
+  return 0.5 * sin (2 * M_PI * (SWEEP_FROM * t + (to - SWEEP_FROM) * t * t /
+                                                 (2 * SWEEP_SECONDS)));
+}
+
+/* resamples a sweep from 20Hz to the given frequency, fed and taken in
+ * chunks of odd sizes, returning the SNR in dB over both channels
+ */
+static double resample_snr (int quality, MrgResampleKernel kernel,
+                            double in_rate, double out_rate, double to)
+{
+  int    in_frames = in_rate * SWEEP_SECONDS;
+  int    out_max = out_rate * SWEEP_SECONDS + 64;
+  float *in = malloc (in_frames * 2 * sizeof (float));
+  float *out = malloc (out_max * 2 * sizeof (float));
+  MrgResampler *resampler = _mrg_resampler_new (quality);
+  double signal = 0.0, noise = 0.0;
+  int    produced = 0, used = 0;
+  int    i;
+
+  _mrg_resampler_set_kernel (resampler, kernel);
+  _mrg_resampler_set_rates (resampler, in_rate, out_rate);
+  for (i = 0; i < in_frames; i++)
+    in[i * 2] = in[i * 2 + 1] = sweep (i / in_rate, to);
+  while (used < in_frames && produced < out_max)
+  {
+    int chunk = in_frames - used < 101 ? in_frames - used : 101;
+    int consumed;
+    produced += _mrg_resampler_process (resampler, in + used * 2, chunk,
+                                        &consumed, out + produced * 2,
+                                        out_max - produced < 97 ?
+                                        out_max - produced : 97);
+    used += consumed;
+  }
+
+  /* the ends are left out, where the filter sees the silence around */
+  for (i = MRG_RESAMPLER_TAPS; i < produced - MRG_RESAMPLER_TAPS &&
+                               i < out_rate * SWEEP_SECONDS - MRG_RESAMPLER_TAPS;
+       i++)
+  {
+    double expected = sweep (i / out_rate, to);
+    signal += expected * expected;
+    noise += ((out[i * 2] - expected) * (out[i * 2] - expected) +
+              (out[i * 2 + 1] - expected) * (out[i * 2 + 1] - expected)) / 2;
+  }
+  _mrg_resampler_free (resampler);
+  free (in);
+  free (out);
+  return 10 * log10 (signal / noise);
+}
+
+static int check_resample (void)
+{
+  const char        *names[4];
+  MrgResampleKernel  funcs[4];
+  int n = _mrg_resample_kernel_impls (names, funcs, 4);
+  int failures = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    double up = resample_snr (MRG_RESAMPLER_SINC, funcs[i], 44100, 48000, 16000);
+    double down = resample_snr (MRG_RESAMPLER_SINC, funcs[i], 48000, 44100, 16000);
+    int failed = up < 80.0 || down < 80.0;
+    printf ("%s sinc %-4s 44.1->48kHz %5.1fdB, 48->44.1kHz %5.1fdB\n",
+            failed ? "FAIL" : "PASS", names[i], up, down);
+    failures += failed;
+  }
+  {
+    /* at the same rate, frames pass unchanged */
+    MrgResampler *resampler = _mrg_resampler_new (MRG_RESAMPLER_SINC);
+    float in[512 * 2], out[512 * 2];
+    int consumed, produced, failed = 0;
+
+    for (i = 0; i < 512 * 2; i++)
+      in[i] = sin (i * 0.3);
+    produced = _mrg_resampler_process (resampler, in, 512, &consumed, out, 512);
+    for (i = 0; i < produced * 2; i++)
+      if (fabsf (out[i] - in[i]) > 1e-6f)
+        failed = 1;
+    failed |= produced < 512 - MRG_RESAMPLER_TAPS / 2;
+    printf ("%s sinc at the same rate\n", failed ? "FAIL" : "PASS");
+    failures += failed;
+    _mrg_resampler_free (resampler);
+  }
+  {
+    double up = resample_snr (MRG_RESAMPLER_LINEAR, funcs[0], 44100, 48000, 4000);
+    int failed = up < 30.0;
+    printf ("%s linear   44.1->48kHz %5.1fdB, to 4kHz\n",
+            failed ? "FAIL" : "PASS", up);
+    failures += failed;
+  }
+  return failures;
+}
+
+static int check_mix (void)
+{
+  const char  *names[4];
+  MrgPcmMix    mixes[4];
+  MrgPcmLimit  limits[4];
+  int n = _mrg_pcm_mix_impls (names, mixes, limits, 4);
+  float   src[MIX_SAMPLES + 3], acc[MIX_SAMPLES + 3], expected[MIX_SAMPLES + 3];
+  int16_t out[MIX_SAMPLES + 3], reference[MIX_SAMPLES + 3];
+  int failures = 0;
+  int i, impl, count;
+
+  for (impl = 0; impl < n; impl++)
+  {
+    int failed = 0;
+    /* odd lengths, for the tails after the vectors */
+    for (count = MIX_SAMPLES - 7; count <= MIX_SAMPLES + 3; count += 5)
+    {
+      for (i = 0; i < count; i++)
+      {
+        src[i] = sin (i * 0.37) * 0.9;
+        acc[i] = expected[i] = sin (i * 0.11) * 0.9;
+      }
+      mixes[impl] (acc, src, 0.8f, count);
+      mixes[0] (expected, src, 0.8f, count);
+      limits[impl] (acc, out, count);
+      limits[0] (expected, reference, count);
+      for (i = 0; i < count; i++)
+        if (fabsf (acc[i] - expected[i]) > 1e-6f ||
+            abs (out[i] - reference[i]) > 1)
+        {
+          fprintf (stderr, "%s differs at %i of %i\n", names[impl], i, count);
+          failed = 1;
+          break;
+        }
+    }
+    printf ("%s mix %s\n", failed ? "FAIL" : "PASS", names[impl]);
+    failures += failed;
+  }
+
+  /* passes samples below the knee, and limits the sum of four full scale
+   * streams without wrapping or clipping hard
+   */
+  {
+    int failed = 0;
+    int prev = -32768;
+    for (i = 0; i < MIX_SAMPLES; i++)
+      acc[i] = (i - MIX_SAMPLES / 2) * (8.0f / MIX_SAMPLES);
+    _mrg_pcm_limit (acc, out, MIX_SAMPLES);
+    for (i = 0; i < MIX_SAMPLES; i++)
+    {
+      if (out[i] < prev ||
+          (fabsf (acc[i]) < MRG_PCM_LIMIT_KNEE &&
+           abs (out[i] - (int)lrintf (acc[i] * 32767.0f)) > 1) ||
+          (fabsf (acc[i]) > 1.0f && abs (out[i]) >= 32767))
+        failed = 1;
+      prev = out[i];
+    }
+    printf ("%s limit\n", failed ? "FAIL" : "PASS");
+    failures += failed;
+  }
+  return failures;
+}
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void bench_resample (const char *name, int quality,
+                            MrgResampleKernel kernel)
+{
+  int    in_frames = 44100 * BENCH_SECONDS;
+  int    out_max = 48000 * BENCH_SECONDS + 64;
+  float *in = malloc (in_frames * 2 * sizeof (float));
+  float *out = malloc (out_max * 2 * sizeof (float));
+  double best = 0;
+  int    run, i;
+
+  for (i = 0; i < in_frames * 2; i++)
+    in[i] = sin (i * 0.01);
+  for (run = 0; run < BENCH_RUNS; run++)
+  {
+    MrgResampler *resampler = _mrg_resampler_new (quality);
+    double start;
+    int used = 0, produced = 0;
+
+    _mrg_resampler_set_kernel (resampler, kernel);
+    _mrg_resampler_set_rates (resampler, 44100, 48000);
+    start = now_ms ();
+    while (used < in_frames)
+    {
+      int consumed;
+      produced += _mrg_resampler_process (resampler, in + used * 2,
+                                          in_frames - used, &consumed,
+                                          out + produced * 2,
+                                          out_max - produced);
+      used += consumed;
+    }
+    if (run == 0 || now_ms () - start < best)
+      best = now_ms () - start;
+    _mrg_resampler_free (resampler);
+  }
+  printf ("%-12s %8.3fms %8.1f Msamples/s\n", name, best,
+          48000.0 * BENCH_SECONDS * 2 / best / 1000.0);
+  free (in);
+  free (out);
+}
+
+/* mixing streams into a period and limiting it, which should take time
+ * in proportion to the number of streams
+ */
+static void bench_mix (int streams)
+{
+  float  *src = malloc (MIX_SAMPLES * sizeof (float) * streams);
+  float   acc[MIX_SAMPLES];
+  int16_t out[MIX_SAMPLES];
+  int     periods = 20000 / streams;
+  double  best = 0;
+  int     run, i, j;
+
+  for (i = 0; i < MIX_SAMPLES * streams; i++)
+    src[i] = sin (i * 0.01) * 0.5;
+  for (run = 0; run < BENCH_RUNS; run++)
+  {
+    double start = now_ms ();
+    for (i = 0; i < periods; i++)
+    {
+      memset (acc, 0, sizeof (acc));
+      for (j = 0; j < streams; j++)
+        _mrg_pcm_mix (acc, src + j * MIX_SAMPLES, 0.5f, MIX_SAMPLES);
+      _mrg_pcm_limit (acc, out, MIX_SAMPLES);
+    }
+    if (run == 0 || now_ms () - start < best)
+      best = now_ms () - start;
+  }
+  printf ("mix %2i streams %8.3fus per period %6.3fns per stream sample\n",
+          streams, best * 1000.0 / periods,
+          best * 1000000.0 / periods / streams / MIX_SAMPLES);
+  free (src);
+}
+
+int main (int argc, char **argv)
+{
+  int failures = 0;
+
+  if (argc > 1 && !strcmp (argv[1], "-s"))
+    return check_sink () ? 1 : 0;
+
+  if (argc > 1 && !strcmp (argv[1], "-b"))
+  {
+    const char        *names[4];
+    MrgResampleKernel  funcs[4];
+    char               name[32];
+    int n = _mrg_resample_kernel_impls (names, funcs, 4);
+    int i;
+
+    bench_resample ("linear", MRG_RESAMPLER_LINEAR, funcs[0]);
+    for (i = 0; i < n; i++)
+    {
+      snprintf (name, sizeof (name), "sinc-%s", names[i]);
+      bench_resample (name, MRG_RESAMPLER_SINC, funcs[i]);
+    }
+    bench_mix (1);
+    bench_mix (4);
+    bench_mix (16);
+    return 0;
+  }
+
+  failures += check_ring ();
+  failures += check_underruns ();
+  failures += check_resample ();
+  failures += check_mix ();
+  return failures ? 1 : 0;
+}
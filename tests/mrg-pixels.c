@@ -0,0 +1,137 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* checks the pixel conversions the cpu supports against the portable one,
+ * for every combination of component and alpha value and for unaligned
+ * runs of pixels of every length up to a few vectors:
+ *
+ *   mrg-pixels [-b]
+ *
+ * With -b the conversion of a 4K image is timed for each of them instead.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mrg-pixels.h"
+
+#define BENCH_WIDTH   3840
+#define BENCH_HEIGHT  2160
+#define BENCH_RUNS    20
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* returns the number of mismatches of func against reference */
+static int check (const char *name, MrgRgbaToCairo func,
+                  MrgRgbaToCairo reference)
+{
+  int      count = 256 * 256;
+  uint8_t *src = malloc (count * 4 + 4);
+  uint32_t *expected = malloc ((count + 1) * 4);
+  uint32_t *got = malloc ((count + 1) * 4);
+  int      failures = 0;
+  int      i, offset, length;
+
+  /* every component against every alpha, r g and b in different orders */
+  for (i = 0; i < count; i++)
+  {
+    src[i * 4 + 0] = i & 255;
+    src[i * 4 + 1] = 255 - (i & 255);
+    src[i * 4 + 2] = (i * 7) & 255;
+    src[i * 4 + 3] = i >> 8;
+  }
+  if (func (src, got, count) != reference (src, expected, count) ||
+      memcmp (got, expected, count * 4))
+    failures ++;
+
+  /* short and unaligned runs, with and without a translucent pixel */
+  srandom (1);
+  for (i = 0; i < count * 4 + 4; i++)
+    src[i] = random ();
+  for (length = 0; length < 40; length++)
+    for (offset = 0; offset < 4; offset++)
+    {
+      uint8_t *run = src + offset * 4 + 1;
+      for (i = 0; i < length; i++)
+        run[i * 4 + 3] = 255;
+      if (length && offset)
+        run[(length - 1) * 4 + 3] = offset * 60;
+      if (func (run, got + 1, length) != reference (run, expected, length) ||
+          memcmp (got + 1, expected, length * 4))
+      {
+        fprintf (stderr, "%s differs for %i pixels at offset %i\n",
+                 name, length, offset);
+        failures ++;
+      }
+    }
+
+  printf ("%s %s\n", failures ? "FAIL" : "PASS", name);
+  free (src);
+  free (expected);
+  free (got);
+  return failures;
+}
+
+static void bench (const char *name, MrgRgbaToCairo func)
+{
+  int       count = BENCH_WIDTH * BENCH_HEIGHT;
+  uint8_t  *src = malloc (count * 4);
+  uint32_t *dst = malloc (count * 4);
+  double    best = 0;
+  int       i;
+
+  for (i = 0; i < count * 4; i++)
+    src[i] = i * 13;
+  for (i = 0; i < BENCH_RUNS; i++)
+  {
+    double start = now_ms ();
+    func (src, dst, count);
+    if (i == 0 || now_ms () - start < best)
+      best = now_ms () - start;
+  }
+  printf ("%-6s %8.3fms %8.1f Mpixels/s\n", name, best,
+          count / best / 1000.0);
+  free (src);
+  free (dst);
+}
+
+int main (int argc, char **argv)
+{
+  const char     *names[8];
+  MrgRgbaToCairo  funcs[8];
+  int n = _mrg_rgba_to_cairo_impls (names, funcs, 8);
+  int failures = 0;
+  int i;
+
+  if (argc > 1 && !strcmp (argv[1], "-b"))
+  {
+    for (i = 0; i < n; i++)
+      bench (names[i], funcs[i]);
+    return 0;
+  }
+
+  for (i = 0; i < n; i++)
+    failures += check (names[i], funcs[i], funcs[0]);
+  return failures ? 1 : 0;
+}
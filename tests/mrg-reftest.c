@@ -0,0 +1,480 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* golden image regression test, renders documents the way
+ * `mrg browser doc.html -o doc.png` does, and compares the pixels of the
+ * mem backend against reference/<doc>.png:
+ *
+ *   mrg-reftest [-r reference] [-t 16] [-p 0.5] [-o outdir]
+ *               [-b bench-baseline.tsv] [-s 1.0] [-j 4] [-c] documents..
+ *
+ * a pixel differs when one of its color components is off by more than
+ * -t, and a document fails when more than -p percent of its pixels differ.
+ * The median render time of a few frames is reported as well. With -b, a
+ * baseline written by mrg-bench -o on the same machine, a document also
+ * fails when it renders more than -s (a fraction) slower than its baseline
+ * median; without that file the run is skipped, with exit status 77. With
+ * -o the renderings are written out as png, for inspecting failures or
+ * updating the references.
+ *
+ * With -j the documents are also rendered with MRG_RENDER_THREADS set to
+ * that number, a document then fails unless the pixels are identical to
+ * those rendered by a single thread.
+ *
+ * With -c the documents are instead all rendered at the same time, each by
+ * its own instance on its own thread, and have to give the same pixels as
+ * when rendered one after the other; built with -Db_sanitize=thread this also
+ * checks that instances do not share unprotected state.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mrg.h"
+
+#define REFTEST_WIDTH   240
+#define REFTEST_HEIGHT  320
+#define REFTEST_WARMUP  2  /* like mrg browser -o, to resolve measurements */
+#define REFTEST_FRAMES  5  /* timed frames */
+#define REFTEST_SKIP    77 /* the exit status for skipped tests */
+
+typedef struct RefDoc {
+  char *uri;
+  char *contents;
+} RefDoc;
+
+static const char *reference_dir = "reference";
+static const char *output_dir = NULL;
+static const char *baseline_path = NULL;
+static int   channel_tolerance = 16;
+static float max_differing = 0.5;   /* percent */
+static float max_slowdown = 1.0;
+static int   render_threads = 0;
+static int   concurrent = 0;
+
+static void render_ui (Mrg *mrg, void *data)
+{
+  RefDoc *doc = data;
+  mrg_stylesheet_clear (mrg);
+  mrg_xml_render (mrg, doc->uri, NULL, NULL, NULL, NULL, doc->contents);
+}
+
+static int compare_float (const void *a, const void *b)
+{
+  float fa = *(const float*)a;
+  float fb = *(const float*)b;
+  return (fa > fb) - (fa < fb);
+}
+
+/* the median frame time recorded for document by mrg-bench, or -1 */
+static float baseline_ms (const char *document)
+{
+  char  line[1024];
+  char  name[256];
+  float median;
+  FILE *file;
+  float ret = -1;
+
+  if (!baseline_path || !(file = fopen (baseline_path, "r")))
+    return -1;
+  while (fgets (line, sizeof (line), file))
+  {
+    if (line[0] == '#')
+      continue;
+    if (sscanf (line, "%255[^\t]\t%*i\t%f", name, &median) == 2 &&
+        !strcmp (name, document))
+      ret = median;
+  }
+  fclose (file);
+  return ret;
+}
+
+/* counts pixels with a color component differing more than the tolerance,
+ * returns -1 if the reference cannot be used
+ */
+static int compare_pixels (const unsigned char *pixels, int rowstride,
+                           const char *reference_path, int *max_diff)
+{
+  cairo_surface_t *reference;
+  unsigned char *ref_pixels;
+  int ref_stride;
+  int differing = 0;
+  int x, y;
+
+  *max_diff = 0;
+  reference = cairo_image_surface_create_from_png (reference_path);
+  if (cairo_surface_status (reference) != CAIRO_STATUS_SUCCESS)
+  {
+    fprintf (stderr, "mrg-reftest: unable to load %s\n", reference_path);
+    cairo_surface_destroy (reference);
+    return -1;
+  }
+  if (cairo_image_surface_get_width (reference) != REFTEST_WIDTH ||
+      cairo_image_surface_get_height (reference) != REFTEST_HEIGHT)
+  {
+    fprintf (stderr, "mrg-reftest: %s is not %ix%i\n", reference_path,
+             REFTEST_WIDTH, REFTEST_HEIGHT);
+    cairo_surface_destroy (reference);
+    return -1;
+  }
+
+  /* both ARGB32 and RGB24 keep the color in the low 24 bits */
+  cairo_surface_flush (reference);
+  ref_pixels = cairo_image_surface_get_data (reference);
+  ref_stride = cairo_image_surface_get_stride (reference);
+  for (y = 0; y < REFTEST_HEIGHT; y++)
+  {
+    const uint32_t *a = (const uint32_t*)(pixels + y * rowstride);
+    const uint32_t *b = (const uint32_t*)(ref_pixels + y * ref_stride);
+    for (x = 0; x < REFTEST_WIDTH; x++)
+    {
+      int pixel_diff = 0;
+      int shift;
+      for (shift = 0; shift < 24; shift += 8)
+      {
+        int diff = (int)((a[x] >> shift) & 0xff) - (int)((b[x] >> shift) & 0xff);
+        if (diff < 0)
+          diff = -diff;
+        if (diff > pixel_diff)
+          pixel_diff = diff;
+      }
+      if (pixel_diff > channel_tolerance)
+        differing ++;
+      if (pixel_diff > *max_diff)
+        *max_diff = pixel_diff;
+    }
+  }
+  cairo_surface_destroy (reference);
+  return differing;
+}
+
+static void write_output (const char *name, unsigned char *pixels, int rowstride)
+{
+  cairo_surface_t *surface;
+  char path[1024];
+
+  snprintf (path, sizeof (path), "%s/%s.png", output_dir, name);
+  surface = cairo_image_surface_create_for_data (pixels, CAIRO_FORMAT_ARGB32,
+                 REFTEST_WIDTH, REFTEST_HEIGHT, rowstride);
+  if (cairo_surface_write_to_png (surface, path) != CAIRO_STATUS_SUCCESS)
+    fprintf (stderr, "mrg-reftest: unable to write %s\n", path);
+  cairo_surface_destroy (surface);
+}
+
+/* renders doc with render_threads threads, and returns the number of
+ * pixels differing from those rendered single threaded
+ */
+static int compare_threaded (RefDoc *doc, const unsigned char *pixels,
+                             int rowstride)
+{
+  const unsigned char *threaded;
+  char  threads[16];
+  int   threaded_stride;
+  int   differing = 0;
+  Mrg  *mrg;
+  int   x, y;
+
+  snprintf (threads, sizeof (threads), "%i", render_threads);
+  setenv ("MRG_RENDER_THREADS", threads, 1);
+  mrg = mrg_new (REFTEST_WIDTH, REFTEST_HEIGHT, "mem");
+  unsetenv ("MRG_RENDER_THREADS");
+
+  mrg_set_target_fps (mrg, 0);
+  mrg_css_set (mrg, "document { background: #ffff;}");
+  mrg_set_ui (mrg, render_ui, doc);
+  for (x = 0; x < REFTEST_WARMUP + REFTEST_FRAMES; x++)
+  {
+    mrg_queue_draw (mrg, NULL);
+    mrg_ui_update (mrg);
+  }
+
+  threaded = mrg_get_pixels (mrg, &threaded_stride);
+  for (y = 0; y < REFTEST_HEIGHT; y++)
+  {
+    const uint32_t *a = (const uint32_t*)(pixels + y * rowstride);
+    const uint32_t *b = (const uint32_t*)(threaded + y * threaded_stride);
+    for (x = 0; x < REFTEST_WIDTH; x++)
+      if (a[x] != b[x])
+        differing ++;
+  }
+  mrg_destroy (mrg);
+  return differing;
+}
+
+/* returns 0 when the document passes */
+static int reftest_document (const char *path)
+{
+  RefDoc doc = {NULL, NULL};
+  float  frame_ms[REFTEST_FRAMES];
+  char   name[256];
+  char   reference_path[1024];
+  char  *real;
+  char  *p;
+  unsigned char *pixels;
+  int    rowstride;
+  int    differing, max_diff;
+  int    threaded_differing = 0;
+  long   length;
+  float  render_ms, expected_ms;
+  int    failed = 0;
+  Mrg   *mrg;
+  int    i;
+
+  snprintf (name, sizeof (name), "%s",
+            strrchr (path, '/') ? strrchr (path, '/') + 1 : path);
+  expected_ms = baseline_ms (name);
+  if ((p = strrchr (name, '.')))
+    *p = 0;
+  snprintf (reference_path, sizeof (reference_path), "%s/%s.png",
+            reference_dir, name);
+
+  real = realpath (path, NULL);
+  if (!real)
+  {
+    fprintf (stderr, "mrg-reftest: %s not found\n", path);
+    return 1;
+  }
+  doc.uri = malloc (strlen (real) + 8);
+  sprintf (doc.uri, "file://%s", real);
+  free (real);
+
+  mrg = mrg_new (REFTEST_WIDTH, REFTEST_HEIGHT, "mem");
+  mrg_get_contents (mrg, NULL, doc.uri, &doc.contents, &length);
+  if (!doc.contents)
+  {
+    fprintf (stderr, "mrg-reftest: unable to load %s\n", path);
+    mrg_destroy (mrg);
+    free (doc.uri);
+    return 1;
+  }
+
+  mrg_set_target_fps (mrg, 0);
+  mrg_css_set (mrg, "document { background: #ffff;}");
+  mrg_set_ui (mrg, render_ui, &doc);
+
+  for (i = 0; i < REFTEST_WARMUP; i++)
+  {
+    mrg_queue_draw (mrg, NULL);
+    mrg_ui_update (mrg);
+  }
+  for (i = 0; i < REFTEST_FRAMES; i++)
+  {
+    mrg_queue_draw (mrg, NULL);
+    mrg_ui_update (mrg);
+    frame_ms[i] = mrg_get_frame_stats (mrg)->frame_ms;
+  }
+  qsort (frame_ms, REFTEST_FRAMES, sizeof (float), compare_float);
+  render_ms = frame_ms[REFTEST_FRAMES/2];
+
+  pixels = mrg_get_pixels (mrg, &rowstride);
+  if (output_dir)
+    write_output (name, pixels, rowstride);
+
+  differing = compare_pixels (pixels, rowstride, reference_path, &max_diff);
+  if (differing < 0 ||
+      differing * 100.0 / (REFTEST_WIDTH * REFTEST_HEIGHT) > max_differing)
+    failed = 1;
+  if (expected_ms > 0 && render_ms > expected_ms * (1.0 + max_slowdown))
+    failed = 1;
+  if (render_threads > 1)
+  {
+    threaded_differing = compare_threaded (&doc, pixels, rowstride);
+    if (threaded_differing)
+      failed = 1;
+  }
+
+  printf ("%s %s: %i pixels differ, max diff %i, render %.3fms",
+          failed ? "FAIL" : "PASS", name, differing, max_diff, render_ms);
+  if (expected_ms > 0)
+    printf (" (baseline %.3fms)", expected_ms);
+  else if (baseline_path)
+    printf (" (not in baseline)");
+  if (render_threads > 1)
+    printf (", %i pixels differ with %i threads", threaded_differing,
+            render_threads);
+  printf ("\n");
+
+  mrg_destroy (mrg);
+  free (doc.contents);
+  free (doc.uri);
+  return failed;
+}
+
+typedef struct ConcurrentDoc {
+  const char    *path;
+  unsigned char *pixels;   /* REFTEST_HEIGHT rows of REFTEST_WIDTH * 4 */
+} ConcurrentDoc;
+
+/* renders a document with its own mem instance, keeping a copy of the pixels
+ */
+static void *render_concurrent (void *data)
+{
+  ConcurrentDoc *cdoc = data;
+  RefDoc doc = {NULL, NULL};
+  const unsigned char *pixels;
+  char *real;
+  long  length;
+  int   rowstride;
+  Mrg  *mrg;
+  int   i;
+
+  real = realpath (cdoc->path, NULL);
+  if (!real)
+    return NULL;
+  doc.uri = malloc (strlen (real) + 8);
+  sprintf (doc.uri, "file://%s", real);
+  free (real);
+
+  mrg = mrg_new (REFTEST_WIDTH, REFTEST_HEIGHT, "mem");
+  mrg_get_contents (mrg, NULL, doc.uri, &doc.contents, &length);
+  if (doc.contents)
+  {
+    mrg_set_target_fps (mrg, 0);
+    mrg_css_set (mrg, "document { background: #ffff;}");
+    mrg_set_ui (mrg, render_ui, &doc);
+    for (i = 0; i < REFTEST_WARMUP + REFTEST_FRAMES; i++)
+    {
+      mrg_queue_draw (mrg, NULL);
+      mrg_ui_update (mrg);
+    }
+    pixels = mrg_get_pixels (mrg, &rowstride);
+    cdoc->pixels = malloc (REFTEST_WIDTH * 4 * REFTEST_HEIGHT);
+    for (i = 0; i < REFTEST_HEIGHT; i++)
+      memcpy (cdoc->pixels + i * REFTEST_WIDTH * 4,
+              pixels + i * rowstride, REFTEST_WIDTH * 4);
+  }
+  mrg_destroy (mrg);
+  free (doc.contents);
+  free (doc.uri);
+  return NULL;
+}
+
+/* returns the number of documents that render differently when all are
+ * rendered at once
+ */
+static int reftest_concurrent (char **paths, int count)
+{
+  ConcurrentDoc *sequential = calloc (sizeof (ConcurrentDoc), count);
+  ConcurrentDoc *parallel   = calloc (sizeof (ConcurrentDoc), count);
+  pthread_t     *threads    = calloc (sizeof (pthread_t), count);
+  int failures = 0;
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    sequential[i].path = paths[i];
+    render_concurrent (&sequential[i]);
+  }
+
+  for (i = 0; i < count; i++)
+  {
+    parallel[i].path = paths[i];
+    pthread_create (&threads[i], NULL, render_concurrent, &parallel[i]);
+  }
+  for (i = 0; i < count; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < count; i++)
+  {
+    int failed = !sequential[i].pixels || !parallel[i].pixels ||
+                 memcmp (sequential[i].pixels, parallel[i].pixels,
+                         REFTEST_WIDTH * 4 * REFTEST_HEIGHT);
+    printf ("%s %s: rendered concurrently with %i others\n",
+            failed ? "FAIL" : "PASS", paths[i], count - 1);
+    failures += failed;
+    free (sequential[i].pixels);
+    free (parallel[i].pixels);
+  }
+  free (sequential);
+  free (parallel);
+  free (threads);
+  return failures;
+}
+
+static void usage (void)
+{
+  fprintf (stderr, "usage: mrg-reftest [-r reference-dir] [-t channel-tolerance] [-p max-percent] [-o output-dir] [-b bench-baseline.tsv] [-s max-slowdown] [-j render-threads] [-c] documents..\n");
+}
+
+int main (int argc, char **argv)
+{
+  int failures = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (!strcmp (argv[i], "-c"))
+    {
+      concurrent = 1;
+      continue;
+    }
+    if (!argv[i+1])
+    {
+      usage ();
+      return 1;
+    }
+    if (!strcmp (argv[i], "-r"))
+      reference_dir = argv[++i];
+    else if (!strcmp (argv[i], "-t"))
+      channel_tolerance = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "-p"))
+      max_differing = atof (argv[++i]);
+    else if (!strcmp (argv[i], "-o"))
+      output_dir = argv[++i];
+    else if (!strcmp (argv[i], "-b"))
+      baseline_path = argv[++i];
+    else if (!strcmp (argv[i], "-s"))
+      max_slowdown = atof (argv[++i]);
+    else if (!strcmp (argv[i], "-j"))
+      render_threads = atoi (argv[++i]);
+    else
+    {
+      usage ();
+      return 1;
+    }
+  }
+  if (i >= argc)
+  {
+    usage ();
+    return 1;
+  }
+
+  /* timings only compare against a baseline made on the same machine, a
+   * missing one is reported as skipped rather than passed
+   */
+  if (baseline_path && access (baseline_path, R_OK))
+  {
+    printf ("SKIP no baseline in %s, create it with mrg-bench -o\n",
+            baseline_path);
+    return REFTEST_SKIP;
+  }
+
+  /* the reference rendering is the single threaded one */
+  if (render_threads > 1)
+    unsetenv ("MRG_RENDER_THREADS");
+
+  if (concurrent)
+    return reftest_concurrent (&argv[i], argc - i) ? 1 : 0;
+
+  for (; i < argc; i++)
+    failures += reftest_document (argv[i]);
+
+  return failures ? 1 : 0;
+}
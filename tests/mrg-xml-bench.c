@@ -0,0 +1,189 @@
+/* mrg - MicroRaptor Gui
+ * Copyright (c) 2014 Øyvind Kolås <pippin@hodefoting.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* xml tokenizer throughput benchmark, tokenizes a document with both the
+ * copying xmltok_get and the zero-copy xmltok_get_slice:
+ *
+ *   mrg-xml-bench [-m 50] [-r 3] document.xhtml
+ *
+ * The document is mmap'd, a document smaller than -m megabytes is repeated
+ * in memory until it reaches that size, so that a small test document
+ * stands in for a large file. The best of -r runs is reported.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mrg-xml.h"
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* returns the number of tokens, and the bytes in them in *bytes */
+static long tokenize_copy (char *buf, long *bytes)
+{
+  MrgXml *xmltok = xmltok_buf_new (buf);
+  long tokens = 0;
+  int  type;
+  int  pos;
+
+  *bytes = 0;
+  do {
+    char *data = NULL;
+    type = xmltok_get (xmltok, &data, &pos);
+    if (data)
+      *bytes += strlen (data);
+    tokens++;
+  } while (type != t_eof);
+  xmltok_free (xmltok);
+  return tokens;
+}
+
+static long tokenize_slice (const char *buf, int length, long *bytes)
+{
+  MrgXml *xmltok = xmltok_slice_new (buf, length);
+  long tokens = 0;
+  int  type;
+  int  offset, slice_length, pos;
+
+  *bytes = 0;
+  do {
+    slice_length = 0;
+    type = xmltok_get_slice (xmltok, &offset, &slice_length, &pos);
+    *bytes += slice_length;
+    tokens++;
+  } while (type != t_eof);
+  xmltok_free (xmltok);
+  return tokens;
+}
+
+static void usage (void)
+{
+  fprintf (stderr, "usage: mrg-xml-bench [-m megabytes] [-r runs] document\n");
+}
+
+int main (int argc, char **argv)
+{
+  const char *path;
+  struct stat st;
+  char  *mapped;
+  char  *buf;
+  long   length;
+  long   megabytes = 50;
+  int    runs = 3;
+  double best_copy = 1e30, best_slice = 1e30;
+  long   tokens_copy = 0, tokens_slice = 0;
+  long   bytes_copy = 0, bytes_slice = 0;
+  int    fd;
+  int    i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (!argv[i+1])
+    {
+      usage ();
+      return 1;
+    }
+    if (!strcmp (argv[i], "-m"))
+      megabytes = atol (argv[++i]);
+    else if (!strcmp (argv[i], "-r"))
+      runs = atoi (argv[++i]);
+    else
+    {
+      usage ();
+      return 1;
+    }
+  }
+  if (i != argc - 1 || runs <= 0 || megabytes <= 0 || megabytes >= 2048)
+  {
+    usage ();
+    return 1;
+  }
+  path = argv[i];
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) != 0 || st.st_size == 0)
+  {
+    fprintf (stderr, "mrg-xml-bench: unable to read %s\n", path);
+    return 1;
+  }
+  mapped = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (mapped == MAP_FAILED)
+  {
+    fprintf (stderr, "mrg-xml-bench: unable to map %s\n", path);
+    return 1;
+  }
+
+  /* xmltok_buf_new wants a NUL terminated copy, which also serves as the
+   * document for the slices when the file has to be repeated
+   */
+  length = megabytes * 1024 * 1024;
+  if (length < st.st_size)
+    length = st.st_size;
+  buf = malloc (length + 1);
+  for (i = 0; i < length; i += st.st_size)
+    memcpy (buf + i, mapped,
+            length - i < st.st_size ? length - i : st.st_size);
+  buf[length] = 0;
+
+  for (i = 0; i < runs; i++)
+  {
+    double start = now_ms ();
+    double elapsed;
+    tokens_copy = tokenize_copy (buf, &bytes_copy);
+    elapsed = now_ms () - start;
+    if (elapsed < best_copy)
+      best_copy = elapsed;
+
+    start = now_ms ();
+    if (length == st.st_size)
+      tokens_slice = tokenize_slice (mapped, length, &bytes_slice);
+    else
+      tokens_slice = tokenize_slice (buf, length, &bytes_slice);
+    elapsed = now_ms () - start;
+    if (elapsed < best_slice)
+      best_slice = elapsed;
+  }
+
+  printf ("# mode\tbytes\ttokens\ttoken_bytes\tms\tMB_per_s\n");
+  printf ("copy\t%li\t%li\t%li\t%.1f\t%.1f\n", length, tokens_copy, bytes_copy,
+          best_copy, length / (1024.0 * 1024.0) / (best_copy / 1000.0));
+  printf ("slice\t%li\t%li\t%li\t%.1f\t%.1f\n", length, tokens_slice, bytes_slice,
+          best_slice, length / (1024.0 * 1024.0) / (best_slice / 1000.0));
+
+  munmap (mapped, st.st_size);
+  free (buf);
+
+  if (tokens_copy != tokens_slice)
+  {
+    fprintf (stderr, "mrg-xml-bench: %li tokens copying, %li as slices\n",
+             tokens_copy, tokens_slice);
+    return 1;
+  }
+  return 0;
+}